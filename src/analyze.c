@@ -0,0 +1,594 @@
+/* -*- tab-width:4;c-file-style:"cc-mode"; -*- */
+/*
+ * analyze.c -- measures the content of an input in one decoding pass
+ * Copyright (C) 2003-2011 <j@v2v.cc>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with This program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+
+#include "libavformat/avformat.h"
+#include "libswscale/swscale.h"
+#include "libavutil/opt.h"
+#include "libavutil/channel_layout.h"
+#include "libavutil/samplefmt.h"
+#include "libswresample_compat.h"
+
+#include "analyze.h"
+#include "scenecut.h"
+
+/* rows and columns with an average luma up to this are black */
+#define BORDER_BLACK 32
+/* borders are looked for in every 10th frame */
+#define BORDER_INTERVAL 10
+/* complexity and combing are measured on every 4th pixel of a line */
+#define ANALYZE_STEP 4
+/* a pixel combs if (p - above) * (p - below) exceeds this... */
+#define COMB_THRESHOLD 100
+/* ...and a frame is combed if this percentage of its pixels comb */
+#define COMBED_PERCENT 2
+/* 3:2 pulldown combs 2 of every 5 frames */
+#define TELECINE_CYCLE 5
+
+/* audio is measured in blocks of 100 ms, loudness over 4 of them */
+#define AUDIO_BLOCKS_PER_SECOND 10
+#define LOUDNESS_BLOCKS 4
+/* silence stays below this for at least SILENCE_SECONDS */
+#define SILENCE_DB -60
+#define SILENCE_SECONDS 2
+/* reported for a peak of 0, the floor of 16 bit audio */
+#define PEAK_FLOOR_DB -96
+
+typedef struct {
+    AVCodecContext *dec;
+    int width;
+    int height;
+    AVFrame *frame;
+    /* converts pictures without a luma plane to gray */
+    struct SwsContext *sws;
+    AVFrame *gray;
+    scene_lookahead *scenes;
+    /* the sparse grid of luma values of the previous frame */
+    uint8_t *prev;
+    int have_prev;
+    int band[4];
+    int border_frames;
+    int64_t combed_phase[TELECINE_CYCLE];
+    double spatial;
+    double temporal;
+}
+video_state;
+
+typedef struct {
+    AVCodecContext *dec;
+    AVFrame *frame;
+    struct SwrContext *swr;
+    float *samples;
+    int max_samples;
+    int channels;
+    /* K-weighting of ITU-R BS.1770, a high shelf followed by a high pass,
+       and the last two inputs and outputs of both for each channel */
+    double shelf_b[3], shelf_a[3];
+    double pass_a[3];
+    double *filter;
+    /* of each channel in the sum: 1.41 for the surround channels, none
+       for LFE */
+    double *weight;
+    /* the current block */
+    int block_length;
+    int block_pos;
+    double block_energy;
+    double block_power;
+    /* K-weighted energy of every block so far */
+    double *blocks;
+    int num_blocks;
+    int max_blocks;
+    int silence_start; /* block, -1 if not silent */
+    double peak;
+}
+audio_state;
+
+int has_luma_plane(int pix_fmt) {
+    switch (pix_fmt) {
+        case PIX_FMT_YUV420P:
+        case PIX_FMT_YUV422P:
+        case PIX_FMT_YUV444P:
+        case PIX_FMT_YUV410P:
+        case PIX_FMT_YUV411P:
+        case PIX_FMT_YUVJ420P:
+        case PIX_FMT_YUVJ422P:
+        case PIX_FMT_YUVJ444P:
+        case PIX_FMT_NV12:
+        case PIX_FMT_NV21:
+        case PIX_FMT_GRAY8:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int black_line(const uint8_t *p, int step, int count) {
+    int i, sum = 0;
+
+    for (i = 0; i < count; i++, p += step)
+        sum += *p;
+    return sum <= BORDER_BLACK * count;
+}
+
+int find_borders(AVFrame *frame, int width, int height, int *band) {
+    const uint8_t *luma = frame->data[0];
+    int stride = frame->linesize[0];
+    int top, bottom, left, right;
+
+    for (top = 0; top < height && black_line(luma + top * stride, 1, width); top++);
+    if (top == height)
+        return -1;
+    for (bottom = 0; black_line(luma + (height - 1 - bottom) * stride, 1, width); bottom++);
+    for (left = 0; left < width && black_line(luma + left, stride, height); left++);
+    for (right = 0; right < width && black_line(luma + width - 1 - right, stride, height); right++);
+    band[0] = top;
+    band[1] = bottom;
+    band[2] = left;
+    band[3] = right;
+    return 0;
+}
+
+static AVCodecContext *open_decoder(AVStream *st) {
+    AVCodec *codec = avcodec_find_decoder(st->codec->codec_id);
+
+    if (!codec || avcodec_open2(st->codec, codec, NULL) < 0)
+        return NULL;
+    return st->codec;
+}
+
+static int open_video(video_state *v, AVStream *st) {
+    int i;
+
+    /* the pictures only have to be close to what the encoder gets */
+    st->codec->skip_loop_filter = AVDISCARD_ALL;
+    if (!(v->dec = open_decoder(st)))
+        return -1;
+    v->width = v->dec->width;
+    v->height = v->dec->height;
+    if (v->width <= 0 || v->height <= 0) {
+        avcodec_close(v->dec);
+        return -1;
+    }
+    if (!has_luma_plane(v->dec->pix_fmt)) {
+        v->sws = sws_getContext(v->width, v->height, v->dec->pix_fmt,
+                                v->width, v->height, PIX_FMT_GRAY8,
+                                SWS_FAST_BILINEAR, NULL, NULL, NULL);
+        v->gray = avcodec_alloc_frame();
+        if (!v->sws || !v->gray ||
+            avpicture_alloc((AVPicture *)v->gray, PIX_FMT_GRAY8, v->width, v->height) < 0) {
+            fprintf(stderr, "ERROR: Unable to convert the video for analysis.\n");
+            exit(1);
+        }
+    }
+    v->frame = avcodec_alloc_frame();
+    v->prev = calloc((v->width / ANALYZE_STEP + 1) * (v->height / ANALYZE_STEP + 1), 1);
+    if (!v->frame || !v->prev) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        exit(1);
+    }
+    v->scenes = scene_lookahead_new();
+    for (i = 0; i < 4; i++)
+        v->band[i] = INT_MAX;
+    return 0;
+}
+
+/* Returns non-zero if the lines of the two fields of |luma| don't fit
+   together. Only one field is compared with the lines around it. */
+static int combed(const uint8_t *luma, int stride, int width, int height) {
+    int x, y, count = 0, samples = 0;
+
+    for (y = 1; y < height - 1; y += 2) {
+        const uint8_t *p = luma + y * stride;
+        for (x = 0; x < width; x += ANALYZE_STEP) {
+            int d = (p[x] - p[x - stride]) * (p[x] - p[x + stride]);
+            if (d > COMB_THRESHOLD)
+                count++;
+            samples++;
+        }
+    }
+    return count * 100 > samples * COMBED_PERCENT;
+}
+
+static void analyze_picture(input_analysis *a, video_state *v, AVFrame *frame) {
+    AVFrame *picture = frame;
+    const uint8_t *luma;
+    th_ycbcr_buffer ycbcr;
+    int stride, x, y, i = 0;
+    int64_t spatial = 0, temporal = 0;
+
+    if (v->sws) {
+        sws_scale(v->sws, (const uint8_t * const*)frame->data, frame->linesize,
+                  0, v->height, v->gray->data, v->gray->linesize);
+        picture = v->gray;
+    }
+    luma = picture->data[0];
+    stride = picture->linesize[0];
+
+    if (frame->interlaced_frame)
+        a->interlaced_frames++;
+    if (combed(luma, stride, v->width, v->height)) {
+        a->combed_frames++;
+        v->combed_phase[a->frames % TELECINE_CYCLE]++;
+    }
+    if (a->frames % BORDER_INTERVAL == 0) {
+        int band[4];
+        if (find_borders(picture, v->width, v->height, band) == 0) {
+            for (i = 0; i < 4; i++)
+                v->band[i] = FFMIN(v->band[i], band[i]);
+            v->border_frames++;
+        }
+    }
+
+    /* only the luma matters to the scene cut detection */
+    memset(ycbcr, 0, sizeof(ycbcr));
+    ycbcr[0].width = v->width;
+    ycbcr[0].height = v->height;
+    ycbcr[0].stride = stride;
+    ycbcr[0].data = (unsigned char *)luma;
+    scene_lookahead_push(v->scenes, ycbcr, 0, 0);
+    if (scene_lookahead_frame(v->scenes, 0)->cut)
+        a->scene_cuts++;
+    scene_lookahead_pop(v->scenes);
+
+    for (i = 0, y = 0; y < v->height - 1; y += ANALYZE_STEP) {
+        const uint8_t *p = luma + y * stride;
+        for (x = 0; x < v->width - 1; x += ANALYZE_STEP, i++) {
+            spatial += abs(p[x + 1] - p[x]) + abs(p[x + stride] - p[x]);
+            temporal += abs(p[x] - v->prev[i]);
+            v->prev[i] = p[x];
+        }
+    }
+    if (i > 0) {
+        v->spatial += (double)spatial / (2 * i);
+        if (v->have_prev)
+            v->temporal += (double)temporal / i;
+    }
+    v->have_prev = 1;
+    a->frames++;
+}
+
+static void decode_video(input_analysis *a, video_state *v, AVPacket *pkt) {
+    int got_frame = 0;
+
+    if (avcodec_decode_video2(v->dec, v->frame, &got_frame, pkt) < 0 || !got_frame)
+        return;
+    /* pictures of another size than the first are only counted */
+    if (v->dec->width != v->width || v->dec->height != v->height) {
+        a->frames++;
+        return;
+    }
+    analyze_picture(a, v, v->frame);
+}
+
+static void close_video(input_analysis *a, video_state *v) {
+    int64_t top = 0, combed = a->combed_frames;
+    int i;
+
+    if (v->border_frames > 0 && v->band[0] + v->band[1] <= v->height / 2 &&
+        v->band[2] + v->band[3] <= v->width / 2) {
+        for (i = 0; i < 4; i++)
+            a->crop[i] = v->band[i] & ~1;
+    }
+
+    /* telecine combs about 2 in 5 frames, at the same places of the cycle
+       until the next edit */
+    for (i = 0; i < TELECINE_CYCLE; i++) {
+        int j, rank = 0;
+        for (j = 0; j < TELECINE_CYCLE; j++)
+            if (v->combed_phase[j] > v->combed_phase[i] || (v->combed_phase[j] == v->combed_phase[i] && j < i))
+                rank++;
+        if (rank < 2)
+            top += v->combed_phase[i];
+    }
+    a->telecine = a->frames >= 10 * TELECINE_CYCLE &&
+                  combed * 5 > a->frames && combed * 5 < a->frames * 3 &&
+                  top * 10 >= combed * 8;
+    a->interlaced = !a->telecine &&
+                    (combed * 2 > a->frames || a->interlaced_frames * 2 > a->frames);
+    if (a->frames > 0)
+        a->spatial_complexity = v->spatial / a->frames;
+    if (a->frames > 1)
+        a->temporal_complexity = v->temporal / (a->frames - 1);
+
+    avcodec_close(v->dec);
+    sws_freeContext(v->sws);
+    if (v->gray) {
+        avpicture_free((AVPicture *)v->gray);
+        av_free(v->gray);
+    }
+    av_free(v->frame);
+    free(v->prev);
+    scene_lookahead_free(v->scenes);
+}
+
+static int open_audio(audio_state *au, AVStream *st) {
+    AVCodecContext *dec;
+    double f0, g, q, k, vh, vb, a0;
+    uint64_t layout;
+    int i;
+
+    if (!(au->dec = dec = open_decoder(st)))
+        return -1;
+    au->channels = dec->channels;
+    if (au->channels <= 0 || dec->sample_rate <= 0) {
+        avcodec_close(dec);
+        return -1;
+    }
+    au->swr = swr_alloc();
+    av_opt_set_int(au->swr, "in_channel_layout", dec->channel_layout ?
+                   dec->channel_layout : av_get_default_channel_layout(dec->channels), 0);
+    av_opt_set_int(au->swr, "in_sample_rate", dec->sample_rate, 0);
+    av_opt_set_int(au->swr, "in_sample_fmt", dec->sample_fmt, 0);
+    av_opt_set_int(au->swr, "out_channel_layout", dec->channel_layout ?
+                   dec->channel_layout : av_get_default_channel_layout(dec->channels), 0);
+    av_opt_set_int(au->swr, "out_sample_rate", dec->sample_rate, 0);
+    av_opt_set_int(au->swr, "out_sample_fmt", AV_SAMPLE_FMT_FLT, 0);
+    if (swr_init(au->swr) < 0) {
+        fprintf(stderr, "Failed to initialize the resampling context\n");
+        exit(1);
+    }
+    au->frame = avcodec_alloc_frame();
+    au->filter = calloc(8 * au->channels, sizeof(double));
+    au->weight = malloc(au->channels * sizeof(double));
+    if (!au->frame || !au->filter || !au->weight) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        exit(1);
+    }
+    layout = dec->channel_layout ? dec->channel_layout :
+             av_get_default_channel_layout(dec->channels);
+    for (i = 0; i < au->channels; i++) {
+        uint64_t channel = av_channel_layout_extract_channel(layout, i);
+        if (channel & (AV_CH_LOW_FREQUENCY | AV_CH_LOW_FREQUENCY_2))
+            au->weight[i] = 0;
+        else if (channel & (AV_CH_SIDE_LEFT | AV_CH_SIDE_RIGHT | AV_CH_BACK_LEFT |
+                            AV_CH_BACK_RIGHT | AV_CH_BACK_CENTER))
+            au->weight[i] = 1.41;
+        else
+            au->weight[i] = 1;
+    }
+
+    /* the filters of BS.1770 for any sample rate */
+    f0 = 1681.974450955533;
+    g = 3.999843853973347;
+    q = 0.7071752369554196;
+    k = tan(M_PI * f0 / dec->sample_rate);
+    vh = pow(10.0, g / 20.0);
+    vb = pow(vh, 0.4996667741545416);
+    a0 = 1.0 + k / q + k * k;
+    au->shelf_b[0] = (vh + vb * k / q + k * k) / a0;
+    au->shelf_b[1] = 2.0 * (k * k - vh) / a0;
+    au->shelf_b[2] = (vh - vb * k / q + k * k) / a0;
+    au->shelf_a[1] = 2.0 * (k * k - 1.0) / a0;
+    au->shelf_a[2] = (1.0 - k / q + k * k) / a0;
+    f0 = 38.13547087602444;
+    q = 0.5003270373238773;
+    k = tan(M_PI * f0 / dec->sample_rate);
+    a0 = 1.0 + k / q + k * k;
+    au->pass_a[1] = 2.0 * (k * k - 1.0) / a0;
+    au->pass_a[2] = (1.0 - k / q + k * k) / a0;
+
+    au->block_length = dec->sample_rate / AUDIO_BLOCKS_PER_SECOND;
+    au->silence_start = -1;
+    return 0;
+}
+
+static void add_silence_range(input_analysis *a, audio_state *au, int end) {
+    silence_range *r;
+
+    if (au->silence_start < 0)
+        return;
+    if (end - au->silence_start >= SILENCE_SECONDS * AUDIO_BLOCKS_PER_SECOND) {
+        a->silences = realloc(a->silences, (a->num_silences + 1) * sizeof(silence_range));
+        if (!a->silences) {
+            fprintf(stderr, "ERROR: Out of memory.\n");
+            exit(1);
+        }
+        r = &a->silences[a->num_silences++];
+        r->start = (double)au->silence_start / AUDIO_BLOCKS_PER_SECOND;
+        r->end = (double)end / AUDIO_BLOCKS_PER_SECOND;
+    }
+    au->silence_start = -1;
+}
+
+static void end_block(input_analysis *a, audio_state *au) {
+    double power = au->block_power / (au->block_length * au->channels);
+
+    if (au->num_blocks == au->max_blocks) {
+        au->max_blocks = au->max_blocks ? 2 * au->max_blocks : 1024;
+        au->blocks = realloc(au->blocks, au->max_blocks * sizeof(double));
+        if (!au->blocks) {
+            fprintf(stderr, "ERROR: Out of memory.\n");
+            exit(1);
+        }
+    }
+    au->blocks[au->num_blocks] = au->block_energy / au->block_length;
+    if (power < pow(10.0, SILENCE_DB / 10.0)) {
+        if (au->silence_start < 0)
+            au->silence_start = au->num_blocks;
+    }
+    else {
+        add_silence_range(a, au, au->num_blocks);
+    }
+    au->num_blocks++;
+    au->block_pos = 0;
+    au->block_energy = 0;
+    au->block_power = 0;
+}
+
+static void analyze_samples(input_analysis *a, audio_state *au, const float *samples, int count) {
+    int n, c;
+
+    for (n = 0; n < count; n++) {
+        for (c = 0; c < au->channels; c++) {
+            double x = *samples++;
+            double *s = au->filter + 8 * c;
+            double y, z;
+
+            if (fabs(x) > au->peak)
+                au->peak = fabs(x);
+            au->block_power += x * x;
+            y = au->shelf_b[0] * x + au->shelf_b[1] * s[0] + au->shelf_b[2] * s[1]
+                - au->shelf_a[1] * s[2] - au->shelf_a[2] * s[3];
+            s[1] = s[0];
+            s[0] = x;
+            s[3] = s[2];
+            s[2] = y;
+            z = y - 2.0 * s[4] + s[5] - au->pass_a[1] * s[6] - au->pass_a[2] * s[7];
+            s[5] = s[4];
+            s[4] = y;
+            s[7] = s[6];
+            s[6] = z;
+            au->block_energy += au->weight[c] * z * z;
+        }
+        if (++au->block_pos == au->block_length)
+            end_block(a, au);
+    }
+}
+
+static void decode_audio(input_analysis *a, audio_state *au, AVPacket *pkt) {
+    AVPacket avpkt = *pkt;
+
+    while (avpkt.size > 0) {
+        int got_frame = 0, len, count;
+        uint8_t *out[1];
+
+        len = avcodec_decode_audio4(au->dec, au->frame, &got_frame, &avpkt);
+        if (len < 0)
+            break;
+        len = FFMIN(len, avpkt.size);
+        if (got_frame) {
+            if (au->frame->nb_samples > au->max_samples) {
+                au->max_samples = au->frame->nb_samples;
+                au->samples = realloc(au->samples, au->max_samples * au->channels * sizeof(float));
+                if (!au->samples) {
+                    fprintf(stderr, "ERROR: Out of memory.\n");
+                    exit(1);
+                }
+            }
+            out[0] = (uint8_t *)au->samples;
+            count = swr_convert(au->swr, out, au->frame->nb_samples,
+                                (const uint8_t **)au->frame->extended_data, au->frame->nb_samples);
+            if (count > 0)
+                analyze_samples(a, au, au->samples, count);
+        }
+        avpkt.size -= len;
+        avpkt.data += len;
+    }
+}
+
+/* Integrated loudness of BS.1770: the mean of the overlapping 400 ms
+   blocks above -70 LUFS, and then of those less than 10 LU below that. */
+static double integrated_loudness(audio_state *au) {
+    double gate = pow(10.0, (-70 + 0.691) / 10.0);
+    double sum, e;
+    int pass, i, j, count = 0;
+
+    for (pass = 0; pass < 2; pass++) {
+        sum = 0;
+        count = 0;
+        for (i = 0; i + LOUDNESS_BLOCKS <= au->num_blocks; i++) {
+            for (e = 0, j = 0; j < LOUDNESS_BLOCKS; j++)
+                e += au->blocks[i + j];
+            e /= LOUDNESS_BLOCKS;
+            if (e > gate) {
+                sum += e;
+                count++;
+            }
+        }
+        if (count == 0)
+            return -70;
+        if (pass == 0)
+            gate = FFMAX(gate, sum / count * pow(10.0, -10 / 10.0));
+    }
+    return -0.691 + 10 * log10(sum / count);
+}
+
+static void close_audio(input_analysis *a, audio_state *au) {
+    add_silence_range(a, au, au->num_blocks);
+    a->loudness = integrated_loudness(au);
+    a->peak = au->peak > 0 ? 20 * log10(au->peak) : PEAK_FLOOR_DB;
+
+    avcodec_close(au->dec);
+    swr_free(&au->swr);
+    av_free(au->frame);
+    free(au->samples);
+    free(au->filter);
+    free(au->weight);
+    free(au->blocks);
+}
+
+int analyze_input(AVFormatContext *context, input_analysis *a) {
+    video_state v;
+    audio_state au;
+    AVPacket pkt;
+    int i, video_index = -1, audio_index = -1;
+
+    memset(a, 0, sizeof(*a));
+    memset(&v, 0, sizeof(v));
+    memset(&au, 0, sizeof(au));
+    for (i = 0; i < context->nb_streams; i++) {
+        AVStream *st = context->streams[i];
+        if (st->codec->codec_type == AVMEDIA_TYPE_VIDEO && video_index < 0) {
+            if (open_video(&v, st) == 0)
+                video_index = i;
+        }
+        else if (st->codec->codec_type == AVMEDIA_TYPE_AUDIO && audio_index < 0) {
+            if (open_audio(&au, st) == 0)
+                audio_index = i;
+        }
+    }
+    if (video_index < 0 && audio_index < 0)
+        return -1;
+    a->has_video = video_index >= 0;
+    a->has_audio = audio_index >= 0;
+
+    while (av_read_frame(context, &pkt) >= 0) {
+        if (pkt.stream_index == video_index)
+            decode_video(a, &v, &pkt);
+        else if (pkt.stream_index == audio_index)
+            decode_audio(a, &au, &pkt);
+        av_free_packet(&pkt);
+    }
+    /* pictures still held back by the decoder */
+    if (a->has_video) {
+        int64_t frames;
+        av_init_packet(&pkt);
+        pkt.data = NULL;
+        pkt.size = 0;
+        do {
+            frames = a->frames;
+            decode_video(a, &v, &pkt);
+        } while (a->frames != frames);
+        close_video(a, &v);
+    }
+    if (a->has_audio)
+        close_audio(a, &au);
+    return 0;
+}
+
+void analysis_free(input_analysis *a) {
+    free(a->silences);
+    a->silences = NULL;
+    a->num_silences = 0;
+}
@@ -0,0 +1,70 @@
+/* -*- tab-width:4;c-file-style:"cc-mode"; -*- */
+/*
+ * analyze.h -- measures the content of an input in one decoding pass
+ * Copyright (C) 2003-2011 <j@v2v.cc>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with This program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _F2T_ANALYZE_H_
+#define _F2T_ANALYZE_H_
+
+#include <stdint.h>
+#include "libavformat/avformat.h"
+
+typedef struct {
+    /* in seconds from the start of the audio */
+    double start;
+    double end;
+}
+silence_range;
+
+/* What --analyze found out about an input, for json_format_info(). */
+typedef struct {
+    /* of the first video stream, if has_video is set */
+    int has_video;
+    int64_t frames;
+    int crop[4]; /* top, bottom, left, right, as --croptop etc. take them */
+    int64_t interlaced_frames; /* flagged as interlaced by the decoder */
+    int64_t combed_frames; /* showing two fields of different moments */
+    int interlaced;
+    int telecine;
+    int scene_cuts;
+    /* average luma difference of neighbouring pixels, and of the same
+       pixel in consecutive frames */
+    double spatial_complexity;
+    double temporal_complexity;
+
+    /* of the first audio stream, if has_audio is set */
+    int has_audio;
+    double loudness; /* integrated, in LUFS, -70 if all silent */
+    double peak; /* sample peak, in dBFS */
+    silence_range *silences;
+    int num_silences;
+}
+input_analysis;
+
+/* Decodes the first video and audio streams of |context| once and fills
+   in |a|. Returns 0 on success, -1 if there is nothing to decode. */
+int analyze_input(AVFormatContext *context, input_analysis *a);
+
+void analysis_free(input_analysis *a);
+
+/* Returns non-zero if |pix_fmt| stores luma as a plane of its own. */
+int has_luma_plane(int pix_fmt);
+
+/* Finds the black borders of a decoded frame with a luma plane.
+   Returns 0 on success, -1 if the frame is black altogether. */
+int find_borders(AVFrame *frame, int width, int height, int *band);
+
+#endif
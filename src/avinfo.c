@@ -45,6 +45,8 @@
 #include "libavformat/avformat.h"
 #include "libavutil/pixdesc.h"
 
+#include "analyze.h"
+
 #ifndef WIN32
 #if !defined(off64_t)
 #define off64_t off_t
@@ -444,8 +446,63 @@ void json_oshash(FILE *output, char const *filename, int indent) {
 }
 
 
+void json_analysis(FILE *output, const input_analysis *a, int indent) {
+    unsigned long long frames = a->frames;
+    unsigned long long combed = a->combed_frames;
+    unsigned long long flagged = a->interlaced_frames;
+    float t;
+    int i;
+
+    do_indent(output, indent);
+    fprintf(output, "\"analysis\": {\n");
+    if (a->has_video) {
+        do_indent(output, indent + 1);
+        fprintf(output, "\"video\": {\n");
+        json_add_key_value(output, "frames", &frames, JSON_LONGLONG, 0, indent + 2);
+        json_add_key_value(output, "croptop", (void *)&a->crop[0], JSON_INT, 0, indent + 2);
+        json_add_key_value(output, "cropbottom", (void *)&a->crop[1], JSON_INT, 0, indent + 2);
+        json_add_key_value(output, "cropleft", (void *)&a->crop[2], JSON_INT, 0, indent + 2);
+        json_add_key_value(output, "cropright", (void *)&a->crop[3], JSON_INT, 0, indent + 2);
+        json_add_key_value(output, "interlaced", (void *)&a->interlaced, JSON_INT, 0, indent + 2);
+        json_add_key_value(output, "interlaced_frames", &flagged, JSON_LONGLONG, 0, indent + 2);
+        json_add_key_value(output, "combed_frames", &combed, JSON_LONGLONG, 0, indent + 2);
+        json_add_key_value(output, "telecine", (void *)&a->telecine, JSON_INT, 0, indent + 2);
+        json_add_key_value(output, "scene_cuts", (void *)&a->scene_cuts, JSON_INT, 0, indent + 2);
+        t = a->spatial_complexity;
+        json_add_key_value(output, "spatial_complexity", &t, JSON_FLOAT, 0, indent + 2);
+        t = a->temporal_complexity;
+        json_add_key_value(output, "temporal_complexity", &t, JSON_FLOAT, 1, indent + 2);
+        do_indent(output, indent + 1);
+        fprintf(output, a->has_audio ? "},\n" : "}\n");
+    }
+    if (a->has_audio) {
+        do_indent(output, indent + 1);
+        fprintf(output, "\"audio\": {\n");
+        t = a->loudness;
+        json_add_key_value(output, "loudness", &t, JSON_FLOAT, 0, indent + 2);
+        t = a->peak;
+        json_add_key_value(output, "peak", &t, JSON_FLOAT, 0, indent + 2);
+        do_indent(output, indent + 2);
+        fprintf(output, "\"silences\": [");
+        for (i = 0; i < a->num_silences; i++) {
+            fprintf(output, i ? ", {\n" : "{\n");
+            t = a->silences[i].start;
+            json_add_key_value(output, "start", &t, JSON_FLOAT, 0, indent + 3);
+            t = a->silences[i].end;
+            json_add_key_value(output, "end", &t, JSON_FLOAT, 1, indent + 3);
+            do_indent(output, indent + 2);
+            fprintf(output, "}");
+        }
+        fprintf(output, "]\n");
+        do_indent(output, indent + 1);
+        fprintf(output, "}\n");
+    }
+    do_indent(output, indent);
+    fprintf(output, "},\n");
+}
+
 /* "user interface" functions */
-void json_format_info(FILE* output, AVFormatContext *ic, const char *url) {
+void json_format_info(FILE* output, AVFormatContext *ic, const char *url, const input_analysis *analysis) {
     int i;
     unsigned long long filesize;
 
@@ -494,6 +551,8 @@ void json_format_info(FILE* output, AVFormatContext *ic, const char *url) {
         }
         fprintf(output, "],\n");
         json_metadata(output, ic->metadata, 1);
+        if (analysis)
+            json_analysis(output, analysis, 1);
     } else {
         json_add_key_value(output, "code", "badfile", JSON_STRING, 0, 1);
         json_add_key_value(output, "error", "file does not exist or has unknown format.", JSON_STRING, 0, 1);
@@ -527,7 +586,7 @@ int main(int argc, char **argv) {
     
     if (avformat_open_input(&context, inputfile_name, NULL, NULL) >= 0) {
         if (avformat_find_stream_info(context, NULL) >= 0) {
-            json_format_info(output, context, inputfile_name);
+            json_format_info(output, context, inputfile_name, NULL);
         }
     }
     if(output != stdout) {
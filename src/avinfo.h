@@ -1,7 +1,9 @@
 #ifndef _F2T_AVINFO_H_
 #define _F2T_AVINFO_H_
 
+#include "analyze.h"
+
 unsigned long long gen_oshash(char const *filename);
-void json_format_info(FILE* output, AVFormatContext *ic, const char *url);
+void json_format_info(FILE* output, AVFormatContext *ic, const char *url, const input_analysis *analysis);
 
 #endif
@@ -25,6 +25,7 @@
 #include <getopt.h>
 #include <math.h>
 #include <errno.h>
+#include <limits.h>
 
 #include "libavformat/avformat.h"
 #include "libavdevice/avdevice.h"
@@ -48,9 +49,13 @@
 #endif
 
 #include "theorautils.h"
+#include "sink.h"
 #include "iso639.h"
 #include "subtitles.h"
 #include "ffmpeg2theora.h"
+#include "ivtc.h"
+#include "scenecut.h"
+#include "analyze.h"
 #include "avinfo.h"
 
 #define MAX_AUDIO_FRAME_SIZE 192000 // 1 second of 48khz 32bit audio
@@ -102,7 +107,35 @@ enum {
     THEORA_INDEX_RESERVE,
     VORBIS_INDEX_RESERVE,
     KATE_INDEX_RESERVE,
-    INFO_FLAG
+    INFO_FLAG,
+    FRAMECACHE_FLAG,
+    FRAMECACHE_COMPRESS_FLAG,
+    FASTFIRSTPASS_FLAG,
+    INDEX_SIDECAR_FLAG,
+    NOINDEXFINALIZE_FLAG,
+    INDEX_MAX_BYTES,
+    SEGMENT_TIME_FLAG,
+    SEGMENT_SIZE_FLAG,
+    PAGE_SIZE_FLAG,
+    PAGE_DURATION_FLAG,
+    INTERLEAVE_DELAY_FLAG,
+    KATE_PAGE_WINDOW_FLAG,
+    TEE_FLAG,
+    HTTP_PORT_FLAG,
+    CHECKPOINT_FLAG,
+    RESUME_FLAG,
+    FOLLOW_FLAG,
+    FOLLOW_TIMEOUT_FLAG,
+    VCOPY_FLAG,
+    ACOPY_FLAG,
+    REMUX_FLAG,
+    PLAYLIST_FLAG,
+    DEDUP_FLAG,
+    IVTC_FLAG,
+    AUTOCROP_FLAG,
+    SCENE_CUTS_FLAG,
+    AUTO_QUALITY_FLAG,
+    ANALYZE_FLAG
 } F2T_FLAGS;
 
 enum {
@@ -128,6 +161,9 @@ enum {
 #define INCSUB_TEXT 1
 #define INCSUB_SPU 2
 
+#define AUTO_QUALITY_BPP 1
+#define AUTO_QUALITY_SIZE 2
+
 oggmux_info info;
 
 static int using_stdin = 0;
@@ -189,6 +225,7 @@ static ff2theora ff2theora_init() {
         this->audio_index = -1;
         this->start_time=0;
         this->end_time=0; /* 0 denotes no end time set */
+        this->follow_timeout = 30;
 
         // audio
         this->sample_rate = -1;  // samplerate hmhmhm
@@ -204,6 +241,7 @@ static ff2theora ff2theora_init() {
         this->video_quality=-1; // defaults set later
         this->video_bitrate=0;
         this->keyint=0;
+        this->dedup_threshold = -1;
         this->force_input_fps.num = -1;
         this->force_input_fps.den = 1;
         this->sync = 1;
@@ -325,7 +363,7 @@ static void lut_apply(unsigned char *lut, unsigned char *src, unsigned char *dst
     }
 }
 
-static void prepare_ycbcr_buffer(ff2theora this, th_ycbcr_buffer ycbcr, AVFrame *frame) {
+static void frame_ycbcr(ff2theora this, th_ycbcr_buffer ycbcr, AVFrame *frame) {
     /* pysical pages */
     ycbcr[0].width = this->frame_width;
     ycbcr[0].height = this->frame_height;
@@ -341,7 +379,10 @@ static void prepare_ycbcr_buffer(ff2theora this, th_ycbcr_buffer ycbcr, AVFrame
     ycbcr[2].height = this->frame_height / 2;
     ycbcr[2].stride = frame->linesize[1];
     ycbcr[2].data = frame->data[2];
+}
 
+static void prepare_ycbcr_buffer(ff2theora this, th_ycbcr_buffer ycbcr, AVFrame *frame) {
+    frame_ycbcr(this, ycbcr, frame);
     if (this->y_lut_used) {
         lut_apply(this->y_lut, ycbcr[0].data, ycbcr[0].data, ycbcr[0].width, ycbcr[0].height, ycbcr[0].stride);
     }
@@ -351,6 +392,127 @@ static void prepare_ycbcr_buffer(ff2theora this, th_ycbcr_buffer ycbcr, AVFrame
     }
 }
 
+/**
+ * Compares two pictures in blocks of 8x8 pixels.
+ * @return 1 if no block differs by more than |threshold| per pixel on
+ * average, 0 otherwise
+ */
+static int same_picture(th_ycbcr_buffer a, th_ycbcr_buffer b, int threshold) {
+    int plane, bx, by, x, y;
+
+    for (plane = 0; plane < 3; plane++) {
+        int width = a[plane].width, height = a[plane].height;
+        for (by = 0; by < height; by += 8) {
+            int rows = height - by < 8 ? height - by : 8;
+            for (bx = 0; bx < width; bx += 8) {
+                int cols = width - bx < 8 ? width - bx : 8;
+                int sad = 0;
+                for (y = by; y < by + rows; y++) {
+                    const unsigned char *pa = a[plane].data + y * a[plane].stride + bx;
+                    const unsigned char *pb = b[plane].data + y * b[plane].stride + bx;
+                    for (x = 0; x < cols; x++)
+                        sad += abs(pa[x] - pb[x]);
+                }
+                if (sad > threshold * rows * cols)
+                    return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+static void encode_frame(ff2theora this, th_ycbcr_buffer ycbcr, int dups, int e_o_s, int keyframe) {
+    if (keyframe) {
+        /* a keyframe interval of 1 makes the encoder code a keyframe */
+        ogg_uint32_t keyint = 1;
+        th_encode_ctl(info.td, TH_ENCCTL_SET_KEYFRAME_FREQUENCY_FORCE, &keyint, sizeof(keyint));
+        oggmux_add_video(&info, ycbcr, e_o_s && dups == 0);
+        keyint = this->max_keyint;
+        th_encode_ctl(info.td, TH_ENCCTL_SET_KEYFRAME_FREQUENCY_FORCE, &keyint, sizeof(keyint));
+        if (dups == 0)
+            return;
+        /* the repeats follow as a frame of their own */
+        dups--;
+    }
+    /* the encoder takes less than a keyframe interval of duplicates at a
+       time, longer runs are passed on in pieces */
+    while (dups >= this->keyint) {
+        int max_dups = this->keyint - 1;
+        if (max_dups > 0)
+            th_encode_ctl(info.td, TH_ENCCTL_SET_DUP_COUNT, &max_dups, sizeof(int));
+        oggmux_add_video(&info, ycbcr, 0);
+        dups -= this->keyint;
+    }
+    if(dups>0) {
+        //this only works if dups < keyint,
+        //see http://theora.org/doc/libtheora-1.1/theoraenc_8h.html#a8bb9b05471c42a09f8684a2583b8a1df
+        if (th_encode_ctl(info.td,TH_ENCCTL_SET_DUP_COUNT,&dups,sizeof(int)) == TH_EINVAL) {
+            int _dups = dups;
+            while(_dups--)
+                oggmux_add_video(&info, ycbcr, e_o_s);
+        }
+    }
+    oggmux_add_video(&info, ycbcr, e_o_s);
+}
+
+/* Returns non-zero if the oldest frame of the lookahead should be a
+   keyframe: at a scene cut, or once the keyframe interval is over unless
+   a cut follows close enough to take its place. */
+static int keyframe_due(ff2theora this) {
+    scene_frame *f = scene_lookahead_frame(this->lookahead, 0);
+    int distance, i;
+
+    if (this->since_keyframe == 0)
+        return 0;
+    if (f->cut)
+        return 1;
+    if (this->since_keyframe < this->keyint)
+        return 0;
+    distance = this->since_keyframe + 1 + f->dups;
+    for (i = 1; i < this->lookahead->count && distance <= this->max_keyint; i++) {
+        f = scene_lookahead_frame(this->lookahead, i);
+        if (f->cut)
+            return 0;
+        distance += 1 + f->dups;
+    }
+    return 1;
+}
+
+/* Encodes the oldest frame of the lookahead. */
+static void encode_lookahead_frame(ff2theora this) {
+    scene_frame *f = scene_lookahead_frame(this->lookahead, 0);
+    ogg_int64_t keyframes = info.theora_keyframes;
+
+    encode_frame(this, f->ycbcr, f->dups, f->e_o_s, keyframe_due(this));
+    if (info.theora_keyframes != keyframes)
+        this->since_keyframe = 1 + f->dups;
+    else
+        this->since_keyframe += 1 + f->dups;
+    scene_lookahead_pop(this->lookahead);
+}
+
+static void encode_video_frame(ff2theora this, th_ycbcr_buffer ycbcr, int dups, int e_o_s) {
+    if (info.passno == 1 && this->frame_cache && !this->frame_cache->overflow) {
+        if (frame_cache_write(this->frame_cache, ycbcr, dups, e_o_s) < 0) {
+            fprintf(stderr, "\n  Frame cache full or not writable after %"PRId64" frames, "
+                            "second pass will decode the input again.\n", this->frame_cache->frames);
+        }
+    }
+    if (this->lookahead) {
+        /* frames are held back to see scene cuts coming */
+        scene_lookahead_push(this->lookahead, ycbcr, dups, e_o_s);
+        while (this->lookahead->count > SCENECUT_LOOKAHEAD ||
+               (e_o_s && this->lookahead->count > 0))
+            encode_lookahead_frame(this);
+    }
+    else {
+        encode_frame(this, ycbcr, dups, e_o_s, 0);
+    }
+    this->frame_count += dups+1;
+    if (info.passno == 1)
+        info.videotime = this->frame_count / av_q2d(this->framerate);
+}
+
 static const char *find_category_for_subtitle_stream (ff2theora this, int idx, int included_subtitles)
 {
   AVCodecContext *enc = this->context->streams[idx]->codec;
@@ -522,6 +684,458 @@ static const char *find_language_for_subtitle_stream(const AVStream *s)
   return lang;
 }
 
+/**
+ * Sets up the conversion of decoded audio to the sample rate and channels
+ * of the output, as planar floats.
+ */
+static struct SwrContext *open_resampler(ff2theora this, AVCodecContext *aenc) {
+    struct SwrContext *swr_ctx = swr_alloc();
+    /* set options */
+    if (aenc->channel_layout) {
+        av_opt_set_int(swr_ctx, "in_channel_layout",    aenc->channel_layout, 0);
+    } else {
+        av_opt_set_int(swr_ctx, "in_channel_layout", av_get_default_channel_layout(aenc->channels), 0);
+    }
+    av_opt_set_int(swr_ctx, "in_sample_rate",       aenc->sample_rate, 0);
+    av_opt_set_int(swr_ctx, "in_sample_fmt", aenc->sample_fmt, 0);
+
+    av_opt_set_int(swr_ctx, "out_channel_layout", av_get_default_channel_layout(this->channels), 0);
+    av_opt_set_int(swr_ctx, "out_sample_rate",       this->sample_rate, 0);
+    av_opt_set_int(swr_ctx, "out_sample_fmt", AV_SAMPLE_FMT_FLTP, 0);
+
+    /* initialize the resampling context */
+    if (swr_init(swr_ctx) < 0) {
+        fprintf(stderr, "Failed to initialize the resampling context\n");
+        exit(1);
+    }
+    return swr_ctx;
+}
+
+/**
+ * Adds |samples| samples of silence to the audio.
+ */
+static void add_silence(ff2theora this, int64_t samples) {
+    float *silence = calloc(1024, sizeof(float));
+    uint8_t **buffer = malloc(this->channels * sizeof(uint8_t *));
+    int i;
+
+    if (!silence || !buffer) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        exit(1);
+    }
+    for (i = 0; i < this->channels; i++)
+        buffer[i] = (uint8_t *)silence;
+    while (samples > 0) {
+        int n = samples > 1024 ? 1024 : samples;
+        oggmux_add_audio(&info, buffer, n, 0);
+        this->sample_count += n;
+        samples -= n;
+    }
+    free(buffer);
+    free(silence);
+}
+
+/* Returns the time of a packet in seconds, -1 if it has none. */
+static double packet_time(AVStream *st, AVPacket *pkt) {
+    int64_t t = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+
+    if (t == AV_NOPTS_VALUE)
+        return -1;
+    return t * av_q2d(st->time_base);
+}
+
+/**
+ * Opens and probes the next of several inputs while the current one is
+ * encoded, so it is ready once that ends.
+ */
+static void open_next_input(ff2theora this) {
+    const char *name;
+
+    if (this->next_context || this->next_input >= this->num_inputs)
+        return;
+    name = this->input_names[this->next_input];
+    if (avformat_open_input(&this->next_context, name, NULL, NULL) < 0 ||
+        avformat_find_stream_info(this->next_context, NULL) < 0) {
+        fprintf(stderr, "\nFile `%s' does not exist or has an unknown format.\n", name);
+        exit(1);
+    }
+}
+
+/* --autocrop looks at a few frames at evenly spaced positions */
+#define AUTOCROP_POSITIONS 20
+#define AUTOCROP_FRAMES 3
+
+/**
+ * Decodes a few frames at evenly spaced positions of the input and crops
+ * the borders that stay black in all of them, on the sides not cropped
+ * by hand. The input is rewound afterwards.
+ */
+static void detect_crop(ff2theora this, AVStream *vstream, AVCodecContext *venc) {
+    AVFormatContext *context = this->context;
+    AVFrame *frame;
+    AVPacket pkt;
+    int64_t start = context->start_time != AV_NOPTS_VALUE ? context->start_time : 0;
+    int band[4], found[4] = {INT_MAX, INT_MAX, INT_MAX, INT_MAX};
+    int i, n, frames = 0;
+
+    if (!context->pb || !context->pb->seekable || this->follow ||
+        context->duration == AV_NOPTS_VALUE || context->duration <= 0 ||
+        !has_luma_plane(venc->pix_fmt)) {
+        if (!info.frontend)
+            fprintf(stderr, "  Autocrop needs a seekable YUV input of known duration, not cropping.\n");
+        return;
+    }
+    frame = avcodec_alloc_frame();
+    for (n = 0; n < AUTOCROP_POSITIONS; n++) {
+        int64_t t = start + context->duration * (2 * n + 1) / (2 * AUTOCROP_POSITIONS);
+        int decoded = 0, packets = 0;
+
+        if (av_seek_frame(context, -1, t, AVSEEK_FLAG_BACKWARD) < 0)
+            continue;
+        avcodec_flush_buffers(venc);
+        /* the first frames after a seek may be broken, give up on a
+           position that takes too long */
+        while (decoded < AUTOCROP_FRAMES && packets < 100 && av_read_frame(context, &pkt) >= 0) {
+            int got_frame = 0;
+            if (pkt.stream_index == vstream->index) {
+                packets++;
+                if (avcodec_decode_video2(venc, frame, &got_frame, &pkt) >= 0 && got_frame) {
+                    decoded++;
+                    if (find_borders(frame, venc->width, venc->height, band) == 0) {
+                        for (i = 0; i < 4; i++)
+                            found[i] = FFMIN(found[i], band[i]);
+                        frames++;
+                    }
+                }
+            }
+            av_free_packet(&pkt);
+        }
+    }
+    av_free(frame);
+    if (av_seek_frame(context, -1, start, AVSEEK_FLAG_BACKWARD) < 0) {
+        fprintf(stderr, "ERROR: Unable to rewind the input after detecting the borders.\n");
+        exit(1);
+    }
+    avcodec_flush_buffers(venc);
+
+    /* keep at least half of the picture, crop sizes have to be even */
+    if (frames == 0 || found[0] + found[1] > venc->height / 2 ||
+        found[2] + found[3] > venc->width / 2) {
+        if (!info.frontend)
+            fprintf(stderr, "  Autocrop: no borders found.\n");
+        return;
+    }
+    if (!this->frame_topBand)
+        this->frame_topBand = found[0] & ~1;
+    if (!this->frame_bottomBand)
+        this->frame_bottomBand = found[1] & ~1;
+    if (!this->frame_leftBand)
+        this->frame_leftBand = found[2] & ~1;
+    if (!this->frame_rightBand)
+        this->frame_rightBand = found[3] & ~1;
+    if (!info.frontend)
+        fprintf(stderr, "  Autocrop: top %d, bottom %d, left %d, right %d\n",
+                        this->frame_topBand, this->frame_bottomBand,
+                        this->frame_leftBand, this->frame_rightBand);
+}
+
+/* --auto-quality trial encodes a few short samples of the input */
+#define PROBE_POSITIONS 8
+#define PROBE_FRAMES 24
+#define PROBE_LEVELS 3
+static const int probe_quality[PROBE_LEVELS] = { 16, 32, 48 };
+
+/* Bytes the trial encoders produced, keyframes and others apart. */
+typedef struct {
+    th_enc_ctx *td;
+    double key_bytes;
+    int key_frames;
+    double inter_bytes;
+    int inter_frames;
+} probe_level;
+
+static th_enc_ctx *probe_encoder(int quality) {
+    th_info ti = info.ti;
+    th_enc_ctx *td;
+    th_comment tc;
+    ogg_packet op;
+
+    ti.quality = quality;
+    ti.pixel_fmt = TH_PF_420;
+    ti.target_bitrate = 0;
+    td = th_encode_alloc(&ti);
+    if (!td) {
+        fprintf(stderr, "ERROR: Unable to set up the trial encoder.\n");
+        exit(1);
+    }
+    if (info.speed_level >= 0)
+        th_encode_ctl(td, TH_ENCCTL_SET_SPLEVEL, &info.speed_level, sizeof(int));
+    th_comment_init(&tc);
+    while (th_encode_flushheader(td, &tc, &op) > 0);
+    th_comment_clear(&tc);
+    return td;
+}
+
+static void probe_encode(probe_level *level, th_ycbcr_buffer ycbcr) {
+    ogg_packet op;
+
+    if (th_encode_ycbcr_in(level->td, ycbcr) < 0)
+        return;
+    while (th_encode_packetout(level->td, 0, &op) > 0) {
+        if (th_packet_iskeyframe(&op) > 0) {
+            level->key_bytes += op.bytes;
+            level->key_frames++;
+        }
+        else {
+            level->inter_bytes += op.bytes;
+            level->inter_frames++;
+        }
+    }
+}
+
+/* Bits an average frame takes with a keyframe every |keyint| frames. */
+static double probe_frame_bits(probe_level *level, int keyint) {
+    double key, inter;
+
+    if (!level->key_frames)
+        return 0;
+    key = level->key_bytes / level->key_frames;
+    inter = level->inter_frames ? level->inter_bytes / level->inter_frames : key;
+    return 8 * (key + inter * (keyint - 1)) / keyint;
+}
+
+/**
+ * Brings a decoded picture to the size and format the encoder takes,
+ * the way the main loop does without deinterlacing and postprocessing.
+ */
+static AVFrame *probe_picture(ff2theora this, AVFrame *frame, int pix_fmt,
+                              int width, int height, AVFrame **frames) {
+    AVFrame *picture = frame;
+    AVPicture cropped;
+
+    if (pix_fmt != this->pix_fmt) {
+        sws_scale(this->sws_colorspace_ctx,
+            (const uint8_t * const*)frame->data, frame->linesize, 0, height,
+            frames[0]->data, frames[0]->linesize);
+        picture = frames[0];
+    }
+    if (av_picture_crop(&cropped, (AVPicture *)picture, this->pix_fmt,
+                        this->frame_topBand, this->frame_leftBand) < 0)
+        return NULL;
+    if (this->sws_scale_ctx) {
+        sws_scale(this->sws_scale_ctx,
+            (const uint8_t * const*)cropped.data, cropped.linesize, 0,
+            height - (this->frame_topBand + this->frame_bottomBand),
+            frames[1]->data, frames[1]->linesize);
+    }
+    else {
+        av_picture_copy((AVPicture *)frames[1], &cropped, this->pix_fmt,
+                        width - (this->frame_leftBand + this->frame_rightBand),
+                        height - (this->frame_topBand + this->frame_bottomBand));
+    }
+    if (av_picture_pad((AVPicture *)frames[2], (AVPicture *)frames[1],
+                       this->frame_height, this->frame_width, this->pix_fmt,
+                       this->frame_y_offset, this->frame_y_offset,
+                       this->frame_x_offset, this->frame_x_offset,
+                       padcolor) < 0)
+        return NULL;
+    return frames[2];
+}
+
+/**
+ * Trial encodes short samples from evenly spaced positions of the input
+ * at a few quality levels and returns the bits an average frame takes at
+ * each. The levels are encoded side by side from the same pictures, so
+ * the input is decoded only once. The input is rewound afterwards.
+ * @return the number of frames encoded at each level
+ */
+static int probe_levels(ff2theora this, AVStream *vstream, AVCodecContext *venc,
+                        int pix_fmt, int width, int height, double *bits) {
+    AVFormatContext *context = this->context;
+    probe_level levels[PROBE_LEVELS];
+    AVFrame *frame, *frames[3];
+    AVPacket pkt;
+    th_ycbcr_buffer ycbcr;
+    int64_t start = context->start_time != AV_NOPTS_VALUE ? context->start_time : 0;
+    int i, n, total = 0;
+
+    memset(levels, 0, sizeof(levels));
+    frame = avcodec_alloc_frame();
+    frames[0] = frame_alloc(this->pix_fmt, width, height);
+    frames[1] = frame_alloc(this->pix_fmt, this->picture_width, this->picture_height);
+    frames[2] = frame_alloc(this->pix_fmt, this->frame_width, this->frame_height);
+    for (n = 0; n < PROBE_POSITIONS; n++) {
+        int64_t t = start + (int64_t)(this->start_time * AV_TIME_BASE) +
+                    (int64_t)(info.duration * AV_TIME_BASE) * (2 * n + 1) / (2 * PROBE_POSITIONS);
+        int decoded = 0, packets = 0;
+
+        if (av_seek_frame(context, -1, t, AVSEEK_FLAG_BACKWARD) < 0)
+            continue;
+        avcodec_flush_buffers(venc);
+        /* every sample starts with a keyframe of its own */
+        for (i = 0; i < PROBE_LEVELS; i++)
+            levels[i].td = probe_encoder(probe_quality[i]);
+        while (decoded < PROBE_FRAMES && packets < 4 * PROBE_FRAMES && av_read_frame(context, &pkt) >= 0) {
+            int got_frame = 0;
+            if (pkt.stream_index == vstream->index) {
+                packets++;
+                if (avcodec_decode_video2(venc, frame, &got_frame, &pkt) >= 0 && got_frame) {
+                    AVFrame *picture = probe_picture(this, frame, pix_fmt, width, height, frames);
+                    if (picture) {
+                        prepare_ycbcr_buffer(this, ycbcr, picture);
+                        for (i = 0; i < PROBE_LEVELS; i++)
+                            probe_encode(&levels[i], ycbcr);
+                        decoded++;
+                    }
+                }
+            }
+            av_free_packet(&pkt);
+        }
+        total += decoded;
+        for (i = 0; i < PROBE_LEVELS; i++)
+            th_encode_free(levels[i].td);
+    }
+    av_free(frame);
+    for (i = 0; i < 3; i++)
+        frame_dealloc(frames[i]);
+    if (av_seek_frame(context, -1, start, AVSEEK_FLAG_BACKWARD) < 0) {
+        fprintf(stderr, "ERROR: Unable to rewind the input after the quality probe.\n");
+        exit(1);
+    }
+    avcodec_flush_buffers(venc);
+
+    for (i = 0; i < PROBE_LEVELS; i++)
+        bits[i] = probe_frame_bits(&levels[i], this->keyint);
+    return total;
+}
+
+/**
+ * Sets the video quality, or the bitrate, that meets the --auto-quality
+ * target. Frame sizes grow about exponentially with the quality, so a
+ * line is fitted to the logarithm of the sizes of the trial encodes.
+ * Targets the lowest quality can't reach, and two-pass encodes, use the
+ * target as bitrate.
+ */
+static void choose_quality(ff2theora this, AVStream *vstream, AVCodecContext *venc,
+                           int pix_fmt, int width, int height) {
+    AVFormatContext *context = this->context;
+    double fps = av_q2d(this->framerate);
+    double bitrate, bits[PROBE_LEVELS];
+    double sx = 0, sy = 0, sxx = 0, sxy = 0, a, b, q;
+    int i, frames = 0;
+
+    if (this->auto_quality == AUTO_QUALITY_SIZE) {
+        if (info.duration <= 0) {
+            fprintf(stderr, "ERROR: --auto-quality size=... needs an input of known duration.\n");
+            exit(1);
+        }
+        bitrate = this->auto_quality_target * 8 * 1024 * 1024 / info.duration;
+    }
+    else {
+        bitrate = this->auto_quality_target * this->picture_width * this->picture_height * fps;
+    }
+    this->video_bitrate = 0;
+    this->video_quality = 0;
+
+    if (!info.twopass) {
+        if (!context->pb || !context->pb->seekable || this->follow || info.duration <= 0) {
+            if (!info.frontend)
+                fprintf(stderr, "  Auto quality needs a seekable input of known duration, using a bitrate.\n");
+        }
+        else {
+            frames = probe_levels(this, vstream, venc, pix_fmt, width, height, bits);
+        }
+    }
+    for (i = 0; i < PROBE_LEVELS && frames > 0; i++) {
+        if (bits[i] <= 0) {
+            frames = 0;
+            break;
+        }
+        sx += probe_quality[i];
+        sy += log(bits[i]);
+        sxx += probe_quality[i] * probe_quality[i];
+        sxy += probe_quality[i] * log(bits[i]);
+    }
+    if (frames > 0) {
+        b = (PROBE_LEVELS * sxy - sx * sy) / (PROBE_LEVELS * sxx - sx * sx);
+        a = (sy - b * sx) / PROBE_LEVELS;
+        /* content that barely changes with the quality gets the best */
+        q = b > 0 ? (log(bitrate / fps) - a) / b : 63;
+        if (q >= 0) {
+            this->video_quality = q > 63 ? 63 : (int)q;
+            if (!info.frontend)
+                fprintf(stderr, "  Auto quality: %.0f kb/s => -v %.1f (%d frames probed)\n",
+                                bitrate / 1000, this->video_quality / 6.3, frames);
+            return;
+        }
+    }
+    this->video_bitrate = rint(bitrate);
+    if (!info.frontend)
+        fprintf(stderr, "  Auto quality: %.0f kb/s => -V %d\n",
+                        bitrate / 1000, this->video_bitrate / 1000);
+}
+
+/**
+ * Splits the codec private data of a Theora or Vorbis stream into its three
+ * header packets. The headers are either preceded by 16 bit lengths, as
+ * from the Ogg demuxer, or Xiph laced, as in Matroska.
+ * @return 0 on success, -1 if the data is not in either format
+ */
+static int split_xiph_headers(uint8_t *data, int size, ogg_packet *headers) {
+    long bytes[3];
+    int i;
+
+    if (!data)
+        return -1;
+    if (size >= 6 && (data[2] == 0x80 || data[2] == 0x01)) {
+        for (i = 0; i < 3; i++) {
+            if (size < 2)
+                return -1;
+            bytes[i] = data[0] << 8 | data[1];
+            data += 2;
+            size -= 2;
+            if (bytes[i] > size)
+                return -1;
+            headers[i].packet = data;
+            data += bytes[i];
+            size -= bytes[i];
+        }
+    }
+    else if (size >= 3 && data[0] == 2) {
+        data++;
+        size--;
+        for (i = 0; i < 2; i++) {
+            bytes[i] = 0;
+            while (size > 0 && *data == 0xff) {
+                bytes[i] += 0xff;
+                data++;
+                size--;
+            }
+            if (size <= 0)
+                return -1;
+            bytes[i] += *data++;
+            size--;
+        }
+        if (bytes[0] + bytes[1] > size)
+            return -1;
+        bytes[2] = size - bytes[0] - bytes[1];
+        headers[0].packet = data;
+        headers[1].packet = data + bytes[0];
+        headers[2].packet = data + bytes[0] + bytes[1];
+    }
+    else {
+        return -1;
+    }
+    for (i = 0; i < 3; i++) {
+        headers[i].bytes = bytes[i];
+        headers[i].b_o_s = i == 0;
+        headers[i].e_o_s = 0;
+        headers[i].granulepos = 0;
+        headers[i].packetno = i;
+    }
+    return 0;
+}
+
 void ff2theora_output(ff2theora this) {
     unsigned int i;
     AVCodecContext *aenc = NULL;
@@ -542,6 +1156,8 @@ void ff2theora_output(ff2theora this) {
     char *subtitles_opened = (char*)alloca(this->context->nb_streams);
     int synced = this->start_time == 0.0;
     AVRational display_aspect_ratio, sample_aspect_ratio;
+    double start_duration = 0;
+    int video_copy = 0, audio_copy = 0;
 
     struct SwrContext *swr_ctx = NULL;
     uint8_t **dst_audio_data = NULL;
@@ -590,6 +1206,15 @@ void ff2theora_output(ff2theora this) {
         venc = vstream->codec;
         vcodec = avcodec_find_decoder (venc->codec_id);
 
+        if (this->video_copy && venc->codec_id == AV_CODEC_ID_THEORA)
+            video_copy = 1;
+        else if (this->remux) {
+            fprintf(stderr, "ERROR: --remux needs Theora video, use --acopy to only pass the audio through.\n");
+            exit(1);
+        }
+        else if (this->video_copy && !info.frontend)
+            fprintf(stderr, "  Input video is not Theora, it will be encoded.\n");
+
         display_width = venc->width;
         display_height = venc->height;
         venc_pix_fmt =  venc->pix_fmt;
@@ -610,10 +1235,22 @@ void ff2theora_output(ff2theora this) {
         this->fps = fps = av_q2d(vstream_fps);
 
         venc->thread_count = 1;
-        if (vcodec == NULL || avcodec_open2 (venc, vcodec, NULL) < 0) {
+        if (vcodec == NULL || (!avcodec_is_open(venc) && avcodec_open2 (venc, vcodec, NULL) < 0)) {
             this->video_index = -1;
         }
         this->fps = fps;
+        /* telecined film goes back to its own frame rate */
+        if (this->ivtc && !video_copy) {
+            if (fabs(fps - 30000.0 / 1001) > 0.01) {
+                if (!info.frontend)
+                    fprintf(stderr, "  Input is not 29.97 fps, not doing inverse telecine.\n");
+                this->ivtc = 0;
+            }
+            else {
+                this->framerate_new.num = 24000;
+                this->framerate_new.den = 1001;
+            }
+        }
 #if DEBUG
         fprintf(stderr, "FPS1(stream): %f\n", 1/av_q2d(vstream->time_base));
         fprintf(stderr, "FPS2(stream.r_frame_rate): %f\n", av_q2d(vstream->r_frame_rate));
@@ -621,226 +1258,249 @@ void ff2theora_output(ff2theora this) {
         fprintf(stderr, "ticks per frame: %i\n", venc->ticks_per_frame);
         fprintf(stderr, "FPS used: %f\n", fps);
 #endif
-        if (this->picture_height==0 &&
-            (this->frame_leftBand || this->frame_rightBand || this->frame_topBand || this->frame_bottomBand) ) {
-            this->picture_height=display_height-
-                    this->frame_topBand-this->frame_bottomBand;
-        }
-        if (this->picture_width==0 &&
-            (this->frame_leftBand || this->frame_rightBand || this->frame_topBand || this->frame_bottomBand) ) {
-            this->picture_width=display_width-
-                    this->frame_leftBand-this->frame_rightBand;
-        }
-
-        //set display_aspect_ratio from source
-        av_reduce(&display_aspect_ratio.num, &display_aspect_ratio.den,
-                  venc->width*vstream->sample_aspect_ratio.num,
-                  venc->height*vstream->sample_aspect_ratio.den,
-                  1024*1024);
-
-        if (vstream->sample_aspect_ratio.num && // default
-            av_cmp_q(vstream->sample_aspect_ratio, venc->sample_aspect_ratio)) {
-            sample_aspect_ratio = vstream->sample_aspect_ratio;
-        } else {
-            sample_aspect_ratio = venc->sample_aspect_ratio;
-        }
-        if (venc->sample_aspect_ratio.num) {
-            av_reduce(&display_aspect_ratio.num, &display_aspect_ratio.den,
-                      venc->width*venc->sample_aspect_ratio.num,
-                      venc->height*venc->sample_aspect_ratio.den,
-                      1024*1024);
-        }
-
-        if (this->preset == V2V_PRESET_PREVIEW) {
-            if (abs(this->fps-30)<1 && (display_width!=NTSC_HALF_WIDTH || display_height!=NTSC_HALF_HEIGHT) ) {
-                this->picture_width=NTSC_HALF_WIDTH;
-                this->picture_height=NTSC_HALF_HEIGHT;
+        /* geometry, aspect and scalers are kept when the input is reused
+           for the second pass */
+        if (!this->prepared) {
+            /* once, the second pass uses the same borders */
+            if (this->autocrop && this->video_index >= 0 && !video_copy) {
+                detect_crop(this, vstream, venc);
+                this->autocrop = 0;
             }
-            else {
-                this->picture_width=PAL_HALF_WIDTH;
-                this->picture_height=PAL_HALF_HEIGHT;
+            if (this->picture_height==0 &&
+                (this->frame_leftBand || this->frame_rightBand || this->frame_topBand || this->frame_bottomBand) ) {
+                this->picture_height=display_height-
+                        this->frame_topBand-this->frame_bottomBand;
             }
-        }
-        else if (this->preset == V2V_PRESET_PRO) {
-            if (abs(this->fps-30)<1 && (display_width!=NTSC_FULL_WIDTH || display_height!=NTSC_FULL_HEIGHT) ) {
-                this->picture_width=NTSC_FULL_WIDTH;
-                this->picture_height=NTSC_FULL_HEIGHT;
+            if (this->picture_width==0 &&
+                (this->frame_leftBand || this->frame_rightBand || this->frame_topBand || this->frame_bottomBand) ) {
+                this->picture_width=display_width-
+                        this->frame_leftBand-this->frame_rightBand;
             }
-            else {
-                this->picture_width=PAL_FULL_WIDTH;
-                this->picture_height=PAL_FULL_HEIGHT;
-            }
-        }
-        else if (this->preset == V2V_PRESET_PADMA) {
-            int width=display_width-this->frame_leftBand-this->frame_rightBand;
-            int height=display_height-this->frame_topBand-this->frame_bottomBand;
-            if (sample_aspect_ratio.den!=0 && sample_aspect_ratio.num!=0) {
-                height=((float)sample_aspect_ratio.den/sample_aspect_ratio.num) * height;
-                sample_aspect_ratio.den = 1;
-                sample_aspect_ratio.num = 1;
+
+            //set display_aspect_ratio from source
+            av_reduce(&display_aspect_ratio.num, &display_aspect_ratio.den,
+                      venc->width*vstream->sample_aspect_ratio.num,
+                      venc->height*vstream->sample_aspect_ratio.den,
+                      1024*1024);
+
+            if (vstream->sample_aspect_ratio.num && // default
+                av_cmp_q(vstream->sample_aspect_ratio, venc->sample_aspect_ratio)) {
+                sample_aspect_ratio = vstream->sample_aspect_ratio;
+            } else {
+                sample_aspect_ratio = venc->sample_aspect_ratio;
             }
-            if (this->frame_aspect.num == 0) {
-                this->frame_aspect.num = width;
-                this->frame_aspect.den = height;
+            if (venc->sample_aspect_ratio.num) {
+                av_reduce(&display_aspect_ratio.num, &display_aspect_ratio.den,
+                          venc->width*venc->sample_aspect_ratio.num,
+                          venc->height*venc->sample_aspect_ratio.den,
+                          1024*1024);
             }
-            if (av_q2d(this->frame_aspect) <= 1.5) {
-                if (width > 640 || height > 480) {
-                    //4:3 640 x 480
-                    this->picture_width=640;
-                    this->picture_height=480;
+
+            if (this->preset == V2V_PRESET_PREVIEW) {
+                if (abs(this->fps-30)<1 && (display_width!=NTSC_HALF_WIDTH || display_height!=NTSC_HALF_HEIGHT) ) {
+                    this->picture_width=NTSC_HALF_WIDTH;
+                    this->picture_height=NTSC_HALF_HEIGHT;
                 }
                 else {
-                    this->picture_width=width;
-                    this->picture_height=height;
+                    this->picture_width=PAL_HALF_WIDTH;
+                    this->picture_height=PAL_HALF_HEIGHT;
                 }
             }
-            else {
-                if (width > 640 || height > 360) {
-                    //16:9 640 x 360
-                    this->picture_width=640;
-                    this->picture_height=360;
+            else if (this->preset == V2V_PRESET_PRO) {
+                if (abs(this->fps-30)<1 && (display_width!=NTSC_FULL_WIDTH || display_height!=NTSC_FULL_HEIGHT) ) {
+                    this->picture_width=NTSC_FULL_WIDTH;
+                    this->picture_height=NTSC_FULL_HEIGHT;
                 }
                 else {
-                    this->picture_width=width;
-                    this->picture_height=height;
+                    this->picture_width=PAL_FULL_WIDTH;
+                    this->picture_height=PAL_FULL_HEIGHT;
                 }
             }
-            this->frame_aspect.num = this->picture_width;
-            this->frame_aspect.den = this->picture_height;
-        }
-        else if (this->preset == V2V_PRESET_PADMASTREAM) {
-            int width=display_width-this->frame_leftBand-this->frame_rightBand;
-            int height=display_height-this->frame_topBand-this->frame_bottomBand;
-            if (sample_aspect_ratio.den!=0 && sample_aspect_ratio.num!=0) {
-                height=((float)sample_aspect_ratio.den/sample_aspect_ratio.num) * height;
-                sample_aspect_ratio.den = 1;
-                sample_aspect_ratio.num = 1;
-            }
-            if (this->frame_aspect.num == 0) {
-                this->frame_aspect.num = width;
-                this->frame_aspect.den = height;
-            }
-
-            this->picture_width=128;
-            this->picture_height=128/av_q2d(this->frame_aspect);
-
-            this->frame_aspect.num = this->picture_width;
-            this->frame_aspect.den = this->picture_height;
-        }
-        else if (this->preset == V2V_PRESET_VIDEOBIN) {
-            int width=display_width-this->frame_leftBand-this->frame_rightBand;
-            int height=display_height-this->frame_topBand-this->frame_bottomBand;
-            if (sample_aspect_ratio.den!=0 && sample_aspect_ratio.num!=0) {
-                height=((float)sample_aspect_ratio.den/sample_aspect_ratio.num) * height;
-                sample_aspect_ratio.den = 1;
-                sample_aspect_ratio.num = 1;
-            }
-            if ( ((float)width /height) <= 1.5) {
-                if (width > 448) {
-                    //4:3 448 x 336
-                    this->picture_width=448;
-                    this->picture_height=336;
+            else if (this->preset == V2V_PRESET_PADMA) {
+                int width=display_width-this->frame_leftBand-this->frame_rightBand;
+                int height=display_height-this->frame_topBand-this->frame_bottomBand;
+                if (sample_aspect_ratio.den!=0 && sample_aspect_ratio.num!=0) {
+                    height=((float)sample_aspect_ratio.den/sample_aspect_ratio.num) * height;
+                    sample_aspect_ratio.den = 1;
+                    sample_aspect_ratio.num = 1;
                 }
-                else {
-                    this->picture_width=width;
-                    this->picture_height=height;
+                if (this->frame_aspect.num == 0) {
+                    this->frame_aspect.num = width;
+                    this->frame_aspect.den = height;
                 }
-            }
-            else {
-                if (width > 512) {
-                    //16:9 512 x 288
-                    this->picture_width=512;
-                    this->picture_height=288;
+                if (av_q2d(this->frame_aspect) <= 1.5) {
+                    if (width > 640 || height > 480) {
+                        //4:3 640 x 480
+                        this->picture_width=640;
+                        this->picture_height=480;
+                    }
+                    else {
+                        this->picture_width=width;
+                        this->picture_height=height;
+                    }
                 }
                 else {
-                    this->picture_width=width;
-                    this->picture_height=height;
+                    if (width > 640 || height > 360) {
+                        //16:9 640 x 360
+                        this->picture_width=640;
+                        this->picture_height=360;
+                    }
+                    else {
+                        this->picture_width=width;
+                        this->picture_height=height;
+                    }
                 }
+                this->frame_aspect.num = this->picture_width;
+                this->frame_aspect.den = this->picture_height;
             }
-            this->frame_aspect.num = this->picture_width;
-            this->frame_aspect.den = this->picture_height;
-        }
-        //so frame_aspect is set on the commandline
+            else if (this->preset == V2V_PRESET_PADMASTREAM) {
+                int width=display_width-this->frame_leftBand-this->frame_rightBand;
+                int height=display_height-this->frame_topBand-this->frame_bottomBand;
+                if (sample_aspect_ratio.den!=0 && sample_aspect_ratio.num!=0) {
+                    height=((float)sample_aspect_ratio.den/sample_aspect_ratio.num) * height;
+                    sample_aspect_ratio.den = 1;
+                    sample_aspect_ratio.num = 1;
+                }
+                if (this->frame_aspect.num == 0) {
+                    this->frame_aspect.num = width;
+                    this->frame_aspect.den = height;
+                }
 
-        if (this->frame_aspect.num != 0) {
-            if (this->picture_height) {
-                this->aspect_numerator = this->frame_aspect.num*this->picture_height;
-                this->aspect_denominator = this->frame_aspect.den*this->picture_width;
-            }
-            else{
-                this->aspect_numerator = this->frame_aspect.num*display_height;
-                this->aspect_denominator = this->frame_aspect.den*display_width;
-            }
-            av_reduce(&this->aspect_numerator,&this->aspect_denominator,
-                       this->aspect_numerator,this->aspect_denominator,
-                       1024*1024);
-            frame_aspect=av_q2d(this->frame_aspect);
-        }
-        if ((this->picture_width && !this->picture_height) ||
-            (this->picture_height && !this->picture_width) ||
-            this->max_x > 0) {
+                this->picture_width=128;
+                this->picture_height=128/av_q2d(this->frame_aspect);
 
-            int width = display_width-this->frame_leftBand-this->frame_rightBand;
-            int height = display_height-this->frame_topBand-this->frame_bottomBand;
-            if (sample_aspect_ratio.den!=0 && sample_aspect_ratio.num!=0) {
-                height=((float)sample_aspect_ratio.den/sample_aspect_ratio.num) * height;
-                sample_aspect_ratio.den = 1;
-                sample_aspect_ratio.num = 1;
+                this->frame_aspect.num = this->picture_width;
+                this->frame_aspect.den = this->picture_height;
             }
-            if (this->frame_aspect.num == 0) {
-                this->frame_aspect.num = width;
-                this->frame_aspect.den = height;
+            else if (this->preset == V2V_PRESET_VIDEOBIN) {
+                int width=display_width-this->frame_leftBand-this->frame_rightBand;
+                int height=display_height-this->frame_topBand-this->frame_bottomBand;
+                if (sample_aspect_ratio.den!=0 && sample_aspect_ratio.num!=0) {
+                    height=((float)sample_aspect_ratio.den/sample_aspect_ratio.num) * height;
+                    sample_aspect_ratio.den = 1;
+                    sample_aspect_ratio.num = 1;
+                }
+                if ( ((float)width /height) <= 1.5) {
+                    if (width > 448) {
+                        //4:3 448 x 336
+                        this->picture_width=448;
+                        this->picture_height=336;
+                    }
+                    else {
+                        this->picture_width=width;
+                        this->picture_height=height;
+                    }
+                }
+                else {
+                    if (width > 512) {
+                        //16:9 512 x 288
+                        this->picture_width=512;
+                        this->picture_height=288;
+                    }
+                    else {
+                        this->picture_width=width;
+                        this->picture_height=height;
+                    }
+                }
+                this->frame_aspect.num = this->picture_width;
+                this->frame_aspect.den = this->picture_height;
             }
+            //so frame_aspect is set on the commandline
 
-            if (this->picture_width && !this->picture_height) {
-                this->picture_height = this->picture_width / av_q2d(this->frame_aspect);
-                this->picture_height = this->picture_height + this->picture_height%2;
-            }
-            else if (this->picture_height && !this->picture_width) {
-                this->picture_width = this->picture_height * av_q2d(this->frame_aspect);
-                this->picture_width = this->picture_width + this->picture_width%2;
+            if (this->frame_aspect.num != 0) {
+                if (this->picture_height) {
+                    this->aspect_numerator = this->frame_aspect.num*this->picture_height;
+                    this->aspect_denominator = this->frame_aspect.den*this->picture_width;
+                }
+                else{
+                    this->aspect_numerator = this->frame_aspect.num*display_height;
+                    this->aspect_denominator = this->frame_aspect.den*display_width;
+                }
+                av_reduce(&this->aspect_numerator,&this->aspect_denominator,
+                           this->aspect_numerator,this->aspect_denominator,
+                           1024*1024);
+                frame_aspect=av_q2d(this->frame_aspect);
             }
+            if ((this->picture_width && !this->picture_height) ||
+                (this->picture_height && !this->picture_width) ||
+                this->max_x > 0) {
+
+                int width = display_width-this->frame_leftBand-this->frame_rightBand;
+                int height = display_height-this->frame_topBand-this->frame_bottomBand;
+                if (sample_aspect_ratio.den!=0 && sample_aspect_ratio.num!=0) {
+                    height=((float)sample_aspect_ratio.den/sample_aspect_ratio.num) * height;
+                    sample_aspect_ratio.den = 1;
+                    sample_aspect_ratio.num = 1;
+                }
+                if (this->frame_aspect.num == 0) {
+                    this->frame_aspect.num = width;
+                    this->frame_aspect.den = height;
+                }
 
-            if (this->max_x > 0) {
-                if (width > height &&
-                    this->max_x/av_q2d(this->frame_aspect) <= this->max_y) {
-                    this->picture_width = this->max_x;
-                    this->picture_height = this->max_x / av_q2d(this->frame_aspect);
+                if (this->picture_width && !this->picture_height) {
+                    this->picture_height = this->picture_width / av_q2d(this->frame_aspect);
                     this->picture_height = this->picture_height + this->picture_height%2;
-                } else {
-                    this->picture_height = this->max_y;
-                    this->picture_width = this->max_y * av_q2d(this->frame_aspect);
+                }
+                else if (this->picture_height && !this->picture_width) {
+                    this->picture_width = this->picture_height * av_q2d(this->frame_aspect);
                     this->picture_width = this->picture_width + this->picture_width%2;
                 }
-            }
-        }
 
-        if (this->no_upscaling) {
-            if (this->picture_height && this->picture_height > display_height) {
-                this->picture_width = display_height * display_aspect_ratio.num / display_aspect_ratio.den;
-                this->picture_height = display_height;
+                if (this->max_x > 0) {
+                    if (width > height &&
+                        this->max_x/av_q2d(this->frame_aspect) <= this->max_y) {
+                        this->picture_width = this->max_x;
+                        this->picture_height = this->max_x / av_q2d(this->frame_aspect);
+                        this->picture_height = this->picture_height + this->picture_height%2;
+                    } else {
+                        this->picture_height = this->max_y;
+                        this->picture_width = this->max_y * av_q2d(this->frame_aspect);
+                        this->picture_width = this->picture_width + this->picture_width%2;
+                    }
+                }
             }
-            else if (this->picture_width && this->picture_width > display_width) {
-                this->picture_width = display_width;
-                this->picture_height = display_width * display_aspect_ratio.den / display_aspect_ratio.num;
+
+            if (this->no_upscaling) {
+                if (this->picture_height && this->picture_height > display_height) {
+                    this->picture_width = display_height * display_aspect_ratio.num / display_aspect_ratio.den;
+                    this->picture_height = display_height;
+                }
+                else if (this->picture_width && this->picture_width > display_width) {
+                    this->picture_width = display_width;
+                    this->picture_height = display_width * display_aspect_ratio.den / display_aspect_ratio.num;
+                }
+                if (this->fps < av_q2d(this->framerate_new))
+                    this->framerate_new = vstream_fps;
             }
-            if (this->fps < av_q2d(this->framerate_new))
-                this->framerate_new = vstream_fps;
-        }
 
-        if (info.twopass!=3 || info.passno==1) {
-            if (sample_aspect_ratio.num!=0 && this->frame_aspect.num==0) {
+            if (info.twopass!=3 || info.passno==1) {
+                if (sample_aspect_ratio.num!=0 && this->frame_aspect.num==0) {
+
+                    // just use the ratio from the input
+                    this->aspect_numerator=sample_aspect_ratio.num;
+                    this->aspect_denominator=sample_aspect_ratio.den;
+                    // or we use ratio for the output
+                    if (this->picture_height) {
+                        int width=display_width-this->frame_leftBand-this->frame_rightBand;
+                        int height=display_height-this->frame_topBand-this->frame_bottomBand;
+                        av_reduce(&this->aspect_numerator,&this->aspect_denominator,
+                        vstream->sample_aspect_ratio.num*width*this->picture_height,
+                        vstream->sample_aspect_ratio.den*height*this->picture_width,10000);
+                        frame_aspect=(float)(this->aspect_numerator*this->picture_width)/
+                                        (this->aspect_denominator*this->picture_height);
+                    }
+                    else{
+                        frame_aspect=(float)(this->aspect_numerator*display_width)/
+                                        (this->aspect_denominator*display_height);
+                    }
+                }
+            }
 
-                // just use the ratio from the input
-                this->aspect_numerator=sample_aspect_ratio.num;
-                this->aspect_denominator=sample_aspect_ratio.den;
-                // or we use ratio for the output
+            //pixel aspect ratio set, use that
+            if (this->pixel_aspect.num>0) {
+                this->aspect_numerator = this->pixel_aspect.num;
+                this->aspect_denominator = this->pixel_aspect.den;
                 if (this->picture_height) {
-                    int width=display_width-this->frame_leftBand-this->frame_rightBand;
-                    int height=display_height-this->frame_topBand-this->frame_bottomBand;
-                    av_reduce(&this->aspect_numerator,&this->aspect_denominator,
-                    vstream->sample_aspect_ratio.num*width*this->picture_height,
-                    vstream->sample_aspect_ratio.den*height*this->picture_width,10000);
                     frame_aspect=(float)(this->aspect_numerator*this->picture_width)/
                                     (this->aspect_denominator*this->picture_height);
                 }
@@ -849,32 +1509,83 @@ void ff2theora_output(ff2theora this) {
                                     (this->aspect_denominator*display_height);
                 }
             }
-        }
+            if (!(info.twopass==3 && info.passno==2) && !info.frontend && this->aspect_denominator && frame_aspect) {
+                fprintf(stderr, "  Pixel Aspect Ratio: %.2f/1 ",(float)this->aspect_numerator/this->aspect_denominator);
+                fprintf(stderr, "  Frame Aspect Ratio: %.2f/1\n", frame_aspect);
+            }
+
+            if (!(info.twopass==3 && info.passno==2) && !info.frontend &&
+                this->deinterlace==1)
+                fprintf(stderr, "  Deinterlace: on\n");
+            if (!(info.twopass==3 && info.passno==2) && !info.frontend &&
+                this->deinterlace==-1)
+                fprintf(stderr, "  Deinterlace: off\n");
 
-        //pixel aspect ratio set, use that
-        if (this->pixel_aspect.num>0) {
-            this->aspect_numerator = this->pixel_aspect.num;
-            this->aspect_denominator = this->pixel_aspect.den;
-            if (this->picture_height) {
-                frame_aspect=(float)(this->aspect_numerator*this->picture_width)/
-                                (this->aspect_denominator*this->picture_height);
+            if (venc->color_primaries == AVCOL_PRI_BT470M)
+                this->colorspace = TH_CS_ITU_REC_470M;
+            else if (venc->color_primaries == AVCOL_PRI_BT470BG)
+                this->colorspace = TH_CS_ITU_REC_470BG;
+
+            if (!this->picture_width)
+                this->picture_width = display_width;
+            if (!this->picture_height)
+                this->picture_height = display_height;
+
+            /* Theora has a divisible-by-sixteen restriction for the encoded video size */
+            /* scale the frame size up to the nearest /16 and calculate offsets */
+            this->frame_width = ((this->picture_width + 15) >>4)<<4;
+            this->frame_height = ((this->picture_height + 15) >>4)<<4;
+
+            /*Force the offsets to be even so that chroma samples line up like we
+               expect.*/
+            this->frame_x_offset = (this->frame_width-this->picture_width)>>1&~1;
+            this->frame_y_offset = (this->frame_height-this->picture_height)>>1&~1;
+
+            //Bicubic  (best for upscaling),
+            if (sws_flags < 0) {
+              if(display_width - (this->frame_leftBand + this->frame_rightBand) < this->picture_width ||
+                 display_height - (this->frame_topBand + this->frame_bottomBand) < this->picture_height) {
+                 sws_flags = SWS_BICUBIC;
+              } else {        //Bilinear (best for downscaling),
+                 sws_flags = SWS_BILINEAR;
+              }
             }
-            else{
-                frame_aspect=(float)(this->aspect_numerator*display_width)/
-                                (this->aspect_denominator*display_height);
+
+            if (this->frame_width > 0 || this->frame_height > 0) {
+                this->sws_colorspace_ctx = sws_getContext(
+                                display_width, display_height, venc_pix_fmt,
+                                display_width, display_height, this->pix_fmt,
+                                sws_flags, NULL, NULL, NULL
+                );
+                this->sws_scale_ctx = sws_getContext(
+                            display_width - (this->frame_leftBand + this->frame_rightBand),
+                            display_height - (this->frame_topBand + this->frame_bottomBand),
+                            this->pix_fmt,
+                            this->picture_width, this->picture_height, this->pix_fmt,
+                            sws_flags, NULL, NULL, NULL
+                );
+                if (!info.frontend && !(info.twopass==3 && info.passno==2)) {
+                    if (this->frame_topBand || this->frame_bottomBand ||
+                        this->frame_leftBand || this->frame_rightBand ||
+                        this->picture_width != (display_width-this->frame_leftBand - this->frame_rightBand) ||
+                        this->picture_height != (display_height-this->frame_topBand-this->frame_bottomBand))
+                        fprintf(stderr, "  Resize: %dx%d", display_width, display_height);
+                    if (this->frame_topBand || this->frame_bottomBand ||
+                        this->frame_leftBand || this->frame_rightBand) {
+                        fprintf(stderr, " => %dx%d",
+                            display_width-this->frame_leftBand-this->frame_rightBand,
+                            display_height-this->frame_topBand-this->frame_bottomBand);
+                    }
+                    if (this->picture_width != (display_width-this->frame_leftBand - this->frame_rightBand)
+                        || this->picture_height != (display_height-this->frame_topBand-this->frame_bottomBand))
+                        fprintf(stderr, " => %dx%d",this->picture_width, this->picture_height);
+                    fprintf(stderr, "\n");
+                }
             }
-        }
-        if (!(info.twopass==3 && info.passno==2) && !info.frontend && this->aspect_denominator && frame_aspect) {
-            fprintf(stderr, "  Pixel Aspect Ratio: %.2f/1 ",(float)this->aspect_numerator/this->aspect_denominator);
-            fprintf(stderr, "  Frame Aspect Ratio: %.2f/1\n", frame_aspect);
-        }
 
-        if (!(info.twopass==3 && info.passno==2) && !info.frontend &&
-            this->deinterlace==1)
-            fprintf(stderr, "  Deinterlace: on\n");
-        if (!(info.twopass==3 && info.passno==2) && !info.frontend &&
-            this->deinterlace==-1)
-            fprintf(stderr, "  Deinterlace: off\n");
+            lut_init(this);
+            this->prepared = 1;
+        }
 
         if (strcmp(this->pp_mode, "")) {
             ppContext = pp_get_context(display_width, display_height, PP_FORMAT_420);
@@ -882,70 +1593,6 @@ void ff2theora_output(ff2theora this) {
             if(!(info.twopass==3 && info.passno==2) && !info.frontend)
                 fprintf(stderr, "  Postprocessing: %s\n", this->pp_mode);
         }
-
-        if (venc->color_primaries == AVCOL_PRI_BT470M)
-            this->colorspace = TH_CS_ITU_REC_470M;
-        else if (venc->color_primaries == AVCOL_PRI_BT470BG)
-            this->colorspace = TH_CS_ITU_REC_470BG;
-
-        if (!this->picture_width)
-            this->picture_width = display_width;
-        if (!this->picture_height)
-            this->picture_height = display_height;
-
-        /* Theora has a divisible-by-sixteen restriction for the encoded video size */
-        /* scale the frame size up to the nearest /16 and calculate offsets */
-        this->frame_width = ((this->picture_width + 15) >>4)<<4;
-        this->frame_height = ((this->picture_height + 15) >>4)<<4;
-
-        /*Force the offsets to be even so that chroma samples line up like we
-           expect.*/
-        this->frame_x_offset = (this->frame_width-this->picture_width)>>1&~1;
-        this->frame_y_offset = (this->frame_height-this->picture_height)>>1&~1;
-
-        //Bicubic  (best for upscaling),
-        if (sws_flags < 0) {
-          if(display_width - (this->frame_leftBand + this->frame_rightBand) < this->picture_width ||
-             display_height - (this->frame_topBand + this->frame_bottomBand) < this->picture_height) {
-             sws_flags = SWS_BICUBIC;
-          } else {        //Bilinear (best for downscaling),
-             sws_flags = SWS_BILINEAR;
-          }
-        }
-
-        if (this->frame_width > 0 || this->frame_height > 0) {
-            this->sws_colorspace_ctx = sws_getContext(
-                            display_width, display_height, venc_pix_fmt,
-                            display_width, display_height, this->pix_fmt,
-                            sws_flags, NULL, NULL, NULL
-            );
-            this->sws_scale_ctx = sws_getContext(
-                        display_width - (this->frame_leftBand + this->frame_rightBand),
-                        display_height - (this->frame_topBand + this->frame_bottomBand),
-                        this->pix_fmt,
-                        this->picture_width, this->picture_height, this->pix_fmt,
-                        sws_flags, NULL, NULL, NULL
-            );
-            if (!info.frontend && !(info.twopass==3 && info.passno==2)) {
-                if (this->frame_topBand || this->frame_bottomBand ||
-                    this->frame_leftBand || this->frame_rightBand ||
-                    this->picture_width != (display_width-this->frame_leftBand - this->frame_rightBand) ||
-                    this->picture_height != (display_height-this->frame_topBand-this->frame_bottomBand))
-                    fprintf(stderr, "  Resize: %dx%d", display_width, display_height);
-                if (this->frame_topBand || this->frame_bottomBand ||
-                    this->frame_leftBand || this->frame_rightBand) {
-                    fprintf(stderr, " => %dx%d",
-                        display_width-this->frame_leftBand-this->frame_rightBand,
-                        display_height-this->frame_topBand-this->frame_bottomBand);
-                }
-                if (this->picture_width != (display_width-this->frame_leftBand - this->frame_rightBand)
-                    || this->picture_height != (display_height-this->frame_topBand-this->frame_bottomBand))
-                    fprintf(stderr, " => %dx%d",this->picture_width, this->picture_height);
-                fprintf(stderr, "\n");
-            }
-        }
-
-        lut_init(this);
     }
     if (!(info.twopass==3 && info.passno==2) && !info.frontend && this->framerate_new.num > 0 && av_cmp_q(vstream_fps, this->framerate_new)) {
         fprintf(stderr, "  Resample Framerate: %0.3f => %0.3f\n",
@@ -956,6 +1603,15 @@ void ff2theora_output(ff2theora this) {
         aenc = this->context->streams[this->audio_index]->codec;
         acodec = avcodec_find_decoder (aenc->codec_id);
         int sample_rate = aenc->sample_rate;
+
+        if (this->audio_copy && aenc->codec_id == AV_CODEC_ID_VORBIS)
+            audio_copy = info.passno != 1;
+        else if (this->remux) {
+            fprintf(stderr, "ERROR: --remux needs Vorbis audio, use --vcopy to only pass the video through.\n");
+            exit(1);
+        }
+        else if (this->audio_copy && !info.frontend && info.passno != 1)
+            fprintf(stderr, "  Input audio is not Vorbis, it will be encoded.\n");
         if (this->channels < 1) {
             this->channels = aenc->channels;
         }
@@ -970,29 +1626,15 @@ void ff2theora_output(ff2theora this) {
                 this->channels = aenc->channels;
         }
         aenc->thread_count = 1;
-        if (acodec != NULL && avcodec_open2 (aenc, acodec, NULL) >= 0) {
+        if (info.passno == 1 || audio_copy) {
+            /* the first pass only looks at the video, audio is not decoded;
+               passed through audio isn't either */
+        }
+        else if (acodec != NULL && (avcodec_is_open(aenc) || avcodec_open2 (aenc, acodec, NULL) >= 0)) {
             if (this->sample_rate != sample_rate
                 || this->channels != aenc->channels
                 || aenc->sample_fmt != AV_SAMPLE_FMT_FLTP) {
-                swr_ctx = swr_alloc();
-                /* set options */
-                if (aenc->channel_layout) {
-                    av_opt_set_int(swr_ctx, "in_channel_layout",    aenc->channel_layout, 0);
-                } else {
-                    av_opt_set_int(swr_ctx, "in_channel_layout", av_get_default_channel_layout(aenc->channels), 0);
-                }
-                av_opt_set_int(swr_ctx, "in_sample_rate",       aenc->sample_rate, 0);
-                av_opt_set_int(swr_ctx, "in_sample_fmt", aenc->sample_fmt, 0);
-
-                av_opt_set_int(swr_ctx, "out_channel_layout", av_get_default_channel_layout(this->channels), 0);
-                av_opt_set_int(swr_ctx, "out_sample_rate",       this->sample_rate, 0);
-                av_opt_set_int(swr_ctx, "out_sample_fmt", AV_SAMPLE_FMT_FLTP, 0);
-
-                /* initialize the resampling context */
-                if (swr_init(swr_ctx) < 0) {
-                    fprintf(stderr, "Failed to initialize the resampling context\n");
-                    exit(1);
-                }
+                swr_ctx = open_resampler(this, aenc);
 
                 max_dst_nb_samples = dst_nb_samples =
                     av_rescale_rnd(src_nb_samples, this->sample_rate, sample_rate, AV_ROUND_UP);
@@ -1080,6 +1722,21 @@ void ff2theora_output(ff2theora this) {
 
     if (info.passno != 1) {
       oggmux_setup_kate_streams(&info, this->n_kate_streams);
+      /* subtitles loaded from a file tell where the keypoints of the kate
+         index will be */
+      for (i=0; i<this->n_kate_streams; ++i) {
+        ff2theora_kate_stream *ks = this->kate_streams+i;
+        oggmux_kate_stream *oks = info.kate_streams+i;
+        size_t n;
+        if (ks->num_subtitles == 0)
+            continue;
+        oks->event_times = (ogg_int64_t*)malloc(ks->num_subtitles*sizeof(ogg_int64_t));
+        if (!oks->event_times)
+            continue;
+        for (n=0; n<ks->num_subtitles; ++n)
+            oks->event_times[n] = (ogg_int64_t)(ks->subtitles[n].t0*1000);
+        oks->num_event_times = ks->num_subtitles;
+      }
     }
 
     if (this->video_index >= 0 || this->audio_index >= 0) {
@@ -1097,6 +1754,28 @@ void ff2theora_output(ff2theora this) {
         AVFrame *output_cropped=NULL;
         AVFrame *output_padded_p=NULL;
         AVFrame *output_padded=NULL;
+        /* where the decoder puts the pictures; later inputs decode into
+           their own frame, which is scaled into |frame| */
+        AVFrame *decode_frame=NULL;
+        AVFrame *decode_frame_p=NULL;
+        AVFrame *scaled_input_p=NULL;
+        /* --ivtc, film frames recovered from the decoded ones */
+        ivtc_filter *ivtc = NULL;
+        AVFrame *ivtc_frame = NULL;
+        /* more inputs follow the current one, set while its decoders are
+           drained */
+        int draining = 0;
+        int later_input = 0;
+        /* repeats of the buffered picture not passed to the encoder yet */
+        int dup_run = 0;
+        /* audio samples to drop at the start of the next input */
+        int64_t audio_skip = 0;
+        uint8_t **audio_skip_p = NULL;
+        /* passed through streams start at the time of the input in
+           copy_start, with --vcopy that of the first keyframe; the audio
+           is aligned to it once it starts */
+        double copy_start = -1;
+        int audio_started = 0;
 
         AVPacket pkt;
         AVPacket avpkt;
@@ -1104,6 +1783,7 @@ void ff2theora_output(ff2theora this) {
         int got_frame;
         int first = 1;
         int audio_eos = 0, video_eos = 0, audio_done = 0, video_done = 0;
+        int replay = 0;
         int ret;
         AVFrame *audio_frame = NULL;
         uint8_t **audio_p = NULL;
@@ -1127,9 +1807,24 @@ void ff2theora_output(ff2theora this) {
         if(info.video_only || info.passno == 1)
             audio_done = 1;
 
-        if (!info.audio_only) {
+        info.theora_copy = info.vorbis_copy = 0;
+        if (!info.audio_only && video_copy) {
+            /* the video is passed through as it is, its settings come from
+               its headers */
+            ogg_packet headers[3];
+            if (split_xiph_headers(venc->extradata, venc->extradata_size, headers) < 0 ||
+                oggmux_copy_theora_headers(&info, headers) < 0) {
+                fprintf(stderr, "ERROR: Unable to read the Theora headers of the input.\n");
+                exit(1);
+            }
+            this->framerate.num = info.ti.fps_numerator;
+            this->framerate.den = info.ti.fps_denominator;
+            this->fps = av_q2d(this->framerate);
+        }
+        else if (!info.audio_only) {
             frame_p = frame = frame_alloc(venc_pix_fmt,
                             venc->width,venc->height);
+            decode_frame = frame;
             output_tmp_p = output_tmp = frame_alloc(this->pix_fmt,
                             venc->width, venc->height);
             output_p = output = frame_alloc(this->pix_fmt,
@@ -1143,6 +1838,10 @@ void ff2theora_output(ff2theora this) {
                             this->frame_width, this->frame_height);
             output_padded_p = output_padded = frame_alloc(this->pix_fmt,
                             this->frame_width, this->frame_height);
+            if (this->ivtc) {
+                ivtc = ivtc_filter_new(display_width, display_height);
+                ivtc_frame = avcodec_alloc_frame();
+            }
 
             /* video settings here */
             /* config file? commandline options? v2v presets? */
@@ -1173,6 +1872,12 @@ void ff2theora_output(ff2theora this) {
 
             info.ti.colorspace = this->colorspace;
 
+            /* once, the second pass uses the same settings */
+            if (this->auto_quality) {
+                choose_quality(this, vstream, venc, venc_pix_fmt, display_width, display_height);
+                this->auto_quality = 0;
+            }
+
             /*Account for the Ogg page overhead.
               This is 1 byte per 255 for lacing values, plus 26 bytes per 4096 bytes for
                the page header, plus approximately 1/2 byte per packet (not accounted for
@@ -1181,6 +1886,9 @@ void ff2theora_output(ff2theora this) {
 
             info.ti.quality = this->video_quality;
             info.ti.keyframe_granule_shift = ilog(this->keyint-1);
+            /* keyframes may be up to the lookahead later to land on a cut */
+            if (this->scene_cuts)
+                info.ti.keyframe_granule_shift = ilog(this->keyint + SCENECUT_LOOKAHEAD - 1);
             info.ti.pixel_fmt = TH_PF_420;
 
             /* no longer in new encoder api
@@ -1197,12 +1905,17 @@ void ff2theora_output(ff2theora this) {
             */
             info.td = th_encode_alloc(&info.ti);
 
-            if (info.speed_level >= 0) {
+            if (info.speed_level >= 0 || (info.passno == 1 && this->fast_first_pass)) {
                 int max_speed_level;
                 th_encode_ctl(info.td, TH_ENCCTL_GET_SPLEVEL_MAX, &max_speed_level, sizeof(int));
                 if (info.speed_level > max_speed_level)
                     info.speed_level = max_speed_level;
-                th_encode_ctl(info.td, TH_ENCCTL_SET_SPLEVEL, &info.speed_level, sizeof(int));
+                /* the first pass only has to get the frame types and relative
+                   frame sizes right, the fastest search is good enough for that */
+                if (info.passno == 1 && this->fast_first_pass)
+                    th_encode_ctl(info.td, TH_ENCCTL_SET_SPLEVEL, &max_speed_level, sizeof(int));
+                else
+                    th_encode_ctl(info.td, TH_ENCCTL_SET_SPLEVEL, &info.speed_level, sizeof(int));
             }
             /* setting just the granule shift only allows power-of-two keyframe
                spacing.  Set the actual requested spacing. */
@@ -1211,6 +1924,17 @@ void ff2theora_output(ff2theora this) {
             if(ret<0){
                 fprintf(stderr,"Could not set keyframe interval to %d.\n",(int)this->keyint);
             }
+            /* with --scene-cuts the regular keyframes are placed by
+               encode_lookahead_frame(), the encoder only enforces what the
+               granule position can count */
+            this->max_keyint = this->keyint;
+            if (this->scene_cuts) {
+                ogg_uint32_t keyint = 1 << info.ti.keyframe_granule_shift;
+                th_encode_ctl(info.td, TH_ENCCTL_SET_KEYFRAME_FREQUENCY_FORCE, &keyint, sizeof(keyint));
+                this->max_keyint = keyint;
+                this->lookahead = scene_lookahead_new();
+                this->since_keyframe = 0;
+            }
 
             if(this->soft_target){
               /* reverse the rate control flags to favor a 'long time' strategy */
@@ -1285,6 +2009,16 @@ void ff2theora_output(ff2theora this) {
         info.sample_rate = this->sample_rate;
         info.vorbis_quality = this->audio_quality * 0.1;
         info.vorbis_bitrate = this->audio_bitrate;
+        if (audio_copy) {
+            ogg_packet headers[3];
+            if (split_xiph_headers(aenc->extradata, aenc->extradata_size, headers) < 0 ||
+                oggmux_copy_vorbis_headers(&info, headers) < 0) {
+                fprintf(stderr, "ERROR: Unable to read the Vorbis headers of the input.\n");
+                exit(1);
+            }
+            this->channels = info.channels;
+            this->sample_rate = info.sample_rate;
+        }
         /* subtitles */
 #ifdef HAVE_KATE
         if (info.passno != 1) {
@@ -1339,6 +2073,11 @@ void ff2theora_output(ff2theora this) {
 #endif
 
         oggmux_init(&info);
+        /* a resumed encode goes on at the keyframe of its checkpoint */
+        if (info.resume && info.passno != 1) {
+            this->start_time += info.resume_time / 1000.0;
+            synced = 0;
+        }
         /*seek to start time*/
         if (this->start_time) {
             int64_t timestamp = this->start_time * AV_TIME_BASE;
@@ -1359,7 +2098,7 @@ void ff2theora_output(ff2theora this) {
             }
         }
 
-        if (this->framerate_new.num > 0) {
+        if (this->framerate_new.num > 0 && !video_copy) {
             double framerate_new = av_q2d(this->framerate_new);
             framerate_add = framerate_new/this->fps;
             //fprintf(stderr, "calculating framerate addition to %f\n",framerate_add);
@@ -1377,16 +2116,55 @@ void ff2theora_output(ff2theora this) {
 
         av_init_packet(&avpkt);
 
+        /* the first pass does not need anything but the video, let the
+           demuxer drop all other packets */
+        if (info.passno == 1 && this->video_index >= 0) {
+            for (i = 0; i < this->context->nb_streams; i++) {
+                if (i != this->video_index)
+                    this->context->streams[i]->discard = AVDISCARD_ALL;
+            }
+        }
+
+        /* second pass gets its video frames from the cache, only audio
+           and subtitles have to be decoded again */
+        if (info.passno == 2 && !info.audio_only && !info.resume &&
+            frame_cache_usable(this->frame_cache)) {
+            replay = 1;
+            vstream->discard = AVDISCARD_ALL;
+        }
+
+        /* from here on, wait for a growing input instead of ending at its
+           current end; the duration is estimated from how much it grew */
+        if (this->follow) {
+            follow_input_start(this->follow);
+            start_duration = info.duration;
+        }
+
+        /* get the next input ready while this one is encoded */
+        open_next_input(this);
+
         /* main decoding loop */
         do{
+            if (this->follow && this->follow->start_size > 0 && start_duration > 0)
+                info.duration = start_duration * this->follow->size / this->follow->start_size;
             ret = av_read_frame(this->context, &pkt);
             avpkt.size = pkt.size;
             avpkt.data = pkt.data;
 
+            /* at the end of an input followed by another one, only the
+               decoders are drained */
+            if (ret < 0 && this->next_context &&
+                !(no_frames > 0 && this->frame_count + dup_run >= no_frames)) {
+                draining = 1;
+                avpkt.size = 0;
+                avpkt.data = NULL;
+                pkt.dts = AV_NOPTS_VALUE;
+            }
+
             if (ret<0) {
-                if (!info.video_only)
+                if (!draining && !info.video_only)
                     audio_eos = 1;
-                if (!info.audio_only)
+                if (!draining && !info.audio_only)
                     video_eos = 1;
             }
             else {
@@ -1401,8 +2179,8 @@ void ff2theora_output(ff2theora this) {
                       pipe data to decoder, needed to have
                       first frame decodec in case its not a keyframe
                     */
-                    if (pkt.stream_index == this->video_index) {
-                      avcodec_decode_video2(venc, frame, &got_frame, &pkt);
+                    if (pkt.stream_index == this->video_index && !replay && !video_copy) {
+                      avcodec_decode_video2(venc, decode_frame, &got_frame, &pkt);
                     }
                     av_free_packet (&pkt);
                     continue;
@@ -1410,32 +2188,83 @@ void ff2theora_output(ff2theora this) {
             }
 
             /* check for end time */
-            if (no_frames > 0 && this->frame_count == no_frames) {
+            if (no_frames > 0 && this->frame_count + dup_run >= no_frames) {
                 video_eos = 1;
             }
 
-            if ((video_eos && !video_done) || (ret >= 0 && pkt.stream_index == this->video_index)) {
+            if (video_copy && !video_done) {
+                /* a passed through stream has to start with a keyframe */
+                if (ret >= 0 && pkt.stream_index == this->video_index &&
+                    !video_eos && (this->frame_count > 0 || (pkt.flags & AV_PKT_FLAG_KEY))) {
+                    if (this->frame_count == 0)
+                        copy_start = packet_time(vstream, &pkt);
+                    oggmux_copy_video(&info, pkt.data, pkt.size, 0);
+                    this->frame_count++;
+                }
+                if (video_eos) {
+                    oggmux_copy_video(&info, NULL, 0, 1);
+                    video_done = 1;
+                }
+            }
+            else if (!replay && ((video_eos && !video_done) || (draining && !info.audio_only) ||
+                                 (ret >= 0 && pkt.stream_index == this->video_index))) {
                 if (avpkt.size == 0 && !first && !video_eos) {
                     //fprintf (stderr, "no frame available\n");
                 }
-                while(video_eos || avpkt.size > 0) {
+                while(video_eos || draining || avpkt.size > 0) {
                     int dups = 0;
                     static th_ycbcr_buffer ycbcr;
-                    len1 = avcodec_decode_video2(venc, frame, &got_frame, &avpkt);
+                    th_ycbcr_buffer next_ycbcr;
+                    len1 = avcodec_decode_video2(venc, decode_frame, &got_frame, &avpkt);
                     if (len1>=0) {
+                        AVFrame *picture = frame;
+                        int64_t picture_dts = pkt.dts;
+                        /* pictures of later inputs get the size and
+                           format of the first */
+                        if (got_frame && decode_frame != frame) {
+                            sws_scale(this->input_sws_ctx,
+                                (const uint8_t * const*)decode_frame->data, decode_frame->linesize,
+                                0, venc->height, frame->data, frame->linesize);
+                            frame->interlaced_frame = decode_frame->interlaced_frame;
+                            frame->top_field_first = decode_frame->top_field_first;
+                        }
+                        if (ivtc) {
+                            /* film frames come out up to a cycle later,
+                               the last ones once the decoder is empty */
+                            AVPicture *film;
+                            if (got_frame && venc_pix_fmt != this->pix_fmt) {
+                                sws_scale(this->sws_colorspace_ctx,
+                                    (const uint8_t * const*)frame->data, frame->linesize, 0, display_height,
+                                    output_tmp->data, output_tmp->linesize);
+                                ivtc_push(ivtc, (AVPicture *)output_tmp, frame->top_field_first, pkt.dts);
+                            }
+                            else if (got_frame) {
+                                ivtc_push(ivtc, (AVPicture *)frame, frame->top_field_first, pkt.dts);
+                            }
+                            film = ivtc_pull(ivtc, &picture_dts, !got_frame && (video_eos || draining));
+                            got_frame = film != NULL;
+                            if (film) {
+                                for (i = 0; i < 4; i++) {
+                                    ivtc_frame->data[i] = film->data[i];
+                                    ivtc_frame->linesize[i] = film->linesize[i];
+                                }
+                                ivtc_frame->interlaced_frame = 0;
+                                picture = ivtc_frame;
+                            }
+                        }
                         if (got_frame) {
                             // this is disabled by default since it does not work
                             // for all input formats the way it should.
-                            if (this->sync == 1 && pkt.dts != AV_NOPTS_VALUE) {
+                            if (this->sync == 1 && picture_dts != AV_NOPTS_VALUE) {
                                 if (this->pts_offset == AV_NOPTS_VALUE) {
-                                    this->pts_offset = pkt.dts;
-                                    this->pts_offset_frame = this->frame_count;
+                                    this->pts_offset = picture_dts;
+                                    this->pts_offset_frame = this->frame_count + dup_run;
                                 }
 
                                 double fr = 1/av_q2d(this->framerate);
 
-                                double ivtime = (pkt.dts - this->pts_offset) * av_q2d(vstream->time_base);
-                                double ovtime = (this->frame_count - this->pts_offset_frame) / av_q2d(this->framerate);
+                                double ivtime = (picture_dts - this->pts_offset) * av_q2d(vstream->time_base);
+                                double ovtime = (this->frame_count + dup_run - this->pts_offset_frame) / av_q2d(this->framerate);
                                 double delta = ivtime - ovtime;
 
                                 /* it should be larger than half a frame to
@@ -1458,17 +2287,17 @@ void ff2theora_output(ff2theora this) {
                             //For audio only files command line option"-e" will not work
                             //as we don't increment frame_count in audio section.
 
-                            if (venc_pix_fmt != this->pix_fmt) {
+                            if (picture != ivtc_frame && venc_pix_fmt != this->pix_fmt) {
                                 sws_scale(this->sws_colorspace_ctx,
-                                (const uint8_t * const*)frame->data, frame->linesize, 0, display_height,
+                                (const uint8_t * const*)picture->data, picture->linesize, 0, display_height,
                                 output_tmp->data, output_tmp->linesize);
                             }
                             else{
-                                av_picture_copy((AVPicture *)output_tmp, (AVPicture *)frame, this->pix_fmt,
+                                av_picture_copy((AVPicture *)output_tmp, (AVPicture *)picture, this->pix_fmt,
                                                 display_width, display_height);
                                 output_tmp_p=NULL;
                             }
-                            if ((this->deinterlace==0 && frame->interlaced_frame) ||
+                            if ((this->deinterlace==0 && picture->interlaced_frame) ||
                                 this->deinterlace==1) {
                                 if (avpicture_deinterlace((AVPicture *)output,(AVPicture *)output_tmp,this->pix_fmt,display_width,display_height)<0) {
                                         fprintf(stderr, "Deinterlace failed.\n");
@@ -1531,37 +2360,84 @@ void ff2theora_output(ff2theora this) {
                     }
                     //now output_resized
 
+                    /* color corrections are applied to the new picture
+                       right away, so it can be compared to the buffered
+                       one as it will be encoded */
+                    if (got_frame)
+                        prepare_ycbcr_buffer(this, next_ycbcr, output_padded);
                     if (!first) {
-                        if (got_frame || video_eos) {
-                            prepare_ycbcr_buffer(this, ycbcr, output_buffered);
-                            if(dups>0) {
-                                //this only works if dups < keyint,
-                                //see http://theora.org/doc/libtheora-1.1/theoraenc_8h.html#a8bb9b05471c42a09f8684a2583b8a1df
-                                if (th_encode_ctl(info.td,TH_ENCCTL_SET_DUP_COUNT,&dups,sizeof(int)) == TH_EINVAL) {
-                                    int _dups = dups;
-                                    while(_dups--)
-                                        oggmux_add_video(&info, ycbcr, video_eos);
-                                }
-                            }
-                            oggmux_add_video(&info, ycbcr, video_eos);
-                            if(video_eos) {
+                        if (got_frame && !video_eos && this->dedup_threshold >= 0 &&
+                            same_picture(next_ycbcr, ycbcr, this->dedup_threshold)) {
+                            /* encoded once the picture changes */
+                            dup_run += dups + 1;
+                        }
+                        else if (got_frame || video_eos) {
+                            /* with --ivtc, the frames it still holds
+                               come after the decoder is empty */
+                            int e_o_s = video_eos && !(ivtc && got_frame);
+                            encode_video_frame(this, ycbcr, dup_run + dups, e_o_s);
+                            dup_run = 0;
+                            if(e_o_s) {
                                 video_done = 1;
                             }
-                            this->frame_count += dups+1;
-                            if (info.passno == 1)
-                                info.videotime = this->frame_count / av_q2d(this->framerate);
                         }
                     }
-                    if (got_frame) {
+                    if (got_frame && (first || dup_run == 0)) {
                         first=0;
                         av_picture_copy((AVPicture *)output_buffered, (AVPicture *)output_padded, this->pix_fmt, this->frame_width, this->frame_height);
+                        frame_ycbcr(this, ycbcr, output_buffered);
                     }
                     if (!got_frame) {
                         break;
                     }
                 }
             }
-            if (info.passno!=1)
+            /* with --vcopy the audio before the first keyframe is dropped,
+               and the rest starts where it belongs relative to it */
+            if (ret >= 0 && pkt.stream_index == this->audio_index && video_copy &&
+                info.passno != 1 && !audio_started) {
+                double t = packet_time(astream, &pkt);
+                double end = t + pkt.duration * av_q2d(astream->time_base);
+                if (this->frame_count == 0 || (t >= 0 && copy_start >= 0 && end <= copy_start)) {
+                    av_free_packet(&pkt);
+                    continue;
+                }
+                if (!audio_copy && t >= 0 && copy_start >= 0) {
+                    int64_t offset = (int64_t)rint((t - copy_start) * this->sample_rate);
+                    if (!audio_skip_p && !(audio_skip_p = malloc(this->channels * sizeof(uint8_t *)))) {
+                        fprintf(stderr, "ERROR: Out of memory.\n");
+                        exit(1);
+                    }
+                    if (offset > 0)
+                        add_silence(this, offset);
+                    else
+                        audio_skip = -offset;
+                }
+                audio_started = 1;
+            }
+            if (audio_copy && !audio_done) {
+                if (ret >= 0 && pkt.stream_index == this->audio_index && !audio_eos) {
+                    ogg_int64_t granulepos = -1;
+                    double t = packet_time(astream, &pkt);
+                    if (copy_start < 0)
+                        copy_start = t;
+                    if (t >= 0 && copy_start >= 0 && pkt.duration > 0) {
+                        granulepos = (ogg_int64_t)rint((t - copy_start +
+                            pkt.duration * av_q2d(astream->time_base)) * this->sample_rate);
+                        if (granulepos < 0)
+                            granulepos = -1;
+                    }
+                    oggmux_copy_audio(&info, pkt.data, pkt.size, granulepos, 0);
+                    this->sample_count = info.vorbis_granulepos;
+                    if (no_samples > 0 && this->sample_count >= no_samples)
+                        audio_eos = 1;
+                }
+                if (audio_eos) {
+                    oggmux_copy_audio(&info, NULL, 0, -1, 1);
+                    audio_done = 1;
+                }
+            }
+            else if (info.passno!=1)
               if ((audio_eos && !audio_done) || (ret >= 0 && pkt.stream_index == this->audio_index)) {
                 while((audio_eos && !audio_done) || avpkt.size > 0 ) {
                     int bytes_per_sample = av_get_bytes_per_sample(aenc->sample_fmt);
@@ -1609,6 +2485,15 @@ void ff2theora_output(ff2theora this) {
                         avpkt.data += len1;
                     }
                     if(got_frame || audio_eos) {
+                        if (got_frame && audio_skip > 0) {
+                            /* the previous input had more audio than video */
+                            int skip = audio_skip < dst_nb_samples ? audio_skip : dst_nb_samples;
+                            for (i = 0; i < this->channels; i++)
+                                audio_skip_p[i] = audio_p[i] + skip * sizeof(float);
+                            audio_p = audio_skip_p;
+                            dst_nb_samples -= skip;
+                            audio_skip -= skip;
+                        }
                         if (!got_frame) {
                             dst_nb_samples = 0;
                         } else if (no_samples > 0 && this->sample_count + dst_nb_samples > no_samples) {
@@ -1631,8 +2516,146 @@ void ff2theora_output(ff2theora this) {
                     }
                 }
             }
+            if (replay && !video_done) {
+                /* keep cached video interleaved with the decoded audio,
+                   once the input is exhausted push out the rest */
+                while (!video_done && (audio_done || (ret < 0 && !draining) ||
+                       this->frame_count / av_q2d(this->framerate) <= (double)this->sample_count / this->sample_rate + 0.5)) {
+                    int dups, e_o_s;
+                    static th_ycbcr_buffer ycbcr;
+                    int r = frame_cache_read(this->frame_cache, ycbcr, &dups, &e_o_s);
+                    if (r < 0) {
+                        fprintf(stderr, "Error reading frame cache.\n");
+                        exit(1);
+                    }
+                    if (r == 0) {
+                        video_done = 1;
+                        break;
+                    }
+                    encode_video_frame(this, ycbcr, dups, e_o_s);
+                    if (e_o_s) {
+                        video_done = 1;
+                    }
+                    oggmux_flush (&info, audio_eos);
+                }
+            }
+
+            if (draining) {
+                /* keep audio and video in step across the inputs */
+                if (!info.audio_only && !info.video_only && info.passno != 1) {
+                    int64_t frames = this->frame_count + dup_run + (first ? 0 : 1);
+                    int64_t pad = (int64_t)(frames / av_q2d(this->framerate) * this->sample_rate)
+                                  - this->sample_count;
+                    if (pad > 0)
+                        add_silence(this, pad);
+                    else
+                        audio_skip = -pad;
+                }
+
+                /* done with this input and its decoders */
+                if (venc && avcodec_is_open(venc))
+                    avcodec_close(venc);
+                if (aenc && avcodec_is_open(aenc))
+                    avcodec_close(aenc);
+                if (swr_ctx)
+                    swr_free(&swr_ctx);
+                for (i = 0; i < this->context->nb_streams && !later_input; i++) {
+                    if (subtitles_opened[i])
+                        avcodec_close(this->context->streams[i]->codec);
+                    subtitles_opened[i] = 0;
+                }
+                avformat_close_input(&this->context);
+                this->context = this->next_context;
+                this->next_context = NULL;
+                this->next_input++;
+                later_input = 1;
+
+                /* take the same kinds of streams from the next one */
+                this->video_index = this->audio_index = -1;
+                for (i = 0; i < this->context->nb_streams; i++) {
+                    AVCodecContext *enc = this->context->streams[i]->codec;
+                    if (enc->codec_type == AVMEDIA_TYPE_VIDEO && this->video_index < 0)
+                        this->video_index = i;
+                    else if (enc->codec_type == AVMEDIA_TYPE_AUDIO && this->audio_index < 0)
+                        this->audio_index = i;
+                }
+                if ((!info.audio_only && this->video_index < 0) ||
+                    (!info.video_only && this->audio_index < 0)) {
+                    fprintf(stderr, "ERROR: `%s' doesn't have the same kinds of streams as the first input.\n",
+                                    this->input_names[this->next_input - 1]);
+                    exit(1);
+                }
+                if (info.audio_only)
+                    this->video_index = -1;
+                if (info.video_only || info.passno == 1)
+                    this->audio_index = -1;
+                for (i = 0; i < this->context->nb_streams; i++) {
+                    if (i != this->video_index && i != this->audio_index)
+                        this->context->streams[i]->discard = AVDISCARD_ALL;
+                }
+                if (this->video_index >= 0) {
+                    vstream = this->context->streams[this->video_index];
+                    venc = vstream->codec;
+                    vcodec = avcodec_find_decoder(venc->codec_id);
+                    venc->thread_count = 1;
+                    if (replay) {
+                        vstream->discard = AVDISCARD_ALL;
+                    }
+                    else {
+                        if (vcodec == NULL || avcodec_open2(venc, vcodec, NULL) < 0) {
+                            fprintf(stderr, "ERROR: Unable to decode the video of `%s'.\n",
+                                            this->input_names[this->next_input - 1]);
+                            exit(1);
+                        }
+                        this->input_sws_ctx = sws_getCachedContext(this->input_sws_ctx,
+                                            venc->width, venc->height, venc->pix_fmt,
+                                            display_width, display_height, venc_pix_fmt,
+                                            SWS_BICUBIC, NULL, NULL, NULL);
+                        if (!scaled_input_p)
+                            scaled_input_p = frame_alloc(venc_pix_fmt, display_width, display_height);
+                        if (!decode_frame_p)
+                            decode_frame_p = avcodec_alloc_frame();
+                        frame = scaled_input_p;
+                        decode_frame = decode_frame_p;
+                    }
+                    this->pts_offset = AV_NOPTS_VALUE;
+                }
+                if (this->audio_index >= 0) {
+                    astream = this->context->streams[this->audio_index];
+                    aenc = astream->codec;
+                    acodec = avcodec_find_decoder(aenc->codec_id);
+                    aenc->thread_count = 1;
+                    if (acodec == NULL || avcodec_open2(aenc, acodec, NULL) < 0) {
+                        fprintf(stderr, "ERROR: Unable to decode the audio of `%s'.\n",
+                                        this->input_names[this->next_input - 1]);
+                        exit(1);
+                    }
+                    if (this->sample_rate != aenc->sample_rate
+                        || this->channels != aenc->channels
+                        || aenc->sample_fmt != AV_SAMPLE_FMT_FLTP) {
+                        swr_ctx = open_resampler(this, aenc);
+                        if (!dst_audio_data) {
+                            dst_audio_data = calloc(this->channels, sizeof(uint8_t *));
+                            max_dst_nb_samples = 0;
+                        }
+                    }
+                    if (!audio_skip_p)
+                        audio_skip_p = malloc(this->channels * sizeof(uint8_t *));
+                    if (!dst_audio_data || !audio_skip_p) {
+                        fprintf(stderr, "ERROR: Out of memory.\n");
+                        exit(1);
+                    }
+                }
+                if (!info.frontend)
+                    fprintf(stderr, "\n  Input #%d: %s\n", this->next_input,
+                                    this->input_names[this->next_input - 1]);
+                open_next_input(this);
+                draining = 0;
+                ret = 0;
+                continue;
+            }
 
-            if (info.passno!=1)
+            if (info.passno!=1 && !later_input)
             if (this->included_subtitles && subtitles_enabled[pkt.stream_index] && is_supported_subtitle_stream(this, pkt.stream_index, this->included_subtitles)) {
               AVStream *stream=this->context->streams[pkt.stream_index];
               AVCodecContext *enc = stream->codec;
@@ -1780,6 +2803,10 @@ void ff2theora_output(ff2theora this) {
             av_free_packet (&pkt);
         } while (ret >= 0 && !(audio_done && video_done));
 
+        if (info.passno == 1 && this->frame_cache) {
+            frame_cache_finish(this->frame_cache);
+        }
+
         if (info.passno != 1) {
 #ifdef HAVE_KATE
           for (i=0; i<this->n_kate_streams; ++i) {
@@ -1792,7 +2819,7 @@ void ff2theora_output(ff2theora this) {
           }
 #endif
 
-          if (this->included_subtitles) {
+          if (this->included_subtitles && !later_input) {
             for (i = 0; i < this->context->nb_streams; i++) {
               if (subtitles_opened[i]) {
                 AVCodecContext *enc = this->context->streams[i]->codec;
@@ -1802,13 +2829,16 @@ void ff2theora_output(ff2theora this) {
           }
         }
 
-        if (this->video_index >= 0) {
+        /* decoders stay open if the input is reused for the second pass,
+           see ff2theora_close_input() */
+        if (this->video_index >= 0 && !(info.twopass == 3 && info.passno == 1)) {
             avcodec_close(venc);
         }
         if (this->audio_index >= 0) {
             if (swr_ctx)
                 swr_free(&swr_ctx);
-            avcodec_close(aenc);
+            if (!(info.twopass == 3 && info.passno == 1) && avcodec_is_open(aenc))
+                avcodec_close(aenc);
         }
 
         /* Write the index out to disk. */
@@ -1816,6 +2846,11 @@ void ff2theora_output(ff2theora this) {
             write_seek_index (&info);
         }
 
+        /* after write_seek_index(), which may have moved the content */
+        if (info.passno != 1 && info.index_sidecar) {
+            write_index_sidecar (&info);
+        }
+
         oggmux_close(&info);
         if (ppContext)
             pp_free_context(ppContext);
@@ -1827,7 +2862,14 @@ void ff2theora_output(ff2theora this) {
             frame_dealloc(output_buffered_p);
             frame_dealloc(output_cropped_p);
             frame_dealloc(output_padded_p);
+            frame_dealloc(scaled_input_p);
+            av_free(decode_frame_p);
+            ivtc_filter_free(ivtc);
+            av_free(ivtc_frame);
+            scene_lookahead_free(this->lookahead);
+            this->lookahead = NULL;
         }
+        free(audio_skip_p);
         if (dst_audio_data) {
             av_freep(&dst_audio_data[0]);
             free(dst_audio_data);
@@ -1843,16 +2885,67 @@ void ff2theora_output(ff2theora this) {
     }
 }
 
-void ff2theora_close(ff2theora this) {
+/* Rewind an input that was kept open after the first pass of --two-pass.
+   Returns 0 on success, -1 if the input has to be opened again. */
+static int ff2theora_rewind(ff2theora this) {
+    int64_t timestamp = 0;
+    unsigned int i;
+
+    /* the first pass ended with the last input open */
+    if (this->num_inputs > 1)
+        return -1;
+    if (using_stdin || !this->context->pb || !this->context->pb->seekable)
+        return -1;
+    if (this->context->start_time != AV_NOPTS_VALUE)
+        timestamp = this->context->start_time;
+    if (av_seek_frame(this->context, -1, timestamp, AVSEEK_FLAG_BACKWARD) < 0)
+        return -1;
+    for (i = 0; i < this->context->nb_streams; i++) {
+        AVCodecContext *enc = this->context->streams[i]->codec;
+        this->context->streams[i]->discard = AVDISCARD_DEFAULT;
+        if (avcodec_is_open(enc))
+            avcodec_flush_buffers(enc);
+    }
+    return 0;
+}
+
+/* Close the input along with its decoders and scalers. */
+static void ff2theora_close_input(ff2theora this) {
+    unsigned int i;
+
+    for (i = 0; i < this->context->nb_streams; i++) {
+        AVCodecContext *enc = this->context->streams[i]->codec;
+        if (avcodec_is_open(enc))
+            avcodec_close(enc);
+    }
     sws_freeContext(this->sws_colorspace_ctx);
     sws_freeContext(this->sws_scale_ctx);
+    sws_freeContext(this->input_sws_ctx);
     this->sws_colorspace_ctx = NULL;
     this->sws_scale_ctx = NULL;
+    this->input_sws_ctx = NULL;
+    this->prepared = 0;
+    avformat_close_input(&this->context);
+    if (this->next_context)
+        avformat_close_input(&this->next_context);
+    if (this->follow)
+        follow_input_close(this->follow);
+}
+
+void ff2theora_close(ff2theora this) {
     /* clear out state */
     if (info.passno != 1)
       free_subtitles(this);
-    this->context = NULL;
+    if (info.passno == 2 && this->frame_cache) {
+        frame_cache_close(this->frame_cache);
+        free(this->frame_cache);
+        this->frame_cache = NULL;
+    }
     if (info.twopass != 3) {
+        int i;
+        for (i = 0; i < this->num_inputs; i++)
+            free(this->input_names[i]);
+        free(this->input_names);
         free(this);
     }
 }
@@ -1968,7 +3061,10 @@ static void print_resize_help(void)
   }
 }
 
-void copy_metadata(const AVFormatContext *av)
+/* Adds the tags of |metadata| to the comment headers, all of them if |all|
+   is set, else only the well-known ones. Tags given on the command line
+   are kept. */
+static void copy_metadata_tags(AVDictionary *metadata, int all)
 {
     static const char *allowed[] = {
         "TITLE",
@@ -1990,8 +3086,8 @@ void copy_metadata(const AVFormatContext *av)
         "AUTHOR"
     };
     AVDictionaryEntry *tag = NULL;
-    while ((tag = av_dict_get(av->metadata, "", tag, AV_DICT_IGNORE_SUFFIX))) {
-        char uc_key[16];
+    while ((tag = av_dict_get(metadata, "", tag, AV_DICT_IGNORE_SUFFIX))) {
+        char uc_key[64];
         int i;
         for (i = 0; tag->key[i] != '\0' && i < LENGTH(uc_key) - 1; i++)
             uc_key[i] = toupper(tag->key[i]);
@@ -2000,7 +3096,8 @@ void copy_metadata(const AVFormatContext *av)
         for (i = 0; i < LENGTH(allowed); i++)
             if (!strcmp(uc_key, allowed[i]))
                 break;
-        if (i != LENGTH(allowed)) {
+        /* the encoder tag is always our own */
+        if (i != LENGTH(allowed) || (all && strcmp(uc_key, "ENCODER"))) {
             if (!strcmp(uc_key, "AUTHOR"))
                 strcpy(uc_key, "ARTIST");
             if (th_comment_query(&info.tc, uc_key, 0) == NULL) {
@@ -2011,6 +3108,54 @@ void copy_metadata(const AVFormatContext *av)
     }
 }
 
+/* Adds the metadata of the input to the comment headers. A remuxed input
+   keeps all comments of its Theora and Vorbis streams. */
+void copy_metadata(const AVFormatContext *av, int remux)
+{
+    unsigned int i;
+
+    copy_metadata_tags(av->metadata, remux);
+    if (!remux)
+        return;
+    for (i = 0; i < av->nb_streams; i++) {
+        enum AVCodecID codec_id = av->streams[i]->codec->codec_id;
+        if (codec_id == AV_CODEC_ID_THEORA || codec_id == AV_CODEC_ID_VORBIS)
+            copy_metadata_tags(av->streams[i]->metadata, 1);
+    }
+}
+
+/* Returns the number of Kate streams an Ogg file has, which libavformat
+   doesn't read, or 0 if the file can't be read. */
+static int count_ogg_kate_streams(const char *filename)
+{
+    unsigned char header[27 + 255], body[8];
+    int count = 0;
+    FILE *f = fopen(filename, "rb");
+
+    if (!f)
+        return 0;
+    /* all streams start on the first pages */
+    while (fread(header, 1, 27, f) == 27 && !memcmp(header, "OggS", 4) &&
+           (header[5] & 0x02)) {
+        long len = 0;
+        int i;
+        if (fread(header + 27, 1, header[26], f) != header[26])
+            break;
+        for (i = 0; i < header[26]; i++)
+            len += header[27 + i];
+        if (len >= 8) {
+            if (fread(body, 1, 8, f) != 8)
+                break;
+            if (!memcmp(body, "\x80kate\0\0\0", 8))
+                count++;
+            len -= 8;
+        }
+        if (fseek(f, len, SEEK_CUR) < 0)
+            break;
+    }
+    fclose(f);
+    return count;
+}
 
 void print_presets_info() {
     fprintf(stdout,
@@ -2038,6 +3183,64 @@ void print_presets_info() {
         );
 }
 
+/* Returns the total duration of the inputs after the first, in seconds. */
+static double inputs_duration(ff2theora this) {
+    AVFormatContext *context;
+    double duration = 0;
+    int i;
+
+    for (i = 1; i < this->num_inputs; i++) {
+        context = NULL;
+        if (avformat_open_input(&context, this->input_names[i], NULL, NULL) < 0) {
+            fprintf(stderr, "\nFile `%s' does not exist or has an unknown format.\n",
+                            this->input_names[i]);
+            exit(1);
+        }
+        if (avformat_find_stream_info(context, NULL) >= 0 &&
+            context->duration != AV_NOPTS_VALUE)
+            duration += (double)context->duration / AV_TIME_BASE;
+        avformat_close_input(&context);
+    }
+    return duration;
+}
+
+/* Adds an input to be encoded after the ones added before. */
+static void add_input(ff2theora this, const char *name) {
+    this->input_names = realloc(this->input_names,
+                                (this->num_inputs + 1) * sizeof(char *));
+    if (!this->input_names || !(this->input_names[this->num_inputs] = strdup(name))) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        exit(1);
+    }
+    this->num_inputs++;
+}
+
+/* Adds the inputs listed in a playlist, one per line. Empty lines and
+   lines starting with # are skipped, relative names are relative to the
+   playlist. */
+static void read_playlist(ff2theora this, const char *playlist) {
+    char line[1024], name[2048];
+    const char *slash = strrchr(playlist, '/');
+    int dir_len = slash ? slash - playlist + 1 : 0;
+    FILE *f = fopen(playlist, "r");
+
+    if (!f) {
+        fprintf(stderr, "ERROR: Unable to open playlist `%s'.\n", playlist);
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (!*line || *line == '#')
+            continue;
+        if (*line == '/' || strstr(line, "://"))
+            snprintf(name, sizeof(name), "%s", line);
+        else
+            snprintf(name, sizeof(name), "%.*s%s", dir_len, playlist, line);
+        add_input(this, name);
+    }
+    fclose(f);
+}
+
 void print_usage() {
     th_info ti;
     th_enc_ctx *td;
@@ -2066,12 +3269,38 @@ void print_usage() {
 
     fprintf(stdout,
         "\n\n"
-        "  Usage: " PACKAGE " [options] input\n"
+        "  Usage: " PACKAGE " [options] input [input ...]\n"
         "\n"
         "General output options:\n"
         "  -o, --output           alternative output filename\n"
         "      --no-skeleton      disables ogg skeleton metadata output\n"
         "      --skeleton-3       outputs Skeleton Version 3, without keyframe indexes\n"
+        "      --segment-time <n> split the output into files of about <n> seconds,\n"
+        "                         each starting on a keyframe and with its own\n"
+        "                         index: output-00000.ogv, output-00001.ogv, ...,\n"
+        "                         listed in output.m3u as they are completed\n"
+        "      --segment-size <n> split the output into files of about <n> MB\n"
+        "      --page-size <n>    collect <n> bytes of a stream for an Ogg page,\n"
+        "                         larger pages have less overhead (default: up to\n"
+        "                         libogg, about 4 kB)\n"
+        "      --page-duration <n>\n"
+        "                         end a page once it spans <n> ms (default: 1000,\n"
+        "                         0 for no limit)\n"
+        "      --interleave-delay <n>\n"
+        "                         don't hold a page longer than <n> ms while\n"
+        "                         waiting for the other stream, at the cost of\n"
+        "                         audio and video getting out of order (default: 0,\n"
+        "                         wait for both). For live streaming try\n"
+        "                         --page-duration 250 --interleave-delay 500, for\n"
+        "                         archival --page-size 65000 --page-duration 0\n"
+        "      --tee <file>       also write the stream to <file> or a pipe, - for\n"
+        "                         standard output; can be given more than once\n"
+        "      --http-port <n>    serve the stream live at http://127.0.0.1:<n>/\n"
+        "      --checkpoint <n>   every <n> seconds, update the index and record\n"
+        "                         where to resume in output.checkpoint\n"
+        "      --resume           go on with an encode that didn't finish, from its\n"
+        "                         last checkpoint; use the same options otherwise,\n"
+        "                         --second-pass instead of --two-pass\n"
         "  -s, --starttime        start encoding at this time (in sec.)\n"
         "  -e, --endtime          end encoding at this time (in sec.)\n"
         "  -p, --preset           encode file with preset.\n"
@@ -2082,6 +3311,11 @@ void print_usage() {
         "  -v, --videoquality     [0 to 10] encoding quality for video (default: 6)\n"
         "                                   use higher values for better quality\n"
         "  -V, --videobitrate     encoding bitrate for video (kb/s)\n"
+        "      --auto-quality <target>  choose the video quality that meets\n"
+        "                         <target>, bpp=<bits per pixel> or size=<MB>\n"
+        "                         of the video stream, from trial encodes of\n"
+        "                         samples of the input. Replaces -v, -V and the\n"
+        "                         quality of presets\n"
         "      --soft-target      Use a large reservoir and treat the rate\n"
         "                         as a soft target; rate control is less\n"
         "                         strict but resulting quality is usually\n"
@@ -2101,6 +3335,15 @@ void print_usage() {
         "                         data must come from a first encoding pass\n"
         "                         using identical input video to work\n"
         "                         properly.\n\n"
+        "      --frame-cache <MB> With --two-pass, keep the frames of the first\n"
+        "                         pass in a temporary file of at most <MB>\n"
+        "                         megabytes (0 for no limit), so the second\n"
+        "                         pass does not have to decode and filter\n"
+        "                         the video again. If the cache fills up,\n"
+        "                         the second pass decodes the input as usual.\n"
+        "      --frame-cache-compress  compress the frame cache (zlib)\n"
+        "      --fast-first-pass  use the fastest speedlevel for the first pass\n"
+        "                         of --two-pass or --first-pass\n\n"
         "      --optimize         optimize video output filesize (slower)\n"
         "                         (same as speedlevel 0)\n"
         "      --speedlevel       encoding is faster with higher values\n"
@@ -2118,7 +3361,17 @@ void print_usage() {
         "  -F, --framerate        output framerate e.g 25:2 or 16\n"
         "      --croptop, --cropbottom, --cropleft, --cropright\n"
         "                         crop input by given pixels before resizing\n"
+        "      --autocrop         crop black borders, found in frames from 20\n"
+        "                         places of the input, on the sides not cropped\n"
+        "                         by hand\n"
         "  -K, --keyint           [1 to 2147483647] keyframe interval (default: 64)\n"
+        "      --scene-cuts       put keyframes at scene cuts, found by looking\n"
+        "                         16 frames ahead; a regular keyframe may wait\n"
+        "                         that long for a cut to take its place\n"
+        "      --dedup <n>        [0 to 255] don't encode frames again that are\n"
+        "                         the same as the one before, within <n> per pixel\n"
+        "                         in every 8x8 block. Saves time and bits on static\n"
+        "                         content like screen recordings or slides\n"
         "  -d --buf-delay <n>     Buffer delay (in frames). Longer delays\n"
         "                         allow smoother rate adaptation and provide\n"
         "                         better overall quality, but require more\n"
@@ -2158,6 +3411,8 @@ void print_usage() {
         "      --deinterlace      force deinterlace, otherwise only material\n"
         "                          marked as interlaced will be deinterlaced\n"
         "      --no-deinterlace   force deinterlace off\n"
+        "      --ivtc             inverse telecine: encode film transferred to\n"
+        "                         29.97 fps video at its own 23.976 fps\n"
 #ifdef HAVE_FRAMEHOOK
         "      --vhook            you can use ffmpeg's vhook system, example:\n"
         "        ffmpeg2theora --vhook '/path/watermark.so -f wm.gif' input.dv\n"
@@ -2170,6 +3425,24 @@ void print_usage() {
         "                          use this to select another video stream\n"
         "      --nosync           do not use A/V sync from input container.\n"
         "                         try this if you have issues with A/V sync\n"
+        "      --vcopy            pass Theora video of the input through as it is,\n"
+        "                         without decoding and encoding it again\n"
+        "      --acopy            pass Vorbis audio of the input through as it is\n"
+        "      --remux            update an Ogg Theora/Vorbis file without encoding:\n"
+        "                         keep its streams and comments, add metadata,\n"
+        "                         subtitles and a new skeleton and index; Kate\n"
+        "                         streams of the input have to be replaced with\n"
+        "                         --subtitles\n"
+        "      --follow           the input is still being written: wait for it to\n"
+        "                         grow until input.done exists or it stops growing\n"
+        "      --follow-timeout <n>\n"
+        "                         with --follow, end once the input didn't grow\n"
+        "                         for <n> seconds (default: 30, 0 to only end\n"
+        "                         on input.done)\n"
+        "      --playlist <file>  encode the inputs listed in <file>, one per line,\n"
+        "                         after any given on the command line. All inputs\n"
+        "                         go into one output, with the size, frame rate\n"
+        "                         and audio settings of the first\n"
 #ifdef HAVE_KATE
         "Subtitles options:\n"
         "      --subtitles file                 use subtitles from the given file (SubRip (.srt) format)\n"
@@ -2186,6 +3459,9 @@ void print_usage() {
         "                                       (equivalent to --subtitles=none)\n"
         "      --subtitle-types=[all,text,spu,none]   select what subtitle types to include from the\n"
         "                                             input video (default text)\n"
+        "      --kate-page-window n             put subtitles starting within n ms of each\n"
+        "                                       other on one Ogg page (default 1000, 0 for\n"
+        "                                       a page per subtitle)\n"
         "\n"
 #endif
         "Metadata options:\n"
@@ -2203,9 +3479,23 @@ void print_usage() {
         "Keyframe indexing options:\n"
         "      --index-interval <n>         set minimum distance between indexed keyframes\n"
         "                                   to <n> ms (default: 2000)\n"
+        "      --index-max-bytes <n>        also index a keyframe once <n> bytes have\n"
+        "                                   passed since the previous one, to bound\n"
+        "                                   the data read when seeking; combine with a\n"
+        "                                   larger --index-interval to keep fewer\n"
+        "                                   keypoints in static scenes\n"
         "      --theora-index-reserve <n>   reserve <n> bytes for theora keyframe index\n"
         "      --vorbis-index-reserve <n>   reserve <n> bytes for vorbis keyframe index\n"
         "      --kate-index-reserve <n>     reserve <n> bytes for kate keyframe index\n"
+        "                                   with --two-pass, the reserved space is sized\n"
+        "                                   from the keyframes found in the first pass\n"
+        "      --index-sidecar <file>       also write the keyframe indexes to <file>,\n"
+        "                                   with a JSON manifest of keypoint byte ranges\n"
+        "                                   in <file>.json; works with non-seekable\n"
+        "                                   outputs like pipes\n"
+        "      --no-index-finalize          don't rewrite the output with an exactly\n"
+        "                                   sized index if the reserved space was too\n"
+        "                                   small or much too large\n"
         "\n"
         "Other options:\n"
 #ifndef _WIN32
@@ -2214,6 +3504,9 @@ void print_usage() {
         "  -P, --pid fname        write the process' id to a file\n"
         "  -h, --help             this message\n"
         "      --info             output json info about input file, use -o to save json to file\n"
+        "      --analyze          like --info, and decode the input once to add\n"
+        "                         frame count, borders, interlacing, scene cuts,\n"
+        "                         complexity, loudness, peak and silences\n"
         "      --frontend         print status information in json, one json dict per line\n"
         "\n"
         "\n"
@@ -2251,8 +3544,10 @@ int main(int argc, char **argv) {
     int  outputfile_set=0;
     char outputfile_name[1024];
     char inputfile_name[1024];
+    const char *playlist_name = NULL;
     char *str_ptr;
     int output_json = 0;
+    int analyze = 0;
     int output_filename_needs_building=0;
 
     static int flag = -1;
@@ -2270,7 +3565,31 @@ int main(int argc, char **argv) {
         {"no-skeleton",no_argument,&flag,NOSKELETON},
         {"skeleton-3",no_argument,&flag,SKELETON_3},
         {"index-interval",required_argument,&flag,INDEX_INTERVAL},
+        {"index-max-bytes",required_argument,&flag,INDEX_MAX_BYTES},
         {"theora-index-reserve",required_argument,&flag,THEORA_INDEX_RESERVE},
+        {"index-sidecar",required_argument,&flag,INDEX_SIDECAR_FLAG},
+        {"no-index-finalize",no_argument,&flag,NOINDEXFINALIZE_FLAG},
+        {"segment-time",required_argument,&flag,SEGMENT_TIME_FLAG},
+        {"segment-size",required_argument,&flag,SEGMENT_SIZE_FLAG},
+        {"page-size",required_argument,&flag,PAGE_SIZE_FLAG},
+        {"page-duration",required_argument,&flag,PAGE_DURATION_FLAG},
+        {"interleave-delay",required_argument,&flag,INTERLEAVE_DELAY_FLAG},
+        {"kate-page-window",required_argument,&flag,KATE_PAGE_WINDOW_FLAG},
+        {"tee",required_argument,&flag,TEE_FLAG},
+        {"http-port",required_argument,&flag,HTTP_PORT_FLAG},
+        {"checkpoint",required_argument,&flag,CHECKPOINT_FLAG},
+        {"resume",no_argument,&flag,RESUME_FLAG},
+        {"follow",no_argument,&flag,FOLLOW_FLAG},
+        {"follow-timeout",required_argument,&flag,FOLLOW_TIMEOUT_FLAG},
+        {"vcopy",no_argument,&flag,VCOPY_FLAG},
+        {"acopy",no_argument,&flag,ACOPY_FLAG},
+        {"remux",no_argument,&flag,REMUX_FLAG},
+        {"playlist",required_argument,&flag,PLAYLIST_FLAG},
+        {"dedup",required_argument,&flag,DEDUP_FLAG},
+        {"ivtc",no_argument,&flag,IVTC_FLAG},
+        {"autocrop",no_argument,&flag,AUTOCROP_FLAG},
+        {"scene-cuts",no_argument,&flag,SCENE_CUTS_FLAG},
+        {"auto-quality",required_argument,&flag,AUTO_QUALITY_FLAG},
         {"vorbis-index-reserve",required_argument,&flag,VORBIS_INDEX_RESERVE},
         {"kate-index-reserve",required_argument,&flag,KATE_INDEX_RESERVE},
         {"format",required_argument,NULL,'f'},
@@ -2285,6 +3604,9 @@ int main(int argc, char **argv) {
         {"two-pass",0,&flag,TWOPASS_FLAG},
         {"first-pass",required_argument,&flag,FIRSTPASS_FLAG},
         {"second-pass",required_argument,&flag,SECONDPASS_FLAG},
+        {"frame-cache",required_argument,&flag,FRAMECACHE_FLAG},
+        {"frame-cache-compress",0,&flag,FRAMECACHE_COMPRESS_FLAG},
+        {"fast-first-pass",0,&flag,FASTFIRSTPASS_FLAG},
         {"keyint",required_argument,NULL,'K'},
         {"buf-delay",required_argument,NULL,'d'},
         {"deinterlace",0,&flag,DEINTERLACE_FLAG},
@@ -2333,6 +3655,7 @@ int main(int argc, char **argv) {
         {"frontend",0,&flag,FRONTEND_FLAG},
         {"frontendfile",required_argument,&flag,FRONTENDFILE_FLAG},
         {"info",no_argument,&flag,INFO_FLAG},
+        {"analyze",no_argument,&flag,ANALYZE_FLAG},
         {"artist",required_argument,&metadata_flag,0},
         {"title",required_argument,&metadata_flag,1},
         {"date",required_argument,&metadata_flag,2},
@@ -2573,6 +3896,134 @@ int main(int argc, char **argv) {
                             info.index_interval = atoi(optarg);
                             flag = -1;
                             break;
+                        case INDEX_MAX_BYTES:
+                            info.index_max_bytes = atoll(optarg);
+                            flag = -1;
+                            break;
+                        case INDEX_SIDECAR_FLAG:
+                            info.index_sidecar = optarg;
+                            flag = -1;
+                            break;
+                        case NOINDEXFINALIZE_FLAG:
+                            info.index_finalize = 0;
+                            flag = -1;
+                            break;
+                        case SEGMENT_TIME_FLAG:
+                            info.segment_time = (ogg_int64_t)(atof(optarg) * 1000);
+                            flag = -1;
+                            break;
+                        case SEGMENT_SIZE_FLAG:
+                            info.segment_size = (ogg_int64_t)(atof(optarg) * 1024 * 1024);
+                            flag = -1;
+                            break;
+                        case PAGE_SIZE_FLAG:
+                            info.page_size = atoi(optarg);
+                            flag = -1;
+                            break;
+                        case PAGE_DURATION_FLAG:
+                            info.page_duration = atoi(optarg);
+                            flag = -1;
+                            break;
+                        case INTERLEAVE_DELAY_FLAG:
+                            info.interleave_delay = atoi(optarg);
+                            flag = -1;
+                            break;
+                        case KATE_PAGE_WINDOW_FLAG:
+                            info.kate_page_window = atoi(optarg);
+                            flag = -1;
+                            break;
+                        case CHECKPOINT_FLAG:
+                            info.checkpoint_interval = (ogg_int64_t)(atof(optarg) * 1000);
+                            flag = -1;
+                            break;
+                        case RESUME_FLAG:
+                            info.resume = 1;
+                            flag = -1;
+                            break;
+                        case FOLLOW_FLAG:
+                            if (!convert->follow)
+                                convert->follow = (follow_input *)calloc(1, sizeof(follow_input));
+                            flag = -1;
+                            break;
+                        case VCOPY_FLAG:
+                            convert->video_copy = 1;
+                            flag = -1;
+                            break;
+                        case ACOPY_FLAG:
+                            convert->audio_copy = 1;
+                            flag = -1;
+                            break;
+                        case REMUX_FLAG:
+                            /* the input keeps its source hash */
+                            convert->remux = 1;
+                            convert->video_copy = 1;
+                            convert->audio_copy = 1;
+                            convert->disable_oshash = 1;
+                            flag = -1;
+                            break;
+                        case AUTO_QUALITY_FLAG:
+                            if (!strncmp(optarg, "bpp=", 4)) {
+                                convert->auto_quality = AUTO_QUALITY_BPP;
+                                convert->auto_quality_target = atof(optarg + 4);
+                            }
+                            else if (!strncmp(optarg, "size=", 5)) {
+                                convert->auto_quality = AUTO_QUALITY_SIZE;
+                                convert->auto_quality_target = atof(optarg + 5);
+                            }
+                            if (!convert->auto_quality || convert->auto_quality_target <= 0) {
+                                fprintf(stderr, "ERROR: --auto-quality takes bpp=<bits per pixel> or size=<MB>.\n");
+                                exit(1);
+                            }
+                            flag = -1;
+                            break;
+                        case SCENE_CUTS_FLAG:
+                            convert->scene_cuts = 1;
+                            flag = -1;
+                            break;
+                        case AUTOCROP_FLAG:
+                            convert->autocrop = 1;
+                            flag = -1;
+                            break;
+                        case IVTC_FLAG:
+                            convert->ivtc = 1;
+                            flag = -1;
+                            break;
+                        case DEDUP_FLAG:
+                            convert->dedup_threshold = atoi(optarg);
+                            if (convert->dedup_threshold < 0 || convert->dedup_threshold > 255) {
+                                fprintf(stderr, "ERROR: --dedup takes a value from 0 to 255.\n");
+                                exit(1);
+                            }
+                            flag = -1;
+                            break;
+                        case PLAYLIST_FLAG:
+                            playlist_name = optarg;
+                            flag = -1;
+                            break;
+                        case FOLLOW_TIMEOUT_FLAG:
+                            convert->follow_timeout = atoi(optarg);
+                            if (convert->follow_timeout < 0) {
+                                fprintf(stderr, "ERROR: --follow-timeout can't be negative.\n");
+                                exit(1);
+                            }
+                            flag = -1;
+                            break;
+                        case TEE_FLAG:
+                            if (!info.sinks)
+                                info.sinks = output_sinks_new();
+                            output_sinks_add_tee(info.sinks, optarg);
+                            flag = -1;
+                            break;
+                        case HTTP_PORT_FLAG:
+                            if (!info.sinks)
+                                info.sinks = output_sinks_new();
+                            info.sinks->http_port = atoi(optarg);
+                            if (info.sinks->http_port <= 0 || info.sinks->http_port > 65535) {
+                                fprintf(stderr, "ERROR: --http-port has to be between 1 and 65535.\n");
+                                exit(1);
+                            }
+                            flag = -1;
+                            break;
                         case THEORA_INDEX_RESERVE:
                             info.theora_index_reserve = atoi(optarg);
                             flag = -1;
@@ -2588,6 +4039,28 @@ int main(int argc, char **argv) {
                         case INFO_FLAG:
                             output_json = 1;
                             break;
+                        case ANALYZE_FLAG:
+                            output_json = 1;
+                            analyze = 1;
+                            flag = -1;
+                            break;
+                        case FRAMECACHE_FLAG:
+                            convert->frame_cache_size = atoi(optarg);
+                            if (convert->frame_cache_size < 0) {
+                                fprintf(stderr, "Frame cache size has to be positive, or 0 for no limit.\n");
+                                exit(1);
+                            }
+                            convert->frame_cache = (frame_cache *)calloc(1, sizeof(frame_cache));
+                            flag = -1;
+                            break;
+                        case FRAMECACHE_COMPRESS_FLAG:
+                            convert->frame_cache_compress = 1;
+                            flag = -1;
+                            break;
+                        case FASTFIRSTPASS_FLAG:
+                            convert->fast_first_pass = 1;
+                            flag = -1;
+                            break;
 #ifdef HAVE_KATE
                         case SUBTITLES_FLAG:
                             set_subtitles_file(convert,optarg);
@@ -2820,12 +4293,13 @@ int main(int argc, char **argv) {
         snprintf(outputfile_name, sizeof(outputfile_name), "-");
         outputfile_set = 1;
     }
-    if(optind<argc) {
-        /* assume that anything following the options must be a filename */
-        snprintf(inputfile_name,sizeof(inputfile_name),"%s",argv[optind]);
-        if (!strcmp(inputfile_name,"-")) {
-            snprintf(inputfile_name,sizeof(inputfile_name),"pipe:");
-        }
+    /* assume that anything following the options must be a filename */
+    for (; optind < argc; optind++)
+        add_input(convert, strcmp(argv[optind], "-") ? argv[optind] : "pipe:");
+    if (playlist_name)
+        read_playlist(convert, playlist_name);
+    if (convert->num_inputs > 0) {
+        snprintf(inputfile_name,sizeof(inputfile_name),"%s",convert->input_names[0]);
         if (outputfile_set!=1) {
             /* we'll create an output filename based on the input name, but not now, only
                when we know what types of streams we'll ouput, as the extension we'll add
@@ -2833,14 +4307,10 @@ int main(int argc, char **argv) {
             output_filename_needs_building = 1;
             outputfile_set=1;
         }
-        optind++;
     } else {
         fprintf(stderr, "ERROR: no input specified\n");
         exit(1);
     }
-    if(optind<argc) {
-        fprintf(stderr, "WARNING: Only one input file supported, others will be ignored\n");
-    }
 
     //FIXME: is using_stdin still neded? is it needed as global variable?
     using_stdin |= !strcmp(inputfile_name, "pipe:" ) ||
@@ -2850,6 +4320,96 @@ int main(int argc, char **argv) {
         fprintf(stderr, "You have to specify an output file with -o output.ogv.\n");
         exit(1);
     }
+    if (info.sinks && !output_json &&
+        (!strcmp(outputfile_name, "-") || !strcmp(outputfile_name, "/dev/stdout"))) {
+        int i;
+        for (i = 0; i < info.sinks->num_tees; i++) {
+            if (!strcmp(info.sinks->tees[i].name, "-")) {
+                fprintf(stderr, "ERROR: The output already goes to standard output, it can't be used with --tee -.\n");
+                exit(1);
+            }
+        }
+    }
+    if (convert->video_copy && info.twopass) {
+        fprintf(stderr, "ERROR: --vcopy doesn't encode the video, it can't be used with two-pass encoding.\n");
+        exit(1);
+    }
+    if ((convert->video_copy || convert->audio_copy) &&
+        (info.checkpoint_interval > 0 || info.resume)) {
+        fprintf(stderr, "ERROR: --checkpoint and --resume can't be used with --vcopy or --acopy.\n");
+        exit(1);
+    }
+    /* the first pass of --two-pass goes to a temporary file, which is gone
+       by the time the encode is resumed */
+    if (info.resume && info.twopass == 3) {
+        fprintf(stderr, "ERROR: --resume can't be used with --two-pass, "
+                        "use --first-pass and --second-pass instead.\n");
+        exit(1);
+    }
+    if (convert->ivtc && convert->framerate_new.num > 0) {
+        fprintf(stderr, "ERROR: --ivtc sets the frame rate, it can't be used with --framerate.\n");
+        exit(1);
+    }
+    if (convert->ivtc && convert->video_copy) {
+        fprintf(stderr, "ERROR: --ivtc can't be used with --vcopy.\n");
+        exit(1);
+    }
+    if (convert->follow && using_stdin) {
+        fprintf(stderr, "ERROR: --follow needs an input file, not standard input.\n");
+        exit(1);
+    }
+    if (convert->num_inputs > 1) {
+        for (n = 0; n < convert->num_inputs; n++) {
+            if (!strcmp(convert->input_names[n], "pipe:") ||
+                !strcmp(convert->input_names[n], "/dev/stdin")) {
+                fprintf(stderr, "ERROR: Standard input can only be used as the only input.\n");
+                exit(1);
+            }
+        }
+        if (convert->follow) {
+            fprintf(stderr, "ERROR: --follow can only be used with a single input.\n");
+            exit(1);
+        }
+        if (convert->video_copy || convert->audio_copy) {
+            fprintf(stderr, "ERROR: --vcopy, --acopy and --remux can only be used with a single input.\n");
+            exit(1);
+        }
+        if (info.checkpoint_interval > 0 || info.resume) {
+            fprintf(stderr, "ERROR: --checkpoint and --resume can only be used with a single input.\n");
+            exit(1);
+        }
+    }
+    if (info.segment_time > 0 || info.segment_size > 0) {
+        if (!output_filename_needs_building &&
+            (!strcmp(outputfile_name, "-") || !strcmp(outputfile_name, "/dev/stdout"))) {
+            fprintf(stderr, "ERROR: Segmented output has to go to files, not standard output.\n");
+            exit(1);
+        }
+        if (info.index_sidecar) {
+            fprintf(stderr, "ERROR: --index-sidecar can't be used with segmented output.\n");
+            exit(1);
+        }
+        if (info.sinks) {
+            fprintf(stderr, "ERROR: --tee and --http-port can't be used with segmented output.\n");
+            exit(1);
+        }
+    }
+
+    if (info.checkpoint_interval > 0 || info.resume) {
+        if (!output_filename_needs_building &&
+            (!strcmp(outputfile_name, "-") || !strcmp(outputfile_name, "/dev/stdout"))) {
+            fprintf(stderr, "ERROR: Checkpoints need an output file, not standard output.\n");
+            exit(1);
+        }
+        if (info.segment_time > 0 || info.segment_size > 0) {
+            fprintf(stderr, "ERROR: --checkpoint and --resume can't be used with segmented output.\n");
+            exit(1);
+        }
+        if (info.resume && info.sinks) {
+            fprintf(stderr, "ERROR: --tee and --http-port can't be used with --resume.\n");
+            exit(1);
+        }
+    }
 
     if (convert->end_time>0 && convert->end_time <= convert->start_time) {
         fprintf(stderr, "End time has to be bigger than start time.\n");
@@ -2862,6 +4422,10 @@ int main(int argc, char **argv) {
         convert->keyint = info.twopass?256:64;
     }
 
+    if (convert->auto_quality && (convert->soft_target || convert->buf_delay > 0)) {
+        fprintf(stderr, "ERROR: --auto-quality can't be used with --soft-target or --buf-delay.\n");
+        exit(1);
+    }
     if (convert->soft_target) {
         if (convert->video_bitrate <= 0) {
           fprintf(stderr,"Soft rate target (--soft-target) requested without a bitrate (-V).\n");
@@ -2877,6 +4441,21 @@ int main(int argc, char **argv) {
                 convert->video_quality = rint(6*6.3); // default quality 5
         }
     }
+    if (convert->frame_cache || convert->frame_cache_compress) {
+        if (info.twopass != 3) {
+            fprintf(stderr, "Frame cache (--frame-cache) only works with --two-pass.\n");
+            exit(1);
+        }
+        if (!convert->frame_cache) {
+            fprintf(stderr, "--frame-cache-compress requires --frame-cache.\n");
+            exit(1);
+        }
+        if (frame_cache_open(convert->frame_cache, (ogg_int64_t)convert->frame_cache_size * 1024 * 1024,
+                             convert->frame_cache_compress) < 0) {
+            fprintf(stderr, "Unable to open temporary file for frame cache\n");
+            exit(1);
+        }
+    }
     if (convert->buf_delay>0 && convert->video_bitrate == 0) {
         fprintf(stderr, "Buffer delay can only be used with target bitrate (-V).\n");
         exit(1);
@@ -2891,8 +4470,11 @@ int main(int argc, char **argv) {
     }
 
     for(info.passno=(info.twopass==3?1:info.twopass);info.passno<=(info.twopass==3?2:info.twopass);info.passno++){
+    /* the second pass of --two-pass reuses the input of the first one if it could be rewound */
+    int reuse_input = convert->context != NULL;
+    convert->next_input = 1;
     //detect image sequences and set framerate if provided
-    if (!input_fmt || (input_fmt != NULL && strcmp(input_fmt->name, "video4linux") >= 0)) {
+    if (!reuse_input && (!input_fmt || (input_fmt != NULL && strcmp(input_fmt->name, "video4linux") >= 0))) {
         char buf[100];
         av_dict_set(&format_opts, "channel", "0", 0);
         if (convert->picture_width || convert->picture_height) {
@@ -2910,8 +4492,27 @@ int main(int argc, char **argv) {
             av_dict_set(&format_opts, "framerate", buf, 0);
         }
     }
-    if (avformat_open_input(&convert->context, inputfile_name, input_fmt, &format_opts) >= 0) {
-        if (avformat_find_stream_info(convert->context, NULL) >= 0) {
+    /* a growing input is read through our own I/O context, which waits
+       for more data at the end of the file once the encode started */
+    if (!reuse_input && convert->follow) {
+        follow_input_close(convert->follow);
+        if (follow_input_open(convert->follow, inputfile_name, convert->follow_timeout) < 0) {
+            fprintf(stderr, "\nFile `%s' does not exist or has an unknown format.\n", inputfile_name);
+            return(1);
+        }
+        convert->context = avformat_alloc_context();
+        convert->context->pb = convert->follow->pb;
+    }
+    if (reuse_input || avformat_open_input(&convert->context, inputfile_name, input_fmt, &format_opts) >= 0) {
+        if (reuse_input || avformat_find_stream_info(convert->context, NULL) >= 0) {
+                /* the subtitles would be lost without a word otherwise */
+                if (convert->remux && !reuse_input && convert->n_kate_streams == 0 &&
+                    count_ogg_kate_streams(inputfile_name) > 0) {
+                    fprintf(stderr, "ERROR: `%s' has Kate subtitles, which --remux can't keep. "
+                                    "Give them again with --subtitles to replace them.\n",
+                            inputfile_name);
+                    exit(1);
+                }
 
                 if (output_filename_needs_building) {
                     int i;
@@ -2951,35 +4552,76 @@ int main(int argc, char **argv) {
                     }
                 }
 
-                if(!convert->disable_oshash) {
+                if(!convert->disable_oshash && !reuse_input) {
 #ifdef WIN32
                     sprintf(info.oshash,"%016I64x", gen_oshash(inputfile_name));
 #else
                     sprintf(info.oshash,"%016qx", gen_oshash(inputfile_name));
 #endif
                 }
+                if (info.checkpoint_interval > 0 || info.resume) {
+                    /* the same for both passes of --two-pass */
+                    if (!info.checkpoint_name) {
+                        info.checkpoint_name = malloc(strlen(outputfile_name) + 12);
+                        sprintf(info.checkpoint_name, "%s.checkpoint", outputfile_name);
+                    }
+                    if (info.resume && oggmux_read_checkpoint(&info) == -1) {
+                        fprintf(stderr, "ERROR: No checkpoint to resume from in `%s'.\n",
+                                info.checkpoint_name);
+                        exit(1);
+                    }
+                }
 #ifdef WIN32
                 if (!strcmp(outputfile_name,"-") || !strcmp(outputfile_name,"/dev/stdout")) {
                     _setmode(_fileno(stdout), _O_BINARY);
                     info.outfile = stdout;
                 }
-                else {
+                else if (info.segment_time > 0 || info.segment_size > 0) {
+                    info.segment_output = outputfile_name;
+                    if(info.twopass!=1)
+                        oggmux_open_segment(&info);
+                }
+                else if (info.resume) {
                     if(info.twopass!=1)
+                        oggmux_open_resume(&info, outputfile_name);
+                }
+                else {
+                    if(info.twopass!=1) {
                         info.outfile = fopen(outputfile_name,"wb");
+                        info.outfile_name = outputfile_name;
+                    }
                 }
 #else
                 if (!strcmp(outputfile_name,"-")) {
                     snprintf(outputfile_name,sizeof(outputfile_name),"/dev/stdout");
                 }
-                if(info.twopass!=1)
+                if (info.segment_time > 0 || info.segment_size > 0) {
+                    info.segment_output = outputfile_name;
+                    if(info.twopass!=1)
+                        oggmux_open_segment(&info);
+                }
+                else if (info.resume) {
+                    if(info.twopass!=1)
+                        oggmux_open_resume(&info, outputfile_name);
+                }
+                else if(info.twopass!=1) {
                     info.outfile = fopen(outputfile_name,"wb");
+                    if (strcmp(outputfile_name,"/dev/stdout"))
+                        info.outfile_name = outputfile_name;
+                }
 #endif
                 if (output_json) {
                     if (using_stdin) {
                         fprintf(stderr, "can not analize input, not seekable\n");
                         exit(0);
                     } else {
-                        json_format_info(info.outfile, convert->context, inputfile_name);
+                        input_analysis analysis;
+                        if (analyze && analyze_input(convert->context, &analysis) < 0)
+                            analyze = 0;
+                        json_format_info(info.outfile, convert->context, inputfile_name,
+                                         analyze ? &analysis : NULL);
+                        if (analyze)
+                            analysis_free(&analysis);
                         if (info.outfile != stdout)
                             fclose(info.outfile);
                         exit(0);
@@ -3003,8 +4645,8 @@ int main(int argc, char **argv) {
                 if (convert->disable_metadata) {
                     if (!info.frontend)
                         fprintf(stderr, "  [metadata disabled].\n");
-                } else {
-                    copy_metadata(convert->context);
+                } else if (!reuse_input) {
+                    copy_metadata(convert->context, convert->remux);
                 }
 
                 if (!convert->sync && !info.frontend) {
@@ -3020,31 +4662,38 @@ int main(int argc, char **argv) {
                         fprintf(stderr,"\nUnable to open output file `%s'.\n", outputfile_name);
                     return(1);
                 }
+                /* only the pass that writes the output feeds the sinks */
+                if (info.passno != 1 && info.sinks && output_sinks_open(info.sinks) < 0) {
+                    return(1);
+                }
                 if (convert->context->duration != AV_NOPTS_VALUE) {
                     info.duration = (double)convert->context->duration / AV_TIME_BASE - \
                                             convert->start_time;
                     if (convert->end_time)
                         info.duration = convert->end_time - convert->start_time;
+                    else
+                        info.duration += inputs_duration(convert);
                 }
 
                 ff2theora_output(convert);
         }
         else{
             if (info.frontend)
-                json_format_info(info.frontend, NULL, inputfile_name);
+                json_format_info(info.frontend, NULL, inputfile_name, NULL);
             else if (output_json)
-                json_format_info(stdout, NULL, inputfile_name);
+                json_format_info(stdout, NULL, inputfile_name, NULL);
             else
                 fprintf(stderr,"\nUnable to decode input.\n");
             return(1);
         }
-        avformat_close_input(&convert->context);
+        if (info.twopass != 3 || info.passno != 1 || ff2theora_rewind(convert) < 0)
+            ff2theora_close_input(convert);
     }
     else{
         if (info.frontend)
-            json_format_info(info.frontend, NULL, inputfile_name);
+            json_format_info(info.frontend, NULL, inputfile_name, NULL);
         else if (output_json)
-            json_format_info(stdout, NULL, inputfile_name);
+            json_format_info(stdout, NULL, inputfile_name, NULL);
         else
             fprintf(stderr, "\nFile `%s' does not exist or has an unknown format.\n", inputfile_name);
         return(1);
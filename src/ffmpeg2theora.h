@@ -2,6 +2,9 @@
 #define _F2T_FFMPEG2THEORA_H_
 
 #include "subtitles.h"
+#include "framecache.h"
+#include "follow.h"
+#include "scenecut.h"
 
 typedef struct ff2theora_subtitle{
     char *text;
@@ -38,6 +41,7 @@ typedef struct ff2theora{
     int audio_index;
 
     int deinterlace;
+    int ivtc; /* --ivtc, recover film frames from 29.97 fps video */
     int soft_target;
     int buf_delay;
     int vhook;
@@ -62,6 +66,7 @@ typedef struct ff2theora{
     double fps;
     struct SwsContext *sws_colorspace_ctx; /* for image resampling/resizing */
     struct SwsContext *sws_scale_ctx; /* for image resampling/resizing */
+    int prepared; /* geometry and scalers are set up */
     ogg_int32_t aspect_numerator;
     ogg_int32_t aspect_denominator;
     int colorspace;
@@ -73,6 +78,10 @@ typedef struct ff2theora{
     int pix_fmt;
     int video_quality;
     int video_bitrate;
+    /* --auto-quality, AUTO_QUALITY_BPP or AUTO_QUALITY_SIZE, cleared once
+       the quality is chosen */
+    int auto_quality;
+    double auto_quality_target; /* in bits per pixel or MB */
     ogg_uint32_t keyint;
     char pp_mode[255];
     int resize_method;
@@ -85,6 +94,7 @@ typedef struct ff2theora{
     int frame_bottomBand;
     int frame_leftBand;
     int frame_rightBand;
+    int autocrop; /* --autocrop, cleared once the borders are found */
 
     int frame_width;
     int frame_height;
@@ -106,6 +116,42 @@ typedef struct ff2theora{
     size_t n_kate_streams;
     ff2theora_kate_stream *kate_streams;
 
+    /* frames of the first pass, replayed in the second pass */
+    frame_cache *frame_cache;
+    int frame_cache_size; /* in MB, 0 means unlimited */
+    int frame_cache_compress;
+    int fast_first_pass;
+
+    /* --dedup, -1 to encode every frame */
+    int dedup_threshold;
+
+    /* --scene-cuts, keyframes are moved to scene cuts seen in the
+       lookahead */
+    int scene_cuts;
+    scene_lookahead *lookahead;
+    int since_keyframe; /* frames since the last keyframe */
+    int max_keyint; /* what the granule position can count */
+
+    /* --vcopy and --acopy: Theora and Vorbis streams of the input are
+       passed through instead of encoded again */
+    int video_copy;
+    int audio_copy;
+    /* --remux: both, and all comments of the input are kept */
+    int remux;
+
+    /* --follow, NULL if the input is complete */
+    follow_input *follow;
+    int follow_timeout; /* in seconds, 0 means wait for input.done */
+
+    /* all inputs, encoded one after the other */
+    char **input_names;
+    int num_inputs;
+    /* the input after the current one, opened ahead of time */
+    int next_input;
+    AVFormatContext *next_context;
+    /* brings pictures of later inputs to the size of the first */
+    struct SwsContext *input_sws_ctx;
+
     int ignore_non_utf8;
     // ffmpeg2theora --nosound -f dv -H 32000 -S 0 -v 8 -x 384 -y 288 -G 1.5 input.dv
     double video_gamma;
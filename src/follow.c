@@ -0,0 +1,156 @@
+/* -*- tab-width:4;c-file-style:"cc-mode"; -*- */
+/*
+ * follow.c -- read input files that are still being written
+ * Copyright (C) 2003-2011 <j@v2v.cc>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with This program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "libavformat/avformat.h"
+#include "follow.h"
+
+#ifdef WIN32
+#if !defined(fseeko)
+#define fseeko fseeko64
+#define ftello ftello64
+#endif
+#endif
+
+#define FOLLOW_BUFFER_SIZE 65536
+/* how often to look for more data, in ms */
+#define FOLLOW_POLL_INTERVAL 250
+
+static void follow_sleep(void) {
+#ifdef WIN32
+    Sleep(FOLLOW_POLL_INTERVAL);
+#else
+    usleep(FOLLOW_POLL_INTERVAL * 1000);
+#endif
+}
+
+static int64_t follow_file_size(follow_input *fi) {
+    struct stat st;
+    if (fstat(fileno(fi->file), &st) != 0)
+        return -1;
+    return st.st_size;
+}
+
+/* Returns non-zero once no more data is to be expected. */
+static int follow_finished(follow_input *fi) {
+    struct stat st;
+    int64_t size;
+
+    if (fi->finished)
+        return 1;
+    size = follow_file_size(fi);
+    if (size > fi->size) {
+        fi->size = size;
+        fi->grown = time(NULL);
+        return 0;
+    }
+    if (stat(fi->done_name, &st) == 0 ||
+        (fi->idle_timeout > 0 && time(NULL) - fi->grown >= fi->idle_timeout)) {
+        fi->finished = 1;
+    }
+    return fi->finished;
+}
+
+static int follow_read(void *opaque, uint8_t *buf, int buf_size) {
+    follow_input *fi = (follow_input *)opaque;
+
+    while (1) {
+        size_t n = fread(buf, 1, buf_size, fi->file);
+        if (n > 0)
+            return n;
+        if (ferror(fi->file))
+            return AVERROR(EIO);
+        clearerr(fi->file);
+        if (!fi->waiting)
+            return AVERROR_EOF;
+        if (follow_finished(fi)) {
+            /* whatever was appended before the writer was done */
+            n = fread(buf, 1, buf_size, fi->file);
+            return n > 0 ? (int)n : AVERROR_EOF;
+        }
+        follow_sleep();
+    }
+}
+
+static int64_t follow_seek(void *opaque, int64_t offset, int whence) {
+    follow_input *fi = (follow_input *)opaque;
+
+    if (whence == AVSEEK_SIZE)
+        return follow_file_size(fi);
+    whence &= ~AVSEEK_FORCE;
+    if (fseeko(fi->file, offset, whence) < 0)
+        return -1;
+    return ftello(fi->file);
+}
+
+int follow_input_open(follow_input *fi, const char *name, int idle_timeout) {
+    unsigned char *buffer;
+
+    memset(fi, 0, sizeof(*fi));
+    fi->idle_timeout = idle_timeout;
+    fi->file = fopen(name, "rb");
+    if (!fi->file)
+        return -1;
+    fi->done_name = malloc(strlen(name) + 6);
+    buffer = av_malloc(FOLLOW_BUFFER_SIZE);
+    if (!fi->done_name || !buffer) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        exit(1);
+    }
+    sprintf(fi->done_name, "%s.done", name);
+    fi->pb = avio_alloc_context(buffer, FOLLOW_BUFFER_SIZE, 0, fi,
+                                follow_read, NULL, follow_seek);
+    if (!fi->pb) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        exit(1);
+    }
+    fi->start_size = fi->size = follow_file_size(fi);
+    fi->grown = time(NULL);
+    return 0;
+}
+
+void follow_input_start(follow_input *fi) {
+    fi->waiting = 1;
+    fi->grown = time(NULL);
+}
+
+void follow_input_close(follow_input *fi) {
+    if (fi->pb) {
+        av_free(fi->pb->buffer);
+        av_free(fi->pb);
+        fi->pb = NULL;
+    }
+    if (fi->file) {
+        fclose(fi->file);
+        fi->file = NULL;
+    }
+    free(fi->done_name);
+    fi->done_name = NULL;
+}
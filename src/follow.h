@@ -0,0 +1,57 @@
+/* -*- tab-width:4;c-file-style:"cc-mode"; -*- */
+/*
+ * follow.h -- read input files that are still being written
+ * Copyright (C) 2003-2011 <j@v2v.cc>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with This program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _F2T_FOLLOW_H_
+#define _F2T_FOLLOW_H_
+
+#include <stdio.h>
+#include <time.h>
+#include "libavformat/avio.h"
+
+/* With --follow the input is read through this instead of the file
+   protocol. Once waiting is enabled, a read at the end of the file waits
+   for it to grow, until the recorder creates the done file next to it or
+   the file didn't grow for idle_timeout seconds. */
+typedef struct {
+    FILE *file;
+    AVIOContext *pb;
+    /* <input>.done, its existence marks the input as complete */
+    char *done_name;
+    int idle_timeout;
+    /* off while the input is probed, which reads up to the current end */
+    int waiting;
+    /* set once the input is complete */
+    int finished;
+    /* size of the input when it was opened and the last time it grew */
+    int64_t start_size;
+    int64_t size;
+    time_t grown;
+}
+follow_input;
+
+/* Opens |name| for reading through fi->pb. Returns 0 on success, -1 on
+   failure. */
+int follow_input_open(follow_input *fi, const char *name, int idle_timeout);
+
+/* Lets reads at the end of the input wait for more data from now on. */
+void follow_input_start(follow_input *fi);
+
+/* Closes the input; the demuxer using fi->pb has to be closed first. */
+void follow_input_close(follow_input *fi);
+
+#endif
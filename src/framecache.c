@@ -0,0 +1,226 @@
+/* -*- tab-width:4;c-file-style:"cc-mode"; -*- */
+/*
+ * framecache.c -- spill file for preprocessed frames between two passes
+ * Copyright (C) 2003-2011 <j@v2v.cc>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with This program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "framecache.h"
+
+/* Every frame is stored as a fixed size record header followed by the
+   Y, Cb and Cr planes packed without padding, optionally deflated. */
+typedef struct {
+    ogg_int32_t dups;
+    ogg_int32_t e_o_s;
+    ogg_int32_t compressed;
+    ogg_int32_t size;
+    ogg_int32_t width[3];
+    ogg_int32_t height[3];
+} frame_cache_record;
+
+static int frame_cache_reserve(unsigned char **buf, size_t *size, size_t needed) {
+    unsigned char *p;
+    if (*size >= needed)
+        return 0;
+    p = realloc(*buf, needed);
+    if (!p)
+        return -1;
+    *buf = p;
+    *size = needed;
+    return 0;
+}
+
+int frame_cache_open(frame_cache *fc, ogg_int64_t budget, int compress) {
+    memset(fc, 0, sizeof(*fc));
+    fc->budget = budget;
+#ifdef HAVE_ZLIB
+    fc->compress = compress;
+#else
+    if (compress)
+        fprintf(stderr, "  Warning: built without zlib, frame cache will not be compressed.\n");
+#endif
+#ifdef WIN32
+    {
+        char *tmp;
+        srand (time (NULL));
+        tmp = getenv("TEMP");
+        if (!tmp) tmp = getenv("TMP");
+        if (!tmp) tmp = ".";
+        snprintf(fc->filename, sizeof(fc->filename), "%s\\f2t_%06d.cache", tmp, rand());
+        fc->file = fopen(fc->filename, "wb+");
+    }
+#else
+    fc->file = tmpfile();
+#endif
+    if (!fc->file)
+        return -1;
+    return 0;
+}
+
+static void frame_cache_drop(frame_cache *fc) {
+    fc->overflow = 1;
+    /* give the disk space back right away, the cache won't be used */
+    if (fc->file) {
+        fclose(fc->file);
+        fc->file = NULL;
+#ifdef WIN32
+        remove(fc->filename);
+#endif
+    }
+}
+
+int frame_cache_write(frame_cache *fc, th_ycbcr_buffer ycbcr, int dups, int e_o_s) {
+    frame_cache_record rec;
+    unsigned char *payload;
+    size_t raw_size = 0, offset = 0;
+    int pli, y;
+
+    if (!fc->file || fc->overflow)
+        return -1;
+
+    for (pli = 0; pli < 3; pli++) {
+        rec.width[pli] = ycbcr[pli].width;
+        rec.height[pli] = ycbcr[pli].height;
+        raw_size += (size_t)ycbcr[pli].width * ycbcr[pli].height;
+    }
+    if (frame_cache_reserve(&fc->raw, &fc->raw_size, raw_size) < 0) {
+        frame_cache_drop(fc);
+        return -1;
+    }
+    for (pli = 0; pli < 3; pli++) {
+        for (y = 0; y < ycbcr[pli].height; y++) {
+            memcpy(fc->raw + offset, ycbcr[pli].data + y * ycbcr[pli].stride, ycbcr[pli].width);
+            offset += ycbcr[pli].width;
+        }
+    }
+
+    payload = fc->raw;
+    rec.compressed = 0;
+    rec.size = raw_size;
+#ifdef HAVE_ZLIB
+    if (fc->compress) {
+        uLongf packed_len = compressBound(raw_size);
+        if (frame_cache_reserve(&fc->packed, &fc->packed_size, packed_len) == 0
+            && compress2(fc->packed, &packed_len, fc->raw, raw_size, Z_BEST_SPEED) == Z_OK
+            && packed_len < raw_size) {
+            payload = fc->packed;
+            rec.compressed = 1;
+            rec.size = packed_len;
+        }
+    }
+#endif
+    rec.dups = dups;
+    rec.e_o_s = e_o_s;
+
+    if (fc->budget > 0 && fc->bytes + (ogg_int64_t)sizeof(rec) + rec.size > fc->budget) {
+        frame_cache_drop(fc);
+        return -1;
+    }
+    if (fwrite(&rec, sizeof(rec), 1, fc->file) != 1
+        || fwrite(payload, 1, rec.size, fc->file) != (size_t)rec.size) {
+        frame_cache_drop(fc);
+        return -1;
+    }
+    fc->bytes += sizeof(rec) + rec.size;
+    fc->frames++;
+    return 0;
+}
+
+int frame_cache_finish(frame_cache *fc) {
+    if (!fc->file || fc->overflow)
+        return -1;
+    if (fflush(fc->file) || fseek(fc->file, 0, SEEK_SET)) {
+        frame_cache_drop(fc);
+        return -1;
+    }
+    fc->complete = 1;
+    fc->frames = 0;
+    return 0;
+}
+
+int frame_cache_usable(frame_cache *fc) {
+    return fc && fc->file && fc->complete && !fc->overflow;
+}
+
+int frame_cache_read(frame_cache *fc, th_ycbcr_buffer ycbcr, int *dups, int *e_o_s) {
+    frame_cache_record rec;
+    size_t raw_size = 0, offset = 0;
+    int pli;
+
+    if (!frame_cache_usable(fc))
+        return -1;
+    if (fread(&rec, sizeof(rec), 1, fc->file) != 1)
+        return feof(fc->file) ? 0 : -1;
+
+    for (pli = 0; pli < 3; pli++)
+        raw_size += (size_t)rec.width[pli] * rec.height[pli];
+    if (frame_cache_reserve(&fc->raw, &fc->raw_size, raw_size) < 0)
+        return -1;
+
+    if (rec.compressed) {
+#ifdef HAVE_ZLIB
+        uLongf raw_len = raw_size;
+        if (frame_cache_reserve(&fc->packed, &fc->packed_size, rec.size) < 0)
+            return -1;
+        if (fread(fc->packed, 1, rec.size, fc->file) != (size_t)rec.size)
+            return -1;
+        if (uncompress(fc->raw, &raw_len, fc->packed, rec.size) != Z_OK || raw_len != raw_size)
+            return -1;
+#else
+        return -1;
+#endif
+    }
+    else {
+        if ((size_t)rec.size != raw_size
+            || fread(fc->raw, 1, raw_size, fc->file) != raw_size)
+            return -1;
+    }
+
+    for (pli = 0; pli < 3; pli++) {
+        ycbcr[pli].width = rec.width[pli];
+        ycbcr[pli].height = rec.height[pli];
+        ycbcr[pli].stride = rec.width[pli];
+        ycbcr[pli].data = fc->raw + offset;
+        offset += (size_t)rec.width[pli] * rec.height[pli];
+    }
+    *dups = rec.dups;
+    *e_o_s = rec.e_o_s;
+    fc->frames++;
+    return 1;
+}
+
+void frame_cache_close(frame_cache *fc) {
+    if (fc->file) {
+        fclose(fc->file);
+        fc->file = NULL;
+#ifdef WIN32
+        remove(fc->filename);
+#endif
+    }
+    if (fc->raw)
+        free(fc->raw);
+    if (fc->packed)
+        free(fc->packed);
+    fc->raw = fc->packed = NULL;
+    fc->raw_size = fc->packed_size = 0;
+}
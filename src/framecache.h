@@ -0,0 +1,75 @@
+/* -*- tab-width:4;c-file-style:"cc-mode"; -*- */
+/*
+ * framecache.h -- spill file for preprocessed frames between two passes
+ * Copyright (C) 2003-2011 <j@v2v.cc>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with This program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _F2T_FRAMECACHE_H_
+#define _F2T_FRAMECACHE_H_
+
+#include <stdio.h>
+#include "theora/codec.h"
+
+/* Frames handed to the encoder in the first pass of --two-pass are written
+   here, so the second pass can feed them again without decoding and
+   preprocessing the input a second time. */
+typedef struct {
+    FILE *file;
+#ifdef WIN32
+    char filename[1024];
+#endif
+    /* Maximal size of the spill file in bytes, 0 means no limit. */
+    ogg_int64_t budget;
+    /* Bytes written to the spill file so far. */
+    ogg_int64_t bytes;
+    /* Compress frames with zlib, if it was available at build time. */
+    int compress;
+    /* Number of frames written/read. */
+    ogg_int64_t frames;
+    /* Set once the first pass stored every frame it encoded. */
+    int complete;
+    /* Set if the budget was exceeded; the cache is unusable then. */
+    int overflow;
+
+    unsigned char *raw;
+    unsigned char *packed;
+    size_t raw_size;
+    size_t packed_size;
+}
+frame_cache;
+
+/* Opens an empty cache. Returns 0 on success, -1 on failure. */
+int frame_cache_open(frame_cache *fc, ogg_int64_t budget, int compress);
+
+/* Appends a frame with its duplicate count and end of stream flag.
+   Returns 0 on success, -1 if the frame could not be stored, in which
+   case the cache is dropped. */
+int frame_cache_write(frame_cache *fc, th_ycbcr_buffer ycbcr, int dups, int e_o_s);
+
+/* Marks the cache as complete and rewinds it for reading. */
+int frame_cache_finish(frame_cache *fc);
+
+/* Returns non-zero if the second pass can read its frames from the cache. */
+int frame_cache_usable(frame_cache *fc);
+
+/* Reads the next frame. The planes point into memory owned by the cache
+   and stay valid until the next call. Returns 1 if a frame was read, 0 at
+   the end of the cache and -1 on error. */
+int frame_cache_read(frame_cache *fc, th_ycbcr_buffer ycbcr, int *dups, int *e_o_s);
+
+/* Closes and removes the spill file. */
+void frame_cache_close(frame_cache *fc);
+
+#endif
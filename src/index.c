@@ -148,6 +148,24 @@ int seek_index_record_sample(seek_index* index,
     return 0;
 }
 
+/*
+ * Keyframes are indexed at least packet_interval ms apart. With max_bytes
+ * set, a keyframe is also indexed once that many bytes have passed since
+ * the previous keypoint, so high bitrate parts of the file don't leave
+ * long stretches for a player to read through when seeking.
+ */
+int seek_index_keypoint_due(const seek_index* index,
+                            ogg_int64_t prev_time,
+                            ogg_int64_t prev_offset,
+                            ogg_int64_t time,
+                            ogg_int64_t offset)
+{
+    if (time > prev_time + index->packet_interval) {
+        return 1;
+    }
+    return index->max_bytes > 0 && offset - prev_offset >= index->max_bytes;
+}
+
 /*
  * Returns 0 on success, -1 on failure.
  */
@@ -176,3 +194,7 @@ void seek_index_set_max_keypoints(seek_index* index, int max_keypoints)
     index->max_keypoints = max_keypoints;
 }
 
+void seek_index_set_max_bytes(seek_index* index, ogg_int64_t max_bytes)
+{
+    index->max_bytes = max_bytes;
+}
@@ -63,6 +63,10 @@ typedef struct {
     /* Minimum time allowed between packets, in milliseconds. */
     ogg_int64_t packet_interval;
 
+    /* If non-zero, a keyframe this many bytes or more after the previous
+       keypoint is indexed even if packet_interval hasn't passed yet. */
+    ogg_int64_t max_bytes;
+
     /* Pages encoded into this stream. */
     keyframe_page* pages;
     /* Number of allocated elements in |pages|. */
@@ -104,6 +108,15 @@ int seek_index_record_sample(seek_index* index,
                              ogg_int64_t end_time,
                              int is_keyframe);
 
+/* Returns non-zero if a keyframe at |time| ms, starting on the page at
+   byte |offset|, should become a keypoint, given the previous keypoint
+   was at |prev_time| and |prev_offset|. */
+int seek_index_keypoint_due(const seek_index* index,
+                            ogg_int64_t prev_time,
+                            ogg_int64_t prev_offset,
+                            ogg_int64_t time,
+                            ogg_int64_t offset);
+
 /* Returns 0 on success, -1 on failure. */
 int seek_index_record_page(seek_index* index,
                            ogg_int64_t offset,
@@ -114,5 +127,9 @@ int seek_index_record_page(seek_index* index,
    media's duration is known. */
 void seek_index_set_max_keypoints(seek_index* index, int num_keypoints);
 
+/* Sets the maximum number of bytes between keypoints, 0 to choose them by
+   time only. */
+void seek_index_set_max_bytes(seek_index* index, ogg_int64_t max_bytes);
+
 
 #endif
@@ -0,0 +1,203 @@
+/* -*- tab-width:4;c-file-style:"cc-mode"; -*- */
+/*
+ * ivtc.c -- inverse telecine for film transferred to 29.97 fps video
+ * Copyright (C) 2003-2011 <j@v2v.cc>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with This program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ivtc.h"
+
+/* a pixel combs if (p - above) * (p - below) exceeds this */
+#define COMB_THRESHOLD 100
+
+static void picture_alloc(AVPicture *picture, int width, int height) {
+    if (avpicture_alloc(picture, PIX_FMT_YUV420P, width, height) < 0) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        exit(1);
+    }
+}
+
+static void picture_copy(ivtc_filter *f, AVPicture *dst, const AVPicture *src) {
+    av_picture_copy(dst, src, PIX_FMT_YUV420P, f->width, f->height);
+}
+
+/* Replaces the lines of one field of |dst|, the bottom one if |bottom| is
+   set, with the ones of |src|. */
+static void copy_field(ivtc_filter *f, AVPicture *dst, const AVPicture *src, int bottom) {
+    int plane, y;
+
+    for (plane = 0; plane < 3; plane++) {
+        int width = plane ? f->width / 2 : f->width;
+        int height = plane ? f->height / 2 : f->height;
+        for (y = bottom; y < height; y += 2) {
+            memcpy(dst->data[plane] + y * dst->linesize[plane],
+                   src->data[plane] + y * src->linesize[plane], width);
+        }
+    }
+}
+
+/* Counts the luma pixels that differ from the lines above and below them
+   in the same direction, the mark of two fields of different moments. */
+static int comb_count(ivtc_filter *f, const AVPicture *picture) {
+    int x, y, count = 0;
+    int stride = picture->linesize[0];
+
+    for (y = 1; y < f->height - 1; y++) {
+        const uint8_t *p = picture->data[0] + y * stride;
+        for (x = 0; x < f->width; x += 2) {
+            int d = (p[x] - p[x - stride]) * (p[x] - p[x + stride]);
+            if (d > COMB_THRESHOLD)
+                count++;
+        }
+    }
+    return count;
+}
+
+static int64_t luma_difference(ivtc_filter *f, const AVPicture *a, const AVPicture *b) {
+    int x, y;
+    int64_t sad = 0;
+
+    for (y = 0; y < f->height; y += 2) {
+        const uint8_t *pa = a->data[0] + y * a->linesize[0];
+        const uint8_t *pb = b->data[0] + y * b->linesize[0];
+        for (x = 0; x < f->width; x += 2)
+            sad += abs(pa[x] - pb[x]);
+    }
+    return sad;
+}
+
+/* Queues the frames of the current cycle but the one at |drop| (none if
+   out of range). */
+static void queue_cycle(ivtc_filter *f, int drop) {
+    int i;
+
+    f->queue_start = 0;
+    f->queue_len = 0;
+    for (i = 1; i <= f->cycle_len; i++) {
+        if (i == drop)
+            continue;
+        picture_copy(f, &f->queue[f->queue_len], &f->cycle[i]);
+        f->queue_dts[f->queue_len] = f->cycle_dts[i];
+        f->queue_len++;
+    }
+    if (f->cycle_len > 0) {
+        picture_copy(f, &f->cycle[0], &f->cycle[f->cycle_len]);
+        f->have_last = 1;
+    }
+    f->cycle_len = 0;
+}
+
+/* Drops the frame that repeats the one before it the most. */
+static void decimate(ivtc_filter *f) {
+    int64_t first = f->cycle_dts[1], last = f->cycle_dts[IVTC_CYCLE];
+    int64_t best = -1;
+    int i, drop = 1;
+
+    for (i = f->have_last ? 1 : 2; i <= IVTC_CYCLE; i++) {
+        int64_t d = luma_difference(f, &f->cycle[i], &f->cycle[i - 1]);
+        if (best < 0 || d < best) {
+            best = d;
+            drop = i;
+        }
+    }
+    queue_cycle(f, drop);
+
+    /* the film frames are evenly spread over the time of the cycle */
+    for (i = 0; i < f->queue_len; i++) {
+        if (first == AV_NOPTS_VALUE || last == AV_NOPTS_VALUE)
+            f->queue_dts[i] = AV_NOPTS_VALUE;
+        else
+            f->queue_dts[i] = first + i * (last - first) * IVTC_CYCLE / ((IVTC_CYCLE - 1) * (IVTC_CYCLE - 1));
+    }
+}
+
+ivtc_filter *ivtc_filter_new(int width, int height) {
+    ivtc_filter *f = calloc(1, sizeof(ivtc_filter));
+    int i;
+
+    if (!f) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        exit(1);
+    }
+    f->width = width;
+    f->height = height;
+    picture_alloc(&f->prev, width, height);
+    picture_alloc(&f->match, width, height);
+    for (i = 0; i <= IVTC_CYCLE; i++)
+        picture_alloc(&f->cycle[i], width, height);
+    for (i = 0; i < IVTC_CYCLE; i++)
+        picture_alloc(&f->queue[i], width, height);
+    return f;
+}
+
+void ivtc_push(ivtc_filter *f, const AVPicture *picture, int top_field_first, int64_t dts) {
+    AVPicture *matched = &f->cycle[f->cycle_len + 1];
+
+    picture_copy(f, matched, picture);
+    if (f->have_prev) {
+        /* the field of this frame that comes second may belong to the
+           film frame of the previous one */
+        picture_copy(f, &f->match, picture);
+        copy_field(f, &f->match, &f->prev, top_field_first);
+        if (comb_count(f, &f->match) < comb_count(f, picture))
+            picture_copy(f, matched, &f->match);
+    }
+    picture_copy(f, &f->prev, picture);
+    f->have_prev = 1;
+
+    f->cycle_dts[f->cycle_len + 1] = dts;
+    f->cycle_len++;
+    if (f->cycle_len == IVTC_CYCLE)
+        decimate(f);
+}
+
+AVPicture *ivtc_pull(ivtc_filter *f, int64_t *dts, int flush) {
+    AVPicture *picture;
+    int i;
+
+    if (f->queue_len == 0 && flush) {
+        queue_cycle(f, -1);
+        for (i = 0; i < f->queue_len; i++)
+            f->queue_dts[i] = AV_NOPTS_VALUE;
+        /* whatever follows doesn't continue these frames */
+        f->have_prev = 0;
+        f->have_last = 0;
+    }
+    if (f->queue_len == 0)
+        return NULL;
+    picture = &f->queue[f->queue_start];
+    *dts = f->queue_dts[f->queue_start];
+    f->queue_start++;
+    f->queue_len--;
+    return picture;
+}
+
+void ivtc_filter_free(ivtc_filter *f) {
+    int i;
+
+    if (!f)
+        return;
+    avpicture_free(&f->prev);
+    avpicture_free(&f->match);
+    for (i = 0; i <= IVTC_CYCLE; i++)
+        avpicture_free(&f->cycle[i]);
+    for (i = 0; i < IVTC_CYCLE; i++)
+        avpicture_free(&f->queue[i]);
+    free(f);
+}
@@ -0,0 +1,73 @@
+/* -*- tab-width:4;c-file-style:"cc-mode"; -*- */
+/*
+ * ivtc.h -- inverse telecine for film transferred to 29.97 fps video
+ * Copyright (C) 2003-2011 <j@v2v.cc>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with This program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _F2T_IVTC_H_
+#define _F2T_IVTC_H_
+
+#include <stdint.h>
+#include "libavcodec/avcodec.h"
+
+/* 3:2 pulldown turns 4 film frames into 5 video frames */
+#define IVTC_CYCLE 5
+
+/* Recovers the progressive film frames of telecined video. Every input
+   frame is matched with the field it leaves behind in the previous one,
+   if that combs less than the frame itself, and of each cycle of 5
+   matched frames the one closest to the frame before it is dropped.
+   Works on YUV 4:2:0 pictures. */
+typedef struct {
+    int width;
+    int height;
+
+    /* the last input picture */
+    AVPicture prev;
+    int have_prev;
+    /* the current picture with the other field of the previous one */
+    AVPicture match;
+
+    /* matched frames of the current cycle, [0] is the last one of the
+       previous cycle to compare the first one with */
+    AVPicture cycle[IVTC_CYCLE + 1];
+    int64_t cycle_dts[IVTC_CYCLE + 1];
+    int cycle_len;
+    int have_last;
+
+    /* frames ready to be encoded */
+    AVPicture queue[IVTC_CYCLE];
+    int64_t queue_dts[IVTC_CYCLE];
+    int queue_start;
+    int queue_len;
+}
+ivtc_filter;
+
+/* Returns a filter for pictures of the given size. */
+ivtc_filter *ivtc_filter_new(int width, int height);
+
+/* Passes the next input picture to the filter, |dts| in any time base
+   or AV_NOPTS_VALUE. Has to be followed by ivtc_pull(). */
+void ivtc_push(ivtc_filter *f, const AVPicture *picture, int top_field_first, int64_t dts);
+
+/* Returns the next film frame, or NULL if there is none yet. The picture
+   stays valid until the next ivtc_push(). With |flush| the frames of an
+   incomplete cycle are passed on as they are; use it once the input has
+   ended. */
+AVPicture *ivtc_pull(ivtc_filter *f, int64_t *dts, int flush);
+
+void ivtc_filter_free(ivtc_filter *f);
+
+#endif
@@ -0,0 +1,130 @@
+/* -*- tab-width:4;c-file-style:"cc-mode"; -*- */
+/*
+ * scenecut.c -- scene cut detection on frames held back from the encoder
+ * Copyright (C) 2003-2011 <j@v2v.cc>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with This program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scenecut.h"
+
+#define SCENECUT_FRAMES (SCENECUT_LOOKAHEAD + 1)
+/* only every 4th pixel of every 4th line is looked at */
+#define SCENECUT_STEP 4
+/* a cut moves at least this percentage of the histogram... */
+#define SCENECUT_MOVED 20
+/* ...and changes the pixels by this much on average */
+#define SCENECUT_DIFFERENCE 16
+
+static void histogram(scene_frame *f) {
+    th_img_plane *luma = &f->ycbcr[0];
+    int x, y;
+
+    memset(f->histogram, 0, sizeof(f->histogram));
+    for (y = 0; y < luma->height; y += SCENECUT_STEP) {
+        unsigned char *p = luma->data + y * luma->stride;
+        for (x = 0; x < luma->width; x += SCENECUT_STEP)
+            f->histogram[p[x] * SCENECUT_BINS / 256]++;
+    }
+}
+
+static int is_cut(scene_frame *prev, scene_frame *f) {
+    th_img_plane *a = &prev->ycbcr[0], *b = &f->ycbcr[0];
+    int x, y, i, samples = 0, moved = 0, difference = 0;
+
+    for (i = 0; i < SCENECUT_BINS; i++)
+        moved += abs(f->histogram[i] - prev->histogram[i]);
+    for (y = 0; y < b->height; y += SCENECUT_STEP) {
+        unsigned char *pa = a->data + y * a->stride;
+        unsigned char *pb = b->data + y * b->stride;
+        for (x = 0; x < b->width; x += SCENECUT_STEP) {
+            difference += abs(pa[x] - pb[x]);
+            samples++;
+        }
+    }
+    /* moved counts every pixel twice, where it left and where it went */
+    return moved * 100 > 2 * samples * SCENECUT_MOVED &&
+           difference > samples * SCENECUT_DIFFERENCE;
+}
+
+scene_lookahead *scene_lookahead_new(void) {
+    scene_lookahead *sl = calloc(1, sizeof(scene_lookahead));
+
+    if (!sl) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        exit(1);
+    }
+    return sl;
+}
+
+void scene_lookahead_push(scene_lookahead *sl, th_ycbcr_buffer ycbcr, int dups, int e_o_s) {
+    int slot = (sl->start + sl->count) % SCENECUT_FRAMES;
+    scene_frame *f = &sl->frames[slot];
+    size_t size = 0, offset = 0;
+    int i, y;
+
+    for (i = 0; i < 3; i++)
+        size += (size_t)ycbcr[i].width * ycbcr[i].height;
+    if (size > f->size) {
+        free(f->data);
+        f->data = malloc(size);
+        if (!f->data) {
+            fprintf(stderr, "ERROR: Out of memory.\n");
+            exit(1);
+        }
+        f->size = size;
+    }
+    for (i = 0; i < 3; i++) {
+        f->ycbcr[i].width = ycbcr[i].width;
+        f->ycbcr[i].height = ycbcr[i].height;
+        f->ycbcr[i].stride = ycbcr[i].width;
+        f->ycbcr[i].data = f->data + offset;
+        for (y = 0; y < ycbcr[i].height; y++) {
+            memcpy(f->ycbcr[i].data + y * ycbcr[i].width,
+                   ycbcr[i].data + y * ycbcr[i].stride, ycbcr[i].width);
+        }
+        offset += (size_t)ycbcr[i].width * ycbcr[i].height;
+    }
+    f->dups = dups;
+    f->e_o_s = e_o_s;
+    histogram(f);
+    f->cut = sl->have_last && is_cut(&sl->frames[sl->last], f);
+
+    sl->last = slot;
+    sl->have_last = 1;
+    sl->count++;
+}
+
+scene_frame *scene_lookahead_frame(scene_lookahead *sl, int i) {
+    return &sl->frames[(sl->start + i) % SCENECUT_FRAMES];
+}
+
+void scene_lookahead_pop(scene_lookahead *sl) {
+    sl->start = (sl->start + 1) % SCENECUT_FRAMES;
+    sl->count--;
+}
+
+void scene_lookahead_free(scene_lookahead *sl) {
+    int i;
+
+    if (!sl)
+        return;
+    for (i = 0; i < SCENECUT_FRAMES; i++)
+        free(sl->frames[i].data);
+    free(sl);
+}
@@ -0,0 +1,70 @@
+/* -*- tab-width:4;c-file-style:"cc-mode"; -*- */
+/*
+ * scenecut.h -- scene cut detection on frames held back from the encoder
+ * Copyright (C) 2003-2011 <j@v2v.cc>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with This program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _F2T_SCENECUT_H_
+#define _F2T_SCENECUT_H_
+
+#include <stddef.h>
+#include "theora/codec.h"
+
+/* frames held back, keyframes may be moved this far to land on a cut */
+#define SCENECUT_LOOKAHEAD 16
+#define SCENECUT_BINS 64
+
+typedef struct {
+    /* the planes point into data, owned by the frame */
+    th_ycbcr_buffer ycbcr;
+    unsigned char *data;
+    size_t size;
+    int dups;
+    int e_o_s;
+    /* set if the frame starts a new scene */
+    int cut;
+    /* luma histogram of a sparse grid of pixels */
+    int histogram[SCENECUT_BINS];
+}
+scene_frame;
+
+/* Frames on their way to the encoder, the oldest first, each one marked
+   if it differs from the frame before it enough to be a scene cut. */
+typedef struct {
+    scene_frame frames[SCENECUT_LOOKAHEAD + 1];
+    int start;
+    int count;
+    /* the last frame added, kept to compare the next one with */
+    int last;
+    int have_last;
+}
+scene_lookahead;
+
+/* Returns an empty lookahead. */
+scene_lookahead *scene_lookahead_new(void);
+
+/* Adds a copy of a frame. There has to be room for it, i.e. fewer than
+   SCENECUT_LOOKAHEAD + 1 frames in the lookahead. */
+void scene_lookahead_push(scene_lookahead *sl, th_ycbcr_buffer ycbcr, int dups, int e_o_s);
+
+/* Returns the frame at position |i|, 0 being the oldest. */
+scene_frame *scene_lookahead_frame(scene_lookahead *sl, int i);
+
+/* Removes the oldest frame. */
+void scene_lookahead_pop(scene_lookahead *sl);
+
+void scene_lookahead_free(scene_lookahead *sl);
+
+#endif
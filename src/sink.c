@@ -0,0 +1,434 @@
+/* -*- tab-width:4;c-file-style:"cc-mode"; -*- */
+/*
+ * sink.c -- additional outputs for the muxed Ogg stream
+ * Copyright (C) 2003-2011 <j@v2v.cc>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with This program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#ifdef WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+#include "sink.h"
+
+#ifdef WIN32
+#if !defined(fseeko)
+#define fseeko fseeko64
+#define ftello ftello64
+#endif
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* Size of the page ring of the HTTP server. Clients that fall further
+   behind than this are disconnected. */
+#define HTTP_RING_SIZE (8 * 1024 * 1024)
+/* Seconds connected clients get to receive the end of the stream. */
+#define HTTP_DRAIN_TIMEOUT 10
+
+output_sinks *output_sinks_new(void) {
+    output_sinks *s = calloc(1, sizeof(output_sinks));
+    if (!s) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        exit(1);
+    }
+    s->listen_fd = -1;
+    return s;
+}
+
+void output_sinks_add_tee(output_sinks *s, const char *name) {
+    tee_sink *tees = realloc(s->tees, (s->num_tees + 1) * sizeof(tee_sink));
+    if (!tees) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        exit(1);
+    }
+    memset(tees + s->num_tees, 0, sizeof(tee_sink));
+    tees[s->num_tees].name = name;
+    s->tees = tees;
+    s->num_tees++;
+}
+
+static int http_listen(output_sinks *s) {
+#ifdef WIN32
+    fprintf(stderr, "ERROR: --http-port is not supported on Windows.\n");
+    return -1;
+#else
+    struct sockaddr_in addr;
+    int one = 1;
+
+    s->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (s->listen_fd < 0) {
+        fprintf(stderr, "ERROR: Can't create HTTP socket: %s\n", strerror(errno));
+        return -1;
+    }
+    setsockopt(s->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(s->http_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(s->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(s->listen_fd, 16) < 0 ||
+        fcntl(s->listen_fd, F_SETFL, O_NONBLOCK) < 0) {
+        fprintf(stderr, "ERROR: Can't listen on port %d: %s\n", s->http_port, strerror(errno));
+        close(s->listen_fd);
+        s->listen_fd = -1;
+        return -1;
+    }
+    s->ring = malloc(HTTP_RING_SIZE);
+    if (!s->ring) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        exit(1);
+    }
+    s->ring_size = HTTP_RING_SIZE;
+    return 0;
+#endif
+}
+
+int output_sinks_open(output_sinks *s) {
+    int i;
+
+#ifndef WIN32
+    /* a pipe reader or HTTP client going away must not end the encode */
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    for (i = 0; i < s->num_tees; i++) {
+        tee_sink *t = s->tees + i;
+        if (!strcmp(t->name, "-")) {
+#ifdef WIN32
+            _setmode(_fileno(stdout), _O_BINARY);
+#endif
+            t->file = stdout;
+        }
+        else {
+            t->file = fopen(t->name, "wb");
+        }
+        if (!t->file) {
+            fprintf(stderr, "ERROR: Unable to open tee output `%s'.\n", t->name);
+            return -1;
+        }
+        t->seekable = t->file != stdout && ftello(t->file) == 0 &&
+                      fseeko(t->file, 0, SEEK_SET) == 0;
+    }
+    if (s->http_port > 0) {
+        if (http_listen(s) < 0)
+            return -1;
+        fprintf(stderr, "  Serving the stream at http://127.0.0.1:%d/\n", s->http_port);
+    }
+    return 0;
+}
+
+static void tee_write(output_sinks *s, const unsigned char *data, size_t len) {
+    int i;
+    for (i = 0; i < s->num_tees; i++) {
+        tee_sink *t = s->tees + i;
+        if (t->failed || len == 0)
+            continue;
+        if (fwrite(data, 1, len, t->file) != len) {
+            fprintf(stderr, "\n  Warning: Failed to write to `%s', dropping it.\n", t->name);
+            t->failed = 1;
+        }
+    }
+}
+
+static void pass_on(output_sinks *s, const unsigned char *data, size_t len) {
+    tee_write(s, data, len);
+    s->offset += len;
+    if (!s->ring)
+        return;
+    while (len > 0) {
+        size_t at = s->ring_end % s->ring_size;
+        size_t n = s->ring_size - at;
+        if (n > len)
+            n = len;
+        memcpy(s->ring + at, data, n);
+        s->ring_end += n;
+        data += n;
+        len -= n;
+    }
+}
+
+#ifndef WIN32
+static void http_drop(output_sinks *s, int i) {
+    close(s->clients[i].fd);
+    s->clients[i] = s->clients[--s->num_clients];
+}
+
+static void http_accept(output_sinks *s) {
+    while (1) {
+        http_client *clients;
+        int fd = accept(s->listen_fd, NULL, NULL);
+        if (fd < 0)
+            return;
+        clients = realloc(s->clients, (s->num_clients + 1) * sizeof(http_client));
+        if (!clients || fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+            if (clients)
+                s->clients = clients;
+            close(fd);
+            continue;
+        }
+        memset(clients + s->num_clients, 0, sizeof(http_client));
+        clients[s->num_clients].fd = fd;
+        s->clients = clients;
+        s->num_clients++;
+    }
+}
+
+/* Sends as much of |data| as the client takes without blocking. Returns the
+   number of bytes sent, or -1 if the client is gone. */
+static ssize_t http_send(http_client *c, const void *data, size_t len) {
+    ssize_t n = send(c->fd, data, len, MSG_NOSIGNAL);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
+    return n;
+}
+
+/* Moves a client along as far as it goes without blocking. Returns -1 if
+   it has to be disconnected. */
+static int http_update(output_sinks *s, http_client *c) {
+    ssize_t n;
+
+    if (c->state == 0) {
+        n = recv(c->fd, c->request + c->request_len,
+                 sizeof(c->request) - 1 - c->request_len, 0);
+        if (n == 0)
+            return -1;
+        if (n < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        c->request_len += n;
+        c->request[c->request_len] = '\0';
+        if (!strstr(c->request, "\r\n\r\n") && !strstr(c->request, "\n\n"))
+            return c->request_len < sizeof(c->request) - 1 ? 0 : -1;
+        /* whatever is asked for, there is only the one stream to get */
+        if (strncmp(c->request, "GET ", 4))
+            return -1;
+        c->state = 1;
+    }
+    if (c->state == 1) {
+        char response[256];
+        size_t len;
+        /* nobody can decode the stream without its header pages */
+        if (!s->header_done)
+            return 0;
+        len = snprintf(response, sizeof(response),
+                       "HTTP/1.0 200 OK\r\n"
+                       "Content-Type: %s\r\n"
+                       "Cache-Control: no-cache\r\n"
+                       "Connection: close\r\n\r\n", s->content_type);
+        n = http_send(c, response + c->sent, len - c->sent);
+        if (n < 0)
+            return -1;
+        c->sent += n;
+        if (c->sent < len)
+            return 0;
+        c->state = 2;
+        c->sent = 0;
+    }
+    if (c->state == 2) {
+        n = http_send(c, s->header + c->sent, s->header_len - c->sent);
+        if (n < 0)
+            return -1;
+        c->sent += n;
+        if (c->sent < s->header_len)
+            return 0;
+        /* only whole pages go into the ring, so its end is a page boundary */
+        c->state = 3;
+        c->pos = s->ring_end;
+    }
+    while (c->pos < s->ring_end) {
+        size_t at, len;
+        if (s->ring_end - c->pos > (ogg_int64_t)s->ring_size) {
+            fprintf(stderr, "\n  Warning: HTTP client fell behind, disconnecting it.\n");
+            return -1;
+        }
+        at = c->pos % s->ring_size;
+        len = s->ring_size - at;
+        if (len > s->ring_end - c->pos)
+            len = s->ring_end - c->pos;
+        n = http_send(c, s->ring + at, len);
+        if (n <= 0)
+            return n;
+        c->pos += n;
+    }
+    return 0;
+}
+#endif
+
+static void http_service(output_sinks *s) {
+#ifndef WIN32
+    int i;
+    if (s->listen_fd >= 0)
+        http_accept(s);
+    for (i = 0; i < s->num_clients; ) {
+        if (http_update(s, s->clients + i) < 0)
+            http_drop(s, i);
+        else
+            i++;
+    }
+#endif
+}
+
+static void http_close(output_sinks *s) {
+#ifndef WIN32
+    time_t deadline = time(NULL) + HTTP_DRAIN_TIMEOUT;
+    int i;
+
+    if (s->listen_fd < 0)
+        return;
+    close(s->listen_fd);
+    s->listen_fd = -1;
+    /* those that haven't even asked yet would only get an empty stream */
+    for (i = 0; i < s->num_clients; ) {
+        if (s->clients[i].state == 0)
+            http_drop(s, i);
+        else
+            i++;
+    }
+    while (s->num_clients > 0 && time(NULL) < deadline) {
+        struct timeval tv;
+        fd_set fds;
+        int max_fd = -1;
+
+        FD_ZERO(&fds);
+        for (i = 0; i < s->num_clients; i++) {
+            FD_SET(s->clients[i].fd, &fds);
+            if (s->clients[i].fd > max_fd)
+                max_fd = s->clients[i].fd;
+        }
+        tv.tv_sec = 1;
+        tv.tv_usec = 0;
+        if (select(max_fd + 1, NULL, &fds, NULL, &tv) < 0 && errno != EINTR)
+            break;
+        http_service(s);
+        for (i = 0; i < s->num_clients; ) {
+            if (s->clients[i].state == 3 && s->clients[i].pos == s->ring_end)
+                http_drop(s, i);
+            else
+                i++;
+        }
+    }
+    while (s->num_clients > 0)
+        http_drop(s, 0);
+#endif
+}
+
+void output_sinks_write_page(output_sinks *s, ogg_int64_t offset, ogg_page *og) {
+    if (!s->header_done) {
+        /* keep the header pages the way they end up in the main output,
+           the skeleton BOS page is overwritten while they are written */
+        size_t end = offset + og->header_len + og->body_len;
+        if (end > s->header_size) {
+            unsigned char *header = realloc(s->header, end * 2);
+            if (!header) {
+                fprintf(stderr, "ERROR: Out of memory.\n");
+                exit(1);
+            }
+            memset(header + s->header_size, 0, end * 2 - s->header_size);
+            s->header = header;
+            s->header_size = end * 2;
+        }
+        memcpy(s->header + offset, og->header, og->header_len);
+        memcpy(s->header + offset + og->header_len, og->body, og->body_len);
+        if (end > s->header_len)
+            s->header_len = end;
+    }
+    else if (offset == s->offset) {
+        pass_on(s, og->header, og->header_len);
+        pass_on(s, og->body, og->body_len);
+    }
+    /* anything else overwrites the header pages, that is the index; it is
+       copied to seekable tee files in output_sinks_close() */
+    http_service(s);
+}
+
+void output_sinks_end_header(output_sinks *s, const char *content_type) {
+    s->header_done = 1;
+    s->content_type = content_type;
+    tee_write(s, s->header, s->header_len);
+    s->offset = s->header_len;
+    http_service(s);
+}
+
+/* Copies the header pages of the finalized main output over those of a
+   seekable tee file. If the finalized output doesn't have the length of the
+   stream passed on, its content was moved to make room for the index and
+   the whole file is copied instead. */
+static void tee_finalize(output_sinks *s, tee_sink *t, const char *final_name) {
+    unsigned char buf[65536];
+    ogg_int64_t length, remaining;
+    FILE *in = fopen(final_name, "rb");
+
+    if (!in || fseeko(in, 0, SEEK_END) < 0 || (length = ftello(in)) < 0 ||
+        fseeko(in, 0, SEEK_SET) < 0 || fseeko(t->file, 0, SEEK_SET) < 0) {
+        fprintf(stderr, "  Warning: Can't write the index to `%s'.\n", t->name);
+        if (in)
+            fclose(in);
+        return;
+    }
+    remaining = length == s->offset ? (ogg_int64_t)s->header_len : length;
+    while (remaining > 0) {
+        size_t n = remaining < (ogg_int64_t)sizeof(buf) ? (size_t)remaining : sizeof(buf);
+        if (fread(buf, 1, n, in) != n || fwrite(buf, 1, n, t->file) != n) {
+            fprintf(stderr, "  Warning: Can't write the index to `%s'.\n", t->name);
+            break;
+        }
+        remaining -= n;
+    }
+#ifndef WIN32
+    if (length < s->offset &&
+        (fflush(t->file) != 0 || ftruncate(fileno(t->file), length) < 0))
+        fprintf(stderr, "  Warning: Can't truncate `%s'.\n", t->name);
+#endif
+    fclose(in);
+}
+
+void output_sinks_close(output_sinks *s, const char *final_name) {
+    int i;
+
+    http_close(s);
+    for (i = 0; i < s->num_tees; i++) {
+        tee_sink *t = s->tees + i;
+        if (!t->file)
+            continue;
+        if (final_name && t->seekable && !t->failed)
+            tee_finalize(s, t, final_name);
+        if (t->file != stdout)
+            fclose(t->file);
+        else
+            fflush(t->file);
+    }
+    free(s->tees);
+    free(s->header);
+    free(s->ring);
+    free(s->clients);
+    free(s);
+}
@@ -0,0 +1,102 @@
+/* -*- tab-width:4;c-file-style:"cc-mode"; -*- */
+/*
+ * sink.h -- additional outputs for the muxed Ogg stream
+ * Copyright (C) 2003-2011 <j@v2v.cc>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with This program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _F2T_SINK_H_
+#define _F2T_SINK_H_
+
+#include <stdio.h>
+#include "ogg/ogg.h"
+
+/* A file or pipe given with --tee. */
+typedef struct {
+    const char *name;
+    FILE *file;
+    int seekable;
+    /* set after a failed write, the sink is not written to anymore */
+    int failed;
+} tee_sink;
+
+/* A connection to the built-in HTTP server. */
+typedef struct {
+    int fd;
+    /* 0: reading the request, 1: sending the response header,
+       2: sending the stream header pages, 3: sending live pages */
+    int state;
+    char request[1024];
+    size_t request_len;
+    /* position in the response header or the stream header pages */
+    size_t sent;
+    /* offset in the live stream of the next byte to send */
+    ogg_int64_t pos;
+}
+http_client;
+
+/* The pages written to the main output are copied to every sink as they
+   are written. Pages that are overwritten later on, the skeleton BOS page
+   and the index, are only passed on once the headers are complete, and
+   seekable tee files are updated with the final index when closing.
+   Everything else only ever sees the stream as it was written. */
+typedef struct output_sinks {
+    tee_sink *tees;
+    int num_tees;
+
+    /* the header pages, as they are at the start of the main output */
+    unsigned char *header;
+    size_t header_len;
+    size_t header_size;
+    int header_done;
+    /* bytes passed to the sinks so far, header pages included */
+    ogg_int64_t offset;
+
+    /* --http-port, 0 if not serving */
+    int http_port;
+    int listen_fd;
+    const char *content_type;
+    http_client *clients;
+    int num_clients;
+    /* the most recent content pages, shared by all clients */
+    unsigned char *ring;
+    size_t ring_size;
+    /* bytes of content pages passed through the ring so far */
+    ogg_int64_t ring_end;
+}
+output_sinks;
+
+/* Returns an empty set of sinks. */
+output_sinks *output_sinks_new(void);
+
+/* Adds a file to write the stream to, "-" for standard output. The file is
+   opened by output_sinks_open(). */
+void output_sinks_add_tee(output_sinks *s, const char *name);
+
+/* Opens the tee files and starts listening on the HTTP port, if one is set.
+   Returns 0 on success, -1 on failure. */
+int output_sinks_open(output_sinks *s);
+
+/* Passes on a page written at |offset| of the main output. */
+void output_sinks_write_page(output_sinks *s, ogg_int64_t offset, ogg_page *og);
+
+/* Called once all header pages are written; sends them to the sinks. */
+void output_sinks_end_header(output_sinks *s, const char *content_type);
+
+/* Lets connected HTTP clients finish receiving the stream, updates
+   seekable tee files with the header pages of |final_name|, the finalized
+   main output, if not NULL, and closes all sinks. */
+void output_sinks_close(output_sinks *s, const char *final_name);
+
+#endif
@@ -45,8 +45,13 @@
 #include <assert.h>
 #include <math.h>
 #include <limits.h>
+#include <inttypes.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 #ifdef WIN32
+#include <io.h>
 #if !defined(fseeko)
 #define fseeko fseeko64
 #define ftello ftello64
@@ -54,6 +59,7 @@
 #endif
 
 #include "theora/theoraenc.h"
+#include "theora/theoradec.h"
 #include "vorbis/codec.h"
 #include "vorbis/vorbisenc.h"
 #ifdef HAVE_OGGKATE
@@ -61,6 +67,7 @@
 #endif
 
 #include "theorautils.h"
+#include "sink.h"
 
 
 void init_info(oggmux_info *info) {
@@ -68,6 +75,7 @@ void init_info(oggmux_info *info) {
     info->with_skeleton = 1; /* skeleton is enabled by default    */
     info->skeleton_3 = 0; /* by default, output skeleton 4 with keyframe indexes. */
     info->index_interval = 2000;
+    info->index_max_bytes = 0;
     info->theora_index_reserve = -1;
     info->vorbis_index_reserve = -1;
     info->kate_index_reserve = -1;
@@ -83,6 +91,8 @@ void init_info(oggmux_info *info) {
     info->audiopage_valid = 0;
     info->audiopage_buffer_length = 0;
     info->videopage_buffer_length = 0;
+    info->videopage_offset = -1;
+    info->audiopage_offset = -1;
     info->audiopage = NULL;
     info->videopage = NULL;
     info->start_time = time(NULL);
@@ -108,6 +118,54 @@ void init_info(oggmux_info *info) {
 
     info->prev_vorbis_window = -1;
     info->content_offset = 0;
+    info->firstpass_bytes = 0;
+    info->index_sidecar = NULL;
+    info->outfile_name = NULL;
+    info->sinks = NULL;
+    info->index_finalize = 1;
+    info->index_offset = 0;
+    info->final_length = 0;
+    info->bytes_written = 0;
+    info->segment_time = 0;
+    info->segment_size = 0;
+    info->segment_output = NULL;
+    info->segment_name = NULL;
+    info->segment_number = 0;
+    info->segment_start_time = 0;
+    info->page_size = 0;
+    info->page_duration = 1000;
+    info->interleave_delay = 0;
+    info->kate_page_window = 1000;
+    info->video_packet_time = 0;
+    info->audio_packet_time = 0;
+    info->pages_written = 0;
+    info->page_header_bytes = 0;
+    info->last_page_time = 0;
+    info->max_page_skew = 0;
+    info->max_page_delay = 0;
+    info->num_theora_headers = 0;
+    info->theora_packet_base = 0;
+    info->vorbis_packet_base = 0;
+    info->vorbis_next_packetno = 0;
+    info->checkpoint_interval = 0;
+    info->checkpoint_name = NULL;
+    info->last_checkpoint = 0;
+    info->resume = 0;
+    info->resume_time = 0;
+    info->resume_offset = 0;
+    info->theora_frame_base = 0;
+    info->vorbis_granule_base = 0;
+    info->resume_vorbis_granulepos = 0;
+    info->vorbis_resume_skip = 0;
+    info->twopass_frame_offset = 0;
+    info->twopass_resume_offset = 0;
+    info->theora_copy = 0;
+    info->vorbis_copy = 0;
+    memset(&info->theora_pending, 0, sizeof(info->theora_pending));
+    memset(&info->vorbis_pending, 0, sizeof(info->vorbis_pending));
+    info->theora_copy_frames = 0;
+    info->theora_copy_keyframe = 0;
+    info->theora_keyframes = 0;
 
     info->serialno = 0;
 }
@@ -126,7 +184,11 @@ void oggmux_setup_kate_streams(oggmux_info *info, int n_kate_streams)
         ks->katepage_buffer_length = 0;
         ks->katepage = NULL;
         ks->katetime = 0;
+        ks->buffered_start = -1;
+        ks->buffered_end = -1;
         ks->last_end_time = -1;
+        ks->event_times = NULL;
+        ks->num_event_times = 0;
     }
 }
 
@@ -157,6 +219,15 @@ static void write64le(unsigned char *ptr,ogg_int64_t v)
     ptr[7]=(hi>>24)&0xff;
 }
 
+/* Returns the current write position in the output. Pipes can't tell,
+   but they are never seeked in either, so count the bytes written. */
+static ogg_int64_t output_offset(oggmux_info* info)
+{
+    if (info->output_seekable == NOT_SEEKABLE)
+        return info->bytes_written;
+    return ftello(info->outfile);
+}
+
 /* Write an ogg page to the output file. The first time this is called, we
    determine the seekable-ness of the output stream, and store the result
    in info->output_seekable. */
@@ -164,7 +235,10 @@ static void
 write_page(oggmux_info* info, ogg_page* page)
 {
     int x;
+    ogg_int64_t offset = info->bytes_written;
     assert(page->header_len > 0);
+    if (info->output_seekable != MAYBE_SEEKABLE)
+        offset = output_offset(info);
     x = fwrite(page->header, 1, page->header_len, info->outfile);
     if (x != page->header_len) {
         fprintf(stderr, "FAILURE: Failed to write page header to disk!\n");
@@ -175,6 +249,7 @@ write_page(oggmux_info* info, ogg_page* page)
         fprintf(stderr, "FAILURE: Failed to write page body to disk!\n");
         exit(1);
     }
+    info->bytes_written += page->header_len + page->body_len;
     if (info->output_seekable == MAYBE_SEEKABLE) {
         /* This is our first page write. Determine if the output
            is seekable. */
@@ -194,6 +269,15 @@ write_page(oggmux_info* info, ogg_page* page)
     }
     /* We should know the seekableness by now... */
     assert(info->output_seekable != MAYBE_SEEKABLE);
+    if (info->sinks)
+        output_sinks_write_page(info->sinks, offset, page);
+}
+
+/* Returns non-zero if keyframes have to be recorded for an index, in the
+   skeleton track or in a sidecar file. */
+static int recording_index(oggmux_info* info)
+{
+    return info->passno != 1 && (!info->skeleton_3 || info->index_sidecar);
 }
 
 static ogg_int64_t output_file_length(oggmux_info* info)
@@ -202,6 +286,9 @@ static ogg_int64_t output_file_length(oggmux_info* info)
     if (info->skeleton_3 || !info->indexing_complete) {
         return -1;
     }
+    if (info->final_length > 0) {
+        return info->final_length;
+    }
     offset = ftello(info->outfile);
     if (fseeko(info->outfile, 0, SEEK_END) < 0) {
         fprintf(stderr, "ERROR: Can't seek output file to write index!\n");
@@ -238,7 +325,7 @@ void add_fishead_packet (oggmux_info *info,
     memcpy (op.packet, FISHEAD_IDENTIFIER, 8); /* identifier */
     write16le(op.packet+8, ver_maj); /* version major */
     write16le(op.packet+10, ver_min); /* version minor */
-    write64le(op.packet+12, (ogg_int64_t)0); /* presentationtime numerator */
+    write64le(op.packet+12, info->segment_start_time); /* presentationtime numerator */
     write64le(op.packet+20, (ogg_int64_t)1000); /* presentationtime denominator */
     write64le(op.packet+28, (ogg_int64_t)0); /* basetime numerator */
     write64le(op.packet+36, (ogg_int64_t)1000); /* basetime denominator */
@@ -377,6 +464,23 @@ void add_fisbone_packet (oggmux_info *info) {
 #endif
 }
 
+/* Returns the duration, in seconds, the index of the current output file
+   has to cover. A segment ends at the first keyframe after --segment-time,
+   which can be up to a keyframe interval later. */
+static double index_duration(oggmux_info *info)
+{
+    double duration = info->duration;
+    if (info->segment_time > 0) {
+        double segment = info->segment_time / 1000.0 + 1;
+        if (!info->audio_only)
+            segment += (double)(1 << info->ti.keyframe_granule_shift) *
+                       info->ti.fps_denominator / info->ti.fps_numerator;
+        if (duration < 0 || segment < duration)
+            duration = segment;
+    }
+    return duration;
+}
+
 static int keypoints_per_index(seek_index* index, double duration)
 {
     double keypoints_per_second = (double)index->packet_interval / 1000.0;
@@ -429,8 +533,8 @@ static int write_index_placeholder_for_stream (oggmux_info *info,
 {
     ogg_packet op;
     ogg_page og;
-    int num_keypoints = keypoints_per_index(index,
-                                            info->duration);
+    int num_keypoints = index->max_keypoints > 0 ? index->max_keypoints :
+                        keypoints_per_index(index, index_duration(info));
     if (index->packet_size == -1) {
         index->packet_size = (int)(num_keypoints * 5.1);
     }
@@ -506,57 +610,180 @@ typedef struct {
     ogg_int64_t time;
 } keypoint;
 
-/* Overwrites pages on disk for a stream's index with actual index data. */
-static int
-write_index_pages (seek_index* index,
-                   const char* name,
-                   oggmux_info *info,
-                   ogg_uint32_t serialno,
-                   int target_packet,
-                   int num_headers)
+/* Size an index for keypoints at |keypoints| (times in ms, sorted). Follows
+   the keypoint selection of write_index_pages(), assuming each keypoint
+   starts a page. Fewer keypoints end up in the index if they don't, which
+   never needs more space. */
+static void estimate_index_size(seek_index* index,
+                                const keypoint* keypoints,
+                                int n)
 {
-    ogg_packet op;
-    ogg_page og;
     int i;
     int k = 0;
-    int result;
-    int num_keypoints;
-    int packetno;
-    int last_packetno = num_headers-1; /* Take into account header packets... */
-    keypoint* keypoints = 0;
-    int pageno = 0;
-    int prev_keyframe_pageno = -INT_MAX;
-    ogg_int64_t prev_keyframe_start_time = -INT_MAX;
-    int packet_in_page = 0;
-    unsigned char* p = 0;
+    int index_bytes = 0;
     ogg_int64_t prev_offset = 0;
     ogg_int64_t prev_time = 0;
-    const unsigned char* limit = 0;
-    int index_bytes = 0;  
-    int keypoints_cutoff = 0;
+    ogg_int64_t prev_keyframe_start_time = -INT_MAX;
 
-    /* Must have indexed keypoints to go on */
-    if (index->max_keypoints == 0 || index->packet_num == 0) {
-      fprintf(stderr, "WARNING: no key points for %s stream %08x\n", name, serialno);
-      return 0;
+    for (i=0; i<n; i++) {
+        if (!seek_index_keypoint_due(index, prev_keyframe_start_time, prev_offset,
+                                     keypoints[i].time, keypoints[i].offset))
+            continue;
+        index_bytes += bytes_required(keypoints[i].offset - prev_offset);
+        index_bytes += bytes_required(keypoints[i].time - prev_time);
+        prev_offset = keypoints[i].offset;
+        prev_time = keypoints[i].time;
+        prev_keyframe_start_time = keypoints[i].time;
+        k++;
     }
+    index->max_keypoints = k + 2;
+    /* write_index_pages() only keeps keypoints that fit with room to spare */
+    index->packet_size = index_bytes + 16;
+}
 
-    /* Must have placeholder packet to rewrite. */
-    assert(index->page_location > 0);
+/* Expected byte rates of the output streams in bytes per ms, from the
+   first pass statistics and the audio encoder setup. */
+static double video_bytes_per_ms(oggmux_info *info)
+{
+    ogg_int64_t duration = info->firstpass_index.end_time -
+                           info->firstpass_index.start_time;
+    if (info->ti.target_bitrate > 0)
+        return info->ti.target_bitrate / 8000.0;
+    return duration > 0 ? (double)info->firstpass_bytes / duration : 0;
+}
 
-    num_keypoints = index->max_keypoints;
+static double audio_bytes_per_ms(oggmux_info *info)
+{
+    long bitrate;
+    if (info->video_only)
+        return 0;
+    bitrate = info->vi.bitrate_nominal > 0 ? info->vi.bitrate_nominal :
+              info->vi.bitrate_upper > 0 ? info->vi.bitrate_upper : 500000;
+    return bitrate / 8000.0;
+}
 
-    /* Calculate and store the keypoints. */
-    keypoints = (keypoint*)malloc(sizeof(keypoint) * num_keypoints);
-    if (!keypoints) {
-        fprintf(stderr, "ERROR: malloc failure in rewrite_index_page\n");
+/* Offsets are guessed from average rates, leave some headroom for the
+   header pages, page overhead and local rate peaks. */
+#define ESTIMATE_HEADER_BYTES 65536
+#define ESTIMATE_RATE_MARGIN 1.5
+
+static ogg_int64_t estimated_offset(double bytes, double time, double bytes_per_ms)
+{
+    return ESTIMATE_HEADER_BYTES + (ogg_int64_t)(ESTIMATE_RATE_MARGIN * (bytes + time * bytes_per_ms));
+}
+
+/* Sizes the index of streams at evenly spaced keypoints, or at |times|
+   if given. */
+static int estimate_stream_index_size(oggmux_info *info,
+                                      seek_index* index,
+                                      const ogg_int64_t* times,
+                                      int n,
+                                      double bytes_per_ms)
+{
+    keypoint* keypoints;
+    double step = index->packet_interval + 1;
+    int i;
+
+    if (!times) {
+        /* with a byte limit, keypoints come at least that often */
+        if (index->max_bytes > 0 && bytes_per_ms > 0 &&
+            index->max_bytes / bytes_per_ms < step)
+        {
+            step = index->max_bytes / bytes_per_ms;
+        }
+        if (step < 1)
+            return 0;
+        n = (int)(index_duration(info) * 1000 / step) + 2;
+    }
+    keypoints = (keypoint*)malloc(sizeof(keypoint) * (n > 0 ? n : 1));
+    if (!keypoints)
         return -1;
+    for (i=0; i<n; i++) {
+        keypoints[i].time = times ? times[i] : (ogg_int64_t)(i * step);
+        keypoints[i].offset = estimated_offset(0, keypoints[i].time, bytes_per_ms);
     }
-    memset(keypoints, -1, sizeof(keypoint) * num_keypoints);
+    estimate_index_size(index, keypoints, n);
+    free(keypoints);
+    return 0;
+}
+
+/* In the second pass of --two-pass, the keyframes of the first pass
+   tell how large the indexes will be; reserve that much instead of
+   guessing from the duration. */
+static int estimate_index_sizes_from_first_pass(oggmux_info *info)
+{
+    seek_index* fp = &info->firstpass_index;
+    double vrate = video_bytes_per_ms(info);
+    double arate = audio_bytes_per_ms(info);
+    double scale = 1;
+    int i;
+
+    /* the first pass saw the keyframes of all segments together */
+    if (info->passno != 2 || info->twopass != 3 || fp->packet_num == 0 ||
+        info->segment_time > 0 || info->segment_size > 0)
+        return 0;
+
+    if (info->ti.target_bitrate > 0 && info->firstpass_bytes > 0 &&
+        fp->end_time > fp->start_time)
+    {
+        scale = vrate * (fp->end_time - fp->start_time) / info->firstpass_bytes;
+    }
+
+    if (!info->audio_only && info->theora_index_reserve == -1) {
+        keypoint* keypoints = (keypoint*)malloc(sizeof(keypoint) * fp->packet_num);
+        if (!keypoints)
+            return -1;
+        for (i=0; i<fp->packet_num; i++) {
+            keypoints[i].time = fp->packets[i].start_time;
+            keypoints[i].offset = estimated_offset(fp->pages[i].offset * scale,
+                                                   keypoints[i].time, arate);
+        }
+        estimate_index_size(&info->theora_index, keypoints, fp->packet_num);
+        free(keypoints);
+    }
+    if (!info->video_only && info->vorbis_index_reserve == -1 &&
+        estimate_stream_index_size(info, &info->vorbis_index, NULL, 0, vrate + arate) == -1)
+    {
+        return -1;
+    }
+#ifdef HAVE_KATE
+    if (info->with_kate && info->kate_index_reserve == -1) {
+        int n;
+        for (n=0; n<info->n_kate_streams; ++n) {
+            oggmux_kate_stream *ks=info->kate_streams+n;
+            if (ks->num_event_times > 0 &&
+                estimate_stream_index_size(info, &ks->index, ks->event_times,
+                                           ks->num_event_times, vrate + arate) == -1)
+            {
+                return -1;
+            }
+        }
+    }
+#endif
+    return 0;
+}
+
+/* Picks the keypoints for a stream's index from its recorded keyframes and
+   pages, at most one per page and spaced as seek_index_keypoint_due() asks
+   for. Stores
+   up to |max_keypoints| keypoints in |keypoints| and returns their number. */
+static int
+find_keypoints (seek_index* index,
+                int target_packet,
+                int num_headers,
+                keypoint* keypoints,
+                int max_keypoints)
+{
+    int i;
+    int k = 0;
+    int packetno;
+    int last_packetno = num_headers-1; /* Take into account header packets... */
+    int pageno = 0;
+    int prev_keyframe_pageno = -INT_MAX;
+    ogg_int64_t prev_keyframe_start_time = -INT_MAX;
+    int packet_in_page = 0;
 
-    prev_offset = 0;
-    prev_time = 0;
-    for (i=0; i < index->packet_num && k < num_keypoints; i++) {
+    for (i=0; i < index->packet_num && k < max_keypoints; i++) {
         packetno = index->packets[i].packetno;
         /* Increment pageno until we find the page which contains the start of
          * the keyframe's packet. */
@@ -577,7 +804,11 @@ write_index_pages (seek_index* index,
         }
 
         if (packet_in_page != target_packet ||
-            index->packets[i].start_time <= (prev_keyframe_start_time + index->packet_interval)) {
+            !seek_index_keypoint_due(index,
+                                     prev_keyframe_start_time,
+                                     k ? keypoints[k-1].offset : 0,
+                                     index->packets[i].start_time,
+                                     index->pages[pageno].offset)) {
             /* Either this isn't the keyframe we want to index on this page, or
                the keyframe occurs too close to the previously indexed one, so
                skip to the next one. */
@@ -587,62 +818,59 @@ write_index_pages (seek_index* index,
         /* Add to final keyframe index. */        
         keypoints[k].offset = index->pages[pageno].offset;
         keypoints[k].time = index->packets[i].start_time;
-        
-        /* Count how many bytes is required to encode this keypoint. */
-        index_bytes += bytes_required(keypoints[k].offset - prev_offset);
-        prev_offset = keypoints[k].offset;
-        index_bytes += bytes_required(keypoints[k].time - prev_time);
-        prev_time = keypoints[k].time;
-
         k++;
 
-        if (index_bytes < index->packet_size) {
-            keypoints_cutoff = k;
-        }
-
         prev_keyframe_start_time = index->packets[i].start_time;
     }
-    if (index_bytes > index->packet_size) {
-        printf("WARNING: Underestimated space for %s keyframe index, dropped %d keyframes, "
-               "only part of the file may be indexed. Rerun with --%s-index-reserve %d to "
-               "ensure a complete index, or use OggIndex to re-index.\n",
-               name, (k - keypoints_cutoff), name, index_bytes);
-    } else if (index_bytes < index->packet_size &&
-               index->packet_size - index_bytes > 10000)
-    {
-        /* We over estimated the index size by 10,000 bytes or more. */
-        printf("Allocated %d bytes for %s keyframe index, %d are unused. "
-               "Index contains %d keyframes. "
-               "Rerun with '--%s-index-reserve %d' to encode with the optimal sized %s index,"
-               " or use OggIndex to re-index.\n",
-               index->packet_size, name, (index->packet_size - index_bytes),
-               keypoints_cutoff,
-               name, index_bytes, name);
-    }
-    num_keypoints = keypoints_cutoff;
+    return k;
+}
 
-    if (create_index_packet(index->packet_size,
-                            &op,
+/* Returns the number of bytes needed to store keypoint |i|, which is
+   encoded relative to the previous one. */
+static int
+keypoint_bytes (const keypoint* keypoints, int i)
+{
+    ogg_int64_t prev_offset = i ? keypoints[i-1].offset : 0;
+    ogg_int64_t prev_time = i ? keypoints[i-1].time : 0;
+    return bytes_required(keypoints[i].offset - prev_offset) +
+           bytes_required(keypoints[i].time - prev_time);
+}
+
+/* Creates the index packet for a stream, with |bytes| space for keypoint
+   data, and fills in the keypoints. */
+static int
+build_index_packet (seek_index* index,
+                    ogg_uint32_t serialno,
+                    const keypoint* keypoints,
+                    int num_keypoints,
+                    size_t bytes,
+                    ogg_packet* op)
+{
+    int i;
+    unsigned char* p = 0;
+    const unsigned char* limit = 0;
+    ogg_int64_t prev_offset = 0;
+    ogg_int64_t prev_time = 0;
+
+    if (create_index_packet(bytes,
+                            op,
                             serialno,
                             num_keypoints) == -1)
     {
-        free(keypoints);
         return -1;
     }
 
     /* Write first sample time numerator. */
-    write64le(op.packet+26, index->start_time);
+    write64le(op->packet+26, index->start_time);
 
     /* Write last sample time numerator. */
-    write64le(op.packet+34, index->end_time);
+    write64le(op->packet+34, index->end_time);
    
     /* Write keypoint data into packet. */
-    p = op.packet + 42;
-    limit = op.packet + op.bytes;
-    prev_offset = 0;
-    prev_time = 0;
+    p = op->packet + 42;
+    limit = op->packet + op->bytes;
     for (i=0; i<num_keypoints; i++) {
-        keypoint* k = &keypoints[i];
+        const keypoint* k = &keypoints[i];
         ogg_int64_t offset_diff = k->offset - prev_offset;
         ogg_int64_t time_diff = k->time - prev_time;
         p = write_vl_int(p, limit, offset_diff);
@@ -650,7 +878,85 @@ write_index_pages (seek_index* index,
         prev_offset = k->offset;
         prev_time = k->time;
     }
+    return 0;
+}
+
+/* Overwrites pages on disk for a stream's index with actual index data. */
+static int
+write_index_pages (seek_index* index,
+                   const char* name,
+                   oggmux_info *info,
+                   ogg_uint32_t serialno,
+                   int target_packet,
+                   int num_headers,
+                   int verbose)
+{
+    ogg_packet op;
+    ogg_page og;
+    int i;
+    int k;
+    int result;
+    int num_keypoints;
+    keypoint* keypoints = 0;
+    int index_bytes = 0;  
+    int keypoints_cutoff = 0;
+
+    /* Must have indexed keypoints to go on */
+    if (index->max_keypoints == 0 || index->packet_num == 0) {
+      if (verbose)
+        fprintf(stderr, "WARNING: no key points for %s stream %08x\n", name, serialno);
+      return 0;
+    }
+
+    /* Must have placeholder packet to rewrite. */
+    assert(index->page_location > 0);
+
+    num_keypoints = index->max_keypoints;
+
+    /* Calculate and store the keypoints. */
+    keypoints = (keypoint*)malloc(sizeof(keypoint) * num_keypoints);
+    if (!keypoints) {
+        fprintf(stderr, "ERROR: malloc failure in rewrite_index_page\n");
+        return -1;
+    }
+    memset(keypoints, -1, sizeof(keypoint) * num_keypoints);
+
+    k = find_keypoints(index, target_packet, num_headers, keypoints, num_keypoints);
+
+    /* Count how many keypoints fit into the space reserved on disk. */
+    for (i=0; i<k; i++) {
+        index_bytes += keypoint_bytes(keypoints, i);
+        if (index_bytes < index->packet_size) {
+            keypoints_cutoff = i + 1;
+        }
+    }
+    if (!verbose) {
+        /* a checkpoint, the final index will report on it */
+    } else if (index_bytes > index->packet_size) {
+        fprintf(stderr, "WARNING: Underestimated space for %s keyframe index, dropped %d keyframes, "
+                        "only part of the file may be indexed. Rerun with --%s-index-reserve %d to "
+                        "ensure a complete index, or use ogg-reindex to re-index.\n",
+                        name, (k - keypoints_cutoff), name, index_bytes);
+    } else if (index_bytes < index->packet_size &&
+               index->packet_size - index_bytes > 10000)
+    {
+        /* We over estimated the index size by 10,000 bytes or more. */
+        fprintf(stderr, "Allocated %d bytes for %s keyframe index, %d are unused. "
+                        "Index contains %d keyframes. "
+                        "Rerun with '--%s-index-reserve %d' to encode with the optimal sized %s index,"
+                        " or use ogg-reindex to re-index.\n",
+                        index->packet_size, name, (index->packet_size - index_bytes),
+                        keypoints_cutoff,
+                        name, index_bytes, name);
+    }
+    num_keypoints = keypoints_cutoff;
+
+    result = build_index_packet(index, serialno, keypoints, num_keypoints,
+                                index->packet_size, &op);
     free(keypoints);
+    if (result == -1) {
+        return -1;
+    }
 
     /* Skeleton stream must be empty. */
     assert(ogg_stream_flush(&info->so, &og) == 0);
@@ -679,74 +985,478 @@ write_index_pages (seek_index* index,
     return 0;
 }
 
-/* Overwrites existing skeleton index placeholder packets with valid keyframe
-   index data. Must only be called once we've constructed the index data after
-   encoding the entire file. */
-int write_seek_index (oggmux_info* info)
-{
+/* A stream whose keyframe index is stored in the skeleton track. */
+typedef struct {
+    seek_index* index;
+    const char* name;
     ogg_uint32_t serialno;
-    ogg_page og;
-
-    /* We shouldn't write indexes for skeleton 3, it's a skeleton 4 feature. */
-    assert(!info->skeleton_3);
-
-    /* Mark that we're done indexing. This causes the header packets' fields
-       to be filled with valid, non-unknown values. */
-    info->indexing_complete = 1;
+    int target_packet;
+    int num_headers;
+    keypoint* keypoints;
+    int num_keypoints;
+    int bytes;
+} index_stream;
 
-    /* Re-encode the entire skeleton track, to ensure the packet and page
-       counts don't change. */
-    serialno = info->so.serialno;
-    ogg_stream_clear(&info->so);
-    ogg_stream_init(&info->so, serialno);
+/* Fills |streams| with the indexed streams, in the order their placeholder
+   pages were written, and finds all their keypoints. Returns the number
+   of streams, or -1 on malloc failure. */
+static int list_index_streams(oggmux_info *info, index_stream *streams)
+{
+    int n = 0;
+    int i, j;
 
-    add_fishead_packet (info, 4, 0);
-    if (ogg_stream_flush(&info->so, &og) != 1) {
-        fprintf (stderr, "Internal Ogg library error.\n");
-        exit (1);
+    if (!info->audio_only) {
+        streams[n].index = &info->theora_index;
+        streams[n].name = "theora";
+        streams[n].serialno = info->to.serialno;
+        streams[n].target_packet = 1;
+        streams[n].num_headers = 3;
+        n++;
     }
-
-    /* Rewrite the skeleton BOS page. It will have changed to account for
-       learning the start time, end time, and length. */
-    if (fseeko(info->outfile, 0, SEEK_SET) < 0) {
-        fprintf(stderr, "ERROR: Can't seek output file to rewrite skeleton BOS!\n");
-        return -1;
+    if (!info->video_only) {
+        streams[n].index = &info->vorbis_index;
+        streams[n].name = "vorbis";
+        streams[n].serialno = info->vo.serialno;
+        streams[n].target_packet = 2;
+        streams[n].num_headers = 3;
+        n++;
     }
-    write_page (info, &og);
+#ifdef HAVE_KATE
+    if (info->with_kate) {
+        for (i=0; i<info->n_kate_streams; ++i) {
+            oggmux_kate_stream *ks=info->kate_streams+i;
+            streams[n].index = &ks->index;
+            streams[n].name = "kate";
+            streams[n].serialno = ks->ko.serialno;
+            streams[n].target_packet = 1;
+            streams[n].num_headers = ks->ki.num_headers;
+            n++;
+        }
+    }
+#endif
 
-    /* Encode and discard fisbone packets, their contents' doesn't need
-       to be updated. */
-    add_fisbone_packet(info);
-    while (1) {
-        int result = ogg_stream_flush(&info->so, &og);
-        if (result < 0) {
-            fprintf(stderr, "Internal Ogg library error.\n");
-            exit (1);
+    for (i=0; i<n; i++) {
+        index_stream *s = &streams[i];
+        s->keypoints = (keypoint*)malloc(sizeof(keypoint) * (s->index->packet_num + 1));
+        if (!s->keypoints) {
+            fprintf(stderr, "ERROR: malloc failure in list_index_streams\n");
+            while (i--)
+                free(streams[i].keypoints);
+            return -1;
+        }
+        s->num_keypoints = s->index->packet_num ?
+            find_keypoints(s->index, s->target_packet, s->num_headers,
+                           s->keypoints, s->index->packet_num) : 0;
+        s->bytes = 0;
+        for (j=0; j<s->num_keypoints; j++) {
+            s->bytes += keypoint_bytes(s->keypoints, j);
         }
-        if (result == 0)
-            break;
     }
+    return n;
+}
 
-    /* Write a new line, so that when we print out indexing stats, it's on a new line. */
-    printf("\n");
-    if (!info->audio_only &&
-        write_index_pages(&info->theora_index,
-                          "theora",
-                          info,
-                          info->to.serialno,
-                          1,
-                          3) == -1)
-    {
+/* Returns the length of the output file. */
+static ogg_int64_t output_length(oggmux_info *info)
+{
+    if (info->output_seekable == NOT_SEEKABLE)
+        return info->bytes_written;
+    if (fseeko(info->outfile, 0, SEEK_END) < 0)
         return -1;
+    return ftello(info->outfile);
+}
+
+/* Appends a page to a growable buffer. */
+static int append_page(unsigned char **buf, size_t *len, size_t *size, const ogg_page *og)
+{
+    size_t needed = *len + og->header_len + og->body_len;
+    if (needed > *size) {
+        unsigned char *p = realloc(*buf, needed * 2);
+        if (!p)
+            return -1;
+        *buf = p;
+        *size = needed * 2;
+    }
+    memcpy(*buf + *len, og->header, og->header_len);
+    memcpy(*buf + *len + og->header_len, og->body, og->body_len);
+    *len = needed;
+    return 0;
+}
+
+/* Copies |length| bytes from |offset| in |in| to the end of |out|. Uses
+   copy_file_range() where available, which lets the filesystem share the
+   blocks instead of copying them. */
+static int copy_file_data(FILE *in, FILE *out, ogg_int64_t offset, ogg_int64_t length)
+{
+    char buf[65536];
+#ifdef SYS_copy_file_range
+    if (fflush(out) == 0) {
+        loff_t in_offset = offset;
+        while (length > 0) {
+            size_t chunk = length > (1 << 30) ? (1 << 30) : (size_t)length;
+            ssize_t n = syscall(SYS_copy_file_range, fileno(in), &in_offset,
+                                fileno(out), NULL, chunk, 0);
+            if (n <= 0)
+                break; /* not supported here, copy the rest by hand */
+            offset += n;
+            length -= n;
+        }
+        if (fseeko(out, 0, SEEK_END) < 0)
+            return -1;
     }
-    if (!info->video_only && 
-        write_index_pages(&info->vorbis_index,
-                          "vorbis",
-                          info,
-                          info->vo.serialno,
-                          2,
-                          3) == -1)
-    {
+#endif
+    if (length > 0 && fseeko(in, offset, SEEK_SET) < 0)
+        return -1;
+    while (length > 0) {
+        size_t n = length > (ogg_int64_t)sizeof(buf) ? sizeof(buf) : (size_t)length;
+        if (fread(buf, 1, n, in) != n || fwrite(buf, 1, n, out) != n)
+            return -1;
+        length -= n;
+    }
+    return 0;
+}
+
+/* Builds the skeleton header pages as they'll be in the rewritten file:
+   the BOS page goes to |bos|, the index pages and the EOS page go to
+   |region|. */
+static int build_skeleton_pages(oggmux_info *info,
+                                index_stream *streams,
+                                int num_streams,
+                                const int *sizes,
+                                unsigned char **bos, size_t *bos_len, size_t *bos_size,
+                                unsigned char **region, size_t *region_len, size_t *region_size)
+{
+    ogg_uint32_t serialno = info->so.serialno;
+    ogg_packet op;
+    ogg_page og;
+    int i;
+
+    ogg_stream_clear(&info->so);
+    ogg_stream_init(&info->so, serialno);
+
+    *bos_len = 0;
+    *region_len = 0;
+    add_fishead_packet (info, 4, 0);
+    if (ogg_stream_flush(&info->so, &og) != 1 ||
+        append_page(bos, bos_len, bos_size, &og) == -1)
+    {
+        return -1;
+    }
+
+    /* The fisbone pages don't change, they're copied from the old file. */
+    add_fisbone_packet(info);
+    while (ogg_stream_flush(&info->so, &og) > 0)
+        ;
+
+    for (i=0; i<num_streams; i++) {
+        index_stream *s = &streams[i];
+        if (build_index_packet(s->index, s->serialno, s->keypoints,
+                               s->num_keypoints, sizes[i], &op) == -1)
+        {
+            return -1;
+        }
+        ogg_stream_packetin(&info->so, &op);
+        free(op.packet);
+        while (ogg_stream_flush(&info->so, &og)) {
+            if (append_page(region, region_len, region_size, &og) == -1)
+                return -1;
+        }
+    }
+
+    memset (&op, 0, sizeof (op));
+    op.e_o_s = 1;
+    ogg_stream_packetin (&info->so, &op);
+    if (ogg_stream_flush(&info->so, &og) != 1 ||
+        append_page(region, region_len, region_size, &og) == -1)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/* The index keypoints store absolute offsets, so making room for a bigger
+   index, or giving back unused space, moves every keypoint by the same
+   amount, which can change the size of the index again. Grow the index
+   sizes until the layout is stable, then write the file again with the
+   new skeleton header pages, and move the content after them. */
+static int rewrite_with_exact_index(oggmux_info *info,
+                                    index_stream *streams,
+                                    int num_streams)
+{
+    ogg_int64_t old_content_offset = info->content_offset;
+    ogg_int64_t old_length = output_length(info);
+    ogg_int64_t delta = 0, applied = 0;
+    unsigned char *bos = NULL, *region = NULL;
+    size_t bos_len = 0, bos_size = 0, region_len = 0, region_size = 0;
+    int *sizes;
+    char *tmp_name = NULL;
+    FILE *in = NULL, *out = NULL;
+    int stable = 0;
+    int i, j, iter;
+    int ret = -1;
+
+    sizes = (int*)calloc(num_streams, sizeof(int));
+    if (!sizes || old_length < 0)
+        goto cleanup;
+
+    for (iter=0; iter<16 && !stable; iter++) {
+        ogg_int64_t new_delta;
+        for (i=0; i<num_streams; i++) {
+            index_stream *s = &streams[i];
+            s->bytes = 0;
+            for (j=0; j<s->num_keypoints; j++) {
+                s->keypoints[j].offset += delta - applied;
+                s->bytes += keypoint_bytes(s->keypoints, j);
+            }
+            /* Sizes only ever grow, so this terminates. */
+            if (s->bytes > sizes[i])
+                sizes[i] = s->bytes;
+        }
+        applied = delta;
+        info->content_offset = old_content_offset + delta;
+        info->final_length = old_length + delta;
+        if (build_skeleton_pages(info, streams, num_streams, sizes,
+                                 &bos, &bos_len, &bos_size,
+                                 &region, &region_len, &region_size) == -1)
+        {
+            goto cleanup;
+        }
+        new_delta = info->index_offset + region_len - old_content_offset;
+        stable = new_delta == delta;
+        delta = new_delta;
+    }
+    if (!stable)
+        goto cleanup;
+
+    if (fflush(info->outfile) != 0)
+        goto cleanup;
+    tmp_name = malloc(strlen(info->outfile_name) + 7);
+    if (!tmp_name)
+        goto cleanup;
+    sprintf(tmp_name, "%s.index", info->outfile_name);
+    in = fopen(info->outfile_name, "rb");
+    out = fopen(tmp_name, "wb");
+    if (!in || !out) {
+        fprintf(stderr, "ERROR: Unable to open `%s' to rewrite the index.\n",
+                in ? tmp_name : info->outfile_name);
+        goto cleanup;
+    }
+
+    if (fwrite(bos, 1, bos_len, out) != bos_len ||
+        copy_file_data(in, out, bos_len, info->index_offset - bos_len) == -1 ||
+        fwrite(region, 1, region_len, out) != region_len ||
+        copy_file_data(in, out, old_content_offset, old_length - old_content_offset) == -1)
+    {
+        fprintf(stderr, "ERROR: Failed to write `%s'.\n", tmp_name);
+        goto cleanup;
+    }
+    fclose(in);
+    in = NULL;
+    if (fclose(out) != 0) {
+        out = NULL;
+        fprintf(stderr, "ERROR: Failed to write `%s'.\n", tmp_name);
+        goto cleanup;
+    }
+    out = NULL;
+
+    fclose(info->outfile);
+#ifdef WIN32
+    remove(info->outfile_name);
+#endif
+    if (rename(tmp_name, info->outfile_name) != 0) {
+        fprintf(stderr, "ERROR: Unable to rename `%s' to `%s'.\n", tmp_name, info->outfile_name);
+        exit(1);
+    }
+    info->outfile = fopen(info->outfile_name, "rb+");
+    if (!info->outfile) {
+        fprintf(stderr, "ERROR: Unable to open `%s'.\n", info->outfile_name);
+        exit(1);
+    }
+
+    /* Keep the recorded pages in line with the new file, for the sidecar. */
+    for (i=0; i<num_streams; i++) {
+        seek_index *index = streams[i].index;
+        for (j=0; j<index->pages_num; j++) {
+            if (index->pages[j].offset >= old_content_offset)
+                index->pages[j].offset += delta;
+        }
+        if (!info->frontend)
+            fprintf(stderr, "Wrote %d keyframes in a %d byte %s keyframe index.\n",
+                            streams[i].num_keypoints, sizes[i], streams[i].name);
+    }
+    ret = 0;
+
+cleanup:
+    if (in)
+        fclose(in);
+    if (out) {
+        fclose(out);
+        remove(tmp_name);
+    }
+    if (ret == -1)
+        info->content_offset = old_content_offset;
+    info->final_length = 0;
+    free(tmp_name);
+    free(sizes);
+    free(bos);
+    free(region);
+    return ret;
+}
+
+/* Checks whether the keyframe indexes fit into the space reserved for
+   them. If an index would have to drop keyframes, or leave more than
+   10,000 bytes unused, the file is rewritten with exactly sized indexes.
+   Returns 1 if the file was rewritten, 0 if the reserved space is to be
+   used, and -1 on error. */
+static int finalize_seek_index(oggmux_info *info)
+{
+    index_stream *streams;
+    int num_streams;
+    int rewrite = 0;
+    int i;
+    struct stat st;
+
+    if (!info->index_finalize || !info->outfile_name ||
+        info->output_seekable != SEEKABLE ||
+        fstat(fileno(info->outfile), &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        return 0;
+    }
+
+    streams = (index_stream*)malloc(sizeof(index_stream) * (2 + info->n_kate_streams));
+    if (!streams)
+        return -1;
+    num_streams = list_index_streams(info, streams);
+    if (num_streams == -1) {
+        free(streams);
+        return -1;
+    }
+
+    for (i=0; i<num_streams; i++) {
+        index_stream *s = &streams[i];
+        if (s->num_keypoints == 0)
+            continue;
+        if (s->num_keypoints > s->index->max_keypoints ||
+            s->bytes >= s->index->packet_size ||
+            s->index->packet_size - s->bytes > 10000)
+        {
+            rewrite = 1;
+        }
+    }
+
+    if (rewrite) {
+        if (!info->frontend)
+            fprintf(stderr, "\nReserved space for the keyframe index doesn't match, rewriting %s.\n",
+                            info->outfile_name);
+        rewrite = rewrite_with_exact_index(info, streams, num_streams) == 0 ? 1 : -1;
+        if (rewrite == -1) {
+            fprintf(stderr, "WARNING: Failed to rewrite the output, "
+                            "filling in the reserved space instead.\n");
+        }
+    }
+
+    for (i=0; i<num_streams; i++)
+        free(streams[i].keypoints);
+    free(streams);
+    return rewrite;
+}
+
+/* Reserves exactly the space the indexes need, for when every keyframe and
+   page is recorded before the placeholders are written, as when re-indexing
+   an existing file. Page offsets are relative to the first content page,
+   which is expected at about |content_offset|; a few bytes are added to
+   allow for that guess being off. Returns 0 on success, -1 on failure. */
+int oggmux_reserve_exact_index (oggmux_info *info, ogg_int64_t content_offset)
+{
+    index_stream *streams;
+    int num_streams;
+    int i, j;
+
+    streams = (index_stream*)malloc(sizeof(index_stream) * (2 + info->n_kate_streams));
+    if (!streams)
+        return -1;
+    num_streams = list_index_streams(info, streams);
+    if (num_streams == -1) {
+        free(streams);
+        return -1;
+    }
+    for (i=0; i<num_streams; i++) {
+        index_stream *s = &streams[i];
+        s->bytes = 0;
+        for (j=0; j<s->num_keypoints; j++) {
+            s->keypoints[j].offset += content_offset;
+            s->bytes += keypoint_bytes(s->keypoints, j);
+        }
+        seek_index_set_max_keypoints(s->index, s->num_keypoints);
+        s->index->packet_size = s->bytes + 8;
+        free(s->keypoints);
+    }
+    free(streams);
+    return 0;
+}
+
+/* Rewrites the skeleton BOS page and the index pages with the current state
+   of the indexes. */
+static int overwrite_seek_index (oggmux_info* info, int verbose)
+{
+    ogg_uint32_t serialno;
+    ogg_page og;
+
+    /* Re-encode the entire skeleton track, to ensure the packet and page
+       counts don't change. */
+    serialno = info->so.serialno;
+    ogg_stream_clear(&info->so);
+    ogg_stream_init(&info->so, serialno);
+
+    add_fishead_packet (info, 4, 0);
+    if (ogg_stream_flush(&info->so, &og) != 1) {
+        fprintf (stderr, "Internal Ogg library error.\n");
+        exit (1);
+    }
+
+    /* Rewrite the skeleton BOS page. It will have changed to account for
+       learning the start time, end time, and length. */
+    if (fseeko(info->outfile, 0, SEEK_SET) < 0) {
+        fprintf(stderr, "ERROR: Can't seek output file to rewrite skeleton BOS!\n");
+        return -1;
+    }
+    write_page (info, &og);
+
+    /* Encode and discard fisbone packets, their contents' doesn't need
+       to be updated. */
+    add_fisbone_packet(info);
+    while (1) {
+        int result = ogg_stream_flush(&info->so, &og);
+        if (result < 0) {
+            fprintf(stderr, "Internal Ogg library error.\n");
+            exit (1);
+        }
+        if (result == 0)
+            break;
+    }
+
+    /* Write a new line, so that when we print out indexing stats, it's on a new line. */
+    if (verbose)
+        fprintf(stderr, "\n");
+    if (!info->audio_only &&
+        write_index_pages(&info->theora_index,
+                          "theora",
+                          info,
+                          info->to.serialno,
+                          1,
+                          3,
+                          verbose) == -1)
+    {
+        return -1;
+    }
+    if (!info->video_only && 
+        write_index_pages(&info->vorbis_index,
+                          "vorbis",
+                          info,
+                          info->vo.serialno,
+                          2,
+                          3,
+                          verbose) == -1)
+    {
         return -1;
     }
 
@@ -755,7 +1465,7 @@ int write_seek_index (oggmux_info* info)
         int n;
         for (n=0; n<info->n_kate_streams; ++n) {
             oggmux_kate_stream *ks=info->kate_streams+n;
-            if (write_index_pages(&ks->index, "kate", info, ks->ko.serialno, 1, ks->ki.num_headers) == -1)
+            if (write_index_pages(&ks->index, "kate", info, ks->ko.serialno, 1, ks->ki.num_headers, verbose) == -1)
             {
                 return -1;
             }
@@ -763,62 +1473,744 @@ int write_seek_index (oggmux_info* info)
     }
 #endif
 
-    return 0;
+    return 0;
+}
+
+/* Overwrites existing skeleton index placeholder packets with valid keyframe
+   index data. Must only be called once we've constructed the index data after
+   encoding the entire file. */
+int write_seek_index (oggmux_info* info)
+{
+    /* We shouldn't write indexes for skeleton 3, it's a skeleton 4 feature. */
+    assert(!info->skeleton_3);
+
+    /* Mark that we're done indexing. This causes the header packets' fields
+       to be filled with valid, non-unknown values. */
+    info->indexing_complete = 1;
+
+    /* If the reserved space was wrong, the whole file is rewritten with
+       the exact index instead. */
+    if (finalize_seek_index(info) == 1) {
+        return 0;
+    }
+    return overwrite_seek_index(info, 1);
+}
+
+/* Fills the index placeholders with the keypoints so far, so that the output
+   is seekable up to its current end if the encode doesn't get to finish.
+   The write position is left at the end. */
+static void refresh_seek_index (oggmux_info* info)
+{
+    ogg_int64_t offset = ftello(info->outfile);
+
+    info->indexing_complete = 1;
+    if (overwrite_seek_index(info, 0) == -1)
+        fprintf(stderr, "\nWARNING: Failed to update the keyframe index.\n");
+    info->indexing_complete = 0;
+    if (fseeko(info->outfile, offset, SEEK_SET) < 0) {
+        fprintf(stderr, "ERROR: Can't seek output file after updating the index!\n");
+        exit(1);
+    }
+}
+
+/* Writes the index of one stream to the sidecar file and its keypoints to
+   the JSON manifest. */
+static int
+write_sidecar_stream (oggmux_info *info,
+                      FILE *out,
+                      FILE *json,
+                      seek_index* index,
+                      const char* name,
+                      ogg_uint32_t serialno,
+                      int target_packet,
+                      int num_headers,
+                      ogg_int64_t length,
+                      int last)
+{
+    ogg_packet op;
+    unsigned char size[4];
+    keypoint* keypoints;
+    int i, k;
+    int index_bytes = 0;
+
+    keypoints = (keypoint*)malloc(sizeof(keypoint) * (index->packet_num + 1));
+    if (!keypoints) {
+        fprintf(stderr, "ERROR: malloc failure in write_sidecar_stream\n");
+        return -1;
+    }
+    k = index->packet_num ?
+        find_keypoints(index, target_packet, num_headers, keypoints, index->packet_num) : 0;
+    for (i=0; i<k; i++) {
+        index_bytes += keypoint_bytes(keypoints, i);
+    }
+    if (build_index_packet(index, serialno, keypoints, k, index_bytes, &op) == -1) {
+        free(keypoints);
+        return -1;
+    }
+    write32le(size, op.bytes);
+    if (fwrite(size, 1, 4, out) != 4 ||
+        fwrite(op.packet, 1, op.bytes, out) != op.bytes) {
+        free(op.packet);
+        free(keypoints);
+        return -1;
+    }
+    free(op.packet);
+
+    fprintf(json, "    {\n");
+    fprintf(json, "      \"codec\": \"%s\",\n", name);
+    fprintf(json, "      \"serialno\": %u,\n", serialno);
+    fprintf(json, "      \"first_time\": %" PRId64 ",\n", k ? index->start_time : 0);
+    fprintf(json, "      \"last_time\": %" PRId64 ",\n", k ? index->end_time : 0);
+    fprintf(json, "      \"keypoints\": [");
+    for (i=0; i<k; i++) {
+        /* a keypoint's byte range runs up to the next one */
+        ogg_int64_t end = (i+1 < k ? keypoints[i+1].offset : length) - 1;
+        fprintf(json, "%s\n        {\"time\": %" PRId64 ", \"start\": %" PRId64 ", \"end\": %" PRId64 "}",
+                i ? "," : "", keypoints[i].time, keypoints[i].offset, end);
+    }
+    fprintf(json, "%s]\n", k ? "\n      " : "");
+    fprintf(json, "    }%s\n", last ? "" : ",");
+
+    free(keypoints);
+    return 0;
+}
+
+/* Writes the keyframe indexes of all streams to a sidecar file, for outputs
+   that can't be seeked back into to fill in the skeleton index. The file
+   holds a header followed by one skeleton 4 index packet per stream, each
+   prefixed with its size:
+
+     0  8  "OggIndex"
+     8  2  version major (1)
+    10  2  version minor (0)
+    12  4  number of streams
+    16  8  offset of the first content page
+    24  8  length of the Ogg file
+
+   A JSON manifest with the byte range behind every keypoint is written
+   next to it, with ".json" appended to the name. */
+int write_index_sidecar (oggmux_info* info)
+{
+    FILE *out, *json;
+    char *json_name;
+    unsigned char header[32];
+    ogg_int64_t length = output_length(info);
+    int num_streams = (!info->audio_only) + (!info->video_only);
+    int n = 0;
+    int ret = 0;
+
+#ifdef HAVE_KATE
+    if (info->with_kate)
+        num_streams += info->n_kate_streams;
+#endif
+
+    json_name = malloc(strlen(info->index_sidecar) + 6);
+    if (!json_name)
+        return -1;
+    sprintf(json_name, "%s.json", info->index_sidecar);
+    out = fopen(info->index_sidecar, "wb");
+    json = fopen(json_name, "w");
+    if (!out || !json) {
+        fprintf(stderr, "ERROR: Unable to open index sidecar file `%s'.\n",
+                out ? json_name : info->index_sidecar);
+        if (out) fclose(out);
+        if (json) fclose(json);
+        free(json_name);
+        return -1;
+    }
+
+    memcpy(header, "OggIndex", 8);
+    write16le(header+8, 1);
+    write16le(header+10, 0);
+    write32le(header+12, num_streams);
+    write64le(header+16, info->content_offset);
+    write64le(header+24, length);
+    if (fwrite(header, 1, sizeof(header), out) != sizeof(header))
+        ret = -1;
+
+    fprintf(json, "{\n");
+    fprintf(json, "  \"file_length\": %" PRId64 ",\n", length);
+    fprintf(json, "  \"content_offset\": %" PRId64 ",\n", info->content_offset);
+    fprintf(json, "  \"streams\": [\n");
+    if (ret == 0 && !info->audio_only)
+        ret = write_sidecar_stream(info, out, json, &info->theora_index, "theora",
+                                   info->to.serialno, 1, 3, length, ++n == num_streams);
+    if (ret == 0 && !info->video_only)
+        ret = write_sidecar_stream(info, out, json, &info->vorbis_index, "vorbis",
+                                   info->vo.serialno, 2, 3, length, ++n == num_streams);
+#ifdef HAVE_KATE
+    if (info->with_kate) {
+        int i;
+        for (i=0; ret == 0 && i<info->n_kate_streams; ++i) {
+            oggmux_kate_stream *ks=info->kate_streams+i;
+            ret = write_sidecar_stream(info, out, json, &ks->index, "kate",
+                                       ks->ko.serialno, 1, ks->ki.num_headers,
+                                       length, ++n == num_streams);
+        }
+    }
+#endif
+    fprintf(json, "  ]\n");
+    fprintf(json, "}\n");
+
+    if (fclose(out) != 0 || ret != 0) {
+        fprintf(stderr, "ERROR: Failed to write index sidecar file `%s'.\n", info->index_sidecar);
+        ret = -1;
+    }
+    fclose(json);
+    free(json_name);
+    return ret;
+}
+
+/* Adds skeleton index packets to the output file at the current write cursor
+   for every stream. We'll fill them with valid data later, we just fill them
+   with placeholder data so that we don't need to rewrite the entire file
+   after encode when we add the index. */
+static int write_placeholder_index_pages (oggmux_info *info)
+{
+    info->index_offset = ftello(info->outfile);
+    if (estimate_index_sizes_from_first_pass(info) == -1) {
+        return -1;
+    }
+    if (info->theora_index_reserve != -1) {
+        info->theora_index.packet_size = info->theora_index_reserve;
+    }
+    if (!info->audio_only &&
+        write_index_placeholder_for_stream(info,
+                                           &info->theora_index,
+                                           info->to.serialno) == -1)
+    {
+        return -1;
+    }
+    if (info->vorbis_index_reserve != -1) {
+        info->vorbis_index.packet_size = info->vorbis_index_reserve;
+    }
+    if (!info->video_only &&
+        write_index_placeholder_for_stream(info,
+                                           &info->vorbis_index,
+                                           info->vo.serialno) == -1)
+    {
+        return -1;
+    }
+
+#ifdef HAVE_KATE
+    if (info->with_kate) {
+        int n;
+        for (n=0; n<info->n_kate_streams; ++n) {
+            oggmux_kate_stream *ks=info->kate_streams+n;
+            if (info->kate_index_reserve != -1) {
+                ks->index.packet_size = info->kate_index_reserve;
+            }
+            if (write_index_placeholder_for_stream(info,
+                                                   &ks->index,
+                                                   ks->ko.serialno) == -1)
+            {
+                return -1;
+            }
+        }
+    }
+#endif
+
+    return 0;
+}
+
+/* Copies a header packet; the encoders only keep theirs until the next
+   call. */
+static void keep_header_packet(ogg_packet *dst, const ogg_packet *src)
+{
+    *dst = *src;
+    dst->packet = malloc(src->bytes > 0 ? src->bytes : 1);
+    if (!dst->packet) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        exit(1);
+    }
+    memcpy(dst->packet, src->packet, src->bytes);
+}
+
+/* Writes the skeleton and header pages of all streams to the start of the
+   output file. */
+static void write_headers (oggmux_info *info) {
+    ogg_page og;
+    int n;
+
+    /* first packet should be skeleton fishead packet, if skeleton is used */
+
+    if (info->with_skeleton) {
+        /* Sometimes the output file is not seekable. We can't write the seek
+           index if the output is not seekable. So write a Skeleton3.0 header
+           packet, which will in turn determine if the file is seekable. If it
+           is, we can safely construct an index, so then overwrite the header
+           page with a Skeleton4.0 header page. */
+        int skeleton_3 = info->skeleton_3;
+        info->skeleton_3 = 1;
+        ogg_stream_init (&info->so, info->serialno++);
+        add_fishead_packet (info, 3, 0);
+        if (ogg_stream_pageout (&info->so, &og) != 1) {
+            fprintf (stderr, "Internal Ogg library error.\n");
+            exit (1);
+        }
+        write_page (info, &og);
+        assert(info->output_seekable != MAYBE_SEEKABLE);
+
+        if (info->output_seekable == NOT_SEEKABLE && !skeleton_3) {
+            fprintf(stderr, "WARNING: Can't write keyframe-seek-index into "
+                            "non-seekable output stream! Writing Skeleton3 track.\n");
+        }
+
+        info->skeleton_3 = skeleton_3 || info->output_seekable == NOT_SEEKABLE;
+
+        if (!info->skeleton_3) {
+            /* Output is seekable and we're indexing. Overwrite the
+               Skeleton3.0 BOS page with a Skeleton4.0 BOS page. */
+            if (fseeko (info->outfile, 0, SEEK_SET) < 0) {
+                fprintf (stderr, "ERROR: failed to seek in seekable output file!?!\n");
+                exit (1);
+            }
+            ogg_stream_clear (&info->so);
+            ogg_stream_init (&info->so, info->serialno++);
+            add_fishead_packet (info, 4, 0);
+            if (ogg_stream_pageout (&info->so, &og) != 1) {
+                fprintf (stderr, "Internal Ogg library error.\n");
+                exit (1);
+            }
+            write_page (info, &og);
+        }
+    }
+
+    /* write the bitstream header packets with proper page interleave */
+
+    /* first packet will get its own page automatically */
+    if (!info->audio_only) {
+        /* write the bitstream header packets with proper page interleave */
+        /* first packet will get its own page automatically */
+        ogg_stream_packetin(&info->to, &info->theora_headers[0]);
+        if(ogg_stream_pageout(&info->to, &og) != 1) {
+            fprintf(stderr, "Internal Ogg library error.\n");
+            exit(1);
+        }
+        write_page (info, &og);
+
+        /* the remaining theora headers */
+        for (n=1; n<info->num_theora_headers; ++n)
+            ogg_stream_packetin(&info->to, &info->theora_headers[n]);
+    }
+    if (!info->video_only) {
+        ogg_stream_packetin (&info->vo, &info->vorbis_headers[0]);    /* automatically placed in its own
+                                 * page */
+        if (ogg_stream_pageout (&info->vo, &og) != 1) {
+            fprintf (stderr, "Internal Ogg library error.\n");
+            exit (1);
+        }
+        write_page (info, &og);
+
+        /* remaining vorbis header packets */
+        ogg_stream_packetin (&info->vo, &info->vorbis_headers[1]);
+        ogg_stream_packetin (&info->vo, &info->vorbis_headers[2]);
+    }
+
+#ifdef HAVE_KATE
+    if (info->with_kate) {
+        int n;
+        for (n=0; n<info->n_kate_streams; ++n) {
+            oggmux_kate_stream *ks=info->kate_streams+n;
+            ogg_packet op;
+            int ret;
+            while (1) {
+                ret=kate_ogg_encode_headers(&ks->k,&ks->kc,&op);
+                if (ret==0) {
+                    ogg_stream_packetin(&ks->ko,&op);
+                    ogg_packet_clear(&op);
+                }
+                if (ret<0) fprintf(stderr, "kate_encode_headers: %d\n",ret);
+                if (ret>0) break;
+            }
+
+            /* first header is on a separate page - libogg will do it automatically */
+            ret=ogg_stream_pageout (&ks->ko, &og);
+            if (ret!=1) {
+                fprintf (stderr, "Internal Ogg library error.\n");
+                exit (1);
+            }
+            write_page (info, &og);
+        }
+    }
+#endif
+
+    /* output the appropriate fisbone packets */
+    if (info->with_skeleton) {
+        add_fisbone_packet (info);
+        while (1) {
+            int result = ogg_stream_flush (&info->so, &og);
+                if (result < 0) {
+                /* can't get here */
+                fprintf (stderr, "Internal Ogg library error.\n");
+            exit (1);
+                }
+            if (result == 0)
+                break;
+            write_page (info, &og);
+        }
+    }
+
+    /* Flush the rest of our headers. This ensures
+     * the actual data in each stream will start
+     * on a new page, as per spec. */
+    while (1 && !info->audio_only) {
+        int result = ogg_stream_flush (&info->to, &og);
+        if (result < 0) {
+            /* can't get here */
+            fprintf (stderr, "Internal Ogg library error.\n");
+            exit (1);
+        }
+        if (result == 0)
+            break;
+        write_page (info, &og);
+    }
+    while (1 && !info->video_only) {
+        int result = ogg_stream_flush (&info->vo, &og);
+        if (result < 0) {
+            /* can't get here */
+            fprintf (stderr, "Internal Ogg library error.\n");
+            exit (1);
+        }
+        if (result == 0)
+            break;
+        write_page (info, &og);
+    }
+#ifdef HAVE_KATE
+    if (info->with_kate) {
+        int n;
+        for (n=0; n<info->n_kate_streams; ++n) {
+            oggmux_kate_stream *ks=info->kate_streams+n;
+            while (1) {
+                int result = ogg_stream_flush (&ks->ko, &og);
+                if (result < 0) {
+                    /* can't get here */
+                    fprintf (stderr, "Internal Ogg library error.\n");
+                    exit (1);
+                }
+                if (result == 0)
+                    break;
+                write_page (info, &og);
+            }
+        }
+    }
+#endif
+
+    if (info->with_skeleton) {
+        oggmux_end_skeleton_headers (info);
+    }
+    if (info->sinks) {
+        output_sinks_end_header(info->sinks,
+                                info->audio_only ? "audio/ogg" : "video/ogg");
+    }
 }
 
-/* Adds skeleton index packets to the output file at the current write cursor
-   for every stream. We'll fill them with valid data later, we just fill them
-   with placeholder data so that we don't need to rewrite the entire file
-   after encode when we add the index. */
-static int write_placeholder_index_pages (oggmux_info *info)
+/* Reads the checkpoint in info->checkpoint_name. Only where to resume is
+   taken, unless |restore| is set: then the state of the streams and their
+   indexes is restored as well, the streams have to be set up for that.
+   Returns 0 on success, -1 if there is no usable checkpoint. */
+static int read_checkpoint(oggmux_info *info, int restore)
 {
-    if (info->theora_index_reserve != -1) {
-        info->theora_index.packet_size = info->theora_index_reserve;
-    }
-    if (!info->audio_only &&
-        write_index_placeholder_for_stream(info,
-                                           &info->theora_index,
-                                           info->to.serialno) == -1)
-    {
+    char line[256], key[32], name[32];
+    ogg_stream_state *os = NULL;
+    seek_index *index = NULL;
+    int version = 0, streams = 0, expected = 0, ok;
+    FILE *f = fopen(info->checkpoint_name, "r");
+
+    if (!f)
         return -1;
-    }
-    if (info->vorbis_index_reserve != -1) {
-        info->vorbis_index.packet_size = info->vorbis_index_reserve;
-    }
-    if (!info->video_only &&
-        write_index_placeholder_for_stream(info,
-                                           &info->vorbis_index,
-                                           info->vo.serialno) == -1)
-    {
+    if (!fgets(line, sizeof(line), f) ||
+        sscanf(line, "ffmpeg2theora-checkpoint %d", &version) != 1 || version != 1) {
+        fclose(f);
         return -1;
     }
-
-#ifdef HAVE_KATE
-    if (info->with_kate) {
+    while (fgets(line, sizeof(line), f)) {
+        long serialno, pageno;
+        ogg_int64_t packetno, granulepos, index_packetno;
         int n;
-        for (n=0; n<info->n_kate_streams; ++n) {
-            oggmux_kate_stream *ks=info->kate_streams+n;
-            if (info->kate_index_reserve != -1) {
-                ks->index.packet_size = info->kate_index_reserve;
+
+        if (sscanf(line, "%31s", key) != 1)
+            continue;
+        if (!strcmp(key, "offset")) {
+            sscanf(line, "%*s %" SCNd64, &info->resume_offset);
+        }
+        else if (!strcmp(key, "time")) {
+            sscanf(line, "%*s %" SCNd64, &info->resume_time);
+        }
+        else if (!strcmp(key, "twopass_offset")) {
+            sscanf(line, "%*s %" SCNd64, &info->twopass_resume_offset);
+        }
+        else if (!restore) {
+            continue;
+        }
+        else if (!strcmp(key, "frame")) {
+            sscanf(line, "%*s %" SCNd64, &info->theora_frame_base);
+        }
+        else if (!strcmp(key, "vorbis_granulepos")) {
+            sscanf(line, "%*s %" SCNd64, &info->resume_vorbis_granulepos);
+        }
+        else if (!strcmp(key, "content_offset")) {
+            sscanf(line, "%*s %" SCNd64, &info->content_offset);
+        }
+        else if (!strcmp(key, "index_offset")) {
+            sscanf(line, "%*s %" SCNd64, &info->index_offset);
+        }
+        else if (!strcmp(key, "skeleton")) {
+            if (sscanf(line, "%*s %ld %d", &serialno, &info->skeleton_3) != 2 || !info->with_skeleton)
+                break;
+            ogg_stream_init(&info->so, serialno);
+            streams++;
+        }
+        else if (!strcmp(key, "bytes")) {
+            sscanf(line, "%*s %" SCNd64 " %" SCNd64, &info->video_bytesout, &info->audio_bytesout);
+        }
+        else if (!strcmp(key, "stream")) {
+            if (sscanf(line, "%*s %31s %ld %ld %" SCNd64 " %" SCNd64 " %" SCNd64, name,
+                       &serialno, &pageno, &packetno, &granulepos, &index_packetno) != 6)
+                break;
+            if (!strcmp(name, "theora") && !info->audio_only) {
+                os = &info->to;
+                index = &info->theora_index;
+                info->theora_packet_base = 3 - index_packetno;
             }
-            if (write_index_placeholder_for_stream(info,
-                                                   &ks->index,
-                                                   ks->ko.serialno) == -1)
-            {
-                return -1;
+            else if (!strcmp(name, "vorbis") && !info->video_only) {
+                os = &info->vo;
+                index = &info->vorbis_index;
+                info->vorbis_packet_base = 3 - index_packetno;
+            }
+            else {
+                break;
             }
+            /* same serial number, and the next page continues the stream */
+            ogg_stream_clear(os);
+            ogg_stream_init(os, serialno);
+            os->b_o_s = 1;
+            os->pageno = pageno;
+            os->packetno = packetno;
+            os->granulepos = granulepos;
+            streams++;
+        }
+        else if (!strcmp(key, "keyframe") && index) {
+            ogg_int64_t start_time;
+            if (sscanf(line, "%*s %d %" SCNd64, &n, &start_time) != 2 ||
+                seek_index_record_sample(index, n, start_time, start_time, 1) != 0)
+                break;
+        }
+        else if (!strcmp(key, "page") && index) {
+            ogg_int64_t offset;
+            if (sscanf(line, "%*s %" SCNd64 " %d", &offset, &n) != 2 ||
+                seek_index_record_page(index, offset, n) != 0)
+                break;
+        }
+        else if (!strcmp(key, "index") && index) {
+            if (sscanf(line, "%*s %" SCNd64 " %d %u %" SCNd64 " %" SCNd64 " %" SCNd64,
+                       &index->page_location, &index->max_keypoints, &index->packet_size,
+                       &index->start_time, &index->end_time, &index->prev_packet_time) != 6)
+                break;
         }
     }
+    if (restore)
+        expected = !info->audio_only + !info->video_only + !!info->with_skeleton;
+    ok = feof(f) && streams == expected;
+    fclose(f);
+    return ok ? 0 : -1;
+}
+
+int oggmux_read_checkpoint (oggmux_info *info)
+{
+    if (read_checkpoint(info, 0) == -1 || info->resume_offset <= 0)
+        return -1;
+    info->resume = 1;
+    return 0;
+}
+
+/* Opens the output of the encode to resume and cuts it off where the
+   checkpoint was written. Returns 0 on success, -1 on failure. */
+int oggmux_open_resume (oggmux_info *info, const char *name)
+{
+    ogg_int64_t length;
+
+    info->outfile = fopen(name, "rb+");
+    if (!info->outfile)
+        return -1;
+    if (fseeko(info->outfile, 0, SEEK_END) < 0 ||
+        (length = ftello(info->outfile)) < info->resume_offset) {
+        fprintf(stderr, "ERROR: `%s' is shorter than its checkpoint.\n", name);
+        exit(1);
+    }
+#ifdef WIN32
+    if (_chsize_s(_fileno(info->outfile), info->resume_offset) != 0 ||
+#else
+    if (ftruncate(fileno(info->outfile), info->resume_offset) < 0 ||
 #endif
+        fseeko(info->outfile, info->resume_offset, SEEK_SET) < 0) {
+        fprintf(stderr, "ERROR: Can't truncate `%s' to its checkpoint.\n", name);
+        exit(1);
+    }
+    info->outfile_name = name;
+    return 0;
+}
+
+/* Picks up the streams where the checkpoint left them, instead of writing
+   the headers. The restarted encoders count frames and samples from 0,
+   their packets are moved to the time of the checkpoint. */
+static void resume_streams (oggmux_info *info)
+{
+    if (info->with_kate) {
+        fprintf(stderr, "ERROR: Encodes with subtitles can't be resumed.\n");
+        exit(1);
+    }
+    if (read_checkpoint(info, 1) == -1) {
+        fprintf(stderr, "ERROR: The checkpoint `%s' doesn't match this encode, "
+                        "resume with the options it was started with.\n",
+                info->checkpoint_name);
+        exit(1);
+    }
+    info->output_seekable = SEEKABLE;
+    info->bytes_written = info->resume_offset;
+    info->last_checkpoint = info->resume_time;
+    info->videotime = info->resume_time / 1000.0;
+    info->video_packet_time = info->resume_time;
+    if (!info->video_only) {
+        /* Audio is decoded again from the time of the keyframe, the samples
+           up to what was written already are dropped. */
+        info->vorbis_granule_base = info->resume_time * info->sample_rate / 1000;
+        if (info->vorbis_granule_base < info->resume_vorbis_granulepos)
+            info->vorbis_resume_skip = info->resume_vorbis_granulepos - info->vorbis_granule_base;
+        info->vorbis_granulepos = info->resume_vorbis_granulepos;
+        info->audiotime = (double)info->resume_vorbis_granulepos / info->sample_rate;
+        info->audio_packet_time = info->audiotime * 1000;
+    }
+    fprintf(stderr, "  Resuming at %.3f seconds.\n", info->resume_time / 1000.0);
+}
+
+/* Non-zero if the granulepos of a Theora stream counts frames from 1, as
+   bitstream version 3.2.1 and later do. */
+static int theora_frame_offset(const th_info *ti)
+{
+    return (ti->version_major << 16 | ti->version_minor << 8 |
+            ti->version_subminor) >= 0x030201;
+}
+
+/* Builds the Theora comment header from info->tc. A passed through stream
+   has no encoder to do it. */
+static void theora_comment_header(oggmux_info *info, ogg_packet *op)
+{
+    const char *vendor = th_version_string();
+    long bytes = 7 + 4 + strlen(vendor) + 4;
+    unsigned char *p;
+    int n;
+
+    for (n=0; n<info->tc.comments; ++n)
+        bytes += 4 + info->tc.comment_lengths[n];
+    memset(op, 0, sizeof(*op));
+    op->packet = p = malloc(bytes);
+    if (!p) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        exit(1);
+    }
+    op->bytes = bytes;
+    op->packetno = 1;
+    memcpy(p, "\x81theora", 7);
+    p += 7;
+    write32le(p, strlen(vendor));
+    memcpy(p + 4, vendor, strlen(vendor));
+    p += 4 + strlen(vendor);
+    write32le(p, info->tc.comments);
+    p += 4;
+    for (n=0; n<info->tc.comments; ++n) {
+        write32le(p, info->tc.comment_lengths[n]);
+        memcpy(p + 4, info->tc.user_comments[n], info->tc.comment_lengths[n]);
+        p += 4 + info->tc.comment_lengths[n];
+    }
+}
+
+/* Takes the header packets of a Theora stream of the input, which is then
+   passed through with oggmux_copy_video() instead of encoded. Its settings
+   end up in info->ti, its comments are replaced with info->tc. Returns 0
+   on success, -1 if the headers are not valid. */
+int oggmux_copy_theora_headers (oggmux_info *info, const ogg_packet *headers)
+{
+    th_comment tc;
+    th_setup_info *setup = NULL;
+    ogg_packet op;
+    int n, ret = 1;
+
+    th_info_init(&info->ti);
+    th_comment_init(&tc);
+    for (n=0; n<3 && ret > 0; ++n) {
+        op = headers[n];
+        ret = th_decode_headerin(&info->ti, &tc, &setup, &op);
+    }
+    th_comment_clear(&tc);
+    if (setup)
+        th_setup_free(setup);
+    if (ret <= 0)
+        return -1;
+
+    keep_header_packet(&info->theora_headers[0], &headers[0]);
+    keep_header_packet(&info->theora_headers[2], &headers[2]);
+    memset(&info->theora_headers[1], 0, sizeof(ogg_packet));
+    info->num_theora_headers = 3;
+    info->theora_copy = 1;
+    info->theora_copy_frames = 0;
+    info->theora_copy_keyframe = 0;
+    info->theora_pending.valid = 0;
+    return 0;
+}
+
+/* Takes the header packets of a Vorbis stream of the input, which is then
+   passed through with oggmux_copy_audio() instead of encoded. Returns 0 on
+   success, -1 if the headers are not valid. */
+int oggmux_copy_vorbis_headers (oggmux_info *info, const ogg_packet *headers)
+{
+    vorbis_comment vc;
+    ogg_packet op;
+    int n;
+
+    vorbis_info_init(&info->vi);
+    vorbis_comment_init(&vc);
+    for (n=0; n<3; ++n) {
+        op = headers[n];
+        if (vorbis_synthesis_headerin(&info->vi, &vc, &op) < 0)
+            break;
+    }
+    vorbis_comment_clear(&vc);
+    if (n < 3) {
+        vorbis_info_clear(&info->vi);
+        return -1;
+    }
 
+    info->channels = info->vi.channels;
+    info->sample_rate = info->vi.rate;
+    keep_header_packet(&info->vorbis_headers[0], &headers[0]);
+    keep_header_packet(&info->vorbis_headers[2], &headers[2]);
+    info->vorbis_copy = 1;
+    info->vorbis_next_packetno = 3;
+    info->vorbis_pending.valid = 0;
     return 0;
 }
 
 void oggmux_init (oggmux_info *info) {
-    ogg_page og;
     ogg_packet op;
     int ret;
 
+    if (info->passno==1) {
+        /* The first pass only collects rate control data, nothing is
+           written. The theora headers still have to be flushed before
+           the encoder accepts frames. */
+        seek_index_init(&info->firstpass_index, info->index_interval);
+        info->firstpass_bytes = 0;
+        if (!info->audio_only) {
+            while ((ret = th_encode_flushheader(info->td, &info->tc, &op)) > 0);
+            if (ret < 0) {
+                fprintf(stderr, "Internal Theora library error.\n");
+                exit(1);
+            }
+        }
+        return;
+    }
+
     /* yayness.  Set up Ogg output stream */
     srand (time (NULL));
     info->serialno = rand();
@@ -836,10 +2228,21 @@ void oggmux_init (oggmux_info *info) {
     if (!info->audio_only) {
         ogg_stream_init (&info->to, info->serialno++);
         seek_index_init(&info->theora_index, info->index_interval);
+        seek_index_set_max_bytes(&info->theora_index, info->index_max_bytes);
     }
     /* init theora done */
+    /* a passed through Vorbis stream was set up from its headers, the
+       decoder state is only needed for the times of its packets */
+    if (!info->video_only && info->vorbis_copy) {
+        vorbis_synthesis_init (&info->vd, &info->vi);
+        vorbis_block_init (&info->vd, &info->vb);
+
+        seek_index_init(&info->vorbis_index, info->index_interval);
+        seek_index_set_max_bytes(&info->vorbis_index, info->index_max_bytes);
+        info->vorbis_granulepos = 0;
+    }
     /* initialize Vorbis too, if we have audio. */
-    if (!info->video_only) {
+    else if (!info->video_only) {
         int ret;
         vorbis_info_init (&info->vi);
         /* Encoding using a VBR quality mode.  */
@@ -860,6 +2263,7 @@ void oggmux_init (oggmux_info *info) {
         vorbis_block_init (&info->vd, &info->vb);
         
         seek_index_init(&info->vorbis_index, info->index_interval);
+        seek_index_set_max_bytes(&info->vorbis_index, info->index_max_bytes);
         info->vorbis_granulepos = 0;
     }
     /* audio init done */
@@ -884,6 +2288,7 @@ void oggmux_init (oggmux_info *info) {
             kate_comment_add_tag (&ks->kc, "ENCODER",PACKAGE_STRING);
 
             seek_index_init(&ks->index, info->index_interval);
+            seek_index_set_max_bytes(&ks->index, info->index_max_bytes);
         }
 #endif
     }
@@ -898,70 +2303,19 @@ void oggmux_init (oggmux_info *info) {
         info->skeleton_3 = 1;
     }
 
-    /* first packet should be skeleton fishead packet, if skeleton is used */
-
-    if (info->with_skeleton && info->passno!=1) {
-        /* Sometimes the output file is not seekable. We can't write the seek
-           index if the output is not seekable. So write a Skeleton3.0 header
-           packet, which will in turn determine if the file is seekable. If it
-           is, we can safely construct an index, so then overwrite the header
-           page with a Skeleton4.0 header page. */
-        int skeleton_3 = info->skeleton_3;
-        info->skeleton_3 = 1;
-        ogg_stream_init (&info->so, info->serialno++);
-        add_fishead_packet (info, 3, 0);
-        if (ogg_stream_pageout (&info->so, &og) != 1) {
-            fprintf (stderr, "Internal Ogg library error.\n");
-            exit (1);
-        }
-        write_page (info, &og);
-        assert(info->output_seekable != MAYBE_SEEKABLE);
-
-        if (info->output_seekable == NOT_SEEKABLE && !skeleton_3) {
-            fprintf(stderr, "WARNING: Can't write keyframe-seek-index into "
-                            "non-seekable output stream! Writing Skeleton3 track.\n");
-        }
-
-        info->skeleton_3 = skeleton_3 || info->output_seekable == NOT_SEEKABLE;
-
-        if (!info->skeleton_3) {
-            /* Output is seekable and we're indexing. Overwrite the
-               Skeleton3.0 BOS page with a Skeleton4.0 BOS page. */
-            if (fseeko (info->outfile, 0, SEEK_SET) < 0) {
-                fprintf (stderr, "ERROR: failed to seek in seekable output file!?!\n");
-                exit (1);
-            }
-            ogg_stream_clear (&info->so);
-            ogg_stream_init (&info->so, info->serialno++);
-            add_fishead_packet (info, 4, 0);
-            if (ogg_stream_pageout (&info->so, &og) != 1) {
-                fprintf (stderr, "Internal Ogg library error.\n");
-                exit (1);
-            }
-            write_page (info, &og);
-        }
+    if (info->with_kate && (info->segment_time > 0 || info->segment_size > 0)) {
+        fprintf(stderr, "ERROR: Subtitles can't be split into segments, "
+                        "use --nosubs with --segment-time or --segment-size.\n");
+        exit(1);
     }
 
-    /* write the bitstream header packets with proper page interleave */
-
-    /* first packet will get its own page automatically */
-    if (!info->audio_only) {
-        /* write the bitstream header packets with proper page interleave */
-        /* first packet will get its own page automatically */
-        if(th_encode_flushheader(info->td, &info->tc, &op) <= 0) {
-          fprintf(stderr, "Internal Theora library error.\n");
-          exit(1);
-        }
-        if(info->passno!=1){
-            ogg_stream_packetin(&info->to, &op);
-            if(ogg_stream_pageout(&info->to, &og) != 1) {
-                fprintf(stderr, "Internal Ogg library error.\n");
-                exit(1);
-            }
-            write_page (info, &og);
-        }
-
-        /* create the remaining theora headers */
+    /* Keep the header packets, every segment starts with them. Passed
+       through streams only get a new comment header. */
+    if (!info->audio_only && info->theora_copy) {
+        theora_comment_header(info, &info->theora_headers[1]);
+    }
+    else if (!info->audio_only) {
+        info->num_theora_headers = 0;
         for(;;){
           ret=th_encode_flushheader(info->td, &info->tc, &op);
           if(ret < 0) {
@@ -969,147 +2323,305 @@ void oggmux_init (oggmux_info *info) {
             exit(1);
           }
           else if(!ret) break;
-          if(info->passno!=1)
-            ogg_stream_packetin(&info->to, &op);
+          if (info->num_theora_headers == 3) {
+            fprintf(stderr,"Internal Theora library error.\n");
+            exit(1);
+          }
+          keep_header_packet(&info->theora_headers[info->num_theora_headers++], &op);
         }
     }
-    if (!info->video_only && info->passno!=1) {
+    if (!info->video_only && info->vorbis_copy) {
+        ogg_packet header_comm;
+
+        vorbis_commentheader_out (&info->vc, &header_comm);
+        keep_header_packet(&info->vorbis_headers[1], &header_comm);
+        ogg_packet_clear (&header_comm);
+    }
+    else if (!info->video_only) {
         ogg_packet header;
         ogg_packet header_comm;
         ogg_packet header_code;
 
         vorbis_analysis_headerout (&info->vd, &info->vc, &header,
                        &header_comm, &header_code);
-        ogg_stream_packetin (&info->vo, &header);    /* automatically placed in its own
-                                 * page */
-        if (ogg_stream_pageout (&info->vo, &og) != 1) {
-            fprintf (stderr, "Internal Ogg library error.\n");
-            exit (1);
-        }
-        write_page (info, &og);
+        keep_header_packet(&info->vorbis_headers[0], &header);
+        keep_header_packet(&info->vorbis_headers[1], &header_comm);
+        keep_header_packet(&info->vorbis_headers[2], &header_code);
+    }
 
-        /* remaining vorbis header packets */
-        ogg_stream_packetin (&info->vo, &header_comm);
-        ogg_stream_packetin (&info->vo, &header_code);
+    if (info->resume)
+        resume_streams (info);
+    else
+        write_headers (info);
+}
+
+/* Writes the index placeholder pages, unless writing skeleton 3, and the
+   skeleton EOS page once all other header pages are written. */
+void oggmux_end_skeleton_headers (oggmux_info *info) {
+    ogg_page og;
+    ogg_packet op;
+    int result;
+
+    if (!info->skeleton_3) {
+        /* Add placeholder packets to reserve space for the index
+         * at the start of file. */
+        write_placeholder_index_pages (info);
     }
 
-#ifdef HAVE_KATE
-    if (info->with_kate && info->passno!=1) {
-        int n;
-        for (n=0; n<info->n_kate_streams; ++n) {
-            oggmux_kate_stream *ks=info->kate_streams+n;
-            int ret;
-            while (1) {
-                ret=kate_ogg_encode_headers(&ks->k,&ks->kc,&op);
-                if (ret==0) {
-                    ogg_stream_packetin(&ks->ko,&op);
-                    ogg_packet_clear(&op);
-                }
-                if (ret<0) fprintf(stderr, "kate_encode_headers: %d\n",ret);
-                if (ret>0) break;
-            }
+    /* build and add the e_o_s packet */
+    memset (&op, 0, sizeof (op));
+    op.b_o_s = 0;
+    op.e_o_s = 1; /* its the e_o_s packet */
+    op.granulepos = 0;
+    op.bytes = 0; /* e_o_s packet is an empty packet */
+    ogg_stream_packetin (&info->so, &op);
+
+    result = ogg_stream_flush (&info->so, &og);
+    if (result < 0) {
+        /* can't get here */
+        fprintf (stderr, "Internal Ogg library error.\n");
+        exit (1);
+    }
+    write_page (info, &og);
 
-            /* first header is on a separate page - libogg will do it automatically */
-            ret=ogg_stream_pageout (&ks->ko, &og);
-            if (ret!=1) {
-                fprintf (stderr, "Internal Ogg library error.\n");
-                exit (1);
-            }
-            write_page (info, &og);
-        }
+    /* Record the offset of the next page; it's the first non-header, or
+     * content page. */
+    info->content_offset = output_offset(info);
+}
+
+/* Returns the name of segment |n|: the output name with the segment number
+   before its extension, or the name of the segment list for n == -1. The
+   result has to be freed. */
+static char *segment_file_name(oggmux_info *info, int n)
+{
+    const char *output = info->segment_output;
+    const char *ext = strrchr(output, '.');
+    const char *slash = strrchr(output, '/');
+    size_t base_len;
+    char *name;
+
+    if (!ext || (slash && ext < slash))
+        ext = output + strlen(output);
+    base_len = ext - output;
+    name = malloc(base_len + strlen(ext) + 16);
+    if (!name) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        exit(1);
+    }
+    memcpy(name, output, base_len);
+    if (n < 0)
+        strcpy(name + base_len, ".m3u");
+    else
+        sprintf(name + base_len, "-%05d%s", n, ext);
+    return name;
+}
+
+/* Rewrites the segment list with all segments finished so far. It is
+   written next to the list and renamed over it, so readers never see a
+   partial list. */
+static void update_segment_list(oggmux_info *info)
+{
+    char *list_name = segment_file_name(info, -1);
+    char *tmp_name = malloc(strlen(list_name) + 5);
+    FILE *list;
+    int n;
+
+    if (!tmp_name) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        exit(1);
     }
+    sprintf(tmp_name, "%s.tmp", list_name);
+    list = fopen(tmp_name, "w");
+    if (!list) {
+        fprintf(stderr, "WARNING: Unable to write segment list `%s'.\n", tmp_name);
+        free(tmp_name);
+        free(list_name);
+        return;
+    }
+    for (n=0; n<=info->segment_number; ++n) {
+        char *name = segment_file_name(info, n);
+        const char *slash = strrchr(name, '/');
+        /* the list is next to the segments */
+        fprintf(list, "%s\n", slash ? slash + 1 : name);
+        free(name);
+    }
+    if (fclose(list) != 0) {
+        fprintf(stderr, "WARNING: Unable to write segment list `%s'.\n", tmp_name);
+        remove(tmp_name);
+    } else {
+#ifdef WIN32
+        remove(list_name);
 #endif
-
-    /* output the appropriate fisbone packets */
-    if (info->with_skeleton && info->passno!=1) {
-        add_fisbone_packet (info);
-        while (1) {
-            int result = ogg_stream_flush (&info->so, &og);
-                if (result < 0) {
-                /* can't get here */
-                fprintf (stderr, "Internal Ogg library error.\n");
-            exit (1);
-                }
-            if (result == 0)
-                break;
-            write_page (info, &og);
-        }
+        if (rename(tmp_name, list_name) != 0)
+            fprintf(stderr, "WARNING: Unable to rename `%s' to `%s'.\n", tmp_name, list_name);
     }
+    free(tmp_name);
+    free(list_name);
+}
 
-    /* Flush the rest of our headers. This ensures
-     * the actual data in each stream will start
-     * on a new page, as per spec. */
-    while (1 && !info->audio_only && info->passno!=1) {
-        int result = ogg_stream_flush (&info->to, &og);
-        if (result < 0) {
-            /* can't get here */
-            fprintf (stderr, "Internal Ogg library error.\n");
-            exit (1);
-        }
-        if (result == 0)
-            break;
-        write_page (info, &og);
+/* Opens the file for the current segment as the output. Returns 0 on
+   success, -1 if it can't be opened. */
+int oggmux_open_segment (oggmux_info *info)
+{
+    if (info->segment_name)
+        free(info->segment_name);
+    info->segment_name = segment_file_name(info, info->segment_number);
+    info->outfile = fopen(info->segment_name, "wb");
+    info->outfile_name = info->segment_name;
+    return info->outfile ? 0 : -1;
+}
+
+/* Returns non-zero if a keyframe at |time| ms should start a new segment. */
+static int segment_due(oggmux_info *info, ogg_int64_t time)
+{
+    if (info->passno == 1)
+        return 0;
+    if (info->segment_time > 0 && time - info->segment_start_time >= info->segment_time)
+        return 1;
+    return info->segment_size > 0 && info->bytes_written >= info->segment_size;
+}
+
+static void flush_all_pages(oggmux_info *info);
+
+/* Sets the end of stream flag on the last page of a stream, once it is
+   written: it is still in |page|, from where it went to |offset|. */
+static void end_segment_stream(oggmux_info *info, unsigned char *page, int page_len,
+                               ogg_int64_t offset)
+{
+    ogg_page og;
+
+    if (offset < 0)
+        return;
+    og.header = page;
+    og.header_len = 27 + page[26];
+    og.body = page + og.header_len;
+    og.body_len = page_len - og.header_len;
+    page[5] |= 0x04;
+    ogg_page_checksum_set(&og);
+    if (fseeko(info->outfile, offset, SEEK_SET) < 0 ||
+        fwrite(page, 1, page_len, info->outfile) != page_len ||
+        fseeko(info->outfile, 0, SEEK_END) < 0) {
+        fprintf(stderr, "ERROR: Failed to write `%s'.\n", info->segment_name);
+        exit(1);
     }
-    while (1 && !info->video_only && info->passno!=1) {
-        int result = ogg_stream_flush (&info->vo, &og);
-        if (result < 0) {
-            /* can't get here */
-            fprintf (stderr, "Internal Ogg library error.\n");
-            exit (1);
-        }
-        if (result == 0)
-            break;
-        write_page (info, &og);
+}
+
+/* Finishes the current segment, with its index, and starts the next one
+   with the keyframe at |time| ms. The encoders go on as they are, the new
+   file gets the same headers on streams with new serial numbers. */
+static void next_segment(oggmux_info *info, ogg_int64_t time)
+{
+    oggmux_flush(info, 1);
+    flush_all_pages(info);
+    if (!info->audio_only)
+        end_segment_stream(info, info->videopage, info->videopage_len, info->videopage_offset);
+    if (!info->video_only)
+        end_segment_stream(info, info->audiopage, info->audiopage_len, info->audiopage_offset);
+
+    if (info->with_skeleton && !info->skeleton_3)
+        write_seek_index(info);
+    if (fclose(info->outfile) != 0) {
+        fprintf(stderr, "ERROR: Failed to write `%s'.\n", info->segment_name);
+        exit(1);
     }
-#ifdef HAVE_KATE
-    if (info->with_kate && info->passno!=1) {
-        int n;
-        for (n=0; n<info->n_kate_streams; ++n) {
-            oggmux_kate_stream *ks=info->kate_streams+n;
-            while (1) {
-                int result = ogg_stream_flush (&ks->ko, &og);
-                if (result < 0) {
-                    /* can't get here */
-                    fprintf (stderr, "Internal Ogg library error.\n");
-                    exit (1);
-                }
-                if (result == 0)
-                    break;
-                write_page (info, &og);
-            }
-        }
+    update_segment_list(info);
+
+    info->segment_number++;
+    if (oggmux_open_segment(info) == -1) {
+        fprintf(stderr, "ERROR: Unable to open output file `%s'.\n", info->segment_name);
+        exit(1);
     }
-#endif
+    info->segment_start_time = time;
+    info->output_seekable = MAYBE_SEEKABLE;
+    info->bytes_written = 0;
+    info->indexing_complete = 0;
+    info->final_length = 0;
+    info->content_offset = 0;
+    info->v_pkg = 0;
+    info->a_pkg = 0;
+    info->videopage_offset = -1;
+    info->audiopage_offset = -1;
 
-    if (info->with_skeleton && info->passno!=1) {
-        int result;
+    if (info->with_skeleton)
+        ogg_stream_clear(&info->so);
+    if (!info->audio_only) {
+        ogg_stream_clear(&info->to);
+        ogg_stream_init(&info->to, info->serialno++);
+        seek_index_clear(&info->theora_index);
+        seek_index_init(&info->theora_index, info->index_interval);
+        seek_index_set_max_bytes(&info->theora_index, info->index_max_bytes);
+    }
+    if (!info->video_only) {
+        ogg_stream_clear(&info->vo);
+        ogg_stream_init(&info->vo, info->serialno++);
+        seek_index_clear(&info->vorbis_index);
+        seek_index_init(&info->vorbis_index, info->index_interval);
+        seek_index_set_max_bytes(&info->vorbis_index, info->index_max_bytes);
+        /* the next packet is the first after the headers */
+        info->vorbis_packet_base = info->vorbis_next_packetno - 3;
+    }
+    write_headers(info);
+}
 
-        if (!info->skeleton_3) {
-            /* Add placeholder packets to reserve space for the index
-             * at the start of file. */
-            write_placeholder_index_pages (info);
-        }
+/* Returns non-zero if a checkpoint is due before the keyframe at |time| ms. */
+static int checkpoint_due(oggmux_info *info, ogg_int64_t time)
+{
+    return info->passno != 1 && info->checkpoint_interval > 0 &&
+           time - info->last_checkpoint >= info->checkpoint_interval;
+}
 
-        /* build and add the e_o_s packet */
-        memset (&op, 0, sizeof (op));
-            op.b_o_s = 0;
-        op.e_o_s = 1; /* its the e_o_s packet */
-            op.granulepos = 0;
-        op.bytes = 0; /* e_o_s packet is an empty packet */
-            ogg_stream_packetin (&info->so, &op);
+static void write_checkpoint(oggmux_info *info, ogg_int64_t time, ogg_int64_t frame,
+                             ogg_int64_t theora_packetno, ogg_int64_t vorbis_granulepos);
 
-        result = ogg_stream_flush (&info->so, &og);
-        if (result < 0) {
-            /* can't get here */
-            fprintf (stderr, "Internal Ogg library error.\n");
-            exit (1);
-        }
-        write_page (info, &og);
-        
-        /* Record the offset of the next page; it's the first non-header, or
-         * content page. */
-        info->content_offset = ftello(info->outfile);
+/* Indexes a Theora packet of frame |frameno| and puts it into the stream,
+   starting a new segment or writing a checkpoint first if one is due. */
+static void mux_theora_packet(oggmux_info *info, ogg_packet *op, ogg_int64_t frameno)
+{
+    ogg_int64_t start_time = (1000 * info->ti.fps_denominator * frameno) /
+                             info->ti.fps_numerator;
+    ogg_int64_t end_time =   (1000 * info->ti.fps_denominator * (frameno + 1)) /
+                             info->ti.fps_numerator;
+    if (th_packet_iskeyframe(op) > 0 && segment_due(info, start_time))
+    {
+        next_segment(info, start_time);
+        info->theora_packet_base = op->packetno - 3;
     }
+    if (th_packet_iskeyframe(op) > 0 && checkpoint_due(info, start_time))
+    {
+        write_checkpoint(info, start_time, frameno,
+                         op->packetno - info->theora_packet_base,
+                         info->vorbis_granulepos);
+    }
+    info->video_packet_time = end_time;
+    if (th_packet_iskeyframe(op) > 0)
+        info->theora_keyframes++;
+    if (recording_index(info))
+    {
+        seek_index_record_sample(&info->theora_index,
+                                 op->packetno - info->theora_packet_base,
+                                 start_time,
+                                 end_time,
+                                 th_packet_iskeyframe(op));
+    }
+    else if (info->passno == 1 && info->twopass == 3 &&
+             info->with_skeleton && !info->skeleton_3)
+    {
+        /* remember where the keyframes are, to size the index in the
+           second pass */
+        if (th_packet_iskeyframe(op) > 0)
+            seek_index_record_page(&info->firstpass_index,
+                                   info->firstpass_bytes, 1);
+        seek_index_record_sample(&info->firstpass_index,
+                                 info->firstpass_index.packet_num,
+                                 start_time,
+                                 end_time,
+                                 th_packet_iskeyframe(op) > 0);
+        info->firstpass_bytes += op->bytes;
+    }
+    /* nothing is written in the first pass */
+    if (info->passno != 1)
+        ogg_stream_packetin (&info->to, op);
+    info->v_pkg++;
 }
 
 /**
@@ -1125,6 +2637,8 @@ void oggmux_add_video (oggmux_info *info, th_ycbcr_buffer ycbcr, int e_o_s) {
     int ret;
 
     if(info->passno==2){
+        /* a checkpoint at this frame resumes reading here */
+        info->twopass_frame_offset = ftello(info->twopass_file);
         for(;;){
           static unsigned char buffer[80];
           static int buf_pos;
@@ -1153,6 +2667,15 @@ void oggmux_add_video (oggmux_info *info, th_ycbcr_buffer ycbcr, int e_o_s) {
           if(ret>=bytes)buf_pos=0;
           /*Otherwise remember how much it used.*/
           else buf_pos+=ret;
+          /*A resumed encode has had the header now, skip to the frame
+            of the checkpoint.*/
+          if(buf_pos==0&&info->twopass_resume_offset>0){
+            if(fseeko(info->twopass_file,info->twopass_resume_offset,SEEK_SET)<0){
+              fprintf(stderr,"Unable to seek in two-pass data file.\n");
+              exit(1);
+            }
+            info->twopass_resume_offset=0;
+          }
         }
     }
 
@@ -1174,22 +2697,14 @@ void oggmux_add_video (oggmux_info *info, th_ycbcr_buffer ycbcr, int e_o_s) {
     }
 
     while (th_encode_packetout (info->td, e_o_s, &op) > 0) {
-        if (!info->skeleton_3 &&
-            info->passno != 1)
-        {
-            ogg_int64_t frameno = th_granule_frame(info->td, op.granulepos);
-            ogg_int64_t start_time = (1000 * info->ti.fps_denominator * frameno) /
-                                     info->ti.fps_numerator;
-            ogg_int64_t end_time =   (1000 * info->ti.fps_denominator * (frameno + 1)) /
-                                     info->ti.fps_numerator;
-            seek_index_record_sample(&info->theora_index,
-                                     op.packetno,
-                                     start_time,
-                                     end_time,
-                                     th_packet_iskeyframe(&op));
-        }
-        ogg_stream_packetin (&info->to, &op);
-        info->v_pkg++;
+        if (info->theora_frame_base > 0 && op.granulepos >= 0) {
+            /* the encoder was restarted at a checkpoint */
+            int shift = info->ti.keyframe_granule_shift;
+            ogg_int64_t iframe = op.granulepos >> shift;
+            ogg_int64_t pframe = op.granulepos - (iframe << shift);
+            op.granulepos = ((iframe + info->theora_frame_base) << shift) + pframe;
+        }
+        mux_theora_packet(info, &op, th_granule_frame(info->td, op.granulepos));
     }
     if(info->passno==1 && e_o_s){
         /* need to read the final (summary) packet */
@@ -1216,6 +2731,61 @@ vorbis_time(vorbis_dsp_state * dsp, ogg_int64_t granulepos) {
     return 1000 * granulepos / dsp->vi->rate;
 }
 
+/* Indexes a Vorbis packet of |num_samples| samples and puts it into the
+   stream, starting a new segment or writing a checkpoint first if one is
+   due. */
+static void mux_vorbis_packet(oggmux_info *info, ogg_packet *op, int num_samples)
+{
+    ogg_int64_t start_granule = op->granulepos - num_samples;
+    if (start_granule < 0) {
+        /* The first vorbis content packet can have more samples than
+           its granulepos reports. This is allowed by the spec, and
+           players should discard the leading samples and not play them.
+           Thus the indexer needs to discard them as well.*/
+        if (op->packetno != 4) {
+            /* We only expect negative start granule in the first content
+               packet, not any of the others... */
+            fprintf(stderr, "WARNING: vorbis packet %" PRId64 " has calculated start"
+                    " granule of %" PRId64 ", but it should be non-negative!",
+                    op->packetno, start_granule);
+        }
+        start_granule = 0;
+    }
+    if (start_granule < info->vorbis_granulepos) {
+        /* This packet starts before the end of the previous packet. This is
+           allowed by the specification in the last packet only, and the
+           trailing samples should be discarded and not played/indexed. */
+        if (!op->e_o_s) {
+            fprintf(stderr, "WARNING: vorbis packet %" PRId64 " (granulepos %" PRId64 ") starts before"
+                    " the end of the preceeding packet!", op->packetno, op->granulepos);
+        }
+        start_granule = info->vorbis_granulepos;
+    }
+    info->vorbis_granulepos = op->granulepos;
+    ogg_int64_t start_time = vorbis_time (&info->vd, start_granule);
+
+    /* audio only output is split at any packet */
+    if (info->audio_only && segment_due(info, start_time))
+        next_segment(info, start_time);
+    if (info->audio_only && checkpoint_due(info, start_time))
+        write_checkpoint(info, start_time, 0, 0, start_granule);
+    info->vorbis_next_packetno = op->packetno + 1;
+
+    if (op->granulepos != -1 &&
+        recording_index(info))
+    {
+        ogg_int64_t end_time = vorbis_time (&info->vd, op->granulepos);
+        seek_index_record_sample(&info->vorbis_index,
+                                 op->packetno - info->vorbis_packet_base,
+                                 start_time,
+                                 end_time,
+                                 1);
+    }
+    info->audio_packet_time = vorbis_time (&info->vd, op->granulepos);
+    ogg_stream_packetin (&info->vo, op);
+    info->a_pkg++;
+}
+
 /**
  * adds audio samples to encoding sink
  * @param buffer pointer to buffer
@@ -1227,7 +2797,15 @@ void oggmux_add_audio (oggmux_info *info, uint8_t **buffer, int samples, int e_o
 
     int i, j, k, count = 0;
     float **vorbis_buffer;
+    int skip = 0;
 
+    if (info->vorbis_resume_skip > 0 && samples > 0) {
+        skip = info->vorbis_resume_skip < samples ? info->vorbis_resume_skip : samples;
+        samples -= skip;
+        /* the encoder counts from the first sample it gets */
+        info->vorbis_granule_base += skip;
+        info->vorbis_resume_skip -= skip;
+    }
     if (samples <= 0) {
         /* end of audio stream */
         if (e_o_s)
@@ -1251,7 +2829,7 @@ void oggmux_add_audio (oggmux_info *info, uint8_t **buffer, int samples, int e_o
                         default: k = j;
                     }
                 }
-                vorbis_buffer[k][i] = ((const float  *)buffer[j])[i];
+                vorbis_buffer[k][i] = ((const float  *)buffer[j])[skip + i];
             }
         }
         vorbis_analysis_wrote (&info->vd, samples);
@@ -1268,6 +2846,8 @@ void oggmux_add_audio (oggmux_info *info, uint8_t **buffer, int samples, int e_o
         /* weld packets into the bitstream */
         if (vorbis_bitrate_flushpacket (&info->vd, &op)) {
             assert(op.granulepos != -1);
+            /* the encoder was restarted at a checkpoint */
+            op.granulepos += info->vorbis_granule_base;
             
             /* For indexing, we must accurately know the presentation time of
                the first sample we can decode on any page. Vorbis packets
@@ -1280,48 +2860,7 @@ void oggmux_add_audio (oggmux_info *info, uint8_t **buffer, int samples, int e_o
             int num_samples = (info->prev_vorbis_window == -1) ? 0 :
                                info->prev_vorbis_window/4 + info->vb.pcmend / 4;
             info->prev_vorbis_window = info->vb.pcmend;
-
-            ogg_int64_t start_granule = op.granulepos - num_samples;
-            if (start_granule < 0) {
-                /* The first vorbis content packet can have more samples than
-                   its granulepos reports. This is allowed by the spec, and
-                   players should discard the leading samples and not play them.
-                   Thus the indexer needs to discard them as well.*/
-                if (op.packetno != 4) {
-                    /* We only expect negative start granule in the first content
-                       packet, not any of the others... */
-                    fprintf(stderr, "WARNING: vorbis packet %" PRId64 " has calculated start"
-                            " granule of %" PRId64 ", but it should be non-negative!",
-                            op.packetno, start_granule);
-                }
-                start_granule = 0;
-            }
-            if (start_granule < info->vorbis_granulepos) {
-                /* This packet starts before the end of the previous packet. This is
-                   allowed by the specification in the last packet only, and the
-                   trailing samples should be discarded and not played/indexed. */
-                if (!op.e_o_s) {
-                    fprintf(stderr, "WARNING: vorbis packet %" PRId64 " (granulepos %" PRId64 ") starts before"
-                            " the end of the preceeding packet!", op.packetno, op.granulepos);
-                }
-                start_granule = info->vorbis_granulepos;
-            }
-            info->vorbis_granulepos = op.granulepos;
-            ogg_int64_t start_time = vorbis_time (&info->vd, start_granule);
-            
-            if (op.granulepos != -1 &&
-                !info->skeleton_3 &&
-                info->passno != 1)
-            {
-                ogg_int64_t end_time = vorbis_time (&info->vd, op.granulepos);
-                seek_index_record_sample(&info->vorbis_index,
-                                         op.packetno,
-                                         start_time,
-                                         end_time,
-                                         1);
-            }
-            ogg_stream_packetin (&info->vo, &op);
-            info->a_pkg++;
+            mux_vorbis_packet(info, &op, num_samples);
         }
         /* libvorbis should encode with 1:1 block:packet ratio. If not, our
            vorbis sample length calculations will be wrong! */
@@ -1330,6 +2869,127 @@ void oggmux_add_audio (oggmux_info *info, uint8_t **buffer, int samples, int e_o
 
 }
 
+/* Keeps a copy of a packet of a passed through stream. */
+static void hold_copy_packet(oggmux_copy_packet *p, const unsigned char *data, long bytes)
+{
+    if (bytes > p->size) {
+        unsigned char *buf = realloc(p->data, bytes);
+        if (!buf) {
+            fprintf(stderr, "ERROR: Out of memory.\n");
+            exit(1);
+        }
+        p->data = buf;
+        p->size = bytes;
+    }
+    memcpy(p->data, data, bytes);
+    p->bytes = bytes;
+    p->valid = 1;
+}
+
+static void copy_theora_packet(oggmux_info *info, const unsigned char *data, long bytes, int e_o_s)
+{
+    ogg_packet op;
+    int shift = info->ti.keyframe_granule_shift;
+    ogg_int64_t frameno = info->theora_copy_frames++;
+
+    op.packet = (unsigned char *)data;
+    op.bytes = bytes;
+    op.b_o_s = 0;
+    op.e_o_s = e_o_s;
+    op.packetno = 3 + frameno;
+    if (th_packet_iskeyframe(&op) > 0)
+        info->theora_copy_keyframe = frameno;
+    op.granulepos = ((info->theora_copy_keyframe + theora_frame_offset(&info->ti)) << shift) +
+                    frameno - info->theora_copy_keyframe;
+    mux_theora_packet(info, &op, frameno);
+}
+
+static void copy_vorbis_packet(oggmux_info *info, const unsigned char *data, long bytes,
+                               ogg_int64_t granulepos, int e_o_s)
+{
+    ogg_packet op;
+    long blocksize;
+    int num_samples;
+
+    op.packet = (unsigned char *)data;
+    op.bytes = bytes;
+    op.b_o_s = 0;
+    op.e_o_s = e_o_s;
+    op.granulepos = -1;
+    op.packetno = info->vorbis_next_packetno;
+    blocksize = vorbis_packet_blocksize(&info->vi, &op);
+    if (blocksize < 0) {
+        fprintf(stderr, "WARNING: Dropping an invalid Vorbis packet.\n");
+        return;
+    }
+    /* see oggmux_add_audio() */
+    num_samples = (info->prev_vorbis_window == -1) ? 0 :
+                   info->prev_vorbis_window/4 + blocksize/4;
+    info->prev_vorbis_window = blocksize;
+    op.granulepos = info->vorbis_granulepos + num_samples;
+    /* the input's time of the first samples keeps the offset of the audio
+       to the video, and the one of the last samples the trimmed end */
+    if (granulepos >= 0 && num_samples > 0 && info->vorbis_granulepos == 0)
+        op.granulepos = granulepos;
+    else if (granulepos >= 0 && e_o_s && granulepos < op.granulepos)
+        op.granulepos = granulepos;
+    mux_vorbis_packet(info, &op, num_samples);
+}
+
+/**
+ * passes a packet of the Theora stream of the input through
+ * the packets are held back by one, to mark the last one as end of stream
+ * @param data packet data, NULL at the end of the stream
+ * @param bytes length of data
+ * @param e_o_s 1 indicates end of stream
+ */
+void oggmux_copy_video (oggmux_info *info, const unsigned char *data, long bytes, int e_o_s) {
+    oggmux_copy_packet *p = &info->theora_pending;
+
+    if (p->valid)
+        copy_theora_packet(info, p->data, p->bytes, e_o_s && !data);
+    p->valid = 0;
+    if (data && e_o_s)
+        copy_theora_packet(info, data, bytes, 1);
+    else if (data)
+        hold_copy_packet(p, data, bytes);
+}
+
+/**
+ * passes a packet of the Vorbis stream of the input through
+ * @param data packet data, NULL at the end of the stream
+ * @param bytes length of data
+ * @param granulepos the sample after the packet in the output's time, as
+ * the input has it, or -1 if not known
+ * @param e_o_s 1 indicates end of stream
+ */
+void oggmux_copy_audio (oggmux_info *info, const unsigned char *data, long bytes,
+                        ogg_int64_t granulepos, int e_o_s) {
+    oggmux_copy_packet *p = &info->vorbis_pending;
+
+    if (data && bytes <= 0)
+        data = NULL;
+    if (p->valid && (data || e_o_s))
+        copy_vorbis_packet(info, p->data, p->bytes, p->granulepos, e_o_s && !data);
+    if (data || e_o_s)
+        p->valid = 0;
+    if (data && e_o_s) {
+        copy_vorbis_packet(info, data, bytes, granulepos, 1);
+    }
+    else if (data) {
+        hold_copy_packet(p, data, bytes);
+        p->granulepos = granulepos;
+    }
+}
+
+/* Remembers the time span of the events waiting for a page. */
+static void oggmux_buffer_kate_event(oggmux_kate_stream *ks, double t)
+{
+    if (ks->buffered_start < 0)
+        ks->buffered_start = t;
+    ks->buffered_end = t;
+}
+
 static void oggmux_record_kate_index(oggmux_info *info, oggmux_kate_stream *ks, const ogg_packet *op, ogg_int64_t start_time, ogg_int64_t end_time)
 {
     if (ks->last_end_time >= 0)
@@ -1371,7 +3031,7 @@ void oggmux_add_kate_text (oggmux_info *info, int idx, double t0, double t1, con
     }
     ret = kate_ogg_encode_text(&ks->k, t0, t1, text, len, &op);
     if (ret>=0) {
-        if (!info->skeleton_3 && info->passno != 1) {
+        if (recording_index(info)) {
             ogg_int64_t start_time = (int)(t0 * 1000.0f + 0.5f);
             ogg_int64_t end_time = (int)(t1 * 1000.0f + 0.5f);
             oggmux_record_kate_index(info, ks, &op, start_time, end_time);
@@ -1379,6 +3039,7 @@ void oggmux_add_kate_text (oggmux_info *info, int idx, double t0, double t1, con
 
         ogg_stream_packetin (&ks->ko, &op);
         ogg_packet_clear (&op);
+        oggmux_buffer_kate_event(ks, t0);
         info->k_pkg++;
     }
     else {
@@ -1407,7 +3068,7 @@ void oggmux_add_kate_image (oggmux_info *info, int idx, double t0, double t1, co
     if (ret >= 0) ret = kate_encode_set_bitmap(&ks->k, kb);
     if (ret >= 0) ret = kate_ogg_encode_text(&ks->k, t0, t1, "", 0, &op);
     if (ret>=0) {
-        if (!info->skeleton_3 && info->passno != 1) {
+        if (recording_index(info)) {
             ogg_int64_t start_time = (int)(t0 * 1000.0f + 0.5f);
             ogg_int64_t end_time = (int)(t1 * 1000.0f + 0.5f);
             oggmux_record_kate_index(info, ks, &op, start_time, end_time);
@@ -1415,6 +3076,7 @@ void oggmux_add_kate_image (oggmux_info *info, int idx, double t0, double t1, co
 
         ogg_stream_packetin (&ks->ko, &op);
         ogg_packet_clear (&op);
+        oggmux_buffer_kate_event(ks, t0);
         info->k_pkg++;
     }
     else {
@@ -1435,13 +3097,14 @@ void oggmux_add_kate_end_packet (oggmux_info *info, int idx, double t) {
     int ret;
     ret = kate_ogg_encode_finish(&ks->k, t, &op);
     if (ret>=0) {
-        if (!info->skeleton_3 && info->passno != 1) {
+        if (recording_index(info)) {
             ogg_int64_t start_time = floorf(t * 1000.0f + 0.5f);
             ogg_int64_t end_time = start_time;
             oggmux_record_kate_index(info, ks, &op, start_time, end_time);
         }
         ogg_stream_packetin (&ks->ko, &op);
         ogg_packet_clear (&op);
+        oggmux_buffer_kate_event(ks, t);
         info->k_pkg++;
     }
     else {
@@ -1565,10 +3228,57 @@ ogg_page_start_packets(unsigned char* page)
 }
 
 
+/* Returns the end time of the newest packet given to the muxer, in ms. */
+static double latest_packet_time(oggmux_info *info)
+{
+    return info->video_packet_time > info->audio_packet_time ?
+           info->video_packet_time : info->audio_packet_time;
+}
+
+/* Keeps track of page overhead, of how far behind the pages already written
+   a page at |time| seconds is and of how long it was held back. */
+static void record_page_stats(oggmux_info *info, const unsigned char *page, double time)
+{
+    double delay = latest_packet_time(info) - time * 1000;
+    info->pages_written++;
+    info->page_header_bytes += 27 + page[26];
+    if (info->last_page_time - time > info->max_page_skew)
+        info->max_page_skew = info->last_page_time - time;
+    if (time > info->last_page_time)
+        info->last_page_time = time;
+    if (delay > info->max_page_delay)
+        info->max_page_delay = delay;
+}
+
+static void print_page_stats(oggmux_info *info)
+{
+    ogg_int64_t bytes = info->audio_bytesout + info->video_bytesout + info->kate_bytesout;
+    if (!info->pages_written || !bytes || info->frontend)
+        return;
+    fprintf(stderr, "\n  Ogg pages: %" PRId64 ", overhead: %.2f%%, "
+            "max A/V skew: %d ms, max page delay: %d ms\n",
+            info->pages_written, 100.0 * info->page_header_bytes / bytes,
+            (int)(info->max_page_skew * 1000), (int)info->max_page_delay);
+}
+
+/* Passes a page written by write_audio_page() and friends on to the sinks. */
+static void sink_content_page(oggmux_info *info, ogg_int64_t offset,
+                              unsigned char *page, int len)
+{
+    ogg_page og;
+    if (!info->sinks)
+        return;
+    og.header = page;
+    og.header_len = 27 + page[26];
+    og.body = page + og.header_len;
+    og.body_len = len - og.header_len;
+    output_sinks_write_page(info->sinks, offset, &og);
+}
+
 static void write_audio_page(oggmux_info *info)
 {
     int ret;
-    ogg_int64_t page_offset = ftello(info->outfile);
+    ogg_int64_t page_offset = output_offset(info);
     int packets = ogg_page_packets((ogg_page *)&info->audiopage);
     int packet_start_num = ogg_page_start_packets(info->audiopage);
 
@@ -1578,9 +3288,13 @@ static void write_audio_page(oggmux_info *info)
     }
     else {
         info->audio_bytesout += ret;
+        info->bytes_written += ret;
+        info->audiopage_offset = page_offset;
+        sink_content_page(info, page_offset, info->audiopage, info->audiopage_len);
     }
     info->audiopage_valid = 0;
     info->a_pkg -= packets;
+    record_page_stats(info, info->audiopage, info->audiotime);
 
     ret = seek_index_record_page(&info->vorbis_index,
                                  page_offset,
@@ -1601,7 +3315,7 @@ static void write_audio_page(oggmux_info *info)
 static void write_video_page(oggmux_info *info)
 {
     int ret;
-    ogg_int64_t page_offset = ftello(info->outfile);
+    ogg_int64_t page_offset = output_offset(info);
     int packets = ogg_page_packets((ogg_page *)&info->videopage);
     int packet_start_num = ogg_page_start_packets(info->videopage);
 
@@ -1611,9 +3325,13 @@ static void write_video_page(oggmux_info *info)
     }
     else {
         info->video_bytesout += ret;
+        info->bytes_written += ret;
+        info->videopage_offset = page_offset;
+        sink_content_page(info, page_offset, info->videopage, info->videopage_len);
     }
     info->videopage_valid = 0;
     info->v_pkg -= packets;
+    record_page_stats(info, info->videopage, info->videotime);
 
     ret = seek_index_record_page(&info->theora_index,
                                  page_offset,
@@ -1635,7 +3353,7 @@ static void write_kate_page(oggmux_info *info, int idx)
 {
     int ret;
     oggmux_kate_stream *ks=info->kate_streams+idx;
-    ogg_int64_t page_offset = ftello(info->outfile);
+    ogg_int64_t page_offset = output_offset(info);
     int packet_start_num = ogg_page_start_packets(ks->katepage);
 
     ret = fwrite(ks->katepage, 1, ks->katepage_len, info->outfile);
@@ -1644,9 +3362,13 @@ static void write_kate_page(oggmux_info *info, int idx)
     }
     else {
         info->kate_bytesout += ret;
+        info->bytes_written += ret;
+        sink_content_page(info, page_offset, ks->katepage, ks->katepage_len);
     }
     ks->katepage_valid = 0;
     info->k_pkg -= ogg_page_packets((ogg_page *)&ks->katepage);
+    info->pages_written++;
+    info->page_header_bytes += 27 + ks->katepage[26];
 
     ret = seek_index_record_page(&ks->index,
                                  page_offset,
@@ -1684,6 +3406,104 @@ static int find_best_valid_kate_page(oggmux_info *info)
     return best;
 }
 
+/* Takes the next page out of a stream when the page policy says so: once
+   it spans --page-duration, once --page-size bytes are buffered, or when
+   libogg thinks it's full if no size is set. |force| takes out whatever
+   is buffered, in pages of at most --page-size bytes. */
+static int stream_page_out(oggmux_info *info, ogg_stream_state *os,
+                           double buffered_ms, int force, ogg_page *og)
+{
+    if (force || (info->page_duration > 0 && buffered_ms >= info->page_duration)) {
+        if (info->page_size > 0)
+            return ogg_stream_flush_fill(os, og, info->page_size);
+        return ogg_stream_flush(os, og);
+    }
+    /* at the end of the stream libogg writes out the rest anyway */
+    if (info->page_size > 0)
+        return ogg_stream_pageout_fill(os, og, info->page_size);
+    return ogg_stream_pageout(os, og);
+}
+
+static void hold_page(unsigned char **page, int *page_len, int *buffer_length,
+                      const ogg_page *og)
+{
+    int len = og->header_len + og->body_len;
+    if (*buffer_length < len) {
+        *page = realloc(*page, len);
+        *buffer_length = len;
+    }
+    *page_len = len;
+    memcpy(*page, og->header, og->header_len);
+    memcpy(*page+og->header_len , og->body, og->body_len);
+}
+
+/* The end time of the frame at |granulepos| in seconds. A passed through
+   stream has no encoder to ask. */
+static double theora_granule_time(oggmux_info *info, ogg_int64_t granulepos)
+{
+    if (info->theora_copy) {
+        int shift = info->ti.keyframe_granule_shift;
+        ogg_int64_t iframe = granulepos >> shift;
+        ogg_int64_t frameno = iframe + (granulepos - (iframe << shift)) -
+                              theora_frame_offset(&info->ti);
+        return (frameno + 1) * (double)info->ti.fps_denominator / info->ti.fps_numerator;
+    }
+    return th_granule_time(info->td, granulepos);
+}
+
+static void next_video_page(oggmux_info *info, int force)
+{
+    ogg_page og;
+    if (stream_page_out(info, &info->to, info->video_packet_time - info->videotime * 1000,
+                        force, &og) > 0) {
+        hold_page(&info->videopage, &info->videopage_len,
+                  &info->videopage_buffer_length, &og);
+        info->videopage_valid = 1;
+        if (ogg_page_granulepos(&og)>0) {
+            info->videotime = theora_granule_time(info, ogg_page_granulepos(&og));
+        }
+    }
+}
+
+static void next_audio_page(oggmux_info *info, int force)
+{
+    ogg_page og;
+    if (stream_page_out(info, &info->vo, info->audio_packet_time - info->audiotime * 1000,
+                        force, &og) > 0) {
+        hold_page(&info->audiopage, &info->audiopage_len,
+                  &info->audiopage_buffer_length, &og);
+        info->audiopage_valid = 1;
+        if (ogg_page_granulepos(&og)>0) {
+            info->audiotime= vorbis_granule_time (&info->vd, ogg_page_granulepos(&og));
+        }
+    }
+}
+
+/* Returns non-zero if the Kate events waiting in a stream have to go on a
+   page now: when the first of them is about to be shown, as audio or video
+   up to the newest packet may be written next, or when they span the
+   coalescing window or fill a page. */
+static int kate_page_due(oggmux_info *info, oggmux_kate_stream *ks, int e_o_s)
+{
+    long buffered = ks->ko.body_fill - ks->ko.body_returned;
+    if (e_o_s || ks->ko.e_o_s || info->kate_page_window <= 0)
+        return 1;
+    if (ks->buffered_start < 0)
+        return 0;
+    if (ks->buffered_start * 1000 <= latest_packet_time(info) ||
+        (ks->buffered_end - ks->buffered_start) * 1000 >= info->kate_page_window)
+        return 1;
+    return buffered >= (info->page_size > 0 ? info->page_size : 4096);
+}
+
+/* Returns non-zero if a page ending at |time| seconds has waited longer
+   than --interleave-delay for a page of the other stream. */
+static int interleave_overdue(oggmux_info *info, double time)
+{
+    return info->interleave_delay > 0 &&
+           latest_packet_time(info) - time * 1000 > info->interleave_delay;
+}
+
 void oggmux_flush (oggmux_info *info, int e_o_s)
 {
     int n,len;
@@ -1698,64 +3518,17 @@ void oggmux_flush (oggmux_info *info, int e_o_s)
     while (1) {
         /* Get pages for both streams, if not already present, and if available.*/
         if (!info->audio_only && !info->videopage_valid) {
-            // this way seeking is much better,
-            // not sure if 23 packets  is a good value. it works though
-            int v_next=0;
-            if (info->v_pkg>22 && ogg_stream_flush(&info->to, &og)) {
-                v_next=1;
-            }
-            else if (ogg_stream_pageout(&info->to, &og)) {
-                v_next=1;
-            }
-            if (v_next) {
-                len = og.header_len + og.body_len;
-                if (info->videopage_buffer_length < len) {
-                    info->videopage = realloc(info->videopage, len);
-                    info->videopage_buffer_length = len;
-                }
-                info->videopage_len = len;
-                memcpy(info->videopage, og.header, og.header_len);
-                memcpy(info->videopage+og.header_len , og.body, og.body_len);
-
-                info->videopage_valid = 1;
-                if (ogg_page_granulepos(&og)>0) {
-                    info->videotime = th_granule_time(info->td, ogg_page_granulepos(&og));
-                }
-            }
+            next_video_page(info, 0);
         }
         if (!info->video_only && !info->audiopage_valid) {
-            // this way seeking is much better,
-            // not sure if 23 packets  is a good value. it works though
-            int a_next=0;
-            if (info->a_pkg>22 && ogg_stream_flush(&info->vo, &og)) {
-                a_next=1;
-            }
-            else if (ogg_stream_pageout(&info->vo, &og)) {
-                a_next=1;
-            }
-            if (a_next) {
-                len = og.header_len + og.body_len;
-                if (info->audiopage_buffer_length < len) {
-                    info->audiopage = realloc(info->audiopage, len);
-                    info->audiopage_buffer_length = len;
-                }
-                info->audiopage_len = len;
-                memcpy(info->audiopage, og.header, og.header_len);
-                memcpy(info->audiopage+og.header_len , og.body, og.body_len);
-
-                info->audiopage_valid = 1;
-                if (ogg_page_granulepos(&og)>0) {
-                    info->audiotime= vorbis_granule_time (&info->vd, ogg_page_granulepos(&og));
-                }
-            }
+            next_audio_page(info, 0);
         }
 
 #ifdef HAVE_KATE
         if (info->with_kate) for (n=0; n<info->n_kate_streams; ++n) {
             oggmux_kate_stream *ks=info->kate_streams+n;
-            if (!ks->katepage_valid) {
+            if (!ks->katepage_valid && kate_page_due(info, ks, e_o_s)) {
                 int k_next=0;
-                /* always flush kate stream */
                 if (ogg_stream_flush(&ks->ko, &og) > 0) {
                     k_next = 1;
                 }
@@ -1774,6 +3547,16 @@ void oggmux_flush (oggmux_info *info, int e_o_s)
                         ks->katetime= kate_granule_time (&ks->ki,
                             ogg_page_granulepos(&og));
                     }
+                    /* A page is due by its first event, it goes out
+                       before audio and video reach that. */
+                    if (ks->buffered_start >= 0 && ks->buffered_start < ks->katetime) {
+                        ks->katetime = ks->buffered_start;
+                    }
+                    /* if events are left over, the first of them can't
+                       start before the ones on this page */
+                    if (ks->ko.lacing_fill == 0) {
+                        ks->buffered_start = ks->buffered_end = -1;
+                    }
                 }
             }
         }
@@ -1814,6 +3597,22 @@ void oggmux_flush (oggmux_info *info, int e_o_s)
               write_audio_page(info);
             }
         }
+        /* Don't hold a page back any longer for the other stream: take
+           what that one has, or write this page on its own. */
+        else if (info->videopage_valid && interleave_overdue(info, info->videotime)) {
+            next_audio_page(info, 1);
+            if (!info->audiopage_valid) {
+                CHECK_KATE_OUTPUT(video);
+                write_video_page(info);
+            }
+        }
+        else if (info->audiopage_valid && interleave_overdue(info, info->audiotime)) {
+            next_video_page(info, 1);
+            if (!info->videopage_valid) {
+                CHECK_KATE_OUTPUT(audio);
+                write_audio_page(info);
+            }
+        }
         else if (e_o_s && best>=0) {
             write_kate_page(info, best);
         }
@@ -1829,6 +3628,123 @@ void oggmux_flush (oggmux_info *info, int e_o_s)
     }
 }
 
+/* Writes out every packet the muxer was given, on partial pages where
+   needed, keeping audio and video in time order. */
+static void flush_all_pages(oggmux_info *info)
+{
+    while (1) {
+        if (!info->audio_only && !info->videopage_valid)
+            next_video_page(info, 1);
+        if (!info->video_only && !info->audiopage_valid)
+            next_audio_page(info, 1);
+        if (info->videopage_valid && info->audiopage_valid) {
+            if (info->videotime <= info->audiotime)
+                write_video_page(info);
+            else
+                write_audio_page(info);
+        }
+        else if (info->videopage_valid) {
+            write_video_page(info);
+        }
+        else if (info->audiopage_valid) {
+            write_audio_page(info);
+        }
+        else {
+            break;
+        }
+    }
+}
+
+static void write_checkpoint_stream(FILE *f, const char *name, ogg_stream_state *os,
+                                    ogg_int64_t index_packetno, seek_index *index)
+{
+    int i;
+    fprintf(f, "stream %s %ld %ld %" PRId64 " %" PRId64 " %" PRId64 "\n", name,
+            os->serialno, os->pageno, (ogg_int64_t)os->packetno,
+            (ogg_int64_t)os->granulepos, index_packetno);
+    for (i=0; i<index->packet_num; ++i)
+        fprintf(f, "keyframe %d %" PRId64 "\n",
+                index->packets[i].packetno, index->packets[i].start_time);
+    for (i=0; i<index->pages_num; ++i)
+        fprintf(f, "page %" PRId64 " %d\n",
+                index->pages[i].offset, index->pages[i].packet_start_num);
+    fprintf(f, "index %" PRId64 " %d %u %" PRId64 " %" PRId64 " %" PRId64 "\n",
+            index->page_location, index->max_keypoints, index->packet_size,
+            index->start_time, index->end_time, index->prev_packet_time);
+}
+
+/* Writes everything encoded so far to the output, updates the index so
+   the output is seekable up to here, and records how to resume with the
+   keyframe of frame |frame| at |time| ms, which is not written yet and is
+   packet |theora_packetno| in the index. Audio was written up to
+   |vorbis_granulepos|. */
+static void write_checkpoint(oggmux_info *info, ogg_int64_t time, ogg_int64_t frame,
+                             ogg_int64_t theora_packetno, ogg_int64_t vorbis_granulepos)
+{
+    char *tmp_name = malloc(strlen(info->checkpoint_name) + 5);
+    ogg_int64_t offset;
+    FILE *f;
+
+    if (!tmp_name) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        exit(1);
+    }
+    info->last_checkpoint = time;
+    flush_all_pages(info);
+    offset = output_offset(info);
+    if (info->with_skeleton && !info->skeleton_3)
+        refresh_seek_index(info);
+    /* the checkpoint must not get to disk before what it refers to */
+    if (fflush(info->outfile) != 0) {
+        fprintf(stderr, "\nWARNING: Failed to write the output, no checkpoint written.\n");
+        free(tmp_name);
+        return;
+    }
+#ifndef WIN32
+    fsync(fileno(info->outfile));
+#endif
+
+    sprintf(tmp_name, "%s.tmp", info->checkpoint_name);
+    f = fopen(tmp_name, "w");
+    if (!f) {
+        fprintf(stderr, "\nWARNING: Unable to write checkpoint `%s'.\n", tmp_name);
+        free(tmp_name);
+        return;
+    }
+    fprintf(f, "ffmpeg2theora-checkpoint 1\n");
+    fprintf(f, "offset %" PRId64 "\n", offset);
+    fprintf(f, "time %" PRId64 "\n", time);
+    fprintf(f, "frame %" PRId64 "\n", frame);
+    fprintf(f, "vorbis_granulepos %" PRId64 "\n", vorbis_granulepos);
+    fprintf(f, "twopass_offset %" PRId64 "\n",
+            info->passno == 2 ? info->twopass_frame_offset : 0);
+    fprintf(f, "content_offset %" PRId64 "\n", info->content_offset);
+    fprintf(f, "index_offset %" PRId64 "\n", info->index_offset);
+    fprintf(f, "bytes %" PRId64 " %" PRId64 "\n", info->video_bytesout, info->audio_bytesout);
+    if (info->with_skeleton)
+        fprintf(f, "skeleton %ld %d\n", info->so.serialno, info->skeleton_3);
+    if (!info->audio_only)
+        write_checkpoint_stream(f, "theora", &info->to, theora_packetno,
+                                &info->theora_index);
+    if (!info->video_only)
+        write_checkpoint_stream(f, "vorbis", &info->vo,
+                                (info->vorbis_next_packetno ? info->vorbis_next_packetno : 3)
+                                - info->vorbis_packet_base,
+                                &info->vorbis_index);
+    if (fclose(f) != 0) {
+        fprintf(stderr, "\nWARNING: Unable to write checkpoint `%s'.\n", tmp_name);
+        remove(tmp_name);
+    } else {
+#ifdef WIN32
+        remove(info->checkpoint_name);
+#endif
+        if (rename(tmp_name, info->checkpoint_name) != 0)
+            fprintf(stderr, "\nWARNING: Unable to rename `%s' to `%s'.\n",
+                    tmp_name, info->checkpoint_name);
+    }
+    free(tmp_name);
+}
+
 void oggmux_close (oggmux_info *info) {
     int n;
 
@@ -1837,17 +3753,21 @@ void oggmux_close (oggmux_info *info) {
     }
 
     print_stats(info, info->duration);
+    if (info->passno!=1)
+        print_page_stats(info);
 
-    ogg_stream_clear (&info->vo);
-    vorbis_block_clear (&info->vb);
-    vorbis_dsp_clear (&info->vd);
-    vorbis_info_clear (&info->vi);
-
-    ogg_stream_clear (&info->to);
     th_encode_free (info->td);
+    /* the first pass only set up the theora encoder, see oggmux_init */
     if (info->passno!=1) {
+        ogg_stream_clear (&info->vo);
+        vorbis_block_clear (&info->vb);
+        vorbis_dsp_clear (&info->vd);
+        vorbis_info_clear (&info->vi);
+
+        ogg_stream_clear (&info->to);
         vorbis_comment_clear (&info->vc);
         th_comment_clear (&info->tc);
+        seek_index_clear (&info->firstpass_index);
     }
 
 #ifdef HAVE_KATE
@@ -1861,11 +3781,36 @@ void oggmux_close (oggmux_info *info) {
     }
 #endif
 
-    if (info->with_skeleton)
+    if (info->with_skeleton && info->passno!=1)
         ogg_stream_clear (&info->so);
 
     if (info->passno!=1 && info->outfile && info->outfile != stdout)
         fclose (info->outfile);
+    if (info->passno!=1 && info->sinks) {
+        /* seekable tee files get the index of the finished output */
+        int indexed = info->with_skeleton && !info->skeleton_3 && info->indexing_complete;
+        output_sinks_close(info->sinks, indexed ? info->outfile_name : NULL);
+        info->sinks = NULL;
+    }
+    if (info->passno!=1 && info->segment_output)
+        update_segment_list(info);
+    /* the encode is complete, there is nothing left to resume */
+    if (info->passno!=1 && info->checkpoint_name)
+        remove(info->checkpoint_name);
+    if (info->segment_name)
+        free(info->segment_name);
+
+    for (n=0; n<info->num_theora_headers; ++n)
+        free(info->theora_headers[n].packet);
+    if (!info->video_only && info->passno!=1) {
+        for (n=0; n<3; ++n)
+            free(info->vorbis_headers[n].packet);
+    }
+
+    free(info->theora_pending.data);
+    free(info->vorbis_pending.data);
+    memset(&info->theora_pending, 0, sizeof(info->theora_pending));
+    memset(&info->vorbis_pending, 0, sizeof(info->vorbis_pending));
 
     if (info->videopage)
         free(info->videopage);
@@ -1875,6 +3820,8 @@ void oggmux_close (oggmux_info *info) {
     for (n=0; n<info->n_kate_streams; ++n) {
         if (info->kate_streams[n].katepage)
             free(info->kate_streams[n].katepage);
+        if (info->kate_streams[n].event_times)
+            free(info->kate_streams[n].event_times);
     }
     free(info->kate_streams);
 }
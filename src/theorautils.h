@@ -54,11 +54,32 @@ typedef struct
     int katepage_len;
     int katepage_buffer_length;
     double katetime;
+    /* start times of the first and last event waiting in |ko| for a page,
+       in seconds, -1 if there is none */
+    double buffered_start;
+    double buffered_end;
     seek_index index;
     ogg_int64_t last_end_time;
+    /* start times of the events that will be encoded, in ms, if known
+       beforehand; used to size the index */
+    ogg_int64_t *event_times;
+    int num_event_times;
 }
 oggmux_kate_stream;
 
+/* A packet of a passed through stream, held back until the next one shows
+   whether it is the last. */
+typedef struct
+{
+    unsigned char *data;
+    long bytes;
+    long size;
+    int valid;
+    /* of the end of the packet in the input, -1 if not known */
+    ogg_int64_t granulepos;
+}
+oggmux_copy_packet;
+
 enum SeekableState {
     MAYBE_SEEKABLE = -1,
     NOT_SEEKABLE = 0,
@@ -79,10 +100,62 @@ typedef struct
     int with_skeleton;
     int skeleton_3;
     int index_interval;
+    /* maximum number of bytes between keypoints, 0 for no limit */
+    ogg_int64_t index_max_bytes;
     int theora_index_reserve;
     int vorbis_index_reserve;
     int kate_index_reserve;
     int indexing_complete;
+    /* write the keyframe indexes to this file as well */
+    const char *index_sidecar;
+    /* name of the output file, NULL if writing to stdout */
+    const char *outfile_name;
+    /* further outputs the stream is copied to, NULL if there are none */
+    struct output_sinks *sinks;
+    /* rewrite the output with an exactly sized index if the space
+       reserved for it turned out to be wrong */
+    int index_finalize;
+    /* start a new output file at the first keyframe after this many ms or
+       bytes, 0 to write a single file */
+    ogg_int64_t segment_time;
+    ogg_int64_t segment_size;
+    /* the segments are named after this, see oggmux_open_segment() */
+    const char *segment_output;
+    char *segment_name;
+    int segment_number;
+    /* presentation time of the current segment's first frame, in ms */
+    ogg_int64_t segment_start_time;
+    /* page policy: bytes to collect for a page (0 leaves it to libogg),
+       longest time a page may span and longest time a page may wait for
+       the other stream, in ms, 0 for no limit */
+    int page_size;
+    int page_duration;
+    int interleave_delay;
+    /* Kate events starting within this many ms share a page, 0 to give
+       every event its own page */
+    int kate_page_window;
+    /* write a checkpoint to checkpoint_name at the first keyframe after
+       this many ms of output, 0 for none */
+    ogg_int64_t checkpoint_interval;
+    char *checkpoint_name;
+    ogg_int64_t last_checkpoint;
+    /* set when resuming from checkpoint_name, see oggmux_read_checkpoint();
+       the output time in ms and the output length at the checkpoint */
+    int resume;
+    ogg_int64_t resume_time;
+    ogg_int64_t resume_offset;
+    /* added to the granulepos of the packets of encoders restarted at a
+       checkpoint */
+    ogg_int64_t theora_frame_base;
+    ogg_int64_t vorbis_granule_base;
+    ogg_int64_t resume_vorbis_granulepos;
+    /* samples at the start of a resumed encode that were written before
+       the checkpoint already, dropped by oggmux_add_audio() */
+    ogg_int64_t vorbis_resume_skip;
+    /* where the two-pass data of the current frame starts, and where to go
+       on reading it after the header when resuming */
+    ogg_int64_t twopass_frame_offset;
+    ogg_int64_t twopass_resume_offset;
     FILE *frontend;
     /* vorbis settings */
     int sample_rate;
@@ -121,6 +194,10 @@ typedef struct
     int audiopage_len;
     int videopage_buffer_length;
     int audiopage_buffer_length;
+    /* where the last page in videopage and audiopage was written, to mark
+       the end of a segment on it */
+    ogg_int64_t videopage_offset;
+    ogg_int64_t audiopage_offset;
 
     /* some stats */
     double audiotime;
@@ -134,6 +211,16 @@ typedef struct
     ogg_int64_t kate_bytesout;
     time_t start_time;
 
+    /* end times of the last packets put into the streams, in ms */
+    ogg_int64_t video_packet_time;
+    ogg_int64_t audio_packet_time;
+    /* what the page policy achieved */
+    ogg_int64_t pages_written;
+    ogg_int64_t page_header_bytes;
+    double last_page_time;
+    double max_page_skew;
+    double max_page_delay;
+
     //to do some manual page flusing
     int v_pkg;
     int a_pkg;
@@ -153,12 +240,44 @@ typedef struct
 
     seek_index theora_index;
     seek_index vorbis_index;
+    /* Theora keyframes seen in the first pass of --two-pass. pages[i].offset
+       holds the number of video bytes encoded before keyframe packets[i]. */
+    seek_index firstpass_index;
+    ogg_int64_t firstpass_bytes;
     int prev_vorbis_window; /* Window size of previous vorbis block. Used to
                                calculate duration of vorbis packets. */
     /* The offset of the first non header page in bytes. */
     ogg_int64_t content_offset;
+    /* The offset of the first index placeholder page. */
+    ogg_int64_t index_offset;
+    /* File length to write into the fishead while the output is being
+       rewritten, 0 to use the current length. */
+    ogg_int64_t final_length;
+    /* Bytes written to the output so far, page rewrites included. */
+    ogg_int64_t bytes_written;
     /* Granulepos of the last encoded packet. */
     ogg_int64_t vorbis_granulepos;
+    /* Header packets, kept to start each segment with. */
+    ogg_packet theora_headers[3];
+    int num_theora_headers;
+    ogg_packet vorbis_headers[3];
+    /* Encoder packet numbers are counted from these in the indexes, so that
+       they start after the headers in every segment. */
+    ogg_int64_t theora_packet_base;
+    ogg_int64_t vorbis_packet_base;
+    ogg_int64_t vorbis_next_packetno;
+    /* Theora keyframes muxed so far */
+    ogg_int64_t theora_keyframes;
+
+    /* Set if the Theora or Vorbis stream of the input is passed through
+       instead of encoded, see oggmux_copy_theora_headers() */
+    int theora_copy;
+    int vorbis_copy;
+    oggmux_copy_packet theora_pending;
+    oggmux_copy_packet vorbis_pending;
+    /* frames passed through so far and the last keyframe among them */
+    ogg_int64_t theora_copy_frames;
+    ogg_int64_t theora_copy_keyframe;
 
     ogg_int32_t serialno;
 }
@@ -167,8 +286,15 @@ oggmux_info;
 void init_info(oggmux_info *info);
 extern void oggmux_setup_kate_streams(oggmux_info *info, int n_kate_streams);
 extern void oggmux_init (oggmux_info *info);
+extern int oggmux_open_segment (oggmux_info *info);
+extern int oggmux_read_checkpoint (oggmux_info *info);
+extern int oggmux_open_resume (oggmux_info *info, const char *name);
 extern void oggmux_add_video (oggmux_info *info, th_ycbcr_buffer ycbcr, int e_o_s);
 extern void oggmux_add_audio (oggmux_info *info, uint8_t **buffer, int samples,int e_o_s);
+extern int oggmux_copy_theora_headers (oggmux_info *info, const ogg_packet *headers);
+extern int oggmux_copy_vorbis_headers (oggmux_info *info, const ogg_packet *headers);
+extern void oggmux_copy_video (oggmux_info *info, const unsigned char *data, long bytes, int e_o_s);
+extern void oggmux_copy_audio (oggmux_info *info, const unsigned char *data, long bytes, ogg_int64_t granulepos, int e_o_s);
 #ifdef HAVE_KATE
 extern void oggmux_add_kate_text (oggmux_info *info, int idx, double t0, double t1, const char *text, size_t len, int x1, int x2, int y1, int y2);
 extern void oggmux_add_kate_image (oggmux_info *info, int idx, double t0, double t1, const kate_region *kr, const kate_palette *kp, const kate_bitmap *kb);
@@ -176,8 +302,13 @@ extern void oggmux_add_kate_end_packet (oggmux_info *info, int idx, double t);
 #endif
 extern void oggmux_flush (oggmux_info *info, int e_o_s);
 extern void oggmux_close (oggmux_info *info);
+extern void oggmux_end_skeleton_headers (oggmux_info *info);
+extern void add_fishead_packet (oggmux_info *info, ogg_uint16_t ver_maj, ogg_uint16_t ver_min);
+extern void add_fisbone_packet (oggmux_info *info);
 
 extern int write_seek_index (oggmux_info* info);
+extern int write_index_sidecar (oggmux_info* info);
+extern int oggmux_reserve_exact_index (oggmux_info *info, ogg_int64_t content_offset);
 
 
 #endif
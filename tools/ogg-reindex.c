@@ -0,0 +1,1654 @@
+/* -*- tab-width:4;c-file-style:"cc-mode"; -*- */
+/*
+ * ogg-reindex.c -- Adds a skeleton 4 keyframe index to existing Ogg files
+ * Copyright (C) 2003-2011 <j@v2v.cc>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with This program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The input is mapped into memory and only its page headers are looked
+ * at, plus the first bytes of every packet: enough to tell Theora
+ * keyframes apart, to get Vorbis block sizes and Kate event times. No
+ * packet is decoded. The output gets a new skeleton track with an index,
+ * written by the same code ffmpeg2theora uses, followed by the content
+ * pages copied unchanged. Any skeleton track the input had is dropped.
+ */
+
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+#if !defined(_LARGEFILE_SOURCE)
+#define _LARGEFILE_SOURCE
+#endif
+#if !defined(_LARGEFILE64_SOURCE)
+#define _LARGEFILE64_SOURCE
+#endif
+#if !defined(_FILE_OFFSET_BITS)
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+#ifdef WIN32
+#if !defined(fseeko)
+#define fseeko fseeko64
+#define ftello ftello64
+#endif
+#endif
+
+#include "src/theorautils.h"
+#ifdef HAVE_OGGKATE
+#include "kate/oggkate.h"
+#endif
+
+/* Bytes kept of a content packet; enough for the Theora frame type, the
+   Vorbis mode and the Kate event times. */
+#define PACKET_HEAD 32
+
+enum {
+    CODEC_SKELETON,
+    CODEC_THEORA,
+    CODEC_VORBIS,
+    CODEC_KATE
+};
+
+enum {
+    NULL_FLAG,
+    INDEX_INTERVAL,
+    INDEX_MAX_BYTES
+};
+
+/* A content packet that ended on a page without a granulepos yet. */
+typedef struct {
+    int packetno;
+    int keyframe;
+    long blocksize;
+} pending_packet;
+
+typedef struct {
+    ogg_uint32_t serialno;
+    int codec;
+    int num_headers;
+    /* Number of packets that started so far. */
+    int packets_started;
+    seek_index index;
+
+    /* Copies of the Theora and Vorbis headers, to check files joined by
+       --concat have the same setup. */
+    unsigned char *header[3];
+    size_t header_len[3];
+
+    /* The packet being read: all of it for headers, its start otherwise. */
+    int in_packet;
+    int packetno;
+    unsigned char *packet;
+    size_t packet_len;
+    size_t packet_size;
+
+    pending_packet *pending;
+    int num_pending;
+    int pending_size;
+
+    /* theora */
+    ogg_uint32_t fps_numerator;
+    ogg_uint32_t fps_denominator;
+    int granule_shift;
+    int frame_offset;
+
+    /* vorbis */
+    vorbis_info vi;
+    vorbis_comment vc;
+    long prev_blocksize;
+    ogg_int64_t granulepos;
+
+#ifdef HAVE_KATE
+    kate_info ki;
+    kate_comment kc;
+    ogg_int64_t last_end_time;
+#endif
+}
+stream;
+
+typedef struct {
+    ogg_int64_t offset;
+    ogg_int64_t length;
+    int bos;
+}
+page_run;
+
+static stream *streams = NULL;
+static int num_streams = 0;
+static int streams_size = 0;
+
+static ogg_uint32_t read32le(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((ogg_uint32_t)p[3] << 24);
+}
+
+static ogg_uint32_t read32be(const unsigned char *p) {
+    return ((ogg_uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static ogg_int64_t read64le(const unsigned char *p) {
+    return (ogg_int64_t)read32le(p) | ((ogg_int64_t)read32le(p + 4) << 32);
+}
+
+static void *grow(void *p, int *size, int needed, size_t element_size) {
+    if (needed <= *size)
+        return p;
+    *size = needed * 2;
+    p = realloc(p, *size * element_size);
+    if (!p) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        exit(1);
+    }
+    return p;
+}
+
+static stream *find_stream(ogg_uint32_t serialno) {
+    int i;
+    for (i = 0; i < num_streams; i++)
+        if (streams[i].serialno == serialno)
+            return &streams[i];
+    return NULL;
+}
+
+static stream *add_stream(ogg_uint32_t serialno, const unsigned char *body, long body_len,
+                          int index_interval, ogg_int64_t index_max_bytes) {
+    stream *st;
+    int codec;
+
+    if (body_len >= 8 && !memcmp(body, "fishead\0", 8))
+        codec = CODEC_SKELETON;
+    else if (body_len >= 7 && !memcmp(body, "\x80theora", 7))
+        codec = CODEC_THEORA;
+    else if (body_len >= 7 && !memcmp(body, "\x01vorbis", 7))
+        codec = CODEC_VORBIS;
+#ifdef HAVE_KATE
+    else if (body_len >= 8 && !memcmp(body, "\x80kate\0\0\0", 8))
+        codec = CODEC_KATE;
+#endif
+    else {
+        fprintf(stderr, "ERROR: Stream %08x is not Theora, Vorbis or Kate, can't index it.\n",
+                serialno);
+        exit(1);
+    }
+
+    streams = grow(streams, &streams_size, num_streams + 1, sizeof(stream));
+    st = &streams[num_streams++];
+    memset(st, 0, sizeof(*st));
+    st->serialno = serialno;
+    st->codec = codec;
+    /* Kate says how many headers it has in its first one. */
+    st->num_headers = codec == CODEC_KATE ? 1 : 3;
+    seek_index_init(&st->index, index_interval);
+    seek_index_set_max_bytes(&st->index, index_max_bytes);
+    st->prev_blocksize = -1;
+    if (codec == CODEC_VORBIS) {
+        vorbis_info_init(&st->vi);
+        vorbis_comment_init(&st->vc);
+    }
+#ifdef HAVE_KATE
+    st->last_end_time = -1;
+    if (codec == CODEC_KATE) {
+        kate_info_init(&st->ki);
+        kate_comment_init(&st->kc);
+    }
+#endif
+    return st;
+}
+
+static void append_packet_data(stream *st, const unsigned char *data, long len) {
+    size_t limit = st->packetno < st->num_headers ? (size_t)-1 : PACKET_HEAD;
+    if (st->packet_len >= limit)
+        return;
+    if ((size_t)len > limit - st->packet_len)
+        len = limit - st->packet_len;
+    if (st->packet_len + len > st->packet_size) {
+        st->packet_size = (st->packet_len + len) * 2;
+        st->packet = realloc(st->packet, st->packet_size);
+        if (!st->packet) {
+            fprintf(stderr, "ERROR: Out of memory.\n");
+            exit(1);
+        }
+    }
+    memcpy(st->packet + st->packet_len, data, len);
+    st->packet_len += len;
+}
+
+static void read_header(stream *st) {
+    ogg_packet op;
+    memset(&op, 0, sizeof(op));
+    op.packet = st->packet;
+    op.bytes = st->packet_len;
+    op.b_o_s = st->packetno == 0;
+    op.packetno = st->packetno;
+
+    if ((st->codec == CODEC_THEORA || st->codec == CODEC_VORBIS) && st->packetno < 3) {
+        st->header[st->packetno] = malloc(st->packet_len);
+        if (!st->header[st->packetno]) {
+            fprintf(stderr, "ERROR: Out of memory.\n");
+            exit(1);
+        }
+        memcpy(st->header[st->packetno], st->packet, st->packet_len);
+        st->header_len[st->packetno] = st->packet_len;
+    }
+
+    switch (st->codec) {
+        case CODEC_THEORA:
+            if (st->packetno == 0) {
+                const unsigned char *p = st->packet;
+                if (st->packet_len < 42) {
+                    fprintf(stderr, "ERROR: Invalid Theora header in stream %08x.\n", st->serialno);
+                    exit(1);
+                }
+                st->fps_numerator = read32be(p + 22);
+                st->fps_denominator = read32be(p + 26);
+                st->granule_shift = ((p[40] & 0x03) << 3) | (p[41] >> 5);
+                /* since 3.2.1 granulepos count frames from 1 */
+                st->frame_offset = (p[7] << 16 | p[8] << 8 | p[9]) >= 0x030201;
+                if (!st->fps_numerator || !st->fps_denominator) {
+                    fprintf(stderr, "ERROR: Invalid Theora frame rate in stream %08x.\n", st->serialno);
+                    exit(1);
+                }
+            }
+            break;
+        case CODEC_VORBIS:
+            if (vorbis_synthesis_headerin(&st->vi, &st->vc, &op) < 0) {
+                fprintf(stderr, "ERROR: Invalid Vorbis header in stream %08x.\n", st->serialno);
+                exit(1);
+            }
+            break;
+#ifdef HAVE_KATE
+        case CODEC_KATE:
+            if (st->packetno == 0) {
+                if (kate_ogg_decode_headerin(&st->ki, &st->kc, &op) < 0 ||
+                    !st->ki.gps_numerator || !st->ki.gps_denominator) {
+                    fprintf(stderr, "ERROR: Invalid Kate header in stream %08x.\n", st->serialno);
+                    exit(1);
+                }
+                st->num_headers = st->ki.num_headers;
+            }
+            break;
+#endif
+    }
+}
+
+/* Called when a packet is complete. Kate events carry their own times, the
+   times of Theora and Vorbis packets are only known once a page with a
+   granulepos turns up. */
+static void end_packet(stream *st) {
+    pending_packet *pp;
+
+    if (st->packetno < st->num_headers) {
+        read_header(st);
+        return;
+    }
+
+    switch (st->codec) {
+        case CODEC_THEORA:
+        case CODEC_VORBIS:
+            st->pending = grow(st->pending, &st->pending_size, st->num_pending + 1,
+                               sizeof(pending_packet));
+            pp = &st->pending[st->num_pending++];
+            pp->packetno = st->packetno;
+            pp->keyframe = st->packet_len > 0 && !(st->packet[0] & 0xc0);
+            pp->blocksize = 0;
+            if (st->codec == CODEC_VORBIS && st->packet_len > 0) {
+                ogg_packet op;
+                memset(&op, 0, sizeof(op));
+                op.packet = st->packet;
+                op.bytes = st->packet_len;
+                pp->blocksize = vorbis_packet_blocksize(&st->vi, &op);
+                if (pp->blocksize < 0)
+                    pp->blocksize = 0;
+            }
+            break;
+#ifdef HAVE_KATE
+        case CODEC_KATE:
+            /* event packets: type, start, duration, backlink */
+            if (st->packet_len >= 17 && st->packet[0] == 0x00) {
+                ogg_int64_t start = read64le(st->packet + 1);
+                ogg_int64_t duration = read64le(st->packet + 9);
+                ogg_int64_t start_time = 1000 * start * st->ki.gps_denominator / st->ki.gps_numerator;
+                ogg_int64_t end_time = 1000 * (start + duration) * st->ki.gps_denominator /
+                                       st->ki.gps_numerator;
+                /* same as ffmpeg2theora does when encoding */
+                if (st->last_end_time >= 0)
+                    start_time = st->last_end_time;
+                seek_index_record_sample(&st->index, st->packetno, start_time, end_time, 1);
+                st->last_end_time = end_time;
+            }
+            break;
+#endif
+    }
+}
+
+/* Assigns times to the packets waiting for a granulepos, counting back
+   from the last one, which ended at |granulepos|. */
+static void end_page(stream *st, ogg_int64_t granulepos) {
+    int i;
+
+    if (granulepos == -1 || st->num_pending == 0)
+        return;
+
+    if (st->codec == CODEC_THEORA) {
+        ogg_int64_t iframe = granulepos >> st->granule_shift;
+        ogg_int64_t pframe = granulepos - (iframe << st->granule_shift);
+        ogg_int64_t last = iframe + pframe - st->frame_offset;
+        for (i = 0; i < st->num_pending; i++) {
+            ogg_int64_t frameno = last - (st->num_pending - 1 - i);
+            ogg_int64_t start_time = (1000 * (ogg_int64_t)st->fps_denominator * frameno) /
+                                     st->fps_numerator;
+            ogg_int64_t end_time = (1000 * (ogg_int64_t)st->fps_denominator * (frameno + 1)) /
+                                   st->fps_numerator;
+            seek_index_record_sample(&st->index, st->pending[i].packetno,
+                                     start_time, end_time, st->pending[i].keyframe);
+        }
+    }
+    else if (st->codec == CODEC_VORBIS) {
+        ogg_int64_t end = granulepos;
+        ogg_int64_t *ends = malloc(sizeof(ogg_int64_t) * st->num_pending);
+        long *durations = malloc(sizeof(long) * st->num_pending);
+        if (!ends || !durations) {
+            fprintf(stderr, "ERROR: Out of memory.\n");
+            exit(1);
+        }
+        for (i = 0; i < st->num_pending; i++) {
+            long blocksize = st->pending[i].blocksize;
+            durations[i] = st->prev_blocksize < 0 ? 0 : st->prev_blocksize / 4 + blocksize / 4;
+            st->prev_blocksize = blocksize;
+        }
+        for (i = st->num_pending - 1; i >= 0; i--) {
+            ends[i] = end;
+            end -= durations[i];
+        }
+        for (i = 0; i < st->num_pending; i++) {
+            ogg_int64_t start = ends[i] - durations[i];
+            /* leading samples of the first packet and trailing ones of the
+               last are not played, see oggmux_add_audio() */
+            if (start < 0)
+                start = 0;
+            if (start < st->granulepos)
+                start = st->granulepos;
+            st->granulepos = ends[i];
+            seek_index_record_sample(&st->index, st->pending[i].packetno,
+                                     1000 * start / st->vi.rate,
+                                     1000 * ends[i] / st->vi.rate, 1);
+        }
+        free(ends);
+        free(durations);
+    }
+    st->num_pending = 0;
+}
+
+/* Returns the number of packets that start on a page. */
+static int page_start_packets(const unsigned char *page) {
+    int i;
+    int packets_start = (page[5] & 0x01) ? 0 : 1;
+    for (i = 1; i < page[26]; i++) {
+        if (page[27 + i - 1] < 0xff)
+            packets_start++;
+    }
+    return packets_start;
+}
+
+static void read_packets(stream *st, const unsigned char *page) {
+    int nsegs = page[26];
+    const unsigned char *lacing = page + 27;
+    const unsigned char *data = page + 27 + nsegs;
+    /* a continued packet we didn't see the start of can't be used */
+    int skipping = (page[5] & 0x01) && !st->in_packet;
+    int i;
+
+    if (!(page[5] & 0x01))
+        st->in_packet = 0;
+
+    for (i = 0; i < nsegs; i++) {
+        int len = lacing[i];
+        if (skipping) {
+            if (len < 255)
+                skipping = 0;
+            data += len;
+            continue;
+        }
+        if (!st->in_packet) {
+            st->in_packet = 1;
+            st->packetno = st->packets_started++;
+            st->packet_len = 0;
+        }
+        append_packet_data(st, data, len);
+        data += len;
+        if (len < 255) {
+            end_packet(st);
+            st->in_packet = 0;
+        }
+    }
+}
+
+static unsigned char *map_file(const char *name, ogg_int64_t *size, int *fd) {
+    struct stat st;
+    unsigned char *map;
+
+    *fd = open(name, O_RDONLY);
+    if (*fd < 0 || fstat(*fd, &st) != 0) {
+        fprintf(stderr, "ERROR: Unable to open input file `%s'.\n", name);
+        exit(1);
+    }
+    *size = st.st_size;
+    if (*size < 27 || (ogg_int64_t)(size_t)*size != *size) {
+        fprintf(stderr, "ERROR: `%s' is not an Ogg file this tool can map.\n", name);
+        exit(1);
+    }
+#ifdef WIN32
+    map = malloc(*size);
+    if (!map || read(*fd, map, *size) != *size) {
+        fprintf(stderr, "ERROR: Unable to read input file `%s'.\n", name);
+        exit(1);
+    }
+#else
+    map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, *fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "ERROR: Unable to map input file `%s'.\n", name);
+        exit(1);
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(map, *size, MADV_SEQUENTIAL);
+#endif
+#endif
+    return map;
+}
+
+static void unmap_file(unsigned char *map, ogg_int64_t size, int fd) {
+#ifdef WIN32
+    free(map);
+#else
+    munmap(map, size);
+#endif
+    close(fd);
+}
+
+static void free_streams(void) {
+    int i, j;
+    for (i = 0; i < num_streams; i++) {
+        for (j = 0; j < 3; j++)
+            free(streams[i].header[j]);
+        if (streams[i].codec == CODEC_VORBIS) {
+            vorbis_info_clear(&streams[i].vi);
+            vorbis_comment_clear(&streams[i].vc);
+        }
+#ifdef HAVE_KATE
+        if (streams[i].codec == CODEC_KATE) {
+            kate_info_clear(&streams[i].ki);
+            kate_comment_clear(&streams[i].kc);
+        }
+#endif
+        free(streams[i].packet);
+        free(streams[i].pending);
+    }
+    free(streams);
+    streams = NULL;
+    num_streams = streams_size = 0;
+}
+
+/* Returns the length of the page at |pos|, 0 if there's no complete page
+   there. */
+static ogg_int64_t page_length(const unsigned char *map, ogg_int64_t size, ogg_int64_t pos) {
+    const unsigned char *page = map + pos;
+    ogg_int64_t len;
+    int i;
+
+    if (pos + 27 > size || memcmp(page, "OggS", 4) || page[4] != 0 ||
+        pos + 27 + page[26] > size)
+        return 0;
+    len = 27 + page[26];
+    for (i = 0; i < page[26]; i++)
+        len += page[27 + i];
+    return pos + len > size ? 0 : len;
+}
+
+/* Writes a copy of the input with a new skeleton track and index. */
+static void reindex_file(const char *input_name, const char *output_name,
+                         int index_interval, ogg_int64_t index_max_bytes) {
+    char *tmp_name;
+    int fd;
+    unsigned char *map;
+    ogg_int64_t size, pos = 0;
+    ogg_int64_t content_length = 0;
+    int in_content = 0;
+    page_run *headers = NULL, *runs = NULL;
+    int num_headers = 0, headers_size = 0, num_runs = 0, runs_size = 0;
+    int warned_resync = 0;
+    stream *theora = NULL, *vorbis = NULL;
+    int num_kate = 0;
+    oggmux_info info;
+    ogg_uint32_t serialno;
+    ogg_page og;
+    ogg_int64_t end_time = 0;
+    time_t start = time(NULL);
+    int i, j;
+
+    map = map_file(input_name, &size, &fd);
+
+    /* Scan the pages. Header pages are written out again in their order,
+       content pages are copied in runs and recorded in the indexes with
+       offsets relative to the first of them. */
+    while (pos + 27 <= size) {
+        const unsigned char *page = map + pos;
+        ogg_int64_t page_len;
+        int header_page;
+        stream *st;
+
+        if (memcmp(page, "OggS", 4) || page[4] != 0) {
+            const unsigned char *next = memmem(page + 1, size - pos - 1, "OggS", 4);
+            if (!warned_resync) {
+                fprintf(stderr, "WARNING: Lost sync at offset %" PRId64 ", skipping garbage.\n", pos);
+                warned_resync = 1;
+            }
+            if (!next)
+                break;
+            pos = next - map;
+            continue;
+        }
+        page_len = page_length(map, size, pos);
+        if (!page_len) {
+            fprintf(stderr, "WARNING: Last page is truncated, leaving it out.\n");
+            break;
+        }
+
+        serialno = read32le(page + 14);
+        st = find_stream(serialno);
+        if (!st) {
+            if (!(page[5] & 0x02)) {
+                fprintf(stderr, "WARNING: Page of unknown stream %08x at offset %" PRId64
+                        " skipped.\n", serialno, pos);
+                pos += page_len;
+                continue;
+            }
+            st = add_stream(serialno, page + 27 + page[26], page_len - 27 - page[26],
+                            index_interval, index_max_bytes);
+        }
+        if (st->codec == CODEC_SKELETON) {
+            /* replaced by the new skeleton track */
+            pos += page_len;
+            continue;
+        }
+
+        header_page = st->packets_started < st->num_headers;
+        if (!header_page && !in_content)
+            in_content = 1;
+        if (in_content) {
+            if (!header_page) {
+                seek_index_record_page(&st->index, content_length, page_start_packets(page));
+            }
+            if (num_runs && runs[num_runs-1].offset + runs[num_runs-1].length == pos) {
+                runs[num_runs-1].length += page_len;
+            } else {
+                runs = grow(runs, &runs_size, num_runs + 1, sizeof(page_run));
+                runs[num_runs].offset = pos;
+                runs[num_runs].length = page_len;
+                runs[num_runs].bos = 0;
+                num_runs++;
+            }
+            content_length += page_len;
+        } else {
+            headers = grow(headers, &headers_size, num_headers + 1, sizeof(page_run));
+            headers[num_headers].offset = pos;
+            headers[num_headers].length = page_len;
+            headers[num_headers].bos = page[5] & 0x02;
+            num_headers++;
+        }
+
+        read_packets(st, page);
+        end_page(st, read64le(page + 6));
+        pos += page_len;
+    }
+
+    for (i = 0; i < num_streams; i++) {
+        stream *st = &streams[i];
+        if (st->codec == CODEC_THEORA) {
+            if (theora) {
+                fprintf(stderr, "ERROR: More than one Theora stream, can't index this file.\n");
+                exit(1);
+            }
+            theora = st;
+        } else if (st->codec == CODEC_VORBIS) {
+            if (vorbis) {
+                fprintf(stderr, "ERROR: More than one Vorbis stream, can't index this file.\n");
+                exit(1);
+            }
+            vorbis = st;
+        } else if (st->codec == CODEC_KATE) {
+            num_kate++;
+        }
+        if (st->codec != CODEC_SKELETON && st->packets_started < st->num_headers) {
+            fprintf(stderr, "ERROR: Stream %08x ends before its headers do.\n", st->serialno);
+            exit(1);
+        }
+        if (st->index.end_time > end_time)
+            end_time = st->index.end_time;
+    }
+    if (!theora && !vorbis) {
+        fprintf(stderr, "ERROR: No Theora or Vorbis stream found in `%s'.\n", input_name);
+        exit(1);
+    }
+
+    /* Describe the streams the way oggmux_init() would have set them up. */
+    init_info(&info);
+    info.with_skeleton = 1;
+    info.passno = 0;
+    info.duration = end_time / 1000.0;
+    info.audio_only = !theora;
+    info.video_only = !vorbis;
+    if (theora) {
+        ogg_stream_init(&info.to, theora->serialno);
+        info.ti.fps_numerator = theora->fps_numerator;
+        info.ti.fps_denominator = theora->fps_denominator;
+        info.ti.keyframe_granule_shift = theora->granule_shift;
+        info.theora_index = theora->index;
+    }
+    if (vorbis) {
+        ogg_stream_init(&info.vo, vorbis->serialno);
+        info.sample_rate = vorbis->vi.rate;
+        info.vorbis_index = vorbis->index;
+    }
+#ifdef HAVE_KATE
+    info.with_kate = num_kate > 0;
+    oggmux_setup_kate_streams(&info, num_kate);
+    for (i = 0, j = 0; i < num_streams; i++) {
+        if (streams[i].codec == CODEC_KATE) {
+            oggmux_kate_stream *ks = info.kate_streams + j++;
+            ogg_stream_init(&ks->ko, streams[i].serialno);
+            ks->ki = streams[i].ki;
+            ks->index = streams[i].index;
+        }
+    }
+#endif
+
+    srand(time(NULL));
+    do {
+        serialno = rand();
+    } while (find_stream(serialno));
+
+    tmp_name = malloc(strlen(output_name) + 9);
+    if (!tmp_name) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        exit(1);
+    }
+    sprintf(tmp_name, "%s.reindex", output_name);
+    info.outfile = fopen(tmp_name, "wb");
+    if (!info.outfile) {
+        fprintf(stderr, "ERROR: Unable to open output file `%s'.\n", tmp_name);
+        exit(1);
+    }
+    info.outfile_name = tmp_name;
+
+    /* skeleton BOS, the other BOS pages, fisbones, then the other headers */
+    ogg_stream_init(&info.so, serialno);
+    add_fishead_packet(&info, 4, 0);
+    if (ogg_stream_flush(&info.so, &og) != 1) {
+        fprintf(stderr, "Internal Ogg library error.\n");
+        exit(1);
+    }
+    fwrite(og.header, 1, og.header_len, info.outfile);
+    fwrite(og.body, 1, og.body_len, info.outfile);
+    for (i = 0; i < num_headers; i++) {
+        if (headers[i].bos)
+            fwrite(map + headers[i].offset, 1, headers[i].length, info.outfile);
+    }
+    add_fisbone_packet(&info);
+    while (ogg_stream_flush(&info.so, &og) > 0) {
+        fwrite(og.header, 1, og.header_len, info.outfile);
+        fwrite(og.body, 1, og.body_len, info.outfile);
+    }
+    for (i = 0; i < num_headers; i++) {
+        if (!headers[i].bos)
+            fwrite(map + headers[i].offset, 1, headers[i].length, info.outfile);
+    }
+
+    /* All keyframes are known, so the index can be sized exactly. */
+    if (oggmux_reserve_exact_index(&info, ftello(info.outfile)) == -1) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        exit(1);
+    }
+    oggmux_end_skeleton_headers(&info);
+
+    for (i = 0; i < 2 + info.n_kate_streams; i++) {
+        seek_index *index = i == 0 ? (theora ? &info.theora_index : NULL) :
+                            i == 1 ? (vorbis ? &info.vorbis_index : NULL) :
+                            &info.kate_streams[i-2].index;
+        if (!index)
+            continue;
+        for (j = 0; j < index->pages_num; j++)
+            index->pages[j].offset += info.content_offset;
+    }
+
+    for (i = 0; i < num_runs; i++) {
+        if (fwrite(map + runs[i].offset, 1, runs[i].length, info.outfile) != (size_t)runs[i].length) {
+            fprintf(stderr, "ERROR: Failed to write `%s'.\n", tmp_name);
+            remove(tmp_name);
+            exit(1);
+        }
+    }
+    if (fflush(info.outfile) != 0 || write_seek_index(&info) == -1 ||
+        fclose(info.outfile) != 0) {
+        fprintf(stderr, "ERROR: Failed to write `%s'.\n", tmp_name);
+        remove(tmp_name);
+        exit(1);
+    }
+
+    unmap_file(map, size, fd);
+#ifdef WIN32
+    remove(output_name);
+#endif
+    if (rename(tmp_name, output_name) != 0) {
+        fprintf(stderr, "ERROR: Unable to rename `%s' to `%s'.\n", tmp_name, output_name);
+        exit(1);
+    }
+    fprintf(stderr, "Indexed `%s' (%.1f MB) in %d seconds.\n",
+            output_name, size / 1048576.0, (int)(time(NULL) - start));
+
+    if (theora)
+        ogg_stream_clear(&info.to);
+    if (vorbis)
+        ogg_stream_clear(&info.vo);
+    ogg_stream_clear(&info.so);
+    seek_index_clear(&info.theora_index);
+    seek_index_clear(&info.vorbis_index);
+    for (i = 0; i < info.n_kate_streams; i++) {
+        ogg_stream_clear(&info.kate_streams[i].ko);
+        seek_index_clear(&info.kate_streams[i].index);
+    }
+    free(info.kate_streams);
+    free_streams();
+    free(headers);
+    free(runs);
+    free(tmp_name);
+}
+
+/* Reads a variable length integer of a skeleton index. */
+static const unsigned char *read_vl_int(const unsigned char *p, const unsigned char *limit,
+                                        ogg_int64_t *n) {
+    int shift = 0;
+    *n = 0;
+    while (p < limit && shift < 63) {
+        *n |= (ogg_int64_t)(*p & 0x7f) << shift;
+        shift += 7;
+        if (*p++ & 0x80)
+            return p;
+    }
+    return NULL;
+}
+
+/* Finds the last keypoint at or before |time| ms in a skeleton index
+   packet. Returns 0 if found, -1 if the index has no such keypoint. */
+static int find_index_keypoint(const unsigned char *packet, long bytes, ogg_int64_t time,
+                               ogg_int64_t *offset, ogg_int64_t *keypoint_time) {
+    const unsigned char *p = packet + 42;
+    const unsigned char *limit = packet + bytes;
+    ogg_int64_t n, denominator, i;
+    ogg_int64_t o = 0, t = 0;
+    int found = -1;
+
+    if (bytes < 42)
+        return -1;
+    n = read64le(packet + 10);
+    denominator = read64le(packet + 18);
+    if (denominator <= 0)
+        return -1;
+    for (i = 0; i < n; i++) {
+        ogg_int64_t d;
+        if (!(p = read_vl_int(p, limit, &d)))
+            break;
+        o += d;
+        if (!(p = read_vl_int(p, limit, &d)))
+            break;
+        t += d;
+        if (t * 1000 / denominator > time)
+            break;
+        *offset = o;
+        *keypoint_time = t * 1000 / denominator;
+        found = 0;
+    }
+    return found;
+}
+
+/* State of a stream while pages are copied into a clip. */
+typedef struct {
+    stream *st;
+    ogg_int64_t start_offset;
+    int started;
+    int done;
+    ogg_uint32_t pageno;
+    /* theora: packets completed since the first keyframe, and its frame
+       number once a granulepos told */
+    int completed;
+    ogg_int64_t first_frame;
+}
+clip_stream;
+
+/* Writes a page made of the segments from |first_segment| on of |page|,
+   with a new serial number, granulepos and sequence number, and the end of
+   stream flag set to |e_o_s|. */
+static int write_clip_page(FILE *out, const unsigned char *page, int first_segment,
+                           ogg_uint32_t serialno, ogg_int64_t granulepos,
+                           ogg_uint32_t pageno, int e_o_s) {
+    unsigned char header[27 + 255];
+    const unsigned char *body = page + 27 + page[26];
+    long body_len = 0, skip = 0;
+    ogg_page og;
+    int nsegs = page[26] - first_segment;
+    int i;
+
+    for (i = 0; i < page[26]; i++) {
+        if (i < first_segment)
+            skip += page[27 + i];
+        else
+            body_len += page[27 + i];
+    }
+    memcpy(header, page, 27);
+    if (first_segment)
+        header[5] &= ~0x01;
+    if (e_o_s)
+        header[5] |= 0x04;
+    else
+        header[5] &= ~0x04;
+    for (i = 0; i < 8; i++)
+        header[6 + i] = (granulepos >> (8 * i)) & 0xff;
+    for (i = 0; i < 4; i++)
+        header[14 + i] = (serialno >> (8 * i)) & 0xff;
+    for (i = 0; i < 4; i++)
+        header[18 + i] = (pageno >> (8 * i)) & 0xff;
+    header[26] = nsegs;
+    memcpy(header + 27, page + 27 + first_segment, nsegs);
+
+    og.header = header;
+    og.header_len = 27 + nsegs;
+    og.body = (unsigned char *)body + skip;
+    og.body_len = body_len;
+    ogg_page_checksum_set(&og);
+    if (fwrite(og.header, 1, og.header_len, out) != (size_t)og.header_len ||
+        fwrite(og.body, 1, og.body_len, out) != (size_t)og.body_len)
+        return -1;
+    return 0;
+}
+
+/* Returns the segment on which the first packet starting on |page| starts,
+   or page[26] if there is none. With |keyframe| set, only Theora keyframes
+   count. */
+static int find_packet_start(const unsigned char *page, int keyframe) {
+    const unsigned char *body = page + 27 + page[26];
+    int at_start = !(page[5] & 0x01);
+    long offset = 0;
+    int i;
+
+    for (i = 0; i < page[26]; i++) {
+        int len = page[27 + i];
+        if (at_start && (!keyframe || (len > 0 && !(body[offset] & 0xc0))))
+            return i;
+        at_start = len < 255;
+        offset += len;
+    }
+    return page[26];
+}
+
+/* Copies the pages from the keyframe before |start_time| to |end_time| (in
+   ms, -1 for the end of the input) into a plain Ogg file without skeleton,
+   with granulepos counting from the keyframe. Kate streams are left out,
+   their events carry absolute times in the packets. */
+static void trim_file(const char *input_name, const char *output_name,
+                      ogg_int64_t start_time, ogg_int64_t end_time) {
+    int fd;
+    unsigned char *map;
+    ogg_int64_t size, pos = 0, page_len;
+    ogg_stream_state so;
+    int have_skeleton = 0;
+    clip_stream *clip;
+    clip_stream *video = NULL, *audio = NULL;
+    ogg_int64_t keyframe_time = 0, granule_offset = 0;
+    ogg_int64_t content_start = -1;
+    int warned_kate = 0;
+    FILE *out;
+    int i;
+
+    map = map_file(input_name, &size, &fd);
+
+    /* Headers, and the skeleton track with its index. */
+    while ((page_len = page_length(map, size, pos)) > 0) {
+        const unsigned char *page = map + pos;
+        ogg_uint32_t serialno = read32le(page + 14);
+        stream *st = find_stream(serialno);
+        int all_done = 1;
+
+        if (!st && (page[5] & 0x02))
+            st = add_stream(serialno, page + 27 + page[26], page_len - 27 - page[26], 0, 0);
+        if (st && st->codec == CODEC_SKELETON) {
+            ogg_page og;
+            if (!have_skeleton) {
+                ogg_stream_init(&so, serialno);
+                have_skeleton = 1;
+            }
+            og.header = (unsigned char *)page;
+            og.header_len = 27 + page[26];
+            og.body = (unsigned char *)page + og.header_len;
+            og.body_len = page_len - og.header_len;
+            ogg_stream_pagein(&so, &og);
+        } else if (st) {
+            if (st->packets_started >= st->num_headers) {
+                content_start = pos;
+                break;
+            }
+            read_packets(st, page);
+        }
+        for (i = 0; i < num_streams; i++) {
+            if (streams[i].codec != CODEC_SKELETON &&
+                streams[i].packets_started < streams[i].num_headers)
+                all_done = 0;
+        }
+        pos += page_len;
+        if (all_done && (page[5] & 0x04) && st && st->codec == CODEC_SKELETON) {
+            content_start = pos;
+            break;
+        }
+    }
+    if (content_start < 0 || !have_skeleton) {
+        fprintf(stderr, "ERROR: `%s' has no skeleton keyframe index, run ogg-reindex on it first.\n",
+                input_name);
+        exit(1);
+    }
+
+    clip = calloc(num_streams, sizeof(clip_stream));
+    if (!clip) {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        exit(1);
+    }
+    for (i = 0; i < num_streams; i++) {
+        clip[i].st = &streams[i];
+        clip[i].start_offset = -1;
+        clip[i].first_frame = -1;
+        if (streams[i].codec == CODEC_THEORA && !video)
+            video = &clip[i];
+        else if (streams[i].codec == CODEC_VORBIS && !audio)
+            audio = &clip[i];
+    }
+
+    /* Look up the keyframe to start from; the audio starts from its time. */
+    {
+        ogg_packet op;
+        clip_stream *first = video ? video : audio;
+        while (ogg_stream_packetout(&so, &op) > 0) {
+            ogg_int64_t offset, time;
+            if (op.bytes < 42 || memcmp(op.packet, "index\0", 6))
+                continue;
+            for (i = 0; i < num_streams; i++) {
+                if (clip[i].st->serialno == read32le(op.packet + 6) &&
+                    (&clip[i] == video || &clip[i] == audio) &&
+                    find_index_keypoint(op.packet, op.bytes,
+                                        &clip[i] == first ? start_time : keyframe_time,
+                                        &offset, &time) == 0) {
+                    clip[i].start_offset = offset;
+                    if (&clip[i] == first)
+                        keyframe_time = time;
+                }
+            }
+            /* theora's index comes first, vorbis is looked up from its time */
+        }
+        ogg_stream_clear(&so);
+        if (!first || first->start_offset < 0) {
+            fprintf(stderr, "ERROR: No keyframe before %.3f s in the index of `%s'.\n",
+                    start_time / 1000.0, input_name);
+            exit(1);
+        }
+    }
+    if (audio) {
+        if (audio->start_offset < 0)
+            audio->start_offset = video ? video->start_offset : content_start;
+        granule_offset = keyframe_time * audio->st->vi.rate / 1000;
+    }
+
+    out = fopen(output_name, "wb");
+    if (!out) {
+        fprintf(stderr, "ERROR: Unable to open output file `%s'.\n", output_name);
+        exit(1);
+    }
+
+    /* Header pages, without skeleton and kate. */
+    for (pos = 0; pos < content_start; pos += page_len) {
+        const unsigned char *page = map + pos;
+        stream *st;
+        page_len = page_length(map, size, pos);
+        st = find_stream(read32le(page + 14));
+        if (!st || (st != (video ? video->st : NULL) && st != (audio ? audio->st : NULL)))
+            continue;
+        fwrite(page, 1, page_len, out);
+        for (i = 0; i < num_streams; i++) {
+            if (clip[i].st == st)
+                clip[i].pageno = read32le(page + 18) + 1;
+        }
+    }
+
+    pos = content_start;
+    if (video && video->start_offset > pos)
+        pos = video->start_offset;
+    if (audio && audio->start_offset < pos)
+        pos = audio->start_offset;
+    for (; (page_len = page_length(map, size, pos)) > 0; pos += page_len) {
+        const unsigned char *page = map + pos;
+        ogg_int64_t granulepos = read64le(page + 6);
+        clip_stream *cs = NULL;
+        stream *st = find_stream(read32le(page + 14));
+        int first_segment = 0;
+        int e_o_s = page[5] & 0x04;
+
+        if (video && st == video->st)
+            cs = video;
+        else if (audio && st == audio->st)
+            cs = audio;
+        if (!cs) {
+            if (st && st->codec == CODEC_KATE && !warned_kate) {
+                fprintf(stderr, "WARNING: Leaving out Kate streams, they can't be trimmed.\n");
+                warned_kate = 1;
+            }
+            continue;
+        }
+        if (cs->done || pos < cs->start_offset)
+            continue;
+
+        if (cs == video) {
+            if (!cs->started) {
+                first_segment = find_packet_start(page, 1);
+                if (first_segment == page[26])
+                    continue;
+                cs->started = 1;
+            }
+            if (cs->first_frame < 0) {
+                /* count packets ending on this page, from the keyframe on */
+                for (i = first_segment; i < page[26]; i++) {
+                    if (page[27 + i] < 255)
+                        cs->completed++;
+                }
+            }
+            if (granulepos != -1) {
+                ogg_int64_t iframe = granulepos >> st->granule_shift;
+                ogg_int64_t pframe = granulepos - (iframe << st->granule_shift);
+                ogg_int64_t frameno = iframe + pframe - st->frame_offset;
+                if (cs->first_frame < 0)
+                    cs->first_frame = frameno - (cs->completed - 1);
+                granulepos = ((iframe - cs->first_frame) << st->granule_shift) + pframe;
+                if (end_time >= 0 &&
+                    (1000 * (ogg_int64_t)st->fps_denominator * (frameno - cs->first_frame + 1)) /
+                    st->fps_numerator >= end_time - keyframe_time)
+                    cs->done = e_o_s = 1;
+            }
+        } else {
+            if (!cs->started) {
+                if (granulepos == -1 || granulepos <= granule_offset)
+                    continue;
+                first_segment = find_packet_start(page, 0);
+                cs->started = 1;
+            }
+            if (granulepos != -1) {
+                granulepos -= granule_offset;
+                if (end_time >= 0 &&
+                    1000 * granulepos / st->vi.rate >= end_time - keyframe_time)
+                    cs->done = e_o_s = 1;
+            }
+        }
+
+        if (write_clip_page(out, page, first_segment, st->serialno, granulepos,
+                            cs->pageno++, e_o_s) == -1) {
+            fprintf(stderr, "ERROR: Failed to write `%s'.\n", output_name);
+            exit(1);
+        }
+        if ((!video || video->done) && (!audio || audio->done))
+            break;
+    }
+
+    if (fclose(out) != 0) {
+        fprintf(stderr, "ERROR: Failed to write `%s'.\n", output_name);
+        exit(1);
+    }
+    unmap_file(map, size, fd);
+    free(clip);
+    free_streams();
+}
+
+/* Checks a Theora or Vorbis stream of a file to join matches the one of
+   the first file: the same identification and setup headers mean the
+   packets of both can go through one decoder. */
+static void check_concat_stream(const char *name, stream *st, stream *first) {
+    int i;
+    if (!st || !first) {
+        fprintf(stderr, "ERROR: `%s' doesn't have the same streams as the first file.\n", name);
+        exit(1);
+    }
+    for (i = 0; i < 3; i += 2) {
+        if (st->header_len[i] != first->header_len[i] ||
+            memcmp(st->header[i], first->header[i], st->header_len[i])) {
+            fprintf(stderr, "ERROR: %s settings of `%s' differ from the first file, "
+                    "it can't be joined without re-encoding.\n",
+                    st->codec == CODEC_THEORA ? "Theora" : "Vorbis", name);
+            exit(1);
+        }
+    }
+}
+
+/* The Vorbis stream written by concat_files(). Its packets are taken out
+   of the input pages and paged again, so each one can get its place on
+   the joined timeline. */
+typedef struct {
+    ogg_stream_state os;
+    FILE *out;
+    const char *output_name;
+    int headers_out;
+    /* the last packet is held back to end the stream with */
+    ogg_packet held;
+    unsigned char *held_data;
+    long held_size;
+    int have_held;
+    /* granulepos and block size of the last packet, across files, and
+       where it starts */
+    ogg_int64_t granulepos;
+    ogg_int64_t held_start;
+    long prev_blocksize;
+}
+concat_audio;
+
+static void concat_audio_pages(concat_audio *ca, int flush) {
+    ogg_page og;
+    while (flush ? ogg_stream_flush(&ca->os, &og) : ogg_stream_pageout(&ca->os, &og)) {
+        if (fwrite(og.header, 1, og.header_len, ca->out) != (size_t)og.header_len ||
+            fwrite(og.body, 1, og.body_len, ca->out) != (size_t)og.body_len) {
+            fprintf(stderr, "ERROR: Failed to write `%s'.\n", ca->output_name);
+            exit(1);
+        }
+    }
+}
+
+/* Writes the Vorbis headers of the first input as they are read, the
+   identification header on a page of its own and the others ending a
+   page, as the header pages of the input did. */
+static void concat_audio_headers(concat_audio *ca, stream *st) {
+    int done = st->packets_started - st->in_packet;
+    if (ca->headers_out == 0)
+        ogg_stream_init(&ca->os, st->serialno);
+    while (ca->headers_out < done && ca->headers_out < 3) {
+        ogg_packet op;
+        memset(&op, 0, sizeof(op));
+        op.packet = st->header[ca->headers_out];
+        op.bytes = st->header_len[ca->headers_out];
+        op.b_o_s = ca->headers_out == 0;
+        op.packetno = ca->headers_out;
+        ogg_stream_packetin(&ca->os, &op);
+        if (++ca->headers_out != 2)
+            concat_audio_pages(ca, 1);
+    }
+}
+
+/* A packet of the input on its way to the joined Vorbis stream. */
+typedef struct {
+    ogg_packet op;
+    long blocksize;
+    long samples;
+}
+concat_packet;
+
+/* Queues a content packet, writing the one held before it. */
+static void concat_audio_packet(concat_audio *ca, const ogg_packet *op) {
+    if (ca->have_held) {
+        ogg_stream_packetin(&ca->os, &ca->held);
+        concat_audio_pages(ca, 0);
+    }
+    if (op->bytes > ca->held_size) {
+        ca->held_size = op->bytes;
+        ca->held_data = realloc(ca->held_data, ca->held_size);
+        if (!ca->held_data) {
+            fprintf(stderr, "ERROR: Out of memory.\n");
+            exit(1);
+        }
+    }
+    memcpy(ca->held_data, op->packet, op->bytes);
+    ca->held = *op;
+    ca->held.packet = ca->held_data;
+    ca->held.b_o_s = 0;
+    ca->held.e_o_s = 0;
+    ca->have_held = 1;
+}
+
+/* Joins the Theora and Vorbis streams of the inputs into a plain Ogg file
+   without skeleton. The headers of the first input are kept, the pages of
+   the others are renumbered into its streams.
+
+   Both streams share one timeline: every input starts where the video of
+   the previous one ended. Vorbis packets are decoded across the joins, so
+   the first packet of an input gives the overlap of its window with the
+   last one before it, which the granulepos makes room for. Audio going on
+   past the end of the video of an input is cut at the first packet after
+   it; audio ending before it leaves a gap in the granulepos, as nothing
+   can be inserted without encoding. Only the end of the last input can be
+   trimmed to the sample. */
+static void concat_files(char **input_names, int num_inputs, const char *output_name) {
+    stream first_video, first_audio;
+    int have_video = 0, have_audio = 0;
+    ogg_uint32_t video_pageno = 0;
+    ogg_int64_t frame_base = 0;
+    ogg_int64_t audio_end = -1;
+    concat_audio ca;
+    int warned_kate = 0;
+    FILE *out;
+    int n, i;
+
+    out = fopen(output_name, "wb");
+    if (!out) {
+        fprintf(stderr, "ERROR: Unable to open output file `%s'.\n", output_name);
+        exit(1);
+    }
+    memset(&ca, 0, sizeof(ca));
+    ca.out = out;
+    ca.output_name = output_name;
+    ca.prev_blocksize = -1;
+
+    for (n = 0; n < num_inputs; n++) {
+        const char *name = input_names[n];
+        int fd;
+        unsigned char *map;
+        ogg_int64_t size, pos, page_len;
+        ogg_int64_t content_start = -1;
+        ogg_int64_t frames = 0;
+        stream *video = NULL, *audio = NULL;
+        ogg_stream_state ain;
+        concat_packet *packets = NULL;
+        int packets_size = 0;
+        /* where the audio of this input goes on the joined timeline, the
+           end of its video there, and the end of its last packet as if it
+           was played alone */
+        ogg_int64_t shift = 0, video_end = -1, file_end = 0;
+        int have_file_end = 0;
+        long file_blocksize = -1;
+
+        map = map_file(name, &size, &fd);
+
+        for (pos = 0; (page_len = page_length(map, size, pos)) > 0; pos += page_len) {
+            const unsigned char *page = map + pos;
+            ogg_uint32_t serialno = read32le(page + 14);
+            stream *st = find_stream(serialno);
+            int all_done = 1;
+
+            if (!st && (page[5] & 0x02))
+                st = add_stream(serialno, page + 27 + page[26], page_len - 27 - page[26], 0, 0);
+            if (!st || st->codec == CODEC_SKELETON)
+                continue;
+            if (st->packets_started >= st->num_headers) {
+                content_start = pos;
+                break;
+            }
+            read_packets(st, page);
+            if (n == 0 && st->codec == CODEC_THEORA)
+                fwrite(page, 1, page_len, out);
+            if (n == 0 && st->codec == CODEC_VORBIS)
+                concat_audio_headers(&ca, st);
+            for (i = 0; i < num_streams; i++) {
+                if (streams[i].codec != CODEC_SKELETON &&
+                    streams[i].packets_started < streams[i].num_headers)
+                    all_done = 0;
+            }
+            if (all_done) {
+                content_start = pos + page_len;
+                break;
+            }
+        }
+        if (content_start < 0) {
+            fprintf(stderr, "ERROR: `%s' ends before its headers do.\n", name);
+            exit(1);
+        }
+
+        for (i = 0; i < num_streams; i++) {
+            stream *st = &streams[i];
+            if (st->codec == CODEC_THEORA || st->codec == CODEC_VORBIS) {
+                if (*(st->codec == CODEC_THEORA ? &video : &audio)) {
+                    fprintf(stderr, "ERROR: More than one %s stream in `%s', can't join it.\n",
+                            st->codec == CODEC_THEORA ? "Theora" : "Vorbis", name);
+                    exit(1);
+                }
+                *(st->codec == CODEC_THEORA ? &video : &audio) = st;
+            } else if (st->codec == CODEC_KATE && !warned_kate) {
+                fprintf(stderr, "WARNING: Leaving out Kate streams, they can't be joined.\n");
+                warned_kate = 1;
+            }
+        }
+        if (n == 0) {
+            if (!video && !audio) {
+                fprintf(stderr, "ERROR: No Theora or Vorbis stream found in `%s'.\n", name);
+                exit(1);
+            }
+            /* keep the serial numbers and headers the other inputs are
+               checked against, nothing else of these copies is used */
+            if (video) {
+                first_video = *video;
+                memset(video->header, 0, sizeof(video->header));
+                have_video = 1;
+            }
+            if (audio) {
+                first_audio = *audio;
+                memset(audio->header, 0, sizeof(audio->header));
+                have_audio = 1;
+            }
+            for (pos = 0; pos < content_start; pos += page_length(map, size, pos)) {
+                ogg_uint32_t serialno = read32le(map + pos + 14);
+                if (video && serialno == video->serialno)
+                    video_pageno = read32le(map + pos + 18) + 1;
+            }
+        } else {
+            if (have_video || video)
+                check_concat_stream(name, video, have_video ? &first_video : NULL);
+            if (have_audio || audio)
+                check_concat_stream(name, audio, have_audio ? &first_audio : NULL);
+        }
+
+        if (audio) {
+            ogg_stream_init(&ain, audio->serialno);
+            /* without video the audio of the inputs follows on directly */
+            shift = ca.have_held ? ca.granulepos : 0;
+            if (video) {
+                ogg_int64_t last_frames = 0;
+                for (pos = content_start; (page_len = page_length(map, size, pos)) > 0; pos += page_len) {
+                    ogg_int64_t granulepos = read64le(map + pos + 6);
+                    if (read32le(map + pos + 14) == video->serialno && granulepos != -1) {
+                        ogg_int64_t iframe = granulepos >> video->granule_shift;
+                        ogg_int64_t pframe = granulepos - (iframe << video->granule_shift);
+                        last_frames = iframe + pframe - video->frame_offset + 1;
+                    }
+                }
+                shift = frame_base * audio->vi.rate * video->fps_denominator /
+                        video->fps_numerator;
+                video_end = (frame_base + last_frames) * audio->vi.rate *
+                            video->fps_denominator / video->fps_numerator;
+            }
+        }
+
+        for (pos = content_start; (page_len = page_length(map, size, pos)) > 0; pos += page_len) {
+            const unsigned char *page = map + pos;
+            ogg_int64_t granulepos = read64le(page + 6);
+            stream *st = find_stream(read32le(page + 14));
+            int last = n == num_inputs - 1 && (page[5] & 0x04);
+            int ret = 0;
+
+            if (st && st == video) {
+                if (granulepos != -1) {
+                    ogg_int64_t iframe = granulepos >> st->granule_shift;
+                    ogg_int64_t pframe = granulepos - (iframe << st->granule_shift);
+                    frames = iframe + pframe - st->frame_offset + 1;
+                    granulepos = ((iframe + frame_base) << st->granule_shift) + pframe;
+                }
+                ret = write_clip_page(out, page, 0, first_video.serialno, granulepos,
+                                      video_pageno++, last);
+            } else if (st && st == audio) {
+                ogg_page og;
+                ogg_packet op;
+                int num_packets = 0;
+
+                og.header = (unsigned char *)page;
+                og.header_len = 27 + page[26];
+                og.body = (unsigned char *)page + og.header_len;
+                og.body_len = page_len - og.header_len;
+                ogg_stream_pagein(&ain, &og);
+                while ((ret = ogg_stream_packetout(&ain, &op)) != 0) {
+                    concat_packet *cp;
+                    /* the header pages weren't fed in */
+                    if (ret < 0)
+                        continue;
+                    packets = grow(packets, &packets_size, num_packets + 1, sizeof(concat_packet));
+                    cp = &packets[num_packets++];
+                    cp->op = op;
+                    cp->blocksize = vorbis_packet_blocksize(&audio->vi, &op);
+                    if (cp->blocksize < 0)
+                        cp->blocksize = 0;
+                    /* as if the input was played alone, the first packet
+                       gives no samples */
+                    cp->samples = file_blocksize < 0 ? 0 : file_blocksize / 4 + cp->blocksize / 4;
+                    file_blocksize = cp->blocksize;
+                }
+                ret = 0;
+                if (num_packets == 0)
+                    continue;
+
+                /* the first page with a granulepos tells when the packets
+                   start, counting back from it as for the input alone */
+                if (!have_file_end && granulepos != -1) {
+                    packets[num_packets - 1].op.granulepos = granulepos;
+                    for (i = num_packets - 1; i > 0; i--)
+                        packets[i - 1].op.granulepos = packets[i].op.granulepos - packets[i].samples;
+                } else {
+                    for (i = 0; i < num_packets; i++) {
+                        file_end += packets[i].samples;
+                        packets[i].op.granulepos = file_end;
+                    }
+                }
+                have_file_end = 1;
+                file_end = packets[num_packets - 1].op.granulepos;
+
+                for (i = 0; i < num_packets; i++) {
+                    concat_packet *cp = &packets[i];
+                    /* samples the decoder gives for it in the joined stream */
+                    long samples = ca.prev_blocksize < 0 ? 0 : ca.prev_blocksize / 4 + cp->blocksize / 4;
+                    ogg_int64_t end = cp->op.granulepos + shift;
+                    if (n > 0 && end < ca.granulepos + samples) {
+                        shift += ca.granulepos + samples - end;
+                        end = ca.granulepos + samples;
+                    }
+                    if (video_end >= 0 && end - samples >= video_end)
+                        continue;
+                    cp->op.granulepos = end < 0 ? 0 : end;
+                    concat_audio_packet(&ca, &cp->op);
+                    ca.granulepos = cp->op.granulepos;
+                    ca.held_start = end - samples;
+                    ca.prev_blocksize = cp->blocksize;
+                }
+                /* the input's end trim is only kept for the last input */
+                if ((page[5] & 0x04) && granulepos != -1 && n == num_inputs - 1)
+                    audio_end = granulepos + shift;
+            }
+            if (ret == -1) {
+                fprintf(stderr, "ERROR: Failed to write `%s'.\n", output_name);
+                exit(1);
+            }
+        }
+        frame_base += frames;
+        if (audio) {
+            ogg_stream_clear(&ain);
+            if (n == num_inputs - 1 && video_end >= 0 &&
+                (audio_end < 0 || video_end < audio_end))
+                audio_end = video_end;
+        }
+        free(packets);
+
+        unmap_file(map, size, fd);
+        free_streams();
+        fprintf(stderr, "Joined `%s'.\n", name);
+    }
+
+    if (have_audio) {
+        if (ca.have_held) {
+            if (audio_end >= 0 && audio_end < ca.held.granulepos)
+                ca.held.granulepos = audio_end > ca.held_start ? audio_end : ca.held_start;
+            ca.held.e_o_s = 1;
+            ogg_stream_packetin(&ca.os, &ca.held);
+        }
+        concat_audio_pages(&ca, 1);
+        ogg_stream_clear(&ca.os);
+        free(ca.held_data);
+    }
+    if (fclose(out) != 0) {
+        fprintf(stderr, "ERROR: Failed to write `%s'.\n", output_name);
+        exit(1);
+    }
+    for (i = 0; i < 3; i++) {
+        if (have_video)
+            free(first_video.header[i]);
+        if (have_audio)
+            free(first_audio.header[i]);
+    }
+}
+
+static void usage(void) {
+    fprintf(stderr,
+        "Usage: ogg-reindex [options] input.ogv\n"
+        "       ogg-reindex [options] -c -o output.ogv input1.ogv input2.ogv ...\n"
+        "\n"
+        "Adds a skeleton 4 keyframe index to an existing Ogg Theora, Vorbis and Kate\n"
+        "file, replacing the skeleton track it may have. Without -o the input is\n"
+        "replaced once the new file is complete.\n"
+        "\n"
+        "  -o, --output <file>          write the indexed file to <file>\n"
+        "  -s, --starttime <t>          cut a clip starting at the keyframe before\n"
+        "                               <t> seconds, without re-encoding; needs -o\n"
+        "                               and an input with a keyframe index\n"
+        "  -e, --endtime <t>            end the clip at <t> seconds\n"
+        "  -c, --concat                 join all input files into the output, they\n"
+        "                               need the same Theora and Vorbis settings\n"
+        "      --index-interval <n>     set minimum distance between indexed keyframes\n"
+        "                               to <n> ms (default: 2000)\n"
+        "      --index-max-bytes <n>    also index a keyframe once <n> bytes have\n"
+        "                               passed since the previous one\n"
+        "  -h, --help                   this message\n"
+        "\n");
+    exit(0);
+}
+
+int main(int argc, char **argv) {
+    static int flag = -1;
+    const char *optstring = "o:s:e:ch";
+    struct option options [] = {
+        {"output",required_argument,NULL,'o'},
+        {"starttime",required_argument,NULL,'s'},
+        {"endtime",required_argument,NULL,'e'},
+        {"concat",no_argument,NULL,'c'},
+        {"index-interval",required_argument,&flag,INDEX_INTERVAL},
+        {"index-max-bytes",required_argument,&flag,INDEX_MAX_BYTES},
+        {"help",no_argument,NULL,'h'},
+        {NULL,0,NULL,0}
+    };
+    int c, long_option_index;
+    int index_interval = 2000;
+    ogg_int64_t index_max_bytes = 0;
+    double start_time = -1, end_time = -1;
+    int concat = 0;
+    const char *input_name, *output_name = NULL;
+
+    while ((c = getopt_long(argc, argv, optstring, options, &long_option_index)) != EOF) {
+        switch (c) {
+            case 0:
+                switch (flag) {
+                    case INDEX_INTERVAL:
+                        index_interval = atoi(optarg);
+                        flag = -1;
+                        break;
+                    case INDEX_MAX_BYTES:
+                        index_max_bytes = atoll(optarg);
+                        flag = -1;
+                        break;
+                }
+                break;
+            case 'o':
+                output_name = optarg;
+                break;
+            case 's':
+                start_time = atof(optarg);
+                break;
+            case 'e':
+                end_time = atof(optarg);
+                break;
+            case 'c':
+                concat = 1;
+                break;
+            case 'h':
+            default:
+                usage();
+        }
+    }
+    if (concat) {
+        char *joined_name;
+        int i;
+        if (optind >= argc || !output_name) {
+            fprintf(stderr, "ERROR: Joining files needs input files and an output file.\n");
+            exit(1);
+        }
+        if (start_time >= 0 || end_time >= 0) {
+            fprintf(stderr, "ERROR: Joining files can't be combined with cutting a clip.\n");
+            exit(1);
+        }
+        for (i = optind; i < argc; i++) {
+            if (!strcmp(output_name, argv[i])) {
+                fprintf(stderr, "ERROR: Joining files needs an output file other than the inputs.\n");
+                exit(1);
+            }
+        }
+        joined_name = malloc(strlen(output_name) + 8);
+        if (!joined_name) {
+            fprintf(stderr, "ERROR: Out of memory.\n");
+            exit(1);
+        }
+        sprintf(joined_name, "%s.concat", output_name);
+        concat_files(argv + optind, argc - optind, joined_name);
+        reindex_file(joined_name, output_name, index_interval, index_max_bytes);
+        remove(joined_name);
+        free(joined_name);
+        return 0;
+    }
+
+    if (optind != argc - 1)
+        usage();
+    input_name = argv[optind];
+
+    if (start_time >= 0 || end_time >= 0) {
+        char *clip_name;
+        if (!output_name || !strcmp(output_name, input_name)) {
+            fprintf(stderr, "ERROR: Cutting a clip needs an output file other than the input.\n");
+            exit(1);
+        }
+        if (start_time < 0)
+            start_time = 0;
+        if (end_time >= 0 && end_time <= start_time) {
+            fprintf(stderr, "ERROR: End time has to be after the start time.\n");
+            exit(1);
+        }
+        clip_name = malloc(strlen(output_name) + 6);
+        if (!clip_name) {
+            fprintf(stderr, "ERROR: Out of memory.\n");
+            exit(1);
+        }
+        sprintf(clip_name, "%s.clip", output_name);
+        trim_file(input_name, clip_name,
+                  (ogg_int64_t)(start_time * 1000),
+                  end_time >= 0 ? (ogg_int64_t)(end_time * 1000) : -1);
+        reindex_file(clip_name, output_name, index_interval, index_max_bytes);
+        remove(clip_name);
+        free(clip_name);
+        return 0;
+    }
+
+    reindex_file(input_name, output_name ? output_name : input_name,
+                 index_interval, index_max_bytes);
+    return 0;
+}